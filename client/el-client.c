@@ -43,7 +43,7 @@ main(int argc, char * argv[])
 
     GOptionEntry options[] =
     {
-        {"command", 0, 0, G_OPTION_ARG_STRING, &command, "Command", "[add|delete|set-flag|unset-flag|count]"},
+        {"command", 0, 0, G_OPTION_ARG_STRING, &command, "Command", "[add|delete|set-flag|unset-flag|count|collect-attachments]"},
         {"service", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_STRING, &service, "Service", "s"},
         {"event-type", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_STRING, &event_type, "Event type", "e"},
         {"start-time", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_INT, &start_time, "Start time", "t"},
@@ -155,6 +155,15 @@ main(int argc, char * argv[])
         n = rtcom_el_count_by_service(el, service);
         g_message("Number of events of service %s: %d.", service, n);
     }
+    else if(!strcmp("collect-attachments", command))
+    {
+        guint64 reclaimed = 0;
+        gboolean ret;
+
+        ret = rtcom_el_collect_attachments(el, &reclaimed, NULL);
+        g_message("Action %s, %" G_GUINT64_FORMAT " bytes reclaimed.",
+                ret ? "succedeed" : "failed", reclaimed);
+    }
 
     g_object_unref(el);
     g_option_context_free(ctx);
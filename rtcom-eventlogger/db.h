@@ -21,7 +21,9 @@
 #define __RTCOM_EL_DB_H__
 
 #include <sqlite3.h>
-#include <glib.h>
+#include <glib-object.h>
+
+#include "rtcom-eventlogger/eventlogger-types.h"
 
 G_BEGIN_DECLS
 
@@ -30,6 +32,8 @@ typedef sqlite3_stmt *rtcom_el_db_stmt_t;
 
 #define RTCOM_EL_DB_MAX_BUSYLOOP_TIME 2.00 /* in seconds */
 #define RTCOM_EL_ERROR rtcom_el_error_quark ()
+/* The fields stored in the db come first among the RTComElField ids */
+#define RTCOM_EL_DB_N_FIELDS RTCOM_EL_FIELD_ADDITIONAL_TEXT
 
 rtcom_el_db_t rtcom_el_db_open (const gchar *fname);
 void rtcom_el_db_close (rtcom_el_db_t db);
@@ -44,6 +48,9 @@ gboolean rtcom_el_db_rollback (rtcom_el_db_t db, GError **error);
 gint rtcom_el_db_iterate (rtcom_el_db_t db, rtcom_el_db_stmt_t stmt,
     GError **error);
 void rtcom_el_db_single_int (gpointer data, gpointer user_data);
+rtcom_el_db_stmt_t rtcom_el_db_stmt_acquire (rtcom_el_db_t db,
+    const gchar *sql, GError **error);
+void rtcom_el_db_stmt_release (rtcom_el_db_stmt_t stmt);
 GHashTable * rtcom_el_db_cache_lookup_table (rtcom_el_db_t db,
 const gchar *tname);
 
@@ -51,9 +58,18 @@ const gchar ** rtcom_el_db_schema_get_sql ();
 gint rtcom_el_db_schema_get_n_items ();
 void rtcom_el_db_schema_get_mappings (const gchar **out_selection,
     GHashTable **out_mapping, GHashTable **out_typing);
+gchar * rtcom_el_db_schema_get_selection (const gchar * const *names,
+    gboolean unique_remote);
 void rtcom_el_db_g_value_slice_free (gpointer p);
 void rtcom_el_db_schema_update_row (rtcom_el_db_stmt_t stmt, GHashTable *row);
 GHashTable *rtcom_el_db_schema_get_row (rtcom_el_db_stmt_t stmt);
+gint rtcom_el_db_schema_get_column (rtcom_el_db_stmt_t stmt,
+    const gchar *name, GType *out_type);
+void rtcom_el_db_schema_get_row_values (GHashTable *row, GValue **values);
+gint *rtcom_el_db_schema_get_column_fields (rtcom_el_db_stmt_t stmt,
+    gint *n_columns);
+void rtcom_el_db_schema_update_values (rtcom_el_db_stmt_t stmt,
+    const gint *column_fields, gint n_columns, GValue * const *values);
 
 gboolean rtcom_el_db_convert_from_db0 (const gchar *fname,
     const gchar *old_fname);
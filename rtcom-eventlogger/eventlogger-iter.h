@@ -43,6 +43,7 @@ G_BEGIN_DECLS
 
 typedef struct _RTComElIterClass RTComElIterClass;
 typedef struct _RTComElIter RTComElIter;
+typedef struct _RTComElIterBatch RTComElIterBatch;
 
 struct _RTComElIterClass
 {
@@ -115,6 +116,18 @@ GHashTable *rtcom_el_iter_get_value_map (RTComElIter *it, ...);
  */
 gboolean rtcom_el_iter_get_values (RTComElIter *it, ...);
 
+/**
+ * Gets a string item without copying it. As with
+ * rtcom_el_iter_get_values(), the plugin is asked first, then the db.
+ * @param it The RTComElIter
+ * @param key The item name
+ * @return The string, owned by the iterator and valid until it moves to
+ * another row, or NULL if the item is unknown, not a string, or NULL.
+ */
+const gchar * rtcom_el_iter_peek_string(
+        RTComElIter * it,
+        const gchar * key);
+
 /** Returns an iterator to the attachments of the event this
  * iterator points to.
  * @param it The iterator for this event.
@@ -123,6 +136,167 @@ gboolean rtcom_el_iter_get_values (RTComElIter *it, ...);
 RTComElAttachIter * rtcom_el_iter_get_attachments(
         RTComElIter * it);
 
+/**
+ * Creates a batch for rtcom_el_iter_fetch_batch(), holding the given
+ * fields of many events column by column. Integer and boolean fields
+ * are kept as arrays of gint, and string fields in a single buffer.
+ * The memory is kept across fetches, so a batch should be reused.
+ * @param fields NULL-terminated array of field names, as in
+ * rtcom_el_iter_get_columns()
+ * @return A new batch, to be freed with rtcom_el_iter_batch_free().
+ */
+RTComElIterBatch * rtcom_el_iter_batch_new(
+        const gchar * const * fields);
+
+/**
+ * Frees a batch.
+ * @param batch The batch. Can be NULL.
+ */
+void rtcom_el_iter_batch_free(
+        RTComElIterBatch * batch);
+
+/**
+ * Fills a batch with up to n events, starting with the one the iterator
+ * points to, and moves the iterator past them. Like
+ * rtcom_el_iter_get_columns(), only fields directly from the database
+ * are returned; plugins aren't queried. Fields the query didn't select
+ * are 0 or NULL.
+ * @param it The RTComElIter
+ * @param n The most events to fetch
+ * @param batch The batch to fill; its previous contents are dropped.
+ * @return The number of events fetched, 0 when there's no more.
+ */
+guint rtcom_el_iter_fetch_batch(
+        RTComElIter * it,
+        guint n,
+        RTComElIterBatch * batch);
+
+/**
+ * Gets the number of events in a batch.
+ * @param batch The batch
+ * @return The number of events
+ */
+guint rtcom_el_iter_batch_get_n_rows(
+        const RTComElIterBatch * batch);
+
+/**
+ * Gets an integer or boolean field of every event in a batch.
+ * @param batch The batch
+ * @param field The index of the field, in the array the batch was
+ * created with
+ * @return An array of rtcom_el_iter_batch_get_n_rows() values, owned by
+ * the batch; or NULL if the field isn't an integer or boolean one.
+ */
+const gint * rtcom_el_iter_batch_get_ints(
+        const RTComElIterBatch * batch,
+        guint field);
+
+/**
+ * Gets a string field of an event in a batch.
+ * @param batch The batch
+ * @param field The index of the field, in the array the batch was
+ * created with
+ * @param row The index of the event
+ * @return The string, owned by the batch and valid until it is filled
+ * again; or NULL if it has no value, or the field isn't a string one.
+ */
+const gchar * rtcom_el_iter_batch_get_string(
+        const RTComElIterBatch * batch,
+        guint field,
+        guint row);
+
+/**
+ * Makes the iterator fetch the given headers for a window of rows at a
+ * time, with a single query, instead of one query per row and header.
+ * rtcom_el_iter_get_header_raw() is then answered from the window, and
+ * so are plugin values built on it.
+ * The iterator's query is copied, so later changes to it don't apply.
+ * @param it The iterator
+ * @param names The header names, NULL-terminated, or NULL to stop
+ * prefetching
+ * @param window The number of rows to fetch the headers of, from the
+ * current one on
+ */
+void rtcom_el_iter_set_header_prefetch(
+        RTComElIter * it,
+        const gchar * const * names,
+        guint window);
+
+/**
+ * Makes rtcom_el_iter_peek_attachments() fetch the attachments of a
+ * window of rows at a time, with a single query. The iterator's query
+ * is copied, so later changes to it don't apply.
+ * @param it The iterator
+ * @param window The number of rows to fetch the attachments of, from the
+ * current one on
+ */
+void rtcom_el_iter_set_attachment_prefetch(
+        RTComElIter * it,
+        guint window);
+
+/**
+ * Makes plugins that export rtcom_el_plugin_get_values compute their
+ * values for a window of rows at a time: the first time a value is asked
+ * for, the plugin's rows among the next window rows are fetched with a
+ * single query, with only the fields the plugin reads, and the plugin
+ * computes the value for all of them at once. Plugins that don't export
+ * it are asked one row at a time, as usual. Values are kept until the
+ * window moves on, so changes made to its events meanwhile may not show.
+ * The iterator's query is copied, so later changes to it don't apply.
+ * @param it The iterator
+ * @param window The number of rows to compute the values of, from the
+ * current one on, or 0 to compute them one row at a time again
+ */
+void rtcom_el_iter_set_plugin_window(
+        RTComElIter * it,
+        guint window);
+
+/**
+ * Gets the attachments of the current event, without an
+ * #RTComElAttachIter. Unless rtcom_el_iter_set_attachment_prefetch() was
+ * called, they are fetched one row at a time. Rows whose
+ * "attachment-count" was selected and is 0 aren't looked up.
+ * @param it The iterator
+ * @param n_attachments A location for the number of attachments
+ * @return The attachments, owned by the iterator and valid until it
+ * moves to another row, or NULL if there are none.
+ */
+const RTComElAttachment * rtcom_el_iter_peek_attachments(
+        RTComElIter * it,
+        guint * n_attachments);
+
+/**
+ * Gets the name of a field.
+ * @param field The #RTComElField
+ * @return The name the field has elsewhere in the API, such as
+ * "local-uid".
+ */
+const gchar * rtcom_el_field_get_name(
+        RTComElField field);
+
+/**
+ * Gets the id of a field.
+ * @param name The field name, such as "local-uid"
+ * @return The #RTComElField, or -1 if there is no such field.
+ */
+gint rtcom_el_field_from_name(
+        const gchar * name);
+
+/**
+ * Gets a field of the current event by its id, which saves looking its
+ * name up. As with rtcom_el_iter_get_values(), the plugin is asked
+ * first.
+ * @param it The iterator
+ * @param field The #RTComElField
+ * @param value An uninitialized GValue to store the value in
+ * @return TRUE on success, FALSE if neither the plugin nor the db had
+ * the value.
+ */
+gboolean rtcom_el_iter_get_by_id(
+        RTComElIter * it,
+        RTComElField field,
+        GValue * value);
+
 /* Plugin functions */
 
 /**
@@ -138,6 +312,19 @@ gboolean rtcom_el_iter_get_raw(
         const gchar * col,
         GValue * value);
 
+/**
+ * Gets a raw field from the db by its id. Like rtcom_el_iter_get_raw(),
+ * this should only be used by plugins.
+ * @param it The iterator.
+ * @param field The #RTComElField; it should be one that is stored.
+ * @param value An uninitialized GValue to store the value in.
+ * @return TRUE on success, FALSE on failure.
+ */
+gboolean rtcom_el_iter_get_raw_by_id(
+        RTComElIter * it,
+        RTComElField field,
+        GValue * value);
+
 /**
  * Gets a RTComElEvent representing the current iterator. Note: this
  * calls into plugin and can result in additional SQL queries, avoid
@@ -152,6 +339,20 @@ gboolean rtcom_el_iter_get_full(
         RTComElIter * it,
         RTComElEvent * ev);
 
+/**
+ * Like rtcom_el_iter_get_full(), but the strings in ev are borrowed from
+ * the iterator rather than copied: they stay valid until it moves to
+ * another row, and must not be freed, so don't call
+ * rtcom_el_event_free_contents() on ev.
+ * @param it The iterator
+ * @param ev A pointer to the RTComElEvent to populate, which should be
+ *  zero-filled
+ * @return TRUE in case of success, FALSE in case of failure
+ */
+gboolean rtcom_el_iter_peek_full(
+        RTComElIter * it,
+        RTComElEvent * ev);
+
 /**
  * Deprecated name of rtcom_el_iter_get_full(). Consider using
  * rtcom_el_get_columns() if possible. */
@@ -0,0 +1,106 @@
+/**
+ * Copyright (C) 2026 The rtcom-eventlogger contributors.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @file eventlogger-live-query.h
+ * @brief Defines an RTComElLiveQuery object.
+ *
+ * An RTComElLiveQuery keeps the ids of the events an #RTComElQuery
+ * returns up to date as events are added, changed and deleted, and
+ * tells what changed rather than having the whole query run again.
+ *
+ * It emits:
+ * - "inserted" (gint event_id, guint position): the event entered the
+ *   results at position.
+ * - "changed" (gint event_id, guint position): the event, still in the
+ *   results, was updated.
+ * - "removed" (gint event_id, guint position): the event left the
+ *   results; position is where it was.
+ * - "reset": the results were loaded again from scratch.
+ */
+
+#ifndef __EVENT_LOGGER_LIVE_QUERY_H
+#define __EVENT_LOGGER_LIVE_QUERY_H
+
+#include <glib-object.h>
+
+#include "rtcom-eventlogger/eventlogger.h"
+
+G_BEGIN_DECLS
+
+#define RTCOM_TYPE_EL_LIVE_QUERY             (rtcom_el_live_query_get_type ())
+#define RTCOM_EL_LIVE_QUERY(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj), RTCOM_TYPE_EL_LIVE_QUERY, RTComElLiveQuery))
+#define RTCOM_EL_LIVE_QUERY_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST ((klass), RTCOM_TYPE_EL_LIVE_QUERY, RTComElLiveQueryClass))
+#define RTCOM_IS_EL_LIVE_QUERY(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj), RTCOM_TYPE_EL_LIVE_QUERY))
+#define RTCOM_IS_EL_LIVE_QUERY_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE ((klass), RTCOM_TYPE_EL_LIVE_QUERY))
+#define RTCOM_EL_LIVE_QUERY_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS ((obj), RTCOM_TYPE_EL_LIVE_QUERY, RTComElLiveQueryClass))
+
+typedef struct _RTComElLiveQueryClass RTComElLiveQueryClass;
+typedef struct _RTComElLiveQuery RTComElLiveQuery;
+
+struct _RTComElLiveQueryClass
+{
+    GObjectClass parent_class;
+};
+
+struct _RTComElLiveQuery
+{
+    GObject parent_instance;
+};
+
+GType rtcom_el_live_query_get_type(void) G_GNUC_CONST;
+
+/**
+ * Creates a new #RTComElLiveQuery and loads the results of the query.
+ * Events are followed one by one for queries that aren't grouped and
+ * have no offset; for the others, every change loads the results again.
+ * A "refresh-hint" always does.
+ * @param el The #RTComEl whose signals to follow
+ * @param query A prepared #RTComElQuery. It shouldn't be changed
+ * afterwards.
+ * @return A newly allocated RTComElLiveQuery.
+ */
+RTComElLiveQuery * rtcom_el_live_query_new(
+        RTComEl * el,
+        RTComElQuery * query);
+
+/**
+ * Gets the ids of the events the query currently returns, in the same
+ * order.
+ * @param live The #RTComElLiveQuery
+ * @param n_ids A location for the number of ids
+ * @return The ids, owned by the live query and valid until the next
+ * change.
+ */
+const gint * rtcom_el_live_query_get_ids(
+        RTComElLiveQuery * live,
+        guint * n_ids);
+
+/**
+ * Loads the results again from scratch, and emits "reset".
+ * @param live The #RTComElLiveQuery
+ * @return TRUE in case of success, FALSE otherwise
+ */
+gboolean rtcom_el_live_query_reload(
+        RTComElLiveQuery * live);
+
+G_END_DECLS
+
+#endif
+
+/* vim: set ai et tw=75 ts=4 sw=4: */
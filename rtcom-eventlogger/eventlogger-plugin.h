@@ -81,6 +81,29 @@ typedef gboolean (*PluginGetValueFunc)(    /* Not mandatory */
         RTComElIter * it,
         const gchar *,
         GValue *);
+/* Not mandatory. Exported as rtcom_el_plugin_get_value_by_id, it is asked
+ * instead of get_value for the values that have an RTComElField id. */
+typedef gboolean (*PluginGetValueByIdFunc)(
+        RTComElIter * it,
+        RTComElField,
+        GValue *);
+/* Not mandatory. Exported as rtcom_el_plugin_get_values, it computes key
+ * for all the rows of a batch at once, once
+ * rtcom_el_iter_set_plugin_window() was called: the batch holds only the
+ * plugin's rows, with one column per stored field indexed by
+ * RTComElField, and values has one zeroed GValue per row, to be left
+ * unset for the rows it has nothing for. Returns FALSE if it doesn't
+ * compute key at all. */
+typedef gboolean (*PluginGetValuesFunc)(
+        RTComElIter * it,
+        const RTComElIterBatch *,
+        const gchar *,
+        GValue *);
+/* Not mandatory. Exported as rtcom_el_plugin_get_values_fields, it lists
+ * the stored fields rtcom_el_plugin_get_values reads from its batches,
+ * NULL-terminated. Only those, and "id", "service-id" and
+ * "event-type-id", are fetched; without it, only the latter are. */
+typedef const gchar * const * (*PluginGetValuesFieldsFunc)(void);
 
 typedef struct _RTComElPlugin RTComElPlugin;
 struct _RTComElPlugin {
@@ -93,6 +116,9 @@ struct _RTComElPlugin {
     PluginEventTypesFunc get_event_types;
     PluginFlagsFunc get_flags;
     PluginGetValueFunc get_value;
+    PluginGetValueByIdFunc get_value_by_id;
+    PluginGetValuesFunc get_values;
+    PluginGetValuesFieldsFunc get_values_fields;
 };
 
 /**
@@ -42,6 +42,7 @@ G_BEGIN_DECLS
 
 typedef struct _RTComElQueryClass RTComElQueryClass;
 typedef struct _RTComElQuery RTComElQuery;
+typedef struct _RTComElQueryExpr RTComElQueryExpr;
 
 #include "rtcom-eventlogger/eventlogger.h"
 
@@ -73,6 +74,15 @@ GType rtcom_el_query_get_type(void) G_GNUC_CONST;
 RTComElQuery * rtcom_el_query_new(
         RTComEl * el);
 
+/**
+ * Creates a copy of a #RTComElQuery, with the same properties and
+ * conditions, that can then be changed on its own.
+ * @param query The #RTComElQuery to copy
+ * @return A newly allocated RTComElQuery.
+ */
+RTComElQuery * rtcom_el_query_copy(
+        RTComElQuery * query);
+
 /**
  * Sets the is-caching property
  * @param query The #RTComElQuery
@@ -100,6 +110,46 @@ void rtcom_el_query_set_offset(
         RTComElQuery * query,
         gint offset);
 
+/**
+ * Sets the before-id property: only events with a smaller id are
+ * returned. To page back through a long list, pass the id of the last
+ * event of the previous page. Unlike the offset, this doesn't get slower
+ * the further you go. When grouping by contact or uids, it applies to
+ * the latest event of each group.
+ * It doesn't affect the WHERE clause used by rtcom_el_delete_events()
+ * and similar.
+ * @param query The #RTComElQuery
+ * @param event_id The event id, or 0 to remove the bound
+ */
+void rtcom_el_query_set_before_id(
+        RTComElQuery * query,
+        gint event_id);
+
+/**
+ * Sets the after-id property: only events with a greater id are
+ * returned, e.g. those added since the first event of a page. Events
+ * are still returned newest first.
+ * @param query The #RTComElQuery
+ * @param event_id The event id, or 0 to remove the bound
+ * @see rtcom_el_query_set_before_id
+ */
+void rtcom_el_query_set_after_id(
+        RTComElQuery * query,
+        gint event_id);
+
+/**
+ * Sets the fields property: only these fields are fetched, and tables
+ * that none of them (nor the conditions) need aren't joined. Iterators
+ * work as usual, but fields that weren't fetched read as 0 or NULL.
+ * "id", "service-id" and "event-type-id" are always fetched.
+ * @param query The #RTComElQuery
+ * @param fields A NULL-terminated array of field names, as for
+ * rtcom_el_query_prepare(), or NULL to fetch all of them
+ */
+void rtcom_el_query_set_fields(
+        RTComElQuery * query,
+        const gchar * const * fields);
+
 /**
  * Sets the group property
  * @param query The #RTComElQuery
@@ -112,8 +162,8 @@ void rtcom_el_query_set_group_by(
 
 /**
  * Re-prepares the query leaving the WHERE clauses unchanged.
- * This should be used just after changing the limit, offset or group
- * properties of the query, in order to rebuild the sql.
+ * This should be used just after changing the limit, offset, before-id,
+ * after-id, fields or group properties of the query, in order to rebuild the sql.
  * @param query The #RTComElQuery object
  * @return TRUE in case of success, FALSE otherwise
  * @see rtcom_el_query_prepare
@@ -179,6 +229,119 @@ gboolean rtcom_el_query_prepare(
         RTComElQuery * query,
         ...);
 
+/**
+ * Prepares the query from an expression, which can combine conditions
+ * with OR and NOT as well as AND. E.g. unread SMS or chat messages:
+ * @code
+ * const gchar *services[] = { "RTCOM_EL_SERVICE_SMS",
+ *     "RTCOM_EL_SERVICE_CHAT", NULL };
+ * RTComElQueryExpr *expr = rtcom_el_query_expr_and (
+ *     rtcom_el_query_expr_in_strv ("service", services),
+ *     rtcom_el_query_expr_int ("is-read", RTCOM_EL_OP_EQUAL, FALSE),
+ *     NULL);
+ *
+ * rtcom_el_query_prepare_expr (query, expr);
+ * rtcom_el_query_expr_free (expr);
+ * @endcode
+ * @param query The #RTComElQuery object
+ * @param expr The condition, or NULL to match all events. It isn't freed.
+ * @return TRUE in case of success, FALSE if a key is unknown or the
+ * value doesn't suit it
+ * @see rtcom_el_query_prepare
+ */
+gboolean rtcom_el_query_prepare_expr(
+        RTComElQuery * query,
+        const RTComElQueryExpr * expr);
+
+/**
+ * Creates a condition on an integer field.
+ * @param key The field, as for rtcom_el_query_prepare()
+ * @param op The #RTComElOp, e.g. #RTCOM_EL_OP_HAS_ANY_FLAG for "flags"
+ * @param value The value
+ * @return A new #RTComElQueryExpr
+ */
+RTComElQueryExpr * rtcom_el_query_expr_int(
+        const gchar * key,
+        RTComElOp op,
+        gint value);
+
+/**
+ * Creates a condition on a string field.
+ * @param key The field, as for rtcom_el_query_prepare()
+ * @param op The #RTComElOp
+ * @param value The value
+ * @return A new #RTComElQueryExpr
+ */
+RTComElQueryExpr * rtcom_el_query_expr_string(
+        const gchar * key,
+        RTComElOp op,
+        const gchar * value);
+
+/**
+ * Creates a condition matching a string field against a list of values.
+ * @param key The field, as for rtcom_el_query_prepare()
+ * @param values A NULL-terminated array of strings, which is copied
+ * @return A new #RTComElQueryExpr
+ */
+RTComElQueryExpr * rtcom_el_query_expr_in_strv(
+        const gchar * key,
+        const gchar * const * values);
+
+/**
+ * Creates a condition matching an integer field against a list of values.
+ * @param key The field, as for rtcom_el_query_prepare()
+ * @param values An array of integers, which is copied
+ * @param n_values The number of integers in values
+ * @return A new #RTComElQueryExpr
+ */
+RTComElQueryExpr * rtcom_el_query_expr_in_ints(
+        const gchar * key,
+        const gint * values,
+        guint n_values);
+
+/**
+ * Creates a condition matching events with no value for a field.
+ * @param key The field, as for rtcom_el_query_prepare()
+ * @return A new #RTComElQueryExpr
+ */
+RTComElQueryExpr * rtcom_el_query_expr_is_null(
+        const gchar * key);
+
+/**
+ * Creates a condition that holds if all of the given ones hold.
+ * @param first The first condition, followed by more and NULL. They're
+ * owned by the new expression.
+ * @return A new #RTComElQueryExpr
+ */
+RTComElQueryExpr * rtcom_el_query_expr_and(
+        RTComElQueryExpr * first,
+        ...) G_GNUC_NULL_TERMINATED;
+
+/**
+ * Creates a condition that holds if any of the given ones holds.
+ * @param first The first condition, followed by more and NULL. They're
+ * owned by the new expression.
+ * @return A new #RTComElQueryExpr
+ */
+RTComElQueryExpr * rtcom_el_query_expr_or(
+        RTComElQueryExpr * first,
+        ...) G_GNUC_NULL_TERMINATED;
+
+/**
+ * Creates a condition that holds if the given one doesn't.
+ * @param expr The condition, owned by the new expression
+ * @return A new #RTComElQueryExpr
+ */
+RTComElQueryExpr * rtcom_el_query_expr_not(
+        RTComElQueryExpr * expr);
+
+/**
+ * Frees an expression and all the conditions in it.
+ * @param expr The #RTComElQueryExpr
+ */
+void rtcom_el_query_expr_free(
+        RTComElQueryExpr * expr);
+
 /**
  * Gets the sql generated by this query
  * @param query The #RTComElQuery
@@ -187,6 +350,64 @@ gboolean rtcom_el_query_prepare(
 const gchar * rtcom_el_query_get_sql(
         RTComElQuery * query);
 
+/**
+ * Gets the sql generated by this query, with a ? placeholder in place of
+ * every value. Queries that differ only in their values share the same
+ * template, so a statement compiled from it can be reused; see
+ * rtcom_el_query_bind().
+ * @param query The #RTComElQuery
+ * @return the sql template
+ */
+const gchar * rtcom_el_query_get_sql_template(
+        RTComElQuery * query);
+
+/**
+ * Gets the template counting the rows the query would return. It takes
+ * the same values as rtcom_el_query_get_sql_template().
+ * @param query The #RTComElQuery
+ * @return the sql template
+ */
+const gchar * rtcom_el_query_get_count_sql_template(
+        RTComElQuery * query);
+
+/**
+ * Gets the template checking whether the query would return any rows.
+ * It takes the same values as rtcom_el_query_get_sql_template().
+ * @param query The #RTComElQuery
+ * @return the sql template
+ */
+const gchar * rtcom_el_query_get_exists_sql_template(
+        RTComElQuery * query);
+
+/**
+ * Gets the template aggregating the rows the query would return, see
+ * rtcom_el_query_aggregate(). It takes the same values as
+ * rtcom_el_query_get_sql_template().
+ * @param query The #RTComElQuery
+ * @param keys NULL-terminated array of the fields to group by. Can be
+ * NULL or empty for a single row.
+ * @param aggregates The aggregates to compute
+ * @param n_aggregates The number of aggregates
+ * @return the sql template, to be freed with g_free(), or NULL if a
+ * field isn't known
+ */
+gchar * rtcom_el_query_get_aggregate_sql_template(
+        RTComElQuery * query,
+        const gchar * const * keys,
+        const RTComElAggregate * aggregates,
+        guint n_aggregates);
+
+/**
+ * Binds the values of this query to a statement compiled from
+ * rtcom_el_query_get_sql_template() or one of the templates above.
+ * @param query The #RTComElQuery
+ * @param stmt An opaque pointer to the sqlite3 statement
+ * @return TRUE in case of success, FALSE otherwise
+ */
+gboolean rtcom_el_query_bind(
+        RTComElQuery * query,
+        gpointer stmt);
+
 /**
  * Gets the WHERE clause generated by this query, i.e. a pointer to the
  * internal SQL string, starting after the word 'WHERE'.
@@ -65,6 +65,42 @@ typedef enum {
     RTCOM_EL_COLUMN_EVENT_TYPE_NAME
 } RTComElColumn;
 
+/**
+ * Numeric ids of the event fields, in the order in which they are
+ * selected. They can be used instead of field names where the names
+ * would have to be looked up for every row.
+ */
+typedef enum {
+    RTCOM_EL_FIELD_SERVICE,
+    RTCOM_EL_FIELD_EVENT_TYPE,
+    RTCOM_EL_FIELD_ID,
+    RTCOM_EL_FIELD_SERVICE_ID,
+    RTCOM_EL_FIELD_EVENT_TYPE_ID,
+    RTCOM_EL_FIELD_STORAGE_TIME,
+    RTCOM_EL_FIELD_START_TIME,
+    RTCOM_EL_FIELD_END_TIME,
+    RTCOM_EL_FIELD_FLAGS,
+    RTCOM_EL_FIELD_IS_READ,
+    RTCOM_EL_FIELD_BYTES_SENT,
+    RTCOM_EL_FIELD_BYTES_RECEIVED,
+    RTCOM_EL_FIELD_LOCAL_UID,
+    RTCOM_EL_FIELD_LOCAL_NAME,
+    RTCOM_EL_FIELD_GROUP_UID,
+    RTCOM_EL_FIELD_REMOTE_EBOOK_UID,
+    RTCOM_EL_FIELD_REMOTE_UID,
+    RTCOM_EL_FIELD_REMOTE_NAME,
+    RTCOM_EL_FIELD_MESSAGE_TOKEN,
+    RTCOM_EL_FIELD_CHANNEL,
+    RTCOM_EL_FIELD_OUTGOING,
+    RTCOM_EL_FIELD_FREE_TEXT,
+    RTCOM_EL_FIELD_ATTACHMENT_COUNT,
+    /* Not stored, only provided by plugins */
+    RTCOM_EL_FIELD_ADDITIONAL_TEXT,
+    RTCOM_EL_FIELD_ICON_NAME,
+    RTCOM_EL_FIELD_PANGO_MARKUP,
+    RTCOM_EL_N_FIELDS
+} RTComElField;
+
 /**
  * Operations used when querying.
  */
@@ -78,13 +114,62 @@ typedef enum {
     RTCOM_EL_OP_IN_STRV,       /** Tests if the first operand is one of the strings in the array */
     RTCOM_EL_OP_STR_ENDS_WITH, /** Tests if the first operand (a string) ends with the given string.
                                    NOTE: not supported when querying for "service", "event-type". */
-    RTCOM_EL_OP_STR_LIKE       /** Tests if the first operand (a string) is present
+    RTCOM_EL_OP_STR_LIKE,      /** Tests if the first operand (a string) is present
                                    NOTE: not supported when querying for "service", "event-type". Case-insensitive. */
+    RTCOM_EL_OP_HAS_ANY_FLAG,  /** Tests if the first operand (an integer) has any of the
+                                   bits of the second one set. */
+    RTCOM_EL_OP_HAS_ALL_FLAGS, /** Tests if the first operand (an integer) has all of the
+                                   bits of the second one set. */
+    RTCOM_EL_OP_IS_NULL,       /** Tests if the first operand has no value. The second
+                                   one is ignored. */
+    RTCOM_EL_OP_IS_NOT_NULL    /** Tests if the first operand has a value. The second
+                                   one is ignored. */
 
 } RTComElOp;
 
 #define RTCOM_EL_FLAG_GENERIC_READ 1<<0
 
+/**
+ * Options for storing attachments.
+ */
+typedef enum {
+    RTCOM_EL_ATTACH_COPY = 0,      /** Copy the file, leaving the original alone. */
+    RTCOM_EL_ATTACH_MOVE = 1 << 0, /** The caller hands the file over: it is linked
+                                       if possible, and removed once committed. */
+    RTCOM_EL_ATTACH_SYNC = 1 << 1  /** Make sure the stored file is on disk before returning. */
+} RTComElAttachFlags;
+
+/**
+ * Options for storing events.
+ */
+typedef enum {
+    RTCOM_EL_ADD_DEFAULT = 0,           /** Always store a new event. */
+    RTCOM_EL_ADD_UNIQUE_TOKEN = 1 << 0  /** If an event of the same service with
+                                            the same message-token header is
+                                            already stored, return its id
+                                            instead of storing a duplicate. */
+} RTComElAddFlags;
+
+/**
+ * Aggregate functions, see rtcom_el_query_aggregate().
+ */
+typedef enum {
+    RTCOM_EL_AGGREGATE_COUNT, /** Number of rows, or of rows where the field has a value. */
+    RTCOM_EL_AGGREGATE_SUM,   /** Sum of the field. */
+    RTCOM_EL_AGGREGATE_MIN,   /** Smallest value of the field. */
+    RTCOM_EL_AGGREGATE_MAX    /** Largest value of the field. */
+} RTComElAggregateFunc;
+
+/**
+ * An aggregate to compute. field is an integer field, such as
+ * "bytes-sent", or "duration" for end-time minus start-time. It can be
+ * NULL for RTCOM_EL_AGGREGATE_COUNT, counting every row.
+ */
+typedef struct {
+    RTComElAggregateFunc func;
+    const gchar *field;
+} RTComElAggregate;
+
 #endif
 
 /* vim: set ai et tw=75 ts=4 sw=4: */
@@ -117,6 +117,7 @@
 #define __EL_H
 
 #include <glib-object.h>
+#include <gio/gio.h>
 
 #include "rtcom-eventlogger/event.h"
 #include "rtcom-eventlogger/eventlogger-types.h"
@@ -150,6 +151,46 @@ struct _RTComEl
     GObject parent_instance;
 };
 
+/**
+ * The result of rtcom_el_query_aggregate(), one row per distinct
+ * combination of keys.
+ */
+struct _RTComElAggregateResult {
+    guint n_rows;
+    guint n_keys;
+    guint n_values;
+    /* n_rows * n_keys keys as strings, row after row; NULL where a key
+     * has no value */
+    const gchar **keys;
+    /* n_rows * n_values aggregates, row after row */
+    gint64 *values;
+
+    /*< private >*/
+    GStringChunk *chunk;
+};
+typedef struct _RTComElAggregateResult RTComElAggregateResult;
+
+/**
+ * The headers returned by rtcom_el_fetch_headers_for_events(), grouped
+ * by event.
+ */
+struct _RTComElHeadersResult {
+    /* The distinct event ids asked for, in increasing order */
+    guint n_events;
+    const gint *event_ids;
+    /* n_events + 1 offsets: the headers of event_ids[i] are those from
+     * offsets[i] up to, not including, offsets[i + 1] */
+    const guint *offsets;
+    /* n_headers names and values, event after event */
+    guint n_headers;
+    const gchar **names;
+    const gchar **values;
+
+    /*< private >*/
+    GStringChunk *chunk;
+};
+typedef struct _RTComElHeadersResult RTComElHeadersResult;
+
 struct _RTComElRemote {
     gchar *local_uid;
     gchar *remote_uid;
@@ -202,7 +243,31 @@ gint rtcom_el_add_event_full(
         GList *attachments,
         GError ** error);
 
-/** Returns the group-uid of the event you added last.
+/** Like rtcom_el_add_event_full(), with #RTComElAddFlags.
+ * With #RTCOM_EL_ADD_UNIQUE_TOKEN, a redelivered message (one whose
+ * "message-token" header matches an event already stored for the same
+ * service) isn't stored again: the id of the existing event is returned
+ * and no NewEvent signal is emitted. The check is done in the same
+ * transaction as the insert, so there's no need to look the token up
+ * beforehand.
+ * @param el The RTComEl object.
+ * @param ev An RTComElEvent object.
+ * @param headers A (gchar *name -> gchar *value) mapping of event headers
+ * @param attachments A list of RTComElAttachments to add to the event
+ * @param flags #RTComElAddFlags
+ * @param error A location for the possible error message
+ * @return The ID of the new or existing event or -1 in case of failure.
+ */
+gint rtcom_el_add_event_full_with_flags(
+        RTComEl * el,
+        RTComElEvent * ev,
+        GHashTable *headers,
+        GList *attachments,
+        RTComElAddFlags flags,
+        GError ** error);
+
+/** Returns the group-uid of the event you added last from the calling
+ * thread.
  * This is useful if you start logging a chat conversation, get a group-uid
  * from here after logging the first message, and then keep using the same
  * group-uid for the rest of the messages in the same conversation.
@@ -242,6 +307,58 @@ gint rtcom_el_add_attachment(
         const gchar * desc,
         GError ** error);
 
+/** Adds an attachment to an event, with control over how the file is
+ * stored. A copy shares the data blocks with the original (reflink)
+ * where the filesystem allows it, and is otherwise written through a
+ * buffer; either way the contents are hashed once, to find identical
+ * attachments already stored.
+ * @param el The RTComEl object.
+ * @param event_id The id of the event you want to add the attachment to.
+ * @param path The path where the file you want to attach is located.
+ * @param desc A description for the attachment. Can be NULL.
+ * @param flags #RTComElAttachFlags controlling ownership of the file and
+ * whether it is synced to disk.
+ * @param error A location for the possible error message. Can be NULL if not interesting.
+ * @return The attachment id or -1 in case of error.
+ */
+gint rtcom_el_add_attachment_with_flags(
+        RTComEl * el,
+        gint event_id,
+        const gchar * path,
+        const gchar * desc,
+        RTComElAttachFlags flags,
+        GError ** error);
+
+/** Removes files in the attachment store that no attachment refers to,
+ * such as those left behind by a crash. Files stored within the last
+ * hour are left alone, as an attachment may be about to refer to them.
+ * Blocks until the whole store has been swept; see
+ * rtcom_el_collect_attachments_idle() for doing it in the background.
+ * @param el The RTComEl object.
+ * @param reclaimed Location for the number of bytes freed. Can be NULL.
+ * @param error A location for the possible error message. Can be NULL if not interesting.
+ * @return TRUE on success, FALSE in case of error.
+ */
+gboolean rtcom_el_collect_attachments(
+        RTComEl * el,
+        guint64 * reclaimed,
+        GError ** error);
+
+/** Starts sweeping the attachment store for orphaned files from the main
+ * loop, a few files at a time while it's idle. The "attachments-collected"
+ * signal is emitted with the number of bytes freed when it's done. Does
+ * nothing if a sweep is already running; a stopped one is resumed.
+ * @param el The RTComEl object.
+ */
+void rtcom_el_collect_attachments_idle(
+        RTComEl * el);
+
+/** Pauses the sweep started by rtcom_el_collect_attachments_idle().
+ * @param el The RTComEl object.
+ */
+void rtcom_el_stop_collecting_attachments(
+        RTComEl * el);
+
 /** Marks an event as read/unread.
  * @param el The RTComEl object.
  * @param event_id The id of the event you want to mark as read/unread.
@@ -256,6 +373,10 @@ gint rtcom_el_set_read_event(
         GError ** error);
 
 /** Marks multiple events as read/unread.
+ * All events are updated in a single transaction: if any of the ids is
+ * invalid, none of the events are changed. A single change notification
+ * is emitted for the whole batch (EventUpdated if only one event changed,
+ * RefreshHint otherwise).
  * @param el The RTComEl object.
  * @param event_ids An array of ids of events. Must be NULL terminated.
  * @param read TRUE if you want to mark read, FALSE if you want to mark unread.
@@ -324,6 +445,61 @@ RTComElIter * rtcom_el_get_events(
         RTComEl * el,
         RTComElQuery * query);
 
+/** Counts the events a query would return, without fetching them.
+ * Grouping, limit and offset are taken into account.
+ * @param el The #RTComEl object
+ * @param query The #RTComElQuery to count
+ * @param error A location for the possible error message. Can be NULL
+ * if not interesting.
+ * @return The number of events, or -1 if an error occurred.
+ */
+gint rtcom_el_query_count(
+        RTComEl * el,
+        RTComElQuery * query,
+        GError ** error);
+
+/** Checks whether a query would return any events, without fetching
+ * them.
+ * @param el The #RTComEl object
+ * @param query The #RTComElQuery to check
+ * @param error A location for the possible error message. Can be NULL
+ * if not interesting.
+ * @return TRUE if there's at least one, FALSE if there's none or an
+ * error occurred.
+ */
+gboolean rtcom_el_query_exists(
+        RTComEl * el,
+        RTComElQuery * query,
+        GError ** error);
+
+/** Computes aggregates over the events a query would return, grouped
+ * by some of their fields, without fetching them. The query's own
+ * grouping, limit and offset apply first.
+ * @param el The #RTComEl object
+ * @param query The #RTComElQuery to aggregate
+ * @param keys NULL-terminated array of the fields to group by. Can be
+ * NULL or empty for a single row.
+ * @param aggregates The aggregates to compute
+ * @param n_aggregates The number of aggregates
+ * @param error A location for the possible error message. Can be NULL
+ * if not interesting.
+ * @return The rows, ordered by their keys, to be freed with
+ * rtcom_el_aggregate_result_free(); or NULL if an error occurred.
+ */
+RTComElAggregateResult * rtcom_el_query_aggregate(
+        RTComEl * el,
+        RTComElQuery * query,
+        const gchar * const * keys,
+        const RTComElAggregate * aggregates,
+        guint n_aggregates,
+        GError ** error);
+
+/** Frees the result of rtcom_el_query_aggregate().
+ * @param result The #RTComElAggregateResult. Can be NULL.
+ */
+void rtcom_el_aggregate_result_free(
+        RTComElAggregateResult * result);
+
 /** Retrieves events from the database in an atomic way.
  * Like rtcom_el_get_events, but the returned iterator is
  * guarded by transactional brackets, so the table contents are
@@ -342,6 +518,41 @@ RTComElIter * rtcom_el_get_events_atomic(
         RTComEl * el,
         RTComElQuery * query);
 
+/** Retrieves events from the database without blocking the caller.
+ * The query is prepared and its first row fetched in a worker thread,
+ * using a database connection of its own, and callback is invoked in
+ * the thread-default main context of the caller. The resulting iterator
+ * keeps using that connection, and can be used from the caller's
+ * thread as usual; attachment iterators got from it should be released
+ * before it is.
+ * @param el The #RTComEl object
+ * @param query The #RTComElQuery to perform
+ * @param cancellable A #GCancellable, interrupting the query when
+ * cancelled. Can be NULL.
+ * @param callback Called when the iterator is ready.
+ * @param user_data Data to pass to callback.
+ */
+void rtcom_el_get_events_async(
+        RTComEl * el,
+        RTComElQuery * query,
+        GCancellable * cancellable,
+        GAsyncReadyCallback callback,
+        gpointer user_data);
+
+/** Finishes rtcom_el_get_events_async().
+ * @param el The #RTComEl object
+ * @param result The #GAsyncResult passed to the callback.
+ * @param error A location for the possible error message. Can be NULL
+ * if not interesting. Set to G_IO_ERROR_CANCELLED if the query was
+ * cancelled.
+ * @return An iterator to the events, or NULL if an error occurred or
+ * none found.
+ */
+RTComElIter * rtcom_el_get_events_finish(
+        RTComEl * el,
+        GAsyncResult * result,
+        GError ** error);
+
 /**
  * Gets all headers of an event from the database.
  * @param el The #RTComEl object
@@ -352,6 +563,45 @@ GHashTable * rtcom_el_fetch_event_headers(
         RTComEl * el,
         gint event_id);
 
+/**
+ * Gets the headers of many events at once, with as few queries as
+ * possible.
+ * @param el The #RTComEl object
+ * @param event_ids The ids of the events whose headers you want to fetch
+ * @param n_events The number of ids
+ * @param names NULL-terminated array of the header names to fetch, or
+ * NULL for all of them
+ * @param error A location for the possible error message. Can be NULL
+ * if not interesting.
+ * @return The headers, to be freed with rtcom_el_headers_result_free();
+ * or NULL if an error occurred.
+ */
+RTComElHeadersResult * rtcom_el_fetch_headers_for_events(
+        RTComEl * el,
+        const gint * event_ids,
+        guint n_events,
+        const gchar * const * names,
+        GError ** error);
+
+/**
+ * Finds a header in the result of rtcom_el_fetch_headers_for_events().
+ * @param result The #RTComElHeadersResult
+ * @param event_id The id of the event
+ * @param name The header name
+ * @return The value, owned by result, or NULL if the event has no such
+ * header or wasn't asked for.
+ */
+const gchar * rtcom_el_headers_result_lookup(
+        const RTComElHeadersResult * result,
+        gint event_id,
+        const gchar * name);
+
+/** Frees the result of rtcom_el_fetch_headers_for_events().
+ * @param result The #RTComElHeadersResult. Can be NULL.
+ */
+void rtcom_el_headers_result_free(
+        RTComElHeadersResult * result);
+
 /**
  * Gets all event-ids that match a certain key:value in the Headers table..
  * @param el The #RTComEl object
@@ -512,6 +762,53 @@ gboolean rtcom_el_delete_events(
         RTComElQuery * query,
         GError ** error);
 
+/**
+ * Marks all the events matching a query as read/unread.
+ * The update is done in a single statement and a single RefreshHint is
+ * emitted if any event changed.
+ * @param el The #RTComEl object
+ * @param query A prepared #RTComElQuery
+ * @param read TRUE if you want to mark read, FALSE if you want to mark unread.
+ * @param error A location for the possible error message. Can be NULL if
+ * not interesting.
+ * @return FALSE in case of error, TRUE in case of success
+ */
+gboolean rtcom_el_set_read_by_query(
+        RTComEl * el,
+        RTComElQuery * query,
+        gboolean read,
+        GError ** error);
+
+/**
+ * Sets a flag for all the events matching a query.
+ * @param el The #RTComEl object
+ * @param query A prepared #RTComElQuery
+ * @param flag The name of the flag
+ * @param error A location for the possible error message. Can be NULL if
+ * not interesting.
+ * @return FALSE in case of error, TRUE in case of success
+ */
+gboolean rtcom_el_set_flag_by_query(
+        RTComEl * el,
+        RTComElQuery * query,
+        const gchar * flag,
+        GError ** error);
+
+/**
+ * Unsets a flag for all the events matching a query.
+ * @param el The #RTComEl object
+ * @param query A prepared #RTComElQuery
+ * @param flag The name of the flag
+ * @param error A location for the possible error message. Can be NULL if
+ * not interesting.
+ * @return FALSE in case of error, TRUE in case of success
+ */
+gboolean rtcom_el_unset_flag_by_query(
+        RTComEl * el,
+        RTComElQuery * query,
+        const gchar * flag,
+        GError ** error);
+
 /**
  * Removes all events matching a service.
  * @param el The #RTComEl object
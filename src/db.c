@@ -19,6 +19,7 @@
 
 #include <glib/gstdio.h>
 #include <errno.h>
+#include <string.h>
 #include <sched.h>
 
 #include "rtcom-eventlogger/db.h"
@@ -32,35 +33,51 @@ typedef struct {
 } EventField;
 
 /* This table encodes the field ordering in the result, API field name,
- * expected type and the SQL column name of the field. */
+ * expected type and the SQL column name of the field. It is indexed by
+ * RTComElField. */
 static EventField fields[] = {
-  { "service", G_TYPE_STRING, "Services.name" },
-  { "event-type", G_TYPE_STRING, "EventTypes.name" },
-  { "id", G_TYPE_INT, "Events.id" },
-  { "service-id", G_TYPE_INT, "Events.service_id" },
-  { "event-type-id", G_TYPE_INT, "Events.event_type_id" },
-  { "storage-time", G_TYPE_INT, "Events.storage_time" },
-  { "start-time", G_TYPE_INT, "Events.start_time" },
-  { "end-time", G_TYPE_INT, "Events.end_time" },
-  { "flags", G_TYPE_INT, "Events.flags" },
-  { "is-read", G_TYPE_BOOLEAN, "Events.is_read" },
-  { "bytes-sent", G_TYPE_INT, "Events.bytes_sent" },
-  { "bytes-received", G_TYPE_INT, "Events.bytes_received" },
-  { "local-uid", G_TYPE_STRING, "Events.local_uid" },
-  { "local-name", G_TYPE_STRING, "Events.local_name" },
-  { "group-uid", G_TYPE_STRING, "Events.group_uid" },
-  { "remote-ebook-uid", G_TYPE_STRING, "Remotes.abook_uid" },
-  { "remote-uid", G_TYPE_STRING, "Remotes.remote_uid" },
-  { "remote-name", G_TYPE_STRING, "Remotes.remote_name" },
+  [RTCOM_EL_FIELD_SERVICE] = { "service", G_TYPE_STRING, "Services.name" },
+  [RTCOM_EL_FIELD_EVENT_TYPE] = { "event-type", G_TYPE_STRING, "EventTypes.name" },
+  [RTCOM_EL_FIELD_ID] = { "id", G_TYPE_INT, "Events.id" },
+  [RTCOM_EL_FIELD_SERVICE_ID] = { "service-id", G_TYPE_INT, "Events.service_id" },
+  [RTCOM_EL_FIELD_EVENT_TYPE_ID] = { "event-type-id", G_TYPE_INT, "Events.event_type_id" },
+  [RTCOM_EL_FIELD_STORAGE_TIME] = { "storage-time", G_TYPE_INT, "Events.storage_time" },
+  [RTCOM_EL_FIELD_START_TIME] = { "start-time", G_TYPE_INT, "Events.start_time" },
+  [RTCOM_EL_FIELD_END_TIME] = { "end-time", G_TYPE_INT, "Events.end_time" },
+  [RTCOM_EL_FIELD_FLAGS] = { "flags", G_TYPE_INT, "Events.flags" },
+  [RTCOM_EL_FIELD_IS_READ] = { "is-read", G_TYPE_BOOLEAN, "Events.is_read" },
+  [RTCOM_EL_FIELD_BYTES_SENT] = { "bytes-sent", G_TYPE_INT, "Events.bytes_sent" },
+  [RTCOM_EL_FIELD_BYTES_RECEIVED] = { "bytes-received", G_TYPE_INT, "Events.bytes_received" },
+  [RTCOM_EL_FIELD_LOCAL_UID] = { "local-uid", G_TYPE_STRING, "Events.local_uid" },
+  [RTCOM_EL_FIELD_LOCAL_NAME] = { "local-name", G_TYPE_STRING, "Events.local_name" },
+  [RTCOM_EL_FIELD_GROUP_UID] = { "group-uid", G_TYPE_STRING, "Events.group_uid" },
+  [RTCOM_EL_FIELD_REMOTE_EBOOK_UID] = { "remote-ebook-uid", G_TYPE_STRING, "Remotes.abook_uid" },
+  [RTCOM_EL_FIELD_REMOTE_UID] = { "remote-uid", G_TYPE_STRING, "Remotes.remote_uid" },
+  [RTCOM_EL_FIELD_REMOTE_NAME] = { "remote-name", G_TYPE_STRING, "Remotes.remote_name" },
   /* Used most of the time, so we might as well special-case preload it. */
-  { "message-token", G_TYPE_STRING, "Headers.value" },
+  [RTCOM_EL_FIELD_MESSAGE_TOKEN] = { "message-token", G_TYPE_STRING, "Headers.value" },
   /* FIXME: these should really be in plugins */
-  { "channel", G_TYPE_STRING, "Events.channel" },
-  { "outgoing", G_TYPE_BOOLEAN, "Events.outgoing" },
-  { "free-text", G_TYPE_STRING, "Events.free_text" },
-  { NULL, 0, NULL }
+  [RTCOM_EL_FIELD_CHANNEL] = { "channel", G_TYPE_STRING, "Events.channel" },
+  [RTCOM_EL_FIELD_OUTGOING] = { "outgoing", G_TYPE_BOOLEAN, "Events.outgoing" },
+  [RTCOM_EL_FIELD_FREE_TEXT] = { "free-text", G_TYPE_STRING, "Events.free_text" },
+  /* Counted through idx_att_event_id, so that rows without attachments
+   * can be told apart without looking them up one by one */
+  [RTCOM_EL_FIELD_ATTACHMENT_COUNT] = { "attachment-count", G_TYPE_INT,
+      "(SELECT COUNT(*) FROM Attachments "
+      "WHERE Attachments.event_id = Events.id)" },
+  [RTCOM_EL_DB_N_FIELDS] = { NULL, 0, NULL }
 };
 
+/* Names of the fields that only plugins provide */
+static const gchar *computed_fields[] = {
+  [RTCOM_EL_FIELD_ADDITIONAL_TEXT - RTCOM_EL_DB_N_FIELDS] = "additional-text",
+  [RTCOM_EL_FIELD_ICON_NAME - RTCOM_EL_DB_N_FIELDS] = "icon-name",
+  [RTCOM_EL_FIELD_PANGO_MARKUP - RTCOM_EL_DB_N_FIELDS] = "pango-markup",
+};
+
+G_STATIC_ASSERT (G_N_ELEMENTS (computed_fields) ==
+    RTCOM_EL_N_FIELDS - RTCOM_EL_DB_N_FIELDS);
+
 /* This piece of SQL defines unique_remote to be a string that is unique
  * for every address book contact, and for every possibly-distinct contact
  * who is not in the address book.
@@ -83,10 +100,10 @@ static EventField fields[] = {
             "('lr:' || Events.local_uid || ';' || Events.remote_uid) " \
         "END AS unique_remote "
 
-#define REQUIRED_USER_VERSION 1
+#define REQUIRED_USER_VERSION 7
 
 static const gchar *db_schema_sql[] = {
-    "PRAGMA user_version = 1;",
+    "PRAGMA user_version = 7;",
     /* Services */
     "CREATE TABLE IF NOT EXISTS Services (" \
     "id INTEGER PRIMARY KEY," \
@@ -128,6 +145,42 @@ static const gchar *db_schema_sql[] = {
     "desc TEXT" \
     ");",
     "CREATE INDEX IF NOT EXISTS idx_att_event_id ON Attachments(event_id);",
+    /* Files in the attachment store, which may be shared by several
+     * attachments; a file can be removed once refcount drops to 0. */
+    "CREATE TABLE IF NOT EXISTS AttachmentFiles (" \
+    "path TEXT PRIMARY KEY," \
+    "refcount INTEGER NOT NULL DEFAULT 0" \
+    ");",
+    /* Attachments stored before the table existed */
+    "INSERT OR IGNORE INTO AttachmentFiles (path, refcount) " \
+       "SELECT path, COUNT(*) FROM Attachments GROUP BY path;",
+    "CREATE TRIGGER IF NOT EXISTS attf_ref AFTER INSERT ON Attachments " \
+       "FOR EACH ROW BEGIN " \
+           "INSERT OR IGNORE INTO AttachmentFiles (path, refcount) " \
+           "VALUES (NEW.path, 0); " \
+           "UPDATE AttachmentFiles SET refcount = refcount + 1 " \
+           "WHERE path = NEW.path; " \
+       "END;",
+    "CREATE TRIGGER IF NOT EXISTS attf_unref AFTER DELETE ON Attachments " \
+       "FOR EACH ROW BEGIN " \
+           "UPDATE AttachmentFiles SET refcount = refcount - 1 " \
+           "WHERE path = OLD.path; " \
+       "END;",
+    "CREATE TRIGGER IF NOT EXISTS attf_move " \
+       "AFTER UPDATE OF path ON Attachments " \
+       "FOR EACH ROW BEGIN " \
+           "UPDATE AttachmentFiles SET refcount = refcount - 1 " \
+           "WHERE path = OLD.path; " \
+           "INSERT OR IGNORE INTO AttachmentFiles (path, refcount) " \
+           "VALUES (NEW.path, 0); " \
+           "UPDATE AttachmentFiles SET refcount = refcount + 1 " \
+           "WHERE path = NEW.path; " \
+       "END;",
+    /* Files of the old attachment layout that couldn't be moved into the
+     * store, and are left where they are */
+    "CREATE TABLE IF NOT EXISTS AttachmentMigrationFailures (" \
+    "path TEXT PRIMARY KEY" \
+    ");",
     /* Headers */
     "CREATE TABLE IF NOT EXISTS Headers (" \
     "id INTEGER PRIMARY KEY," \
@@ -181,6 +234,31 @@ static const gchar *db_schema_sql[] = {
     "CREATE INDEX IF NOT EXISTS idx_ev_group_uid ON Events(group_uid);",
     "CREATE INDEX IF NOT EXISTS idx_ev_remote_uid ON Events(remote_uid);",
     "CREATE INDEX IF NOT EXISTS idx_gc_group_uid ON GroupCache(group_uid);",
+    /* The message-token header of each event, unique per service, for
+     * spotting redelivered messages. Only the first event stored with a
+     * given token is recorded. */
+    "CREATE TABLE IF NOT EXISTS MessageTokens (" \
+    "service_id INTEGER NOT NULL," \
+    "token TEXT NOT NULL," \
+    "event_id INTEGER NOT NULL," \
+    "PRIMARY KEY (service_id, token)" \
+    ");",
+    "CREATE INDEX IF NOT EXISTS idx_mt_event_id ON MessageTokens(event_id);",
+    /* Tokens stored before the table existed */
+    "INSERT OR IGNORE INTO MessageTokens (service_id, token, event_id) " \
+       "SELECT Events.service_id, Headers.value, Headers.event_id " \
+       "FROM Headers JOIN Events ON Events.id = Headers.event_id " \
+       "WHERE Headers.name = 'message-token' ORDER BY Headers.event_id;",
+    "CREATE TRIGGER IF NOT EXISTS mt_add AFTER INSERT ON Headers " \
+       "FOR EACH ROW WHEN NEW.name = 'message-token' BEGIN " \
+           "INSERT OR IGNORE INTO MessageTokens (service_id, token, event_id) " \
+           "SELECT service_id, NEW.value, NEW.event_id FROM Events " \
+           "WHERE id = NEW.event_id; " \
+       "END;",
+    "CREATE TRIGGER IF NOT EXISTS mt_remove AFTER DELETE ON Headers " \
+       "FOR EACH ROW WHEN OLD.name = 'message-token' BEGIN " \
+           "DELETE FROM MessageTokens WHERE event_id = OLD.event_id; " \
+       "END;",
     /* equivalent to ON DELETE CASCADE for Services and EventTypes */
     "CREATE TRIGGER IF NOT EXISTS fkd_services_event_types_plugin_id " \
        "BEFORE DELETE ON Plugins FOR EACH ROW BEGIN " \
@@ -223,6 +301,105 @@ static const gchar *db_schema_sql[] = {
                "flags = (flags & (~OLD.flags)) | NEW.flags " \
                "WHERE group_uid = NEW.group_uid; " \
         "END;",
+    /* Number of events per service, so counting them doesn't need a
+     * scan of Events */
+    "CREATE TABLE IF NOT EXISTS EventCounts (" \
+    "service_id INTEGER PRIMARY KEY," \
+    "total INTEGER NOT NULL DEFAULT 0" \
+    ");",
+    /* Events stored before the table existed */
+    "INSERT OR REPLACE INTO EventCounts (service_id, total) " \
+       "SELECT service_id, COUNT(*) FROM Events GROUP BY service_id;",
+    "CREATE TRIGGER IF NOT EXISTS ec_add AFTER INSERT ON Events " \
+       "FOR EACH ROW BEGIN " \
+           "INSERT OR IGNORE INTO EventCounts (service_id, total) " \
+           "VALUES (NEW.service_id, 0); " \
+           "UPDATE EventCounts SET total = total + 1 " \
+           "WHERE service_id = NEW.service_id; " \
+       "END;",
+    "CREATE TRIGGER IF NOT EXISTS ec_remove AFTER DELETE ON Events " \
+       "FOR EACH ROW BEGIN " \
+           "UPDATE EventCounts SET total = total - 1 " \
+           "WHERE service_id = OLD.service_id; " \
+       "END;",
+    "CREATE TRIGGER IF NOT EXISTS ec_move AFTER UPDATE OF service_id ON Events " \
+       "FOR EACH ROW WHEN NEW.service_id <> OLD.service_id BEGIN " \
+           "UPDATE EventCounts SET total = total - 1 " \
+           "WHERE service_id = OLD.service_id; " \
+           "INSERT OR IGNORE INTO EventCounts (service_id, total) " \
+           "VALUES (NEW.service_id, 0); " \
+           "UPDATE EventCounts SET total = total + 1 " \
+           "WHERE service_id = NEW.service_id; " \
+       "END;",
+    /* Latest event and totals for each local and remote uid pair, which
+     * is what grouping by contact or uids works on. It's keyed by the
+     * uids rather than by contact, so address book changes don't touch
+     * it. The uids can be NULL, hence IS rather than =. */
+    "CREATE TABLE IF NOT EXISTS ContactCache (" \
+    "local_uid TEXT," \
+    "remote_uid TEXT," \
+    "event_id INTEGER NOT NULL," \
+    "total_events INTEGER DEFAULT 0," \
+    "read_events INTEGER DEFAULT 0," \
+    "UNIQUE(local_uid, remote_uid)" \
+    ");",
+    "CREATE INDEX IF NOT EXISTS idx_cc_event_id ON ContactCache(event_id);",
+    /* Events stored before the table existed */
+    "DELETE FROM ContactCache;",
+    "INSERT INTO ContactCache (local_uid, remote_uid, event_id, " \
+       "total_events, read_events) " \
+       "SELECT local_uid, remote_uid, MAX(id), COUNT(*), SUM(is_read) " \
+       "FROM Events GROUP BY local_uid, remote_uid;",
+    "CREATE TRIGGER IF NOT EXISTS cc_add AFTER INSERT ON Events " \
+       "FOR EACH ROW BEGIN " \
+           "INSERT INTO ContactCache (local_uid, remote_uid, event_id) " \
+           "SELECT NEW.local_uid, NEW.remote_uid, NEW.id WHERE NOT EXISTS " \
+           "(SELECT 1 FROM ContactCache WHERE local_uid IS NEW.local_uid AND remote_uid IS NEW.remote_uid); " \
+           "UPDATE ContactCache SET event_id = MAX(event_id, NEW.id), " \
+           "total_events = total_events + 1, " \
+           "read_events = read_events + NEW.is_read " \
+           "WHERE local_uid IS NEW.local_uid AND remote_uid IS NEW.remote_uid; " \
+       "END;",
+    "CREATE TRIGGER IF NOT EXISTS cc_remove AFTER DELETE ON Events " \
+       "FOR EACH ROW BEGIN " \
+           "UPDATE ContactCache SET total_events = total_events - 1, " \
+           "read_events = read_events - OLD.is_read " \
+           "WHERE local_uid IS OLD.local_uid AND remote_uid IS OLD.remote_uid; " \
+           "DELETE FROM ContactCache WHERE local_uid IS OLD.local_uid AND remote_uid IS OLD.remote_uid " \
+           "AND total_events <= 0; " \
+           "UPDATE ContactCache SET event_id = (SELECT MAX(id) FROM Events " \
+           "WHERE local_uid IS OLD.local_uid AND remote_uid IS OLD.remote_uid) " \
+           "WHERE local_uid IS OLD.local_uid AND remote_uid IS OLD.remote_uid AND event_id = OLD.id; " \
+       "END;",
+    "CREATE TRIGGER IF NOT EXISTS cc_update_read " \
+       "AFTER UPDATE OF is_read ON Events " \
+       "FOR EACH ROW WHEN NEW.is_read <> OLD.is_read " \
+       "AND NEW.local_uid IS OLD.local_uid " \
+       "AND NEW.remote_uid IS OLD.remote_uid BEGIN " \
+           "UPDATE ContactCache SET " \
+           "read_events = read_events - OLD.is_read + NEW.is_read " \
+           "WHERE local_uid IS NEW.local_uid AND remote_uid IS NEW.remote_uid; " \
+       "END;",
+    "CREATE TRIGGER IF NOT EXISTS cc_move " \
+       "AFTER UPDATE OF local_uid, remote_uid ON Events " \
+       "FOR EACH ROW WHEN NEW.local_uid IS NOT OLD.local_uid " \
+       "OR NEW.remote_uid IS NOT OLD.remote_uid BEGIN " \
+           "UPDATE ContactCache SET total_events = total_events - 1, " \
+           "read_events = read_events - OLD.is_read " \
+           "WHERE local_uid IS OLD.local_uid AND remote_uid IS OLD.remote_uid; " \
+           "DELETE FROM ContactCache WHERE local_uid IS OLD.local_uid AND remote_uid IS OLD.remote_uid " \
+           "AND total_events <= 0; " \
+           "UPDATE ContactCache SET event_id = (SELECT MAX(id) FROM Events " \
+           "WHERE local_uid IS OLD.local_uid AND remote_uid IS OLD.remote_uid) " \
+           "WHERE local_uid IS OLD.local_uid AND remote_uid IS OLD.remote_uid AND event_id = OLD.id; " \
+           "INSERT INTO ContactCache (local_uid, remote_uid, event_id) " \
+           "SELECT NEW.local_uid, NEW.remote_uid, NEW.id WHERE NOT EXISTS " \
+           "(SELECT 1 FROM ContactCache WHERE local_uid IS NEW.local_uid AND remote_uid IS NEW.remote_uid); " \
+           "UPDATE ContactCache SET event_id = MAX(event_id, NEW.id), " \
+           "total_events = total_events + 1, " \
+           "read_events = read_events + NEW.is_read " \
+           "WHERE local_uid IS NEW.local_uid AND remote_uid IS NEW.remote_uid; " \
+       "END;",
     NULL };
 
 /* Busy looping is handled in rtcom_el_db_exec, here we just make sure
@@ -252,18 +429,17 @@ void
 rtcom_el_db_schema_get_mappings (const gchar **out_selection,
     GHashTable **out_mapping, GHashTable **out_typing)
 {
+  static gsize initialized = 0;
   static GHashTable *mapping = NULL;
   static GHashTable *typing = NULL;
   static gchar *selection = NULL;
 
-  if (G_UNLIKELY (mapping == NULL))
+  /* Threads with their own connections may get here at the same time */
+  if (g_once_init_enter (&initialized))
     {
       GPtrArray *sel = g_ptr_array_sized_new (sizeof(fields) / sizeof(EventField));
       gint i;
 
-      g_assert (selection == NULL);
-      g_assert (typing == NULL);
-
       mapping = g_hash_table_new (g_str_hash, g_str_equal);
       typing = g_hash_table_new (g_str_hash, g_str_equal);
 
@@ -279,6 +455,8 @@ rtcom_el_db_schema_get_mappings (const gchar **out_selection,
       g_ptr_array_add (sel, NULL);
       selection = g_strjoinv (", ", (gchar **) sel->pdata);
       g_ptr_array_free (sel, TRUE);
+
+      g_once_init_leave (&initialized, 1);
   }
 
   if (out_mapping != NULL)
@@ -291,6 +469,52 @@ rtcom_el_db_schema_get_mappings (const gchar **out_selection,
       *out_selection = selection;
 }
 
+/* Builds a selection of only the given fields (plus those the iterator
+ * needs), each named after its field so that rows can be read back by
+ * name. Fields are kept in schema order, so a selection of all of them
+ * reads like the full one. */
+gchar *
+rtcom_el_db_schema_get_selection (const gchar * const *names,
+    gboolean unique_remote)
+{
+  GString *sel = g_string_sized_new (256);
+  const gchar * const *name;
+  gint i;
+
+  for (name = names; *name != NULL; name++)
+    {
+      for (i = 0; fields[i].name != NULL; i++)
+          if (strcmp (*name, fields[i].name) == 0)
+              break;
+
+      if (fields[i].name == NULL)
+          g_warning ("%s: unknown field %s", G_STRFUNC, *name);
+    }
+
+  for (i = 0; fields[i].name != NULL; i++)
+    {
+      gboolean wanted = (strcmp (fields[i].name, "id") == 0 ||
+          strcmp (fields[i].name, "service-id") == 0 ||
+          strcmp (fields[i].name, "event-type-id") == 0);
+
+      for (name = names; !wanted && *name != NULL; name++)
+          wanted = (strcmp (*name, fields[i].name) == 0);
+
+      if (!wanted)
+          continue;
+
+      if (sel->len > 0)
+          g_string_append (sel, ", ");
+      g_string_append_printf (sel, "%s AS \"%s\"", fields[i].column,
+          fields[i].name);
+    }
+
+  if (unique_remote)
+      g_string_append (sel, ", " UNIQUE_REMOTE);
+
+  return g_string_free (sel, FALSE);
+}
+
 #ifdef SQL_TRACING
 static void
 trace_cb (void *dummy, const char *sql)
@@ -776,13 +1000,172 @@ rtcom_el_db_open (const gchar *fname)
   return _internal_open (fname, TRUE);
 }
 
+/* Compiled statements kept for reuse by a connection. A statement is
+ * taken out of the cache while it's in use, so it's never shared; when
+ * the cache is full, the one released the longest ago goes. Guarded by
+ * the connection's own mutex. */
+#define STMT_CACHE_SIZE 32
+
+typedef struct {
+  /* SQL, owned by the statement -> its link in lru */
+  GHashTable *by_sql;
+  /* sqlite3_stmt *, the most recently released first */
+  GQueue lru;
+} StmtCache;
+
+/* db -> StmtCache. Only changed when a connection first keeps a
+ * statement and when it's closed, so it's mostly read, concurrently. */
+static GRWLock stmt_caches_lock;
+static GHashTable *stmt_caches = NULL;
+
+static void
+_stmt_cache_free (StmtCache *cache)
+{
+  while (!g_queue_is_empty (&cache->lru))
+      sqlite3_finalize (g_queue_pop_head (&cache->lru));
+
+  g_hash_table_destroy (cache->by_sql);
+  g_slice_free (StmtCache, cache);
+}
+
+/* The statement cache of db, created if asked to */
+static StmtCache *
+_stmt_cache_get (rtcom_el_db_t db, gboolean create)
+{
+  StmtCache *cache = NULL;
+
+  g_rw_lock_reader_lock (&stmt_caches_lock);
+  if (stmt_caches != NULL)
+      cache = g_hash_table_lookup (stmt_caches, db);
+  g_rw_lock_reader_unlock (&stmt_caches_lock);
+
+  if (cache != NULL || !create)
+      return cache;
+
+  g_rw_lock_writer_lock (&stmt_caches_lock);
+  if (stmt_caches == NULL)
+      stmt_caches = g_hash_table_new (NULL, NULL);
+
+  cache = g_hash_table_lookup (stmt_caches, db);
+  if (cache == NULL)
+    {
+      cache = g_slice_new0 (StmtCache);
+      cache->by_sql = g_hash_table_new (g_str_hash, g_str_equal);
+      g_queue_init (&cache->lru);
+      g_hash_table_insert (stmt_caches, db, cache);
+    }
+  g_rw_lock_writer_unlock (&stmt_caches_lock);
+
+  return cache;
+}
+
 void
 rtcom_el_db_close (rtcom_el_db_t db)
 {
+  StmtCache *cache = NULL;
+
   g_assert (db);
+
+  g_rw_lock_writer_lock (&stmt_caches_lock);
+  if (stmt_caches != NULL &&
+      (cache = g_hash_table_lookup (stmt_caches, db)) != NULL)
+      g_hash_table_remove (stmt_caches, db);
+  g_rw_lock_writer_unlock (&stmt_caches_lock);
+
+  /* sqlite3_close() fails while statements are left */
+  if (cache != NULL)
+      _stmt_cache_free (cache);
+
   sqlite3_close (db);
 }
 
+/* Returns a statement compiled from sql, from the cache of the connection
+ * if there's one. Hand it back with rtcom_el_db_stmt_release() when
+ * done. */
+rtcom_el_db_stmt_t
+rtcom_el_db_stmt_acquire (rtcom_el_db_t db, const gchar *sql, GError **error)
+{
+  rtcom_el_db_stmt_t stmt = NULL;
+  StmtCache *cache;
+  GList *link;
+
+  g_assert (db);
+  g_assert (sql);
+
+  cache = _stmt_cache_get (db, FALSE);
+  if (cache != NULL)
+    {
+      sqlite3_mutex_enter (sqlite3_db_mutex (db));
+      link = g_hash_table_lookup (cache->by_sql, sql);
+      if (link != NULL)
+        {
+          stmt = link->data;
+          g_hash_table_remove (cache->by_sql, sql);
+          g_queue_delete_link (&cache->lru, link);
+        }
+      sqlite3_mutex_leave (sqlite3_db_mutex (db));
+    }
+
+  if (stmt != NULL)
+      return stmt;
+
+  if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+      g_warning ("%s: can't compile SQL statement \"%s\": %s", G_STRFUNC, sql,
+          sqlite3_errmsg (db));
+      g_set_error (error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+          "Can't compile SQL statement: %s", sqlite3_errmsg (db));
+      sqlite3_finalize (stmt);
+      return NULL;
+    }
+
+  return stmt;
+}
+
+/* Resets the statement and keeps it for the next
+ * rtcom_el_db_stmt_acquire() with the same SQL, making room for it if
+ * the cache is full. */
+void
+rtcom_el_db_stmt_release (rtcom_el_db_stmt_t stmt)
+{
+  rtcom_el_db_t db;
+  rtcom_el_db_stmt_t evicted = NULL;
+  StmtCache *cache;
+  const gchar *sql;
+
+  if (stmt == NULL)
+      return;
+
+  db = sqlite3_db_handle (stmt);
+  sql = sqlite3_sql (stmt);
+
+  sqlite3_reset (stmt);
+  sqlite3_clear_bindings (stmt);
+
+  cache = _stmt_cache_get (db, TRUE);
+
+  sqlite3_mutex_enter (sqlite3_db_mutex (db));
+  if (!g_hash_table_contains (cache->by_sql, sql))
+    {
+      g_queue_push_head (&cache->lru, stmt);
+      g_hash_table_insert (cache->by_sql, (gpointer) sql, cache->lru.head);
+      stmt = NULL;
+
+      if (g_queue_get_length (&cache->lru) > STMT_CACHE_SIZE)
+        {
+          evicted = g_queue_pop_tail (&cache->lru);
+          g_hash_table_remove (cache->by_sql, sqlite3_sql (evicted));
+        }
+    }
+  sqlite3_mutex_leave (sqlite3_db_mutex (db));
+
+  /* Another one with the same SQL was released first */
+  if (stmt != NULL)
+      sqlite3_finalize (stmt);
+  if (evicted != NULL)
+      sqlite3_finalize (evicted);
+}
+
 /* Fetches a single integer value from a row of data */
 void
 rtcom_el_db_single_int (gpointer data, gpointer user_data)
@@ -958,7 +1341,8 @@ rtcom_el_db_exec_printf (rtcom_el_db_t db, GFunc cb, gpointer user_data,
 
 /* Starts a new transaction. SQLite doesn't return error for nested
  * BEGINs, so we guard against it manually. Note that this is
- * not threadsafe. */
+ * not threadsafe, so connections shouldn't be shared between
+ * threads. */
 gboolean
 rtcom_el_db_transaction (rtcom_el_db_t db, gboolean exclusive,
     GError **error)
@@ -1059,9 +1443,11 @@ rtcom_el_db_schema_get_row (rtcom_el_db_stmt_t stmt)
   GHashTable *row = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
       rtcom_el_db_g_value_slice_free);
 
+  /* Fields that weren't selected keep their default value */
   for (i = 0; fields[i].name != NULL; i++)
     {
       GValue *val = g_slice_new0 (GValue);
+      g_value_init (val, fields[i].type);
       g_hash_table_insert (row, fields[i].name, val);
     }
 
@@ -1069,40 +1455,189 @@ rtcom_el_db_schema_get_row (rtcom_el_db_stmt_t stmt)
   return row;
 }
 
+static void
+_set_value_from_column (GValue *val, rtcom_el_db_stmt_t stmt, gint col)
+{
+  switch (G_VALUE_TYPE (val))
+    {
+      case G_TYPE_INT:
+          g_value_set_int (val, sqlite3_column_int (stmt, col));
+          break;
+      case G_TYPE_BOOLEAN:
+          g_value_set_boolean (val, 0 != sqlite3_column_int (stmt, col));
+          break;
+      case G_TYPE_STRING:
+          g_value_set_string (val,
+              (const gchar *) sqlite3_column_text (stmt, col));
+          break;
+
+      default:
+          /* If we got here, that means get_schema() is buggy. */
+          g_assert_not_reached ();
+    }
+}
+
+/* Finds which column of the statement holds a field, or -1 if it wasn't
+ * selected or doesn't exist */
+gint
+rtcom_el_db_schema_get_column (rtcom_el_db_stmt_t stmt, const gchar *name,
+    GType *out_type)
+{
+  gint i, n_columns;
+
+  g_assert (stmt);
+
+  for (i = 0; fields[i].name != NULL; i++)
+      if (strcmp (name, fields[i].name) == 0)
+          break;
+
+  if (fields[i].name == NULL)
+      return -1;
+
+  if (out_type != NULL)
+      *out_type = fields[i].type;
+
+  n_columns = sqlite3_column_count (stmt);
+
+  /* The full selection is in schema order, see update_row() */
+  if (n_columns >= (gint) G_N_ELEMENTS (fields))
+      return i;
+
+  for (i = 0; i < n_columns; i++)
+      if (strcmp (name, sqlite3_column_name (stmt, i)) == 0)
+          return i;
+
+  return -1;
+}
+
+/* Points values, indexed by RTComElField, at the fields of a row
+ * returned by get_row() */
 void
-rtcom_el_db_schema_update_row (rtcom_el_db_stmt_t stmt,
-    GHashTable *row)
+rtcom_el_db_schema_get_row_values (GHashTable *row, GValue **values)
 {
   gint i;
 
-  g_assert (stmt);
   g_assert (row);
 
-  for (i = 0; fields[i].name != NULL; i++)
-    {
-      GValue *val = g_hash_table_lookup (row, fields[i].name);
-      if (G_VALUE_TYPE (val) != G_TYPE_INVALID)
-          g_value_unset (val);
+  for (i = 0; i < RTCOM_EL_DB_N_FIELDS; i++)
+      values[i] = g_hash_table_lookup (row, fields[i].name);
+}
 
-      g_value_init (val, fields[i].type);
+/* Maps each column of the statement to the RTComElField it holds, or -1,
+ * so that rows can be read without looking their columns up by name */
+gint *
+rtcom_el_db_schema_get_column_fields (rtcom_el_db_stmt_t stmt,
+    gint *n_columns)
+{
+  gint *column_fields;
+  gint i, j;
 
-      switch (fields[i].type)
+  g_assert (stmt);
+
+  *n_columns = sqlite3_column_count (stmt);
+  column_fields = g_new (gint, *n_columns);
+
+  for (i = 0; i < *n_columns; i++)
+    {
+      column_fields[i] = -1;
+
+      /* The full selection is in schema order, see update_row() */
+      if (*n_columns >= (gint) G_N_ELEMENTS (fields))
         {
-          case G_TYPE_INT:
-              g_value_set_int (val, sqlite3_column_int (stmt, i));
-              break;
-          case G_TYPE_BOOLEAN:
-              g_value_set_boolean (val, 0 != sqlite3_column_int (stmt, i));
-              break;
-          case G_TYPE_STRING:
-              g_value_set_string (val,
-                  (const gchar *) sqlite3_column_text (stmt, i));
+          if (i < RTCOM_EL_DB_N_FIELDS)
+              column_fields[i] = i;
+          continue;
+        }
+
+      for (j = 0; j < RTCOM_EL_DB_N_FIELDS; j++)
+          if (strcmp (sqlite3_column_name (stmt, i), fields[j].name) == 0)
+            {
+              column_fields[i] = j;
               break;
+            }
+    }
 
-          default:
-              /* If we got here, that means get_schema() is buggy. */
-              g_assert_not_reached ();
-        }
+  return column_fields;
+}
+
+void
+rtcom_el_db_schema_update_values (rtcom_el_db_stmt_t stmt,
+    const gint *column_fields, gint n_columns, GValue * const *values)
+{
+  gint i;
+
+  g_assert (stmt);
+
+  for (i = 0; i < n_columns; i++)
+      if (column_fields[i] >= 0)
+          _set_value_from_column (values[column_fields[i]], stmt, i);
+}
+
+const gchar *
+rtcom_el_field_get_name (RTComElField field)
+{
+  g_return_val_if_fail (field >= 0 && field < RTCOM_EL_N_FIELDS, NULL);
+
+  if (field < RTCOM_EL_DB_N_FIELDS)
+      return fields[field].name;
+
+  return computed_fields[field - RTCOM_EL_DB_N_FIELDS];
+}
+
+gint
+rtcom_el_field_from_name (const gchar *name)
+{
+  static gsize ids = 0;
+
+  g_return_val_if_fail (name != NULL, -1);
+
+  if (g_once_init_enter (&ids))
+    {
+      GHashTable *table;
+      gint i;
+
+      table = g_hash_table_new (g_str_hash, g_str_equal);
+
+      /* Offset by one so that a missing name reads as -1 */
+      for (i = 0; i < RTCOM_EL_N_FIELDS; i++)
+          g_hash_table_insert (table, (gpointer) rtcom_el_field_get_name (i),
+              GINT_TO_POINTER (i + 1));
+
+      g_once_init_leave (&ids, (gsize) table);
+    }
+
+  return GPOINTER_TO_INT (g_hash_table_lookup ((GHashTable *) ids,
+      name)) - 1;
+}
+
+void
+rtcom_el_db_schema_update_row (rtcom_el_db_stmt_t stmt,
+    GHashTable *row)
+{
+  gint i, n_columns;
+
+  g_assert (stmt);
+  g_assert (row);
+
+  n_columns = sqlite3_column_count (stmt);
+
+  /* fields[] ends with a NULL entry, the selection with unique_remote */
+  if (n_columns >= (gint) G_N_ELEMENTS (fields))
+    {
+      /* The full selection, in schema order */
+      for (i = 0; fields[i].name != NULL; i++)
+          _set_value_from_column (g_hash_table_lookup (row, fields[i].name),
+              stmt, i);
+      return;
+    }
+
+  /* A projection; its columns are named after the fields */
+  for (i = 0; i < n_columns; i++)
+    {
+      GValue *val = g_hash_table_lookup (row, sqlite3_column_name (stmt, i));
+
+      if (val != NULL)
+          _set_value_from_column (val, stmt, i);
     }
 }
 
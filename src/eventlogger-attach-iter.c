@@ -115,7 +115,7 @@ static void rtcom_el_attach_iter_finalize(
 
     if(priv->stmt)
     {
-        sqlite3_finalize(priv->stmt);
+        rtcom_el_db_stmt_release(priv->stmt);
         priv->stmt = NULL;
     }
 
@@ -182,7 +182,7 @@ gboolean rtcom_el_attach_iter_next(
     status = rtcom_el_db_iterate (priv->db, priv->stmt, NULL);
     if(status == SQLITE_DONE)
     {
-        sqlite3_finalize(priv->stmt);
+        rtcom_el_db_stmt_release(priv->stmt);
         priv->stmt = NULL;
         return FALSE;
     }
@@ -190,7 +190,7 @@ gboolean rtcom_el_attach_iter_next(
     {
         g_warning("Could not step statement: %s",
                 sqlite3_errmsg(priv->db));
-        sqlite3_finalize(priv->stmt);
+        rtcom_el_db_stmt_release(priv->stmt);
         priv->stmt = NULL;
         return FALSE;
     }
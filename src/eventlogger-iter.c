@@ -45,6 +45,42 @@ struct _RTComElIterPrivate {
     /* Row data, as returned by rtocm_el_query_get_row() */
     GHashTable * columns;
 
+    /* The same values, indexed by RTComElField */
+    GValue * values[RTCOM_EL_DB_N_FIELDS];
+
+    /* The field each column of stmt holds, or -1 */
+    gint * column_fields;
+    gint n_columns;
+    gboolean has_attachment_count;
+
+    /* Plugin values handed out by rtcom_el_iter_peek_string(), kept
+     * until the iterator moves */
+    GHashTable * peeked;
+
+    /* Headers fetched ahead, see rtcom_el_iter_set_header_prefetch().
+     * prefetched maps the event ids of the window to their row in
+     * prefetch_values, which has a value or NULL for each name. */
+    gchar ** prefetch_names;
+    RTComElQuery * prefetch_probe;
+    GHashTable * prefetched;
+    GPtrArray * prefetch_values;
+    GStringChunk * prefetch_chunk;
+
+    /* Attachments fetched ahead, see
+     * rtcom_el_iter_set_attachment_prefetch(). attach_starts maps the
+     * event ids of the window to where their attachments start in
+     * attachments, plus one; they are contiguous. */
+    RTComElQuery * attach_probe;
+    GHashTable * attach_starts;
+    GArray * attachments;
+    GStringChunk * attach_chunk;
+
+    /* Plugin values computed for a window of rows at a time, see
+     * rtcom_el_iter_set_plugin_window(). plugin_windows maps each plugin
+     * to the PluginWindow holding its rows. */
+    RTComElQuery * plugin_probe;
+    GHashTable * plugin_windows;
+
     /* Whether this iterator is atomic and should close the
      * transaction when getting disposed. */
     gboolean atomic;
@@ -58,6 +94,46 @@ struct _RTComElIterPrivate {
 
 G_DEFINE_TYPE_WITH_PRIVATE(RTComElIter, rtcom_el_iter, G_TYPE_OBJECT);
 
+typedef struct {
+    const gchar * name;
+    GType type;
+    /* gint values for integer and boolean fields; for strings, guint
+     * offsets into the arena, G_MAXUINT standing for NULL */
+    GArray * data;
+} BatchColumn;
+
+struct _RTComElIterBatch {
+    BatchColumn * columns;
+    guint n_columns;
+    guint n_rows;
+    GByteArray * arena;
+};
+
+/* The values a plugin computed for the rows of a window */
+typedef struct {
+    guint n;
+    GValue * values;
+} PluginValues;
+
+/* The rows of a plugin's window, one column per stored RTComElField */
+typedef struct {
+    /* The iterator's query, fetching only what the plugin reads */
+    RTComElQuery * probe;
+    RTComElIterBatch * batch;
+    /* Event ids to their row in batch, plus one */
+    GHashTable * rows;
+    /* Interned keys to their PluginValues, or to NULL if the plugin
+     * doesn't compute them */
+    GHashTable * values;
+} PluginWindow;
+
+static void _plugin_window_free(gpointer data);
+static gboolean _window_plugin_value(
+        RTComElIter * it,
+        RTComElPlugin * plugin,
+        const gchar * key,
+        GValue * value);
+
 enum
 {
     RTCOM_EL_ITER_PROP_EL = 1,
@@ -71,20 +147,36 @@ enum
 void _update_representation(
         RTComElIterPrivate * priv)
 {
+    gint i;
+
     g_assert(priv);
 
     g_return_if_fail(priv->stmt);
 
-    if (priv->columns)
-        rtcom_el_db_schema_update_row (priv->stmt, priv->columns);
-    else
+    g_hash_table_remove_all (priv->peeked);
+
+    if (priv->columns == NULL)
+      {
         priv->columns = rtcom_el_db_schema_get_row (priv->stmt);
+        rtcom_el_db_schema_get_row_values (priv->columns, priv->values);
+        priv->column_fields = rtcom_el_db_schema_get_column_fields (
+            priv->stmt, &priv->n_columns);
+
+        for (i = 0; i < priv->n_columns; i++)
+            if (priv->column_fields[i] == RTCOM_EL_FIELD_ATTACHMENT_COUNT)
+                priv->has_attachment_count = TRUE;
+      }
+    else
+      {
+        rtcom_el_db_schema_update_values (priv->stmt, priv->column_fields,
+            priv->n_columns, priv->values);
+      }
 
-#define LOOKUP_INT(x) (g_value_get_int (g_hash_table_lookup (priv->columns, x)))
+#define LOOKUP_INT(x) (g_value_get_int (priv->values[RTCOM_EL_FIELD_ ## x]))
 
-    priv->current_event_id = LOOKUP_INT("id");
-    priv->current_service_id = LOOKUP_INT("service-id");
-    priv->current_event_type_id = LOOKUP_INT("event-type-id");
+    priv->current_event_id = LOOKUP_INT(ID);
+    priv->current_service_id = LOOKUP_INT(SERVICE_ID);
+    priv->current_event_type_id = LOOKUP_INT(EVENT_TYPE_ID);
 
     priv->currently_active_plugin = g_hash_table_lookup (priv->plugins,
         GINT_TO_POINTER (priv->current_service_id));
@@ -92,23 +184,52 @@ void _update_representation(
 #undef LOOKUP_INT
 }
 
+/* Asks the plugin for a value: by id if it takes ids and the value has
+ * one, by name otherwise. field may be -1 if it hasn't been looked up. */
+static gboolean _plugin_get_value(
+        RTComElIter * it,
+        gint field,
+        const gchar * key,
+        GValue * value)
+{
+    RTComElIterPrivate * priv = RTCOM_EL_ITER_GET_PRIV(it);
+    RTComElPlugin * plugin = priv->currently_active_plugin;
+
+    if(plugin == NULL)
+        return FALSE;
+
+    if(plugin->get_values && priv->plugin_probe &&
+       _window_plugin_value(it, plugin, key, value))
+        return TRUE;
+
+    if(plugin->get_value_by_id)
+    {
+        if(field < 0)
+            field = rtcom_el_field_from_name(key);
+
+        if(field >= 0)
+            return plugin->get_value_by_id(it, field, value);
+    }
+
+    if(plugin->get_value)
+        return plugin->get_value(it, key, value);
+
+    return FALSE;
+}
+
 static gboolean _find_value(
         RTComElIter * it,
         const gchar * key,
         GValue * value)
 {
-    RTComElIterPrivate * priv;
     gboolean got_value = FALSE;
 
     g_return_val_if_fail(
              RTCOM_IS_EL_ITER(it) && key != NULL && value != NULL,
              FALSE);
 
-    priv = RTCOM_EL_ITER_GET_PRIV(it);
-
     /* Ask the plugin */
-    if(priv->currently_active_plugin && priv->currently_active_plugin->get_value)
-        got_value = priv->currently_active_plugin->get_value(it, key, value);
+    got_value = _plugin_get_value(it, -1, key, value);
 
     if(!got_value)
     {
@@ -125,6 +246,75 @@ static gboolean _find_value(
     return TRUE;
 }
 
+/* Asks the plugin for a value, keeping it until the iterator moves so
+ * that it can be handed out without copying */
+static const GValue * _peek_plugin_value(
+        RTComElIter * it,
+        gint field,
+        const gchar * key)
+{
+    RTComElIterPrivate * priv = RTCOM_EL_ITER_GET_PRIV(it);
+    GValue * value;
+
+    value = g_hash_table_lookup(priv->peeked, key);
+    if(value != NULL)
+        return value;
+
+    if(priv->currently_active_plugin == NULL)
+        return NULL;
+
+    value = g_slice_new0(GValue);
+    if(!_plugin_get_value(it, field, key, value))
+    {
+        g_slice_free(GValue, value);
+        return NULL;
+    }
+
+    g_hash_table_insert(priv->peeked, (gpointer) g_intern_string(key),
+            value);
+
+    return value;
+}
+
+/* Gets a plugin-provided string, or the fallback field (-1 for none) if
+ * the plugin doesn't provide it */
+static gchar * _plugin_string(
+        RTComElIter * it,
+        RTComElField field,
+        gint fallback,
+        gboolean borrowed)
+{
+    RTComElIterPrivate * priv = RTCOM_EL_ITER_GET_PRIV(it);
+    const gchar * key = rtcom_el_field_get_name(field);
+    const GValue * value = NULL;
+
+    if(borrowed)
+    {
+        value = _peek_plugin_value(it, field, key);
+    }
+    else
+    {
+        GValue tmp = {0,};
+
+        if(_plugin_get_value(it, field, key, &tmp))
+        {
+            gchar * ret = g_value_dup_string(&tmp);
+
+            g_value_unset(&tmp);
+            return ret;
+        }
+    }
+
+    if(value == NULL && fallback >= 0)
+        value = priv->values[fallback];
+
+    if(value == NULL)
+        return NULL;
+
+    return borrowed ? (gchar *) g_value_get_string(value) :
+        g_value_dup_string(value);
+}
+
 static void rtcom_el_iter_set_property(
         GObject * obj,
         guint prop_id,
@@ -223,6 +413,21 @@ static void rtcom_el_iter_init(
     priv->stmt = NULL;
     priv->plugins = NULL;
     priv->atomic = FALSE;
+    priv->peeked = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+        rtcom_el_db_g_value_slice_free);
+    priv->prefetch_names = NULL;
+    priv->prefetch_probe = NULL;
+    priv->prefetched = g_hash_table_new (g_direct_hash, g_direct_equal);
+    priv->prefetch_values = g_ptr_array_new ();
+    priv->prefetch_chunk = g_string_chunk_new (1024);
+    priv->attach_probe = NULL;
+    priv->attach_starts = g_hash_table_new (g_direct_hash, g_direct_equal);
+    priv->attachments = g_array_new (FALSE, FALSE,
+        sizeof (RTComElAttachment));
+    priv->attach_chunk = g_string_chunk_new (1024);
+    priv->plugin_probe = NULL;
+    priv->plugin_windows = g_hash_table_new_full (g_direct_hash,
+        g_direct_equal, NULL, _plugin_window_free);
 
     priv->current_event_id = -1;
     priv->current_service_id = -1;
@@ -252,24 +457,44 @@ static void rtcom_el_iter_finalize(
 {
     RTComElIterPrivate * priv = RTCOM_EL_ITER_GET_PRIV(object);
 
+    if(priv->stmt)
+    {
+        rtcom_el_db_stmt_release(priv->stmt);
+        priv->stmt = NULL;
+    }
+
     if (priv->atomic)
       rtcom_el_db_commit (priv->db, NULL);
 
     g_object_unref(priv->el);
     g_object_unref(priv->query);
 
-    if(priv->stmt)
-    {
-        sqlite3_finalize(priv->stmt);
-        priv->stmt = NULL;
-    }
-
     if(priv->columns)
     {
         g_hash_table_destroy (priv->columns);
         priv->columns = NULL;
     }
 
+    g_hash_table_destroy (priv->peeked);
+    g_free (priv->column_fields);
+
+    g_strfreev (priv->prefetch_names);
+    if (priv->prefetch_probe)
+        g_object_unref (priv->prefetch_probe);
+    g_hash_table_destroy (priv->prefetched);
+    g_ptr_array_free (priv->prefetch_values, TRUE);
+    g_string_chunk_free (priv->prefetch_chunk);
+
+    if (priv->attach_probe)
+        g_object_unref (priv->attach_probe);
+    g_hash_table_destroy (priv->attach_starts);
+    g_array_free (priv->attachments, TRUE);
+    g_string_chunk_free (priv->attach_chunk);
+
+    if (priv->plugin_probe)
+        g_object_unref (priv->plugin_probe);
+    g_hash_table_destroy (priv->plugin_windows);
+
     G_OBJECT_CLASS(rtcom_el_iter_parent_class)->finalize(object);
 }
 
@@ -371,7 +596,7 @@ gboolean rtcom_el_iter_next(
     status = rtcom_el_db_iterate (priv->db, priv->stmt, NULL);
     if(status == SQLITE_DONE)
     {
-        sqlite3_finalize(priv->stmt);
+        rtcom_el_db_stmt_release(priv->stmt);
         priv->stmt = NULL;
         return FALSE;
     }
@@ -379,7 +604,8 @@ gboolean rtcom_el_iter_next(
     {
         g_warning("Could not step statement: %s",
                 sqlite3_errmsg(priv->db));
-        sqlite3_finalize(priv->stmt);
+        rtcom_el_db_stmt_release(priv->stmt);
+        priv->stmt = NULL;
         return FALSE;
     }
 
@@ -564,14 +790,16 @@ RTComElAttachIter * rtcom_el_iter_get_attachments(
      * rtcom_el_get_events_atomic() which wraps the whole query and all
      * subselects inside a transaction. */
 
-    if (sqlite3_prepare_v2 (priv->db,
-                            "SELECT id, event_id, path, desc"
-                               " FROM Attachments WHERE event_id = ?", -1,
-                            &stmt, NULL) != SQLITE_OK)
-    {
-        g_warning ("could not compile attachment select query: %s", sqlite3_errmsg(priv->db));
+    if (priv->has_attachment_count &&
+        g_value_get_int (priv->values[RTCOM_EL_FIELD_ATTACHMENT_COUNT]) == 0)
+        return NULL;
+
+    stmt = rtcom_el_db_stmt_acquire (priv->db,
+                                     "SELECT id, event_id, path, desc"
+                                        " FROM Attachments WHERE event_id = ?",
+                                     NULL);
+    if (stmt == NULL)
         goto ret_null;
-    }
 
     if (sqlite3_bind_int (stmt, 1, priv->current_event_id) != SQLITE_OK)
     {
@@ -594,10 +822,7 @@ RTComElAttachIter * rtcom_el_iter_get_attachments(
             NULL);
 
 ret_null:
-    if (stmt != NULL)
-    {
-        sqlite3_finalize (stmt);
-    }
+    rtcom_el_db_stmt_release (stmt);
     return NULL;
 }
 
@@ -621,6 +846,257 @@ gboolean rtcom_el_iter_dup_string(
     return rtcom_el_iter_get_values (it, key, ret, NULL);
 }
 
+const gchar * rtcom_el_iter_peek_string(
+        RTComElIter * it,
+        const gchar * key)
+{
+    RTComElIterPrivate * priv = NULL;
+    const GValue * value;
+
+    g_return_val_if_fail(RTCOM_IS_EL_ITER(it), NULL);
+    g_return_val_if_fail(key != NULL, NULL);
+
+    priv = RTCOM_EL_ITER_GET_PRIV(it);
+    g_return_val_if_fail(priv->columns, NULL);
+
+    /* Like _find_value(), the plugin comes first */
+    value = _peek_plugin_value(it, -1, key);
+    if(value == NULL)
+        value = g_hash_table_lookup(priv->columns, key);
+
+    if(value == NULL)
+    {
+        g_debug("%s: invalid column '%s'", G_STRFUNC, key);
+        return NULL;
+    }
+
+    if(!G_VALUE_HOLDS_STRING(value))
+    {
+        g_warning("%s: '%s' is not a string", G_STRFUNC, key);
+        return NULL;
+    }
+
+    return g_value_get_string(value);
+}
+
+gboolean rtcom_el_iter_get_by_id(
+        RTComElIter * it,
+        RTComElField field,
+        GValue * value)
+{
+    RTComElIterPrivate * priv = NULL;
+
+    g_return_val_if_fail(RTCOM_IS_EL_ITER(it), FALSE);
+    g_return_val_if_fail(field >= 0 && field < RTCOM_EL_N_FIELDS, FALSE);
+    g_return_val_if_fail(value != NULL, FALSE);
+
+    priv = RTCOM_EL_ITER_GET_PRIV(it);
+    g_return_val_if_fail(priv->columns, FALSE);
+
+    if(_plugin_get_value(it, field, rtcom_el_field_get_name(field), value))
+        return TRUE;
+
+    return rtcom_el_iter_get_raw_by_id(it, field, value);
+}
+
+RTComElIterBatch * rtcom_el_iter_batch_new(
+        const gchar * const * fields)
+{
+    RTComElIterBatch * batch = NULL;
+    GHashTable * typing = NULL;
+    guint i;
+
+    g_return_val_if_fail(fields != NULL, NULL);
+
+    rtcom_el_db_schema_get_mappings(NULL, NULL, &typing);
+
+    batch = g_slice_new0(RTComElIterBatch);
+    batch->n_columns = g_strv_length((gchar **) fields);
+    batch->columns = g_new0(BatchColumn, batch->n_columns);
+    batch->arena = g_byte_array_sized_new(4096);
+
+    for(i = 0; i < batch->n_columns; i++)
+    {
+        BatchColumn * c = &batch->columns[i];
+
+        c->name = g_intern_string(fields[i]);
+        c->type = GPOINTER_TO_UINT(g_hash_table_lookup(typing, fields[i]));
+        if(c->type == G_TYPE_INVALID)
+            g_warning("%s: unknown field %s", G_STRFUNC, fields[i]);
+
+        c->data = g_array_sized_new(FALSE, FALSE,
+                c->type == G_TYPE_STRING ? sizeof(guint) : sizeof(gint), 64);
+    }
+
+    return batch;
+}
+
+void rtcom_el_iter_batch_free(
+        RTComElIterBatch * batch)
+{
+    guint i;
+
+    if(batch == NULL)
+        return;
+
+    for(i = 0; i < batch->n_columns; i++)
+        g_array_free(batch->columns[i].data, TRUE);
+
+    g_free(batch->columns);
+    g_byte_array_free(batch->arena, TRUE);
+    g_slice_free(RTComElIterBatch, batch);
+}
+
+static void
+_batch_clear(
+        RTComElIterBatch * batch)
+{
+    guint i;
+
+    batch->n_rows = 0;
+    g_byte_array_set_size(batch->arena, 0);
+    for(i = 0; i < batch->n_columns; i++)
+        g_array_set_size(batch->columns[i].data, 0);
+}
+
+/* Appends the current row of stmt to the batch; index holds the column
+ * of each field, or -1 */
+static void
+_batch_append_row(
+        RTComElIterBatch * batch,
+        rtcom_el_db_stmt_t stmt,
+        const gint * index)
+{
+    guint i;
+
+    for(i = 0; i < batch->n_columns; i++)
+    {
+        BatchColumn * c = &batch->columns[i];
+
+        if(c->type == G_TYPE_STRING)
+        {
+            const guint8 *text = NULL;
+            guint offset = G_MAXUINT;
+
+            if(index[i] >= 0)
+                text = sqlite3_column_text(stmt, index[i]);
+
+            if(text != NULL)
+            {
+                /* Including the terminating NUL */
+                offset = batch->arena->len;
+                g_byte_array_append(batch->arena, text,
+                        sqlite3_column_bytes(stmt, index[i]) + 1);
+            }
+
+            g_array_append_val(c->data, offset);
+        }
+        else
+        {
+            gint value = index[i] >= 0 ? sqlite3_column_int(stmt, index[i]) : 0;
+
+            if(c->type == G_TYPE_BOOLEAN)
+                value = value != 0;
+
+            g_array_append_val(c->data, value);
+        }
+    }
+}
+
+guint rtcom_el_iter_fetch_batch(
+        RTComElIter * it,
+        guint n,
+        RTComElIterBatch * batch)
+{
+    RTComElIterPrivate * priv = NULL;
+    gint *index;
+    gint status;
+    guint i;
+
+    g_return_val_if_fail(RTCOM_IS_EL_ITER(it), 0);
+    g_return_val_if_fail(batch != NULL, 0);
+
+    priv = RTCOM_EL_ITER_GET_PRIV(it);
+
+    _batch_clear(batch);
+
+    /* Past the last event */
+    if(priv->stmt == NULL)
+        return 0;
+
+    index = g_newa(gint, batch->n_columns);
+    for(i = 0; i < batch->n_columns; i++)
+        index[i] = rtcom_el_db_schema_get_column(priv->stmt,
+                batch->columns[i].name, NULL);
+
+    /* Step through the rows directly, rather than updating the row
+     * representation for each of them */
+    while(batch->n_rows < n)
+    {
+        _batch_append_row(batch, priv->stmt, index);
+        batch->n_rows++;
+
+        status = rtcom_el_db_iterate(priv->db, priv->stmt, NULL);
+        if(status != SQLITE_ROW)
+        {
+            if(status != SQLITE_DONE)
+                g_warning("Could not step statement: %s",
+                        sqlite3_errmsg(priv->db));
+            rtcom_el_db_stmt_release(priv->stmt);
+            priv->stmt = NULL;
+            break;
+        }
+    }
+
+    if(priv->stmt != NULL)
+        _update_representation(priv);
+
+    return batch->n_rows;
+}
+
+guint rtcom_el_iter_batch_get_n_rows(
+        const RTComElIterBatch * batch)
+{
+    g_return_val_if_fail(batch != NULL, 0);
+
+    return batch->n_rows;
+}
+
+const gint * rtcom_el_iter_batch_get_ints(
+        const RTComElIterBatch * batch,
+        guint field)
+{
+    g_return_val_if_fail(batch != NULL, NULL);
+    g_return_val_if_fail(field < batch->n_columns, NULL);
+
+    if(batch->columns[field].type != G_TYPE_INT &&
+       batch->columns[field].type != G_TYPE_BOOLEAN)
+        return NULL;
+
+    return (const gint *) batch->columns[field].data->data;
+}
+
+const gchar * rtcom_el_iter_batch_get_string(
+        const RTComElIterBatch * batch,
+        guint field,
+        guint row)
+{
+    guint offset;
+
+    g_return_val_if_fail(batch != NULL, NULL);
+    g_return_val_if_fail(field < batch->n_columns, NULL);
+    g_return_val_if_fail(row < batch->n_rows, NULL);
+
+    if(batch->columns[field].type != G_TYPE_STRING)
+        return NULL;
+
+    offset = g_array_index(batch->columns[field].data, guint, row);
+    if(offset == G_MAXUINT)
+        return NULL;
+
+    return (const gchar *) batch->arena->data + offset;
+}
+
 /* Plugins functions */
 
 gboolean rtcom_el_iter_get_raw(
@@ -650,6 +1126,30 @@ gboolean rtcom_el_iter_get_raw(
     return TRUE;
 }
 
+gboolean rtcom_el_iter_get_raw_by_id(
+        RTComElIter * it,
+        RTComElField field,
+        GValue * value)
+{
+    RTComElIterPrivate * priv = NULL;
+
+    g_return_val_if_fail(RTCOM_IS_EL_ITER(it), FALSE);
+    g_return_val_if_fail(field >= 0 && field < RTCOM_EL_N_FIELDS, FALSE);
+    g_return_val_if_fail(value, FALSE);
+
+    priv = RTCOM_EL_ITER_GET_PRIV(it);
+    g_return_val_if_fail(priv->columns, FALSE);
+
+    /* Only plugins provide these */
+    if(field >= RTCOM_EL_DB_N_FIELDS)
+        return FALSE;
+
+    g_value_init (value, G_VALUE_TYPE (priv->values[field]));
+    g_value_copy (priv->values[field], value);
+
+    return TRUE;
+}
+
 const GHashTable *
 rtcom_el_iter_get_columns (RTComElIter *it)
 {
@@ -678,9 +1178,10 @@ rtcom_el_iter_get (RTComElIter *it, RTComElEvent *ev)
   return rtcom_el_iter_get_full (it, ev);
 }
 
-gboolean rtcom_el_iter_get_full (
+static gboolean _get_full(
         RTComElIter * it,
-        RTComElEvent * ev)
+        RTComElEvent * ev,
+        gboolean borrowed)
 {
     RTComElIterPrivate * priv = NULL;
 
@@ -695,73 +1196,279 @@ gboolean rtcom_el_iter_get_full (
         return FALSE;
       }
 
-    /* FIXME: this should be improved */
-    RTCOM_EL_EVENT_SET_FIELD(ev, id,               g_value_get_int(g_hash_table_lookup(priv->columns, "id")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, service_id,       g_value_get_int(g_hash_table_lookup(priv->columns, "service-id")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, event_type_id,    g_value_get_int(g_hash_table_lookup(priv->columns, "event-type-id")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, service,          (gchar *) g_value_dup_string(g_hash_table_lookup(priv->columns, "service")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, event_type,       (gchar *) g_value_dup_string(g_hash_table_lookup(priv->columns, "event-type")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, storage_time,     g_value_get_int(g_hash_table_lookup(priv->columns, "storage-time")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, start_time,       g_value_get_int(g_hash_table_lookup(priv->columns, "start-time")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, end_time,         g_value_get_int(g_hash_table_lookup(priv->columns, "end-time")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, is_read,          g_value_get_boolean(g_hash_table_lookup(priv->columns, "is-read")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, outgoing,         g_value_get_boolean(g_hash_table_lookup(priv->columns, "outgoing")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, flags,            g_value_get_int(g_hash_table_lookup(priv->columns, "flags")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, bytes_sent,       g_value_get_int(g_hash_table_lookup(priv->columns, "bytes-sent")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, bytes_received,   g_value_get_int(g_hash_table_lookup(priv->columns, "bytes-received")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, remote_ebook_uid, (gchar *) g_value_dup_string(g_hash_table_lookup(priv->columns, "remote-ebook-uid")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, local_uid,        (gchar *) g_value_dup_string(g_hash_table_lookup(priv->columns, "local-uid")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, local_name,       (gchar *) g_value_dup_string(g_hash_table_lookup(priv->columns, "local-name")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, remote_uid,       (gchar *) g_value_dup_string(g_hash_table_lookup(priv->columns, "remote-uid")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, remote_name,      (gchar *) g_value_dup_string(g_hash_table_lookup(priv->columns, "remote-name")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, channel,          (gchar *) g_value_dup_string(g_hash_table_lookup(priv->columns, "channel")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, free_text,        (gchar *) g_value_dup_string(g_hash_table_lookup(priv->columns, "free-text")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, group_uid,        (gchar *) g_value_dup_string(g_hash_table_lookup(priv->columns, "group-uid")));
-
-    /* This is not actually present among the columns, so fill in an empty
-     * value; plugins will get a chance to alter it afterwards */
-    RTCOM_EL_EVENT_SET_FIELD(ev, additional_text, NULL);
-
-    /* These are initialized from the service column, then plugins get a
-     * chance to alter them (FIXME: I can see that it might make sense
-     * to look for the service name as an icon in a theme, but does it really
-     * make sense for the pango markup?) */
-    RTCOM_EL_EVENT_SET_FIELD(ev, icon_name,        (gchar *) g_value_dup_string(g_hash_table_lookup(priv->columns, "service")));
-    RTCOM_EL_EVENT_SET_FIELD(ev, pango_markup,     (gchar *) g_value_dup_string(g_hash_table_lookup(priv->columns, "service")));
-
-    /* FIXME: this will look better when we ditch the Event struct fields */
-    if(priv->currently_active_plugin && priv->currently_active_plugin->get_value)
+#define LOOKUP(x) ((const GValue *) priv->values[RTCOM_EL_FIELD_ ## x])
+#define LOOKUP_INT(x) (g_value_get_int (LOOKUP (x)))
+#define LOOKUP_BOOLEAN(x) (g_value_get_boolean (LOOKUP (x)))
+#define LOOKUP_STRING(x) (borrowed ? \
+        (gchar *) g_value_get_string (LOOKUP (x)) : \
+        g_value_dup_string (LOOKUP (x)))
+
+    RTCOM_EL_EVENT_SET_FIELD(ev, id,               LOOKUP_INT(ID));
+    RTCOM_EL_EVENT_SET_FIELD(ev, service_id,       LOOKUP_INT(SERVICE_ID));
+    RTCOM_EL_EVENT_SET_FIELD(ev, event_type_id,    LOOKUP_INT(EVENT_TYPE_ID));
+    RTCOM_EL_EVENT_SET_FIELD(ev, service,          LOOKUP_STRING(SERVICE));
+    RTCOM_EL_EVENT_SET_FIELD(ev, event_type,       LOOKUP_STRING(EVENT_TYPE));
+    RTCOM_EL_EVENT_SET_FIELD(ev, storage_time,     LOOKUP_INT(STORAGE_TIME));
+    RTCOM_EL_EVENT_SET_FIELD(ev, start_time,       LOOKUP_INT(START_TIME));
+    RTCOM_EL_EVENT_SET_FIELD(ev, end_time,         LOOKUP_INT(END_TIME));
+    RTCOM_EL_EVENT_SET_FIELD(ev, is_read,          LOOKUP_BOOLEAN(IS_READ));
+    RTCOM_EL_EVENT_SET_FIELD(ev, outgoing,         LOOKUP_BOOLEAN(OUTGOING));
+    RTCOM_EL_EVENT_SET_FIELD(ev, flags,            LOOKUP_INT(FLAGS));
+    RTCOM_EL_EVENT_SET_FIELD(ev, bytes_sent,       LOOKUP_INT(BYTES_SENT));
+    RTCOM_EL_EVENT_SET_FIELD(ev, bytes_received,   LOOKUP_INT(BYTES_RECEIVED));
+    RTCOM_EL_EVENT_SET_FIELD(ev, remote_ebook_uid, LOOKUP_STRING(REMOTE_EBOOK_UID));
+    RTCOM_EL_EVENT_SET_FIELD(ev, local_uid,        LOOKUP_STRING(LOCAL_UID));
+    RTCOM_EL_EVENT_SET_FIELD(ev, local_name,       LOOKUP_STRING(LOCAL_NAME));
+    RTCOM_EL_EVENT_SET_FIELD(ev, remote_uid,       LOOKUP_STRING(REMOTE_UID));
+    RTCOM_EL_EVENT_SET_FIELD(ev, remote_name,      LOOKUP_STRING(REMOTE_NAME));
+    RTCOM_EL_EVENT_SET_FIELD(ev, channel,          LOOKUP_STRING(CHANNEL));
+    RTCOM_EL_EVENT_SET_FIELD(ev, free_text,        LOOKUP_STRING(FREE_TEXT));
+    RTCOM_EL_EVENT_SET_FIELD(ev, group_uid,        LOOKUP_STRING(GROUP_UID));
+
+#undef LOOKUP_STRING
+#undef LOOKUP_BOOLEAN
+#undef LOOKUP_INT
+#undef LOOKUP
+
+    /* This is not actually present among the columns, so it's left empty
+     * unless the plugin provides it */
+    RTCOM_EL_EVENT_SET_FIELD(ev, additional_text,
+            _plugin_string(it, RTCOM_EL_FIELD_ADDITIONAL_TEXT, -1, borrowed));
+
+    /* These default to the service column, unless the plugin provides
+     * them (FIXME: I can see that it might make sense to look for the
+     * service name as an icon in a theme, but does it really make sense
+     * for the pango markup?) */
+    RTCOM_EL_EVENT_SET_FIELD(ev, icon_name,
+            _plugin_string(it, RTCOM_EL_FIELD_ICON_NAME,
+                RTCOM_EL_FIELD_SERVICE, borrowed));
+    RTCOM_EL_EVENT_SET_FIELD(ev, pango_markup,
+            _plugin_string(it, RTCOM_EL_FIELD_PANGO_MARKUP,
+                RTCOM_EL_FIELD_SERVICE, borrowed));
+
+    return TRUE;
+}
+
+gboolean rtcom_el_iter_get_full (
+        RTComElIter * it,
+        RTComElEvent * ev)
+{
+    return _get_full(it, ev, FALSE);
+}
+
+gboolean rtcom_el_iter_peek_full (
+        RTComElIter * it,
+        RTComElEvent * ev)
+{
+    return _get_full(it, ev, TRUE);
+}
+
+/* A copy of the iterator's query that returns only the ids of a window
+ * of rows. Results are always in decreasing id order, so the window
+ * starting at a row is the one before the next id up. */
+static RTComElQuery * _window_probe_new(
+        RTComElIterPrivate * priv,
+        guint window)
+{
+    static const gchar * id_only[] = { "id", NULL };
+    RTComElQuery * probe;
+
+    probe = rtcom_el_query_copy(priv->query);
+    rtcom_el_query_set_fields(probe, id_only);
+    g_object_set(probe,
+            "offset", 0,
+            "limit", (gint) window,
+            NULL);
+
+    return probe;
+}
+
+/* Appends the probe as a subquery named w, for the window of rows that
+ * starts at the current one; its values are bound first */
+static gboolean _window_append(
+        RTComElIterPrivate * priv,
+        RTComElQuery * probe,
+        GString * sql)
+{
+    g_object_set(probe,
+            "before-id", priv->current_event_id + 1,
+            NULL);
+    if(!rtcom_el_query_refresh(probe))
+        return FALSE;
+
+    g_string_append_c(sql, '(');
+    g_string_append(sql, rtcom_el_query_get_sql_template(probe));
+    /* Drop the terminating ';' */
+    while(sql->len > 0 &&
+          (sql->str[sql->len - 1] == ';' || sql->str[sql->len - 1] == ' '))
+        g_string_truncate(sql, sql->len - 1);
+    g_string_append(sql, ") AS w");
+
+    return TRUE;
+}
+
+static void _prefetch_clear(
+        RTComElIterPrivate * priv)
+{
+    g_hash_table_remove_all(priv->prefetched);
+    g_ptr_array_set_size(priv->prefetch_values, 0);
+    g_string_chunk_clear(priv->prefetch_chunk);
+}
+
+void rtcom_el_iter_set_header_prefetch(
+        RTComElIter * it,
+        const gchar * const * names,
+        guint window)
+{
+    RTComElIterPrivate * priv = NULL;
+
+    g_return_if_fail(RTCOM_IS_EL_ITER(it));
+
+    priv = RTCOM_EL_ITER_GET_PRIV(it);
+
+    _prefetch_clear(priv);
+    g_strfreev(priv->prefetch_names);
+    priv->prefetch_names = NULL;
+    if(priv->prefetch_probe)
     {
-        GValue tmp = {0,};
-        gboolean ret =
-            priv->currently_active_plugin->get_value(it, "additional-text", &tmp);
-        if (ret)
-        {
-            g_free (RTCOM_EL_EVENT_GET_FIELD (ev, additional_text));
-            RTCOM_EL_EVENT_SET_FIELD(ev, additional_text,
-                (gchar *) g_value_dup_string(&tmp));
-            g_value_unset(&tmp);
-        }
+        g_object_unref(priv->prefetch_probe);
+        priv->prefetch_probe = NULL;
+    }
+
+    if(names == NULL || names[0] == NULL || window == 0)
+        return;
+
+    g_return_if_fail(priv->query);
 
-        ret = priv->currently_active_plugin->get_value(it, "icon-name", &tmp);
-        if (ret)
+    priv->prefetch_names = g_strdupv((gchar **) names);
+    priv->prefetch_probe = _window_probe_new(priv, window);
+}
+
+/* Fetches the prefetched headers for the window of rows starting at the
+ * current one, in a single statement */
+static gboolean _prefetch(
+        RTComElIterPrivate * priv)
+{
+    sqlite3_stmt * stmt;
+    GString * sql;
+    guint n_names, i;
+    gint first_name, status;
+
+    _prefetch_clear(priv);
+
+    n_names = g_strv_length(priv->prefetch_names);
+
+    sql = g_string_new("SELECT w.\"id\", Headers.name, Headers.value FROM ");
+    if(!_window_append(priv, priv->prefetch_probe, sql))
+    {
+        g_string_free(sql, TRUE);
+        return FALSE;
+    }
+    g_string_append(sql, " LEFT JOIN Headers "
+            "ON Headers.event_id = w.\"id\" AND Headers.name IN (");
+    for(i = 0; i < n_names; i++)
+        g_string_append(sql, i == 0 ? "?" : ", ?");
+    g_string_append(sql, ");");
+
+    stmt = rtcom_el_db_stmt_acquire(priv->db, sql->str, NULL);
+    g_string_free(sql, TRUE);
+    if(stmt == NULL)
+        return FALSE;
+
+    /* The names come after the values of the query */
+    first_name = sqlite3_bind_parameter_count(stmt) - n_names + 1;
+    if(!rtcom_el_query_bind(priv->prefetch_probe, stmt))
+    {
+        rtcom_el_db_stmt_release(stmt);
+        return FALSE;
+    }
+    for(i = 0; i < n_names; i++)
+        sqlite3_bind_text(stmt, first_name + i, priv->prefetch_names[i], -1,
+                SQLITE_STATIC);
+
+    while((status = rtcom_el_db_iterate(priv->db, stmt, NULL)) == SQLITE_ROW)
+    {
+        gint event_id = sqlite3_column_int(stmt, 0);
+        const gchar * name = (const gchar *) sqlite3_column_text(stmt, 1);
+        const gchar * value = (const gchar *) sqlite3_column_text(stmt, 2);
+        guint row;
+
+        row = GPOINTER_TO_UINT(g_hash_table_lookup(priv->prefetched,
+                    GINT_TO_POINTER(event_id)));
+        if(row == 0)
         {
-            g_free (RTCOM_EL_EVENT_GET_FIELD (ev, icon_name));
-            RTCOM_EL_EVENT_SET_FIELD(ev, icon_name,
-                (gchar *) g_value_dup_string(&tmp));
-            g_value_unset(&tmp);
+            /* Rows are stored offset by one, so that 0 means missing */
+            row = priv->prefetch_values->len / n_names + 1;
+            g_hash_table_insert(priv->prefetched, GINT_TO_POINTER(event_id),
+                    GUINT_TO_POINTER(row));
+            for(i = 0; i < n_names; i++)
+                g_ptr_array_add(priv->prefetch_values, NULL);
         }
 
-        ret = priv->currently_active_plugin->get_value(it, "pango-markup", &tmp);
-        if (ret)
+        if(name == NULL || value == NULL)
+            continue;
+
+        for(i = 0; i < n_names; i++)
         {
-            g_free (RTCOM_EL_EVENT_GET_FIELD (ev, pango_markup));
-            RTCOM_EL_EVENT_SET_FIELD(ev, pango_markup,
-                (gchar *) g_value_dup_string(&tmp));
-            g_value_unset(&tmp);
+            gpointer * slot = &g_ptr_array_index(priv->prefetch_values,
+                    (row - 1) * n_names + i);
+
+            /* Like rtcom_el_iter_get_header_raw(), keep the first one */
+            if(*slot == NULL && strcmp(name, priv->prefetch_names[i]) == 0)
+                *slot = g_string_chunk_insert(priv->prefetch_chunk, value);
         }
     }
 
+    rtcom_el_db_stmt_release(stmt);
+
+    if(status != SQLITE_DONE)
+    {
+        g_warning("%s: could not fetch headers: %s", G_STRFUNC,
+                sqlite3_errmsg(priv->db));
+        _prefetch_clear(priv);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Looks a header of the current event up in the prefetched window,
+ * fetching the window again if the event isn't in it. Returns FALSE if
+ * the header isn't prefetched at all. */
+static gboolean _get_prefetched_header(
+        RTComElIterPrivate * priv,
+        const gchar * key,
+        const gchar ** value)
+{
+    guint n_names, i, row;
+
+    if(priv->prefetch_names == NULL)
+        return FALSE;
+
+    n_names = g_strv_length(priv->prefetch_names);
+    for(i = 0; i < n_names; i++)
+        if(strcmp(key, priv->prefetch_names[i]) == 0)
+            break;
+
+    if(i == n_names)
+        return FALSE;
+
+    row = GPOINTER_TO_UINT(g_hash_table_lookup(priv->prefetched,
+                GINT_TO_POINTER(priv->current_event_id)));
+    if(row == 0)
+    {
+        if(!_prefetch(priv))
+            return FALSE;
+
+        row = GPOINTER_TO_UINT(g_hash_table_lookup(priv->prefetched,
+                    GINT_TO_POINTER(priv->current_event_id)));
+        if(row == 0)
+            return FALSE;
+    }
+
+    *value = g_ptr_array_index(priv->prefetch_values,
+            (row - 1) * n_names + i);
+
     return TRUE;
 }
 
@@ -770,9 +1477,10 @@ gchar * rtcom_el_iter_get_header_raw(
         const gchar * key)
 {
     RTComElIterPrivate * priv = NULL;
-    gchar * sql = NULL;
     sqlite3_stmt * stmt = NULL;
+    const gchar * prefetched = NULL;
     gchar * ret = NULL;
+    gint status;
 
     g_return_val_if_fail(RTCOM_IS_EL_ITER(it), NULL);
     g_return_val_if_fail(key, NULL);
@@ -780,34 +1488,391 @@ gchar * rtcom_el_iter_get_header_raw(
     priv = RTCOM_EL_ITER_GET_PRIV(it);
     g_return_val_if_fail(priv->db, NULL);
 
-    sql = sqlite3_mprintf(
-            "SELECT value from Headers where event_id = %d and name = %Q;",
-            priv->current_event_id,
-            key);
-    if(sqlite3_prepare(priv->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    if(_get_prefetched_header(priv, key, &prefetched))
+        return g_strdup(prefetched);
+
+    stmt = rtcom_el_db_stmt_acquire(priv->db,
+            "SELECT value FROM Headers WHERE event_id = ? AND name = ? "
+            "LIMIT 1;", NULL);
+    if(stmt == NULL)
+        return NULL;
+
+    sqlite3_bind_int(stmt, 1, priv->current_event_id);
+    sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
+
+    status = rtcom_el_db_iterate(priv->db, stmt, NULL);
+    if(status == SQLITE_ROW)
+        ret = g_strdup((const gchar *) sqlite3_column_text(stmt, 0));
+    else if(status != SQLITE_DONE)
+        g_warning("Could not fetch header '%s': %s", key,
+                sqlite3_errmsg(priv->db));
+
+    rtcom_el_db_stmt_release(stmt);
+
+    return ret;
+}
+
+static void _attach_clear(
+        RTComElIterPrivate * priv)
+{
+    g_hash_table_remove_all(priv->attach_starts);
+    g_array_set_size(priv->attachments, 0);
+    g_string_chunk_clear(priv->attach_chunk);
+}
+
+void rtcom_el_iter_set_attachment_prefetch(
+        RTComElIter * it,
+        guint window)
+{
+    RTComElIterPrivate * priv = NULL;
+
+    g_return_if_fail(RTCOM_IS_EL_ITER(it));
+    g_return_if_fail(window > 0);
+
+    priv = RTCOM_EL_ITER_GET_PRIV(it);
+    g_return_if_fail(priv->query);
+
+    _attach_clear(priv);
+    if(priv->attach_probe)
+        g_object_unref(priv->attach_probe);
+    priv->attach_probe = _window_probe_new(priv, window);
+}
+
+/* Fetches the attachments of the window of rows starting at the current
+ * one, in a single statement */
+static gboolean _attach_prefetch(
+        RTComElIterPrivate * priv)
+{
+    sqlite3_stmt * stmt;
+    GString * sql;
+    gint status;
+
+    _attach_clear(priv);
+
+    sql = g_string_new("SELECT w.\"id\", Attachments.id, "
+            "Attachments.path, Attachments.desc FROM ");
+    if(!_window_append(priv, priv->attach_probe, sql))
+    {
+        g_string_free(sql, TRUE);
+        return FALSE;
+    }
+    g_string_append(sql, " LEFT JOIN Attachments "
+            "ON Attachments.event_id = w.\"id\" "
+            "ORDER BY w.\"id\", Attachments.id;");
+
+    stmt = rtcom_el_db_stmt_acquire(priv->db, sql->str, NULL);
+    g_string_free(sql, TRUE);
+    if(stmt == NULL)
+        return FALSE;
+
+    if(!rtcom_el_query_bind(priv->attach_probe, stmt))
+    {
+        rtcom_el_db_stmt_release(stmt);
+        return FALSE;
+    }
+
+    while((status = rtcom_el_db_iterate(priv->db, stmt, NULL)) == SQLITE_ROW)
+    {
+        gint event_id = sqlite3_column_int(stmt, 0);
+        RTComElAttachment att;
+
+        if(g_hash_table_lookup(priv->attach_starts,
+                    GINT_TO_POINTER(event_id)) == NULL)
+            g_hash_table_insert(priv->attach_starts,
+                    GINT_TO_POINTER(event_id),
+                    GUINT_TO_POINTER(priv->attachments->len + 1));
+
+        /* An event without attachments */
+        if(sqlite3_column_type(stmt, 1) == SQLITE_NULL)
+            continue;
+
+        att.id = sqlite3_column_int(stmt, 1);
+        att.event_id = event_id;
+        att.path = g_string_chunk_insert(priv->attach_chunk,
+                (const gchar *) sqlite3_column_text(stmt, 2));
+        att.desc = NULL;
+        if(sqlite3_column_type(stmt, 3) != SQLITE_NULL)
+            att.desc = g_string_chunk_insert(priv->attach_chunk,
+                    (const gchar *) sqlite3_column_text(stmt, 3));
+
+        g_array_append_val(priv->attachments, att);
+    }
+
+    rtcom_el_db_stmt_release(stmt);
+
+    if(status != SQLITE_DONE)
+    {
+        g_warning("%s: could not fetch attachments: %s", G_STRFUNC,
+                sqlite3_errmsg(priv->db));
+        _attach_clear(priv);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+const RTComElAttachment * rtcom_el_iter_peek_attachments(
+        RTComElIter * it,
+        guint * n_attachments)
+{
+    RTComElIterPrivate * priv = NULL;
+    RTComElAttachment * atts;
+    guint start, n;
+
+    g_return_val_if_fail(RTCOM_IS_EL_ITER(it), NULL);
+    g_return_val_if_fail(n_attachments != NULL, NULL);
+
+    *n_attachments = 0;
+
+    priv = RTCOM_EL_ITER_GET_PRIV(it);
+    g_return_val_if_fail(priv->db, NULL);
+    g_return_val_if_fail(priv->stmt, NULL);
+
+    if(priv->has_attachment_count &&
+       g_value_get_int(priv->values[RTCOM_EL_FIELD_ATTACHMENT_COUNT]) == 0)
+        return NULL;
+
+    if(priv->attach_probe == NULL)
+        priv->attach_probe = _window_probe_new(priv, 1);
+
+    start = GPOINTER_TO_UINT(g_hash_table_lookup(priv->attach_starts,
+                GINT_TO_POINTER(priv->current_event_id)));
+    if(start == 0)
+    {
+        if(!_attach_prefetch(priv))
+            return NULL;
+
+        start = GPOINTER_TO_UINT(g_hash_table_lookup(priv->attach_starts,
+                    GINT_TO_POINTER(priv->current_event_id)));
+        if(start == 0)
+            return NULL;
+    }
+
+    atts = &g_array_index(priv->attachments, RTComElAttachment, start - 1);
+    for(n = 0; start - 1 + n < priv->attachments->len &&
+            atts[n].event_id == (guint) priv->current_event_id; n++);
+
+    *n_attachments = n;
+    return n > 0 ? atts : NULL;
+}
+
+static void _plugin_values_free(
+        gpointer data)
+{
+    PluginValues * pv = data;
+    guint i;
+
+    if(pv == NULL)
+        return;
+
+    for(i = 0; i < pv->n; i++)
+        if(G_VALUE_TYPE(&pv->values[i]) != G_TYPE_INVALID)
+            g_value_unset(&pv->values[i]);
+
+    g_free(pv->values);
+    g_slice_free(PluginValues, pv);
+}
+
+static PluginWindow * _plugin_window_new(
+        RTComElIterPrivate * priv,
+        RTComElPlugin * plugin)
+{
+    const gchar * fields[RTCOM_EL_DB_N_FIELDS + 1];
+    PluginWindow * pw;
+    gint i;
+
+    for(i = 0; i < RTCOM_EL_DB_N_FIELDS; i++)
+        fields[i] = rtcom_el_field_get_name(i);
+    fields[RTCOM_EL_DB_N_FIELDS] = NULL;
+
+    pw = g_slice_new(PluginWindow);
+
+    /* The batch has a column for every field all the same; the ones that
+     * aren't fetched read as 0 or NULL */
+    pw->probe = rtcom_el_query_copy(priv->plugin_probe);
+    if(plugin->get_values_fields)
+        rtcom_el_query_set_fields(pw->probe, plugin->get_values_fields());
+
+    pw->batch = rtcom_el_iter_batch_new(fields);
+    pw->rows = g_hash_table_new(g_direct_hash, g_direct_equal);
+    pw->values = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, _plugin_values_free);
+
+    return pw;
+}
+
+static void _plugin_window_free(
+        gpointer data)
+{
+    PluginWindow * pw = data;
+
+    g_object_unref(pw->probe);
+    rtcom_el_iter_batch_free(pw->batch);
+    g_hash_table_destroy(pw->rows);
+    g_hash_table_destroy(pw->values);
+    g_slice_free(PluginWindow, pw);
+}
+
+void rtcom_el_iter_set_plugin_window(
+        RTComElIter * it,
+        guint window)
+{
+    RTComElIterPrivate * priv = NULL;
+
+    g_return_if_fail(RTCOM_IS_EL_ITER(it));
+
+    priv = RTCOM_EL_ITER_GET_PRIV(it);
+
+    g_hash_table_remove_all(priv->plugin_windows);
+    if(priv->plugin_probe)
     {
-        g_warning("Could not compile: '%s': %s",
-                sql,
+        g_object_unref(priv->plugin_probe);
+        priv->plugin_probe = NULL;
+    }
+
+    if(window == 0)
+        return;
+
+    g_return_if_fail(priv->query);
+
+    priv->plugin_probe = _window_probe_new(priv, window);
+}
+
+/* Fetches the rows of the plugin in the window of rows starting at the
+ * current one */
+static gboolean _plugin_window_fetch(
+        RTComElIterPrivate * priv,
+        RTComElPlugin * plugin,
+        PluginWindow * pw)
+{
+    RTComElIterBatch * batch = pw->batch;
+    sqlite3_stmt * stmt;
+    gint * index;
+    gint status;
+    guint i;
+
+    g_hash_table_remove_all(pw->rows);
+    g_hash_table_remove_all(pw->values);
+    _batch_clear(batch);
+
+    g_object_set(pw->probe,
+            "before-id", priv->current_event_id + 1,
+            NULL);
+    if(!rtcom_el_query_refresh(pw->probe))
+        return FALSE;
+
+    stmt = rtcom_el_db_stmt_acquire(priv->db,
+            rtcom_el_query_get_sql_template(pw->probe), NULL);
+    if(stmt == NULL)
+        return FALSE;
+
+    if(!rtcom_el_query_bind(pw->probe, stmt))
+    {
+        rtcom_el_db_stmt_release(stmt);
+        return FALSE;
+    }
+
+    index = g_newa(gint, batch->n_columns);
+    for(i = 0; i < batch->n_columns; i++)
+        index[i] = rtcom_el_db_schema_get_column(stmt,
+                batch->columns[i].name, NULL);
+
+    while((status = rtcom_el_db_iterate(priv->db, stmt, NULL)) == SQLITE_ROW)
+    {
+        gint service_id = sqlite3_column_int(stmt,
+                index[RTCOM_EL_FIELD_SERVICE_ID]);
+
+        /* Other plugins' rows go in their own windows */
+        if(g_hash_table_lookup(priv->plugins,
+                    GINT_TO_POINTER(service_id)) != plugin)
+            continue;
+
+        _batch_append_row(batch, stmt, index);
+        batch->n_rows++;
+        g_hash_table_insert(pw->rows,
+                GINT_TO_POINTER(sqlite3_column_int(stmt,
+                        index[RTCOM_EL_FIELD_ID])),
+                GUINT_TO_POINTER(batch->n_rows));
+    }
+
+    rtcom_el_db_stmt_release(stmt);
+
+    if(status != SQLITE_DONE)
+    {
+        g_warning("%s: could not fetch the window: %s", G_STRFUNC,
                 sqlite3_errmsg(priv->db));
-        if(stmt)
-        {
-            sqlite3_finalize(stmt);
-            stmt = NULL;
-        }
+        g_hash_table_remove_all(pw->rows);
+        _batch_clear(batch);
+        return FALSE;
     }
-    else
+
+    return TRUE;
+}
+
+/* Looks a plugin value of the current event up in the plugin's window,
+ * fetching the window again if the event isn't in it and having the
+ * plugin compute the key for all of its rows the first time it is
+ * asked for. */
+static gboolean _window_plugin_value(
+        RTComElIter * it,
+        RTComElPlugin * plugin,
+        const gchar * key,
+        GValue * value)
+{
+    RTComElIterPrivate * priv = RTCOM_EL_ITER_GET_PRIV(it);
+    PluginWindow * pw;
+    PluginValues * pv = NULL;
+    const GValue * computed;
+    guint row;
+
+    pw = g_hash_table_lookup(priv->plugin_windows, plugin);
+    if(pw == NULL)
     {
-        while(sqlite3_step(stmt) == SQLITE_ROW)
+        pw = _plugin_window_new(priv, plugin);
+        g_hash_table_insert(priv->plugin_windows, plugin, pw);
+    }
+
+    row = GPOINTER_TO_UINT(g_hash_table_lookup(pw->rows,
+                GINT_TO_POINTER(priv->current_event_id)));
+    if(row == 0)
+    {
+        if(!_plugin_window_fetch(priv, plugin, pw))
+            return FALSE;
+
+        row = GPOINTER_TO_UINT(g_hash_table_lookup(pw->rows,
+                    GINT_TO_POINTER(priv->current_event_id)));
+        if(row == 0)
+            return FALSE;
+    }
+
+    key = g_intern_string(key);
+    if(!g_hash_table_lookup_extended(pw->values, key, NULL,
+                (gpointer *) &pv))
+    {
+        pv = g_slice_new(PluginValues);
+        pv->n = pw->batch->n_rows;
+        pv->values = g_new0(GValue, pv->n);
+
+        if(!plugin->get_values(it, pw->batch, key, pv->values))
         {
-            ret = g_strdup((gchar *)sqlite3_column_text(stmt, 0));
-            break;
+            _plugin_values_free(pv);
+            pv = NULL;
         }
-        sqlite3_finalize(stmt);
-        stmt = NULL;
+
+        g_hash_table_insert(pw->values, (gpointer) key, pv);
     }
-    sqlite3_free(sql);
 
-    return ret;
+    if(pv == NULL)
+        return FALSE;
+
+    computed = &pv->values[row - 1];
+    if(G_VALUE_TYPE(computed) == G_TYPE_INVALID)
+        return FALSE;
+
+    g_value_init(value, G_VALUE_TYPE(computed));
+    g_value_copy(computed, value);
+
+    return TRUE;
 }
 
 /* vim: set ai et tw=75 ts=4 sw=4: */
@@ -0,0 +1,504 @@
+/**
+ * Copyright (C) 2026 The rtcom-eventlogger contributors.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "rtcom-eventlogger/eventlogger-live-query.h"
+
+#define RTCOM_EL_LIVE_QUERY_GET_PRIV(live) ((RTComElLiveQueryPrivate *) \
+  rtcom_el_live_query_get_instance_private(RTCOM_EL_LIVE_QUERY(live)))
+
+typedef struct _RTComElLiveQueryPrivate RTComElLiveQueryPrivate;
+struct _RTComElLiveQueryPrivate {
+    RTComEl * el;
+    RTComElQuery * query;
+
+    /* A copy of query, bounded to check single events */
+    RTComElQuery * probe;
+
+    /* A copy of query fetching only the ids, to reload them */
+    RTComElQuery * ids_query;
+
+    /* Current results, newest first */
+    GArray * ids;
+
+    gint limit;
+    gint before_id;
+    gint after_id;
+
+    /* Whether events can be followed one by one */
+    gboolean incremental;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE(RTComElLiveQuery, rtcom_el_live_query,
+                           G_TYPE_OBJECT);
+
+enum {
+    INSERTED,
+    CHANGED,
+    REMOVED,
+    RESET,
+    LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+static void rtcom_el_live_query_init(
+        RTComElLiveQuery * live)
+{
+    RTComElLiveQueryPrivate * priv = RTCOM_EL_LIVE_QUERY_GET_PRIV(live);
+
+    priv->el = NULL;
+    priv->query = NULL;
+    priv->probe = NULL;
+    priv->ids_query = NULL;
+    priv->ids = g_array_new(FALSE, FALSE, sizeof(gint));
+    priv->limit = -1;
+    priv->before_id = 0;
+    priv->after_id = 0;
+    priv->incremental = FALSE;
+}
+
+static void rtcom_el_live_query_dispose(
+        GObject * object)
+{
+    RTComElLiveQueryPrivate * priv = RTCOM_EL_LIVE_QUERY_GET_PRIV(object);
+
+    if(priv->el)
+    {
+        g_signal_handlers_disconnect_by_data(priv->el, object);
+        g_object_unref(priv->el);
+        priv->el = NULL;
+    }
+
+    if(priv->query)
+    {
+        g_object_unref(priv->query);
+        priv->query = NULL;
+    }
+
+    if(priv->probe)
+    {
+        g_object_unref(priv->probe);
+        priv->probe = NULL;
+    }
+
+    if(priv->ids_query)
+    {
+        g_object_unref(priv->ids_query);
+        priv->ids_query = NULL;
+    }
+
+    G_OBJECT_CLASS(rtcom_el_live_query_parent_class)->dispose(object);
+}
+
+static void rtcom_el_live_query_finalize(
+        GObject * object)
+{
+    RTComElLiveQueryPrivate * priv = RTCOM_EL_LIVE_QUERY_GET_PRIV(object);
+
+    g_array_free(priv->ids, TRUE);
+
+    G_OBJECT_CLASS(rtcom_el_live_query_parent_class)->finalize(object);
+}
+
+static void rtcom_el_live_query_class_init(
+        RTComElLiveQueryClass * klass)
+{
+    GObjectClass * object_class = G_OBJECT_CLASS(klass);
+
+    object_class->dispose = rtcom_el_live_query_dispose;
+    object_class->finalize = rtcom_el_live_query_finalize;
+
+    signals[INSERTED] = g_signal_new(
+            "inserted",
+            G_TYPE_FROM_CLASS(object_class),
+            G_SIGNAL_RUN_FIRST,
+            0,
+            NULL,
+            NULL,
+            g_cclosure_marshal_generic,
+            G_TYPE_NONE,
+            2,
+            G_TYPE_INT,
+            G_TYPE_UINT);
+
+    signals[CHANGED] = g_signal_new(
+            "changed",
+            G_TYPE_FROM_CLASS(object_class),
+            G_SIGNAL_RUN_FIRST,
+            0,
+            NULL,
+            NULL,
+            g_cclosure_marshal_generic,
+            G_TYPE_NONE,
+            2,
+            G_TYPE_INT,
+            G_TYPE_UINT);
+
+    signals[REMOVED] = g_signal_new(
+            "removed",
+            G_TYPE_FROM_CLASS(object_class),
+            G_SIGNAL_RUN_FIRST,
+            0,
+            NULL,
+            NULL,
+            g_cclosure_marshal_generic,
+            G_TYPE_NONE,
+            2,
+            G_TYPE_INT,
+            G_TYPE_UINT);
+
+    signals[RESET] = g_signal_new(
+            "reset",
+            G_TYPE_FROM_CLASS(object_class),
+            G_SIGNAL_RUN_FIRST,
+            0,
+            NULL,
+            NULL,
+            g_cclosure_marshal_VOID__VOID,
+            G_TYPE_NONE,
+            0);
+}
+
+/* The position of event_id in the results, or of the first event older
+ * than it if it isn't there */
+static guint
+_find(
+        RTComElLiveQueryPrivate * priv,
+        gint event_id,
+        gboolean * found)
+{
+    guint lo = 0, hi = priv->ids->len;
+
+    while(lo < hi)
+    {
+        guint mid = lo + (hi - lo) / 2;
+        gint id = g_array_index(priv->ids, gint, mid);
+
+        if(id == event_id)
+        {
+            *found = TRUE;
+            return mid;
+        }
+
+        /* Newest first */
+        if(id > event_id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *found = FALSE;
+    return lo;
+}
+
+/* Whether event_id is one the query returns, leaving the limit aside */
+static gboolean
+_matches(
+        RTComElLiveQueryPrivate * priv,
+        gint event_id)
+{
+    if(priv->before_id > 0 && event_id >= priv->before_id)
+        return FALSE;
+
+    if(priv->after_id > 0 && event_id <= priv->after_id)
+        return FALSE;
+
+    g_object_set(priv->probe,
+            "before-id", event_id + 1,
+            "after-id", event_id - 1,
+            "limit", -1,
+            NULL);
+    rtcom_el_query_refresh(priv->probe);
+
+    return rtcom_el_query_exists(priv->el, priv->probe, NULL);
+}
+
+/* The newest event the query returns past the current results, or 0 */
+static gint
+_fetch_next(
+        RTComElLiveQueryPrivate * priv)
+{
+    RTComElIter * it;
+    gint before_id = priv->before_id;
+    gint event_id = 0;
+
+    if(priv->ids->len > 0)
+        before_id = g_array_index(priv->ids, gint, priv->ids->len - 1);
+
+    g_object_set(priv->probe,
+            "before-id", before_id,
+            "after-id", priv->after_id,
+            "limit", 1,
+            NULL);
+    rtcom_el_query_refresh(priv->probe);
+
+    it = rtcom_el_get_events(priv->el, priv->probe);
+    if(it == NULL)
+        return 0;
+
+    if(!rtcom_el_iter_get_values(it, "id", &event_id, NULL))
+        event_id = 0;
+
+    g_object_unref(it);
+    return event_id;
+}
+
+static void
+_insert(
+        RTComElLiveQuery * live,
+        gint event_id,
+        guint position)
+{
+    RTComElLiveQueryPrivate * priv = RTCOM_EL_LIVE_QUERY_GET_PRIV(live);
+
+    /* Past the end of a full window */
+    if(priv->limit >= 0 && position >= (guint) priv->limit)
+        return;
+
+    g_array_insert_val(priv->ids, position, event_id);
+    g_signal_emit(live, signals[INSERTED], 0, event_id, position);
+
+    if(priv->limit >= 0 && priv->ids->len > (guint) priv->limit)
+    {
+        position = priv->ids->len - 1;
+        event_id = g_array_index(priv->ids, gint, position);
+        g_array_remove_index(priv->ids, position);
+        g_signal_emit(live, signals[REMOVED], 0, event_id, position);
+    }
+}
+
+static void
+_remove(
+        RTComElLiveQuery * live,
+        guint position)
+{
+    RTComElLiveQueryPrivate * priv = RTCOM_EL_LIVE_QUERY_GET_PRIV(live);
+    gint event_id = g_array_index(priv->ids, gint, position);
+    gboolean was_full;
+
+    was_full = priv->limit >= 0 && priv->ids->len == (guint) priv->limit;
+
+    g_array_remove_index(priv->ids, position);
+    g_signal_emit(live, signals[REMOVED], 0, event_id, position);
+
+    /* Something past the window may move into it */
+    if(was_full)
+    {
+        event_id = _fetch_next(priv);
+        if(event_id > 0)
+        {
+            g_array_append_val(priv->ids, event_id);
+            g_signal_emit(live, signals[INSERTED], 0, event_id,
+                    priv->ids->len - 1);
+        }
+    }
+}
+
+static void
+_event_changed(
+        RTComElLiveQuery * live,
+        gint event_id)
+{
+    RTComElLiveQueryPrivate * priv = RTCOM_EL_LIVE_QUERY_GET_PRIV(live);
+    gboolean found;
+    guint position;
+
+    if(!priv->incremental || event_id < 1)
+    {
+        rtcom_el_live_query_reload(live);
+        return;
+    }
+
+    position = _find(priv, event_id, &found);
+
+    if(_matches(priv, event_id))
+    {
+        if(found)
+            g_signal_emit(live, signals[CHANGED], 0, event_id, position);
+        else
+            _insert(live, event_id, position);
+    }
+    else if(found)
+        _remove(live, position);
+}
+
+static void
+_on_event(
+        RTComEl * el,
+        gint event_id,
+        const gchar * local_uid,
+        const gchar * remote_uid,
+        const gchar * remote_ebook_uid,
+        const gchar * group_uid,
+        const gchar * service,
+        gpointer user_data)
+{
+    _event_changed(RTCOM_EL_LIVE_QUERY(user_data), event_id);
+}
+
+static void
+_on_event_deleted(
+        RTComEl * el,
+        gint event_id,
+        const gchar * local_uid,
+        const gchar * remote_uid,
+        const gchar * remote_ebook_uid,
+        const gchar * group_uid,
+        const gchar * service,
+        gpointer user_data)
+{
+    RTComElLiveQuery * live = RTCOM_EL_LIVE_QUERY(user_data);
+    RTComElLiveQueryPrivate * priv = RTCOM_EL_LIVE_QUERY_GET_PRIV(live);
+    gboolean found;
+    guint position;
+
+    if(!priv->incremental || event_id < 1)
+    {
+        rtcom_el_live_query_reload(live);
+        return;
+    }
+
+    position = _find(priv, event_id, &found);
+    if(found)
+        _remove(live, position);
+}
+
+static void
+_on_all_deleted(
+        RTComEl * el,
+        const gchar * service,
+        gpointer user_data)
+{
+    rtcom_el_live_query_reload(RTCOM_EL_LIVE_QUERY(user_data));
+}
+
+static void
+_on_refresh_hint(
+        RTComEl * el,
+        gpointer user_data)
+{
+    rtcom_el_live_query_reload(RTCOM_EL_LIVE_QUERY(user_data));
+}
+
+RTComElLiveQuery * rtcom_el_live_query_new(
+        RTComEl * el,
+        RTComElQuery * query)
+{
+    RTComElLiveQuery * live = NULL;
+    RTComElLiveQueryPrivate * priv = NULL;
+    const gchar * fields[] = { "id", NULL };
+    RTComElQueryGroupBy group_by;
+    gint offset;
+
+    g_return_val_if_fail(RTCOM_IS_EL(el), NULL);
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), NULL);
+
+    live = RTCOM_EL_LIVE_QUERY(g_object_new(RTCOM_TYPE_EL_LIVE_QUERY, NULL));
+    priv = RTCOM_EL_LIVE_QUERY_GET_PRIV(live);
+
+    priv->el = g_object_ref(el);
+    priv->query = g_object_ref(query);
+
+    g_object_get(query,
+            "limit", &priv->limit,
+            "offset", &offset,
+            "before-id", &priv->before_id,
+            "after-id", &priv->after_id,
+            "group-by", &group_by,
+            NULL);
+
+    /* Grouped results and offsets shift in ways single events can't
+     * tell */
+    priv->incremental = group_by == RTCOM_EL_QUERY_GROUP_BY_NONE &&
+        offset == 0;
+
+    if(priv->incremental)
+    {
+        priv->probe = rtcom_el_query_copy(query);
+        rtcom_el_query_set_fields(priv->probe, fields);
+    }
+
+    priv->ids_query = rtcom_el_query_copy(query);
+    rtcom_el_query_set_fields(priv->ids_query, fields);
+    rtcom_el_query_refresh(priv->ids_query);
+
+    g_signal_connect(el, "new-event", G_CALLBACK(_on_event), live);
+    g_signal_connect(el, "event-updated", G_CALLBACK(_on_event), live);
+    g_signal_connect(el, "event-deleted", G_CALLBACK(_on_event_deleted),
+            live);
+    g_signal_connect(el, "all-deleted", G_CALLBACK(_on_all_deleted), live);
+    g_signal_connect(el, "refresh-hint", G_CALLBACK(_on_refresh_hint), live);
+
+    rtcom_el_live_query_reload(live);
+
+    return live;
+}
+
+const gint * rtcom_el_live_query_get_ids(
+        RTComElLiveQuery * live,
+        guint * n_ids)
+{
+    RTComElLiveQueryPrivate * priv = NULL;
+
+    g_return_val_if_fail(RTCOM_IS_EL_LIVE_QUERY(live), NULL);
+    priv = RTCOM_EL_LIVE_QUERY_GET_PRIV(live);
+
+    if(n_ids)
+        *n_ids = priv->ids->len;
+
+    return (const gint *) priv->ids->data;
+}
+
+gboolean rtcom_el_live_query_reload(
+        RTComElLiveQuery * live)
+{
+    RTComElLiveQueryPrivate * priv = NULL;
+    RTComElIter * it = NULL;
+    gboolean ret = TRUE;
+    gint event_id;
+
+    g_return_val_if_fail(RTCOM_IS_EL_LIVE_QUERY(live), FALSE);
+    priv = RTCOM_EL_LIVE_QUERY_GET_PRIV(live);
+
+    g_array_set_size(priv->ids, 0);
+
+    it = rtcom_el_get_events(priv->el, priv->ids_query);
+    if(it != NULL && rtcom_el_iter_first(it))
+    {
+        do
+        {
+            if(!rtcom_el_iter_get_values(it, "id", &event_id, NULL))
+            {
+                ret = FALSE;
+                break;
+            }
+
+            g_array_append_val(priv->ids, event_id);
+        }
+        while(rtcom_el_iter_next(it));
+    }
+
+    if(it != NULL)
+        g_object_unref(it);
+
+    g_signal_emit(live, signals[RESET], 0);
+
+    return ret;
+}
+
+/* vim: set ai et tw=75 ts=4 sw=4: */
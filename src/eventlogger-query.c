@@ -33,17 +33,56 @@ struct _RTComElQueryPrivate {
     gboolean is_caching; /** Indicates if it's a query performed for caching purposes */
     gint limit;
     gint offset;
+    gint before_id;
+    gint after_id;
     RTComElQueryGroupBy group_by;
+    /* The fields to select, or NULL for all */
+    gchar ** fields;
 
     /* Borrowed mapping of field name -> expected GType */
     GHashTable *typing;
     /* Borrowed mapping of field name -> SQL column name */
     GHashTable *mapping;
 
+    /* The SQL, with a ? for every value in values */
     GString * sql;
+    GArray * values;
+    /* The WHERE clause, with a ? for every value in where_values */
+    gchar * where_template;
+    GArray * where_values;
+
+    /* Built when asked for */
+    gchar * rendered_sql;
+    gchar * count_sql;
+    gchar * exists_sql;
     gchar * where_clause;
 };
 
+typedef enum {
+    EXPR_AND,
+    EXPR_OR,
+    EXPR_NOT,
+    EXPR_INT,
+    EXPR_STRING,
+    EXPR_STRV,
+    EXPR_INTV
+} ExprType;
+
+struct _RTComElQueryExpr {
+    ExprType type;
+
+    /* EXPR_AND, EXPR_OR, EXPR_NOT */
+    GPtrArray *children;
+
+    /* The others */
+    gchar *key;
+    RTComElOp op;
+    gint int_val;
+    gchar *str_val;
+    gchar **strv_val;
+    GArray *intv_val;
+};
+
 G_DEFINE_TYPE_WITH_PRIVATE(RTComElQuery, rtcom_el_query, G_TYPE_OBJECT);
 
 static gboolean _build_where_clause(
@@ -51,11 +90,71 @@ static gboolean _build_where_clause(
         const gchar * key,
         gpointer val,
         RTComElOp op,
-        GString *acc);
+        GString *acc,
+        GArray *values);
 
 static const gchar * _build_operator(
         RTComElOp op);
 
+static void _append_cursor(
+        RTComElQueryPrivate * priv,
+        GString * sql,
+        const gchar * sep,
+        const gchar * id_column,
+        GArray * values);
+
+static void _append_joins(
+        GString * sql,
+        gboolean remotes,
+        gboolean headers);
+
+static gboolean _where_needs(
+        RTComElQueryPrivate * priv,
+        const gchar * table);
+
+static gboolean _uses_contact_cache(
+        RTComElQueryPrivate * priv);
+
+static void _build_select(
+        RTComElQueryPrivate * priv,
+        GString * sql,
+        const gchar * selection,
+        gboolean need_remotes,
+        gboolean need_headers,
+        GArray * values);
+
+static gchar * _build_aggregate(
+        RTComElQueryPrivate * priv,
+        gboolean exists);
+
+static GArray * _values_new(void);
+
+static GArray * _values_copy(
+        GArray * values);
+
+static void _values_add_int(
+        GArray * values,
+        gint val);
+
+static void _values_add_string(
+        GArray * values,
+        const gchar * val);
+
+static gchar * _render_sql(
+        const gchar * sql,
+        GArray * values);
+
+static gboolean _build_expr(
+        RTComElQuery * query,
+        const RTComElQueryExpr * expr,
+        GString * ret,
+        GArray * values);
+
+static void _set_where(
+        RTComElQuery * query,
+        GString * where_buf,
+        GArray * where_values);
+
 enum
 {
     RTCOM_EL_QUERY_PROP_0,
@@ -63,7 +162,10 @@ enum
     RTCOM_EL_QUERY_PROP_IS_CACHING,
     RTCOM_EL_QUERY_PROP_LIMIT,
     RTCOM_EL_QUERY_PROP_OFFSET,
-    RTCOM_EL_QUERY_PROP_GROUP_BY
+    RTCOM_EL_QUERY_PROP_BEFORE_ID,
+    RTCOM_EL_QUERY_PROP_AFTER_ID,
+    RTCOM_EL_QUERY_PROP_GROUP_BY,
+    RTCOM_EL_QUERY_PROP_FIELDS
 };
 
 static void rtcom_el_query_set_property(
@@ -92,10 +194,23 @@ static void rtcom_el_query_set_property(
             priv->offset = g_value_get_int(value);
             break;
 
+        case RTCOM_EL_QUERY_PROP_BEFORE_ID:
+            priv->before_id = g_value_get_int(value);
+            break;
+
+        case RTCOM_EL_QUERY_PROP_AFTER_ID:
+            priv->after_id = g_value_get_int(value);
+            break;
+
         case RTCOM_EL_QUERY_PROP_GROUP_BY:
             priv->group_by = g_value_get_int(value);
             break;
 
+        case RTCOM_EL_QUERY_PROP_FIELDS:
+            g_strfreev(priv->fields);
+            priv->fields = g_value_dup_boxed(value);
+            break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(obj, prop_id, pspec);
             break;
@@ -128,10 +243,22 @@ static void rtcom_el_query_get_property(
             g_value_set_int(value, priv->offset);
             break;
 
+        case RTCOM_EL_QUERY_PROP_BEFORE_ID:
+            g_value_set_int(value, priv->before_id);
+            break;
+
+        case RTCOM_EL_QUERY_PROP_AFTER_ID:
+            g_value_set_int(value, priv->after_id);
+            break;
+
         case RTCOM_EL_QUERY_PROP_GROUP_BY:
             g_value_set_int(value, priv->group_by);
             break;
 
+        case RTCOM_EL_QUERY_PROP_FIELDS:
+            g_value_set_boxed(value, priv->fields);
+            break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(obj, prop_id, pspec);
             break;
@@ -148,8 +275,17 @@ static void rtcom_el_query_init(
     priv->is_caching = FALSE;
     priv->limit = -1;
     priv->offset = 0;
+    priv->before_id = 0;
+    priv->after_id = 0;
     priv->group_by = RTCOM_EL_QUERY_GROUP_BY_NONE;
+    priv->fields = NULL;
     priv->sql = NULL;
+    priv->values = NULL;
+    priv->where_template = NULL;
+    priv->where_values = NULL;
+    priv->rendered_sql = NULL;
+    priv->count_sql = NULL;
+    priv->exists_sql = NULL;
     priv->where_clause = NULL;
 
     rtcom_el_db_schema_get_mappings (NULL, &priv->mapping, &priv->typing);
@@ -163,8 +299,18 @@ static void rtcom_el_query_finalize(
     if(priv->sql)
         g_string_free(priv->sql, TRUE);
 
-    if(priv->where_clause)
-        g_free(priv->where_clause);
+    if(priv->values)
+        g_array_free(priv->values, TRUE);
+
+    if(priv->where_values)
+        g_array_free(priv->where_values, TRUE);
+
+    g_free(priv->where_template);
+    g_free(priv->rendered_sql);
+    g_free(priv->count_sql);
+    g_free(priv->exists_sql);
+    g_free(priv->where_clause);
+    g_strfreev(priv->fields);
 
     G_OBJECT_CLASS(rtcom_el_query_parent_class)->finalize(object);
 }
@@ -218,6 +364,26 @@ static void rtcom_el_query_class_init(
                 0, G_MAXINT, 0,
                 G_PARAM_READWRITE));
 
+    g_object_class_install_property(
+            object_class,
+            RTCOM_EL_QUERY_PROP_BEFORE_ID,
+            g_param_spec_int(
+                "before-id",
+                "Before id",
+                "Only return events older than this one (0 for no limit)",
+                0, G_MAXINT, 0,
+                G_PARAM_READWRITE));
+
+    g_object_class_install_property(
+            object_class,
+            RTCOM_EL_QUERY_PROP_AFTER_ID,
+            g_param_spec_int(
+                "after-id",
+                "After id",
+                "Only return events newer than this one (0 for no limit)",
+                0, G_MAXINT, 0,
+                G_PARAM_READWRITE));
+
     g_object_class_install_property(
             object_class,
             RTCOM_EL_QUERY_PROP_GROUP_BY,
@@ -229,6 +395,16 @@ static void rtcom_el_query_class_init(
                 RTCOM_EL_QUERY_GROUP_BY_GROUP,
                 RTCOM_EL_QUERY_GROUP_BY_NONE,
                 G_PARAM_READWRITE));
+
+    g_object_class_install_property(
+            object_class,
+            RTCOM_EL_QUERY_PROP_FIELDS,
+            g_param_spec_boxed(
+                "fields",
+                "Fields",
+                "The fields to fetch, or NULL for all of them",
+                G_TYPE_STRV,
+                G_PARAM_READWRITE));
 }
 
 RTComElQuery * rtcom_el_query_new(
@@ -241,6 +417,40 @@ RTComElQuery * rtcom_el_query_new(
                 NULL));
 }
 
+RTComElQuery * rtcom_el_query_copy(
+        RTComElQuery * query)
+{
+    RTComElQueryPrivate * priv = NULL;
+    RTComElQueryPrivate * copy_priv = NULL;
+    RTComElQuery * copy = NULL;
+
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), NULL);
+    priv = RTCOM_EL_QUERY_GET_PRIV(query);
+
+    copy = RTCOM_EL_QUERY(
+            g_object_new(
+                RTCOM_TYPE_EL_QUERY,
+                "el", priv->el,
+                "is-caching", priv->is_caching,
+                "limit", priv->limit,
+                "offset", priv->offset,
+                "before-id", priv->before_id,
+                "after-id", priv->after_id,
+                "group-by", priv->group_by,
+                "fields", priv->fields,
+                NULL));
+    copy_priv = RTCOM_EL_QUERY_GET_PRIV(copy);
+
+    copy_priv->where_template = g_strdup(priv->where_template);
+    if(priv->where_values)
+        copy_priv->where_values = _values_copy(priv->where_values);
+
+    if(priv->sql)
+        rtcom_el_query_refresh(copy);
+
+    return copy;
+}
+
 void rtcom_el_query_set_is_caching(
         RTComElQuery * query,
         gboolean is_caching)
@@ -271,6 +481,36 @@ void rtcom_el_query_set_offset(
             NULL);
 }
 
+void rtcom_el_query_set_before_id(
+        RTComElQuery * query,
+        gint event_id)
+{
+    g_object_set(
+            G_OBJECT(query),
+            "before-id", event_id,
+            NULL);
+}
+
+void rtcom_el_query_set_after_id(
+        RTComElQuery * query,
+        gint event_id)
+{
+    g_object_set(
+            G_OBJECT(query),
+            "after-id", event_id,
+            NULL);
+}
+
+void rtcom_el_query_set_fields(
+        RTComElQuery * query,
+        const gchar * const * fields)
+{
+    g_object_set(
+            G_OBJECT(query),
+            "fields", fields,
+            NULL);
+}
+
 void rtcom_el_query_set_group_by(
         RTComElQuery * query,
         RTComElQueryGroupBy group_by)
@@ -286,7 +526,9 @@ gboolean rtcom_el_query_refresh(
 {
     RTComElQueryPrivate * priv = NULL;
     const gchar *selection;
+    gchar *projection = NULL;
     const gchar *order_by_clause;
+    gboolean need_remotes, need_headers;
 
     g_return_val_if_fail(query, FALSE);
 
@@ -296,56 +538,63 @@ gboolean rtcom_el_query_refresh(
     if(priv->sql)
         g_string_free(priv->sql, TRUE);
 
-    rtcom_el_db_schema_get_mappings (&selection, NULL, NULL);
+    if(priv->values)
+        g_array_free(priv->values, TRUE);
 
-    priv->sql = g_string_sized_new (1024); /* size hint for performance */
+    g_free(priv->rendered_sql);
+    priv->rendered_sql = NULL;
+    g_free(priv->count_sql);
+    priv->count_sql = NULL;
+    g_free(priv->exists_sql);
+    priv->exists_sql = NULL;
 
-    /* Use the caching data if available. */
-    if (priv->group_by == RTCOM_EL_QUERY_GROUP_BY_GROUP)
+    if (priv->fields)
     {
-        g_string_printf (priv->sql, "SELECT %s FROM GroupCache "
-            "JOIN Events ON GroupCache.event_id = Events.id "
-            "JOIN Services ON GroupCache.service_id = Services.id "
-            "JOIN EventTypes ON Events.event_type_id = EventTypes.id "
-            "LEFT JOIN Remotes ON Events.remote_uid = Remotes.remote_uid "
-                "AND Events.local_uid = Remotes.local_uid "
-            "LEFT JOIN Headers ON Headers.event_id = Events.id "
-                "AND Headers.name = 'message-token'", selection);
-
-        if(priv->where_clause)
-            g_string_append_printf(priv->sql, " WHERE %s", priv->where_clause);
-    } else {
-        g_string_printf (priv->sql, "SELECT %s FROM Events "
-            "JOIN Services ON Events.service_id = Services.id "
-            "JOIN EventTypes ON Events.event_type_id = EventTypes.id "
-            "LEFT JOIN Remotes ON Events.remote_uid = Remotes.remote_uid "
-                "AND Events.local_uid = Remotes.local_uid "
-            "LEFT JOIN Headers ON Headers.event_id = Events.id AND "
-                "Headers.name = 'message-token'", selection);
+        projection = rtcom_el_db_schema_get_selection (
+                (const gchar * const *) priv->fields,
+                priv->group_by == RTCOM_EL_QUERY_GROUP_BY_CONTACT);
+        selection = projection;
+    }
+    else
+        rtcom_el_db_schema_get_mappings (&selection, NULL, NULL);
 
-        if(priv->where_clause)
-            g_string_append_printf(priv->sql, " WHERE %s", priv->where_clause);
+    /* Only join the tables something refers to */
+    need_remotes = priv->fields == NULL ||
+        strstr(selection, "Remotes.") != NULL ||
+        _where_needs(priv, "Remotes.");
+    need_headers = priv->fields == NULL ||
+        strstr(selection, "Headers.") != NULL ||
+        _where_needs(priv, "Headers.");
 
-        if(priv->group_by == RTCOM_EL_QUERY_GROUP_BY_CONTACT)
-            g_string_append(priv->sql, " GROUP BY unique_remote");
-        else if(priv->group_by == RTCOM_EL_QUERY_GROUP_BY_UIDS)
-            g_string_append(priv->sql, " GROUP BY Remotes.local_uid, Remotes.remote_uid");
-    }
+    priv->sql = g_string_sized_new (1024); /* size hint for performance */
+
+    if(priv->where_values)
+        priv->values = _values_copy(priv->where_values);
+    else
+        priv->values = _values_new();
+
+    _build_select(priv, priv->sql, selection, need_remotes, need_headers,
+            priv->values);
 
     /* We need MAX() in case of GROUP BY as otherwise we may get the wrong
      * result */
-    if (priv->group_by == RTCOM_EL_QUERY_GROUP_BY_CONTACT ||
+    if (_uses_contact_cache(priv)) {
+      /* Already one event per group */
+      order_by_clause = " ORDER BY Events.id DESC LIMIT ? OFFSET ?;";
+    } else if (priv->group_by == RTCOM_EL_QUERY_GROUP_BY_CONTACT ||
         priv->group_by == RTCOM_EL_QUERY_GROUP_BY_UIDS) {
-      order_by_clause = " ORDER BY MAX(Events.id) DESC LIMIT %d OFFSET %d;";
+      order_by_clause = " ORDER BY MAX(Events.id) DESC LIMIT ? OFFSET ?;";
+    } else if (priv->group_by == RTCOM_EL_QUERY_GROUP_BY_GROUP) {
+      /* Same as Events.id, but lets the cursor walk the GroupCache index */
+      order_by_clause = " ORDER BY GroupCache.event_id DESC LIMIT ? OFFSET ?;";
     } else
-      order_by_clause = " ORDER BY Events.id DESC LIMIT %d OFFSET %d;";
+      order_by_clause = " ORDER BY Events.id DESC LIMIT ? OFFSET ?;";
 
-    g_string_append_printf(
-            priv->sql,
-            order_by_clause,
-            priv->limit,
-            priv->offset);
+    g_string_append(priv->sql, order_by_clause);
+    _values_add_int(priv->values, priv->limit);
+    _values_add_int(priv->values, priv->offset);
 
+    g_free(projection);
     return TRUE;
 }
 
@@ -362,25 +611,31 @@ gboolean rtcom_el_query_prepare(
     priv = RTCOM_EL_QUERY_GET_PRIV(query);
     g_assert(priv);
 
-    g_free (priv->where_clause);
-    priv->where_clause = NULL;
+    _set_where (query, NULL, NULL);
 
     va_start(ap, query);
     col = va_arg(ap, const gchar *);
     if(col)
     {
         GString *where_buf = g_string_new ("");
+        GArray *where_values = _values_new ();
 
         while(col)
         {
             gpointer val = va_arg(ap, gpointer);
             /* XXX: use of enum in va_arg is not portable */
             RTComElOp op  = va_arg(ap, RTComElOp);
-            if(!_build_where_clause (query, col, val, op, where_buf))
+            if(!_build_where_clause (query, col, val, op, where_buf,
+                    where_values))
             {
                  va_end(ap);
                  g_string_free(where_buf, TRUE);
-                 g_string_free(priv->sql, TRUE); priv->sql = NULL;
+                 g_array_free(where_values, TRUE);
+                 if(priv->sql)
+                 {
+                     g_string_free(priv->sql, TRUE);
+                     priv->sql = NULL;
+                 }
                  return FALSE;
             }
 
@@ -391,7 +646,7 @@ gboolean rtcom_el_query_prepare(
             }
         }
 
-        priv->where_clause = g_string_free (where_buf, FALSE);
+        _set_where (query, where_buf, where_values);
     }
     va_end(ap);
 
@@ -399,6 +654,199 @@ gboolean rtcom_el_query_prepare(
     return TRUE;
 }
 
+gboolean rtcom_el_query_prepare_expr(
+        RTComElQuery * query,
+        const RTComElQueryExpr * expr)
+{
+    RTComElQueryPrivate * priv = NULL;
+    GString *where_buf;
+    GArray *where_values;
+
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), FALSE);
+
+    priv = RTCOM_EL_QUERY_GET_PRIV(query);
+
+    _set_where (query, NULL, NULL);
+
+    if(expr != NULL)
+    {
+        where_buf = g_string_new ("");
+        where_values = _values_new ();
+
+        if(!_build_expr (query, expr, where_buf, where_values))
+        {
+            g_string_free(where_buf, TRUE);
+            g_array_free(where_values, TRUE);
+            if(priv->sql)
+            {
+                g_string_free(priv->sql, TRUE);
+                priv->sql = NULL;
+            }
+            return FALSE;
+        }
+
+        _set_where (query, where_buf, where_values);
+    }
+
+    rtcom_el_query_refresh (query);
+    return TRUE;
+}
+
+static RTComElQueryExpr *
+_expr_new(
+        ExprType type,
+        const gchar * key,
+        RTComElOp op)
+{
+    RTComElQueryExpr *expr = g_slice_new0(RTComElQueryExpr);
+
+    expr->type = type;
+    expr->key = g_strdup(key);
+    expr->op = op;
+    return expr;
+}
+
+static RTComElQueryExpr *
+_expr_new_node(
+        ExprType type,
+        RTComElQueryExpr * first,
+        va_list ap)
+{
+    RTComElQueryExpr *expr = _expr_new(type, NULL, 0);
+    RTComElQueryExpr *child;
+
+    expr->children = g_ptr_array_new_with_free_func(
+            (GDestroyNotify) rtcom_el_query_expr_free);
+
+    for(child = first; child != NULL; child = va_arg(ap, RTComElQueryExpr *))
+        g_ptr_array_add(expr->children, child);
+
+    return expr;
+}
+
+RTComElQueryExpr * rtcom_el_query_expr_int(
+        const gchar * key,
+        RTComElOp op,
+        gint value)
+{
+    RTComElQueryExpr *expr;
+
+    g_return_val_if_fail(key != NULL, NULL);
+
+    expr = _expr_new(EXPR_INT, key, op);
+    expr->int_val = value;
+    return expr;
+}
+
+RTComElQueryExpr * rtcom_el_query_expr_string(
+        const gchar * key,
+        RTComElOp op,
+        const gchar * value)
+{
+    RTComElQueryExpr *expr;
+
+    g_return_val_if_fail(key != NULL, NULL);
+    g_return_val_if_fail(op != RTCOM_EL_OP_IN_STRV, NULL);
+
+    expr = _expr_new(EXPR_STRING, key, op);
+    expr->str_val = g_strdup(value);
+    return expr;
+}
+
+RTComElQueryExpr * rtcom_el_query_expr_in_strv(
+        const gchar * key,
+        const gchar * const * values)
+{
+    RTComElQueryExpr *expr;
+
+    g_return_val_if_fail(key != NULL, NULL);
+    g_return_val_if_fail(values != NULL, NULL);
+
+    expr = _expr_new(EXPR_STRV, key, RTCOM_EL_OP_IN_STRV);
+    expr->strv_val = g_strdupv((gchar **) values);
+    return expr;
+}
+
+RTComElQueryExpr * rtcom_el_query_expr_in_ints(
+        const gchar * key,
+        const gint * values,
+        guint n_values)
+{
+    RTComElQueryExpr *expr;
+
+    g_return_val_if_fail(key != NULL, NULL);
+    g_return_val_if_fail(values != NULL || n_values == 0, NULL);
+
+    expr = _expr_new(EXPR_INTV, key, RTCOM_EL_OP_EQUAL);
+    expr->intv_val = g_array_sized_new(FALSE, FALSE, sizeof(gint), n_values);
+    g_array_append_vals(expr->intv_val, values, n_values);
+    return expr;
+}
+
+RTComElQueryExpr * rtcom_el_query_expr_is_null(
+        const gchar * key)
+{
+    g_return_val_if_fail(key != NULL, NULL);
+
+    return _expr_new(EXPR_INT, key, RTCOM_EL_OP_IS_NULL);
+}
+
+RTComElQueryExpr * rtcom_el_query_expr_and(
+        RTComElQueryExpr * first,
+        ...)
+{
+    RTComElQueryExpr *expr;
+    va_list ap;
+
+    va_start(ap, first);
+    expr = _expr_new_node(EXPR_AND, first, ap);
+    va_end(ap);
+    return expr;
+}
+
+RTComElQueryExpr * rtcom_el_query_expr_or(
+        RTComElQueryExpr * first,
+        ...)
+{
+    RTComElQueryExpr *expr;
+    va_list ap;
+
+    va_start(ap, first);
+    expr = _expr_new_node(EXPR_OR, first, ap);
+    va_end(ap);
+    return expr;
+}
+
+RTComElQueryExpr * rtcom_el_query_expr_not(
+        RTComElQueryExpr * expr)
+{
+    RTComElQueryExpr *ret;
+
+    g_return_val_if_fail(expr != NULL, NULL);
+
+    ret = _expr_new(EXPR_NOT, NULL, 0);
+    ret->children = g_ptr_array_new_with_free_func(
+            (GDestroyNotify) rtcom_el_query_expr_free);
+    g_ptr_array_add(ret->children, expr);
+    return ret;
+}
+
+void rtcom_el_query_expr_free(
+        RTComElQueryExpr * expr)
+{
+    if(expr == NULL)
+        return;
+
+    if(expr->children)
+        g_ptr_array_free(expr->children, TRUE);
+    if(expr->intv_val)
+        g_array_free(expr->intv_val, TRUE);
+    g_strfreev(expr->strv_val);
+    g_free(expr->str_val);
+    g_free(expr->key);
+    g_slice_free(RTComElQueryExpr, expr);
+}
+
 const gchar * rtcom_el_query_get_sql(
         RTComElQuery * query)
 {
@@ -407,12 +855,237 @@ const gchar * rtcom_el_query_get_sql(
     g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), NULL);
     priv = RTCOM_EL_QUERY_GET_PRIV(query);
 
+    if(!priv->sql)
+        return NULL;
+
+    if(!priv->rendered_sql)
+        priv->rendered_sql = _render_sql(priv->sql->str, priv->values);
+
+    return priv->rendered_sql;
+}
+
+const gchar * rtcom_el_query_get_sql_template(
+        RTComElQuery * query)
+{
+    RTComElQueryPrivate * priv = NULL;
+
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), NULL);
+    priv = RTCOM_EL_QUERY_GET_PRIV(query);
+
     if(!priv->sql)
         return NULL;
 
     return priv->sql->str;
 }
 
+const gchar * rtcom_el_query_get_count_sql_template(
+        RTComElQuery * query)
+{
+    RTComElQueryPrivate * priv = NULL;
+
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), NULL);
+    priv = RTCOM_EL_QUERY_GET_PRIV(query);
+
+    if(!priv->sql)
+        return NULL;
+
+    if(!priv->count_sql)
+        priv->count_sql = _build_aggregate(priv, FALSE);
+
+    return priv->count_sql;
+}
+
+const gchar * rtcom_el_query_get_exists_sql_template(
+        RTComElQuery * query)
+{
+    RTComElQueryPrivate * priv = NULL;
+
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), NULL);
+    priv = RTCOM_EL_QUERY_GET_PRIV(query);
+
+    if(!priv->sql)
+        return NULL;
+
+    if(!priv->exists_sql)
+        priv->exists_sql = _build_aggregate(priv, TRUE);
+
+    return priv->exists_sql;
+}
+
+/* Maps the field of an aggregate to a column, or an expression over
+ * them; NULL if it isn't an integer field */
+static const gchar *
+_aggregate_column(
+        RTComElQueryPrivate * priv,
+        const gchar * field)
+{
+    if(g_str_equal(field, "duration"))
+        return "(Events.end_time - Events.start_time)";
+
+    if(GPOINTER_TO_UINT(g_hash_table_lookup(priv->typing, field)) !=
+            G_TYPE_INT)
+        return NULL;
+
+    return g_hash_table_lookup(priv->mapping, field);
+}
+
+gchar * rtcom_el_query_get_aggregate_sql_template(
+        RTComElQuery * query,
+        const gchar * const * keys,
+        const RTComElAggregate * aggregates,
+        guint n_aggregates)
+{
+    static const gchar *funcs[] = { "COUNT", "SUM", "MIN", "MAX" };
+    RTComElQueryPrivate * priv = NULL;
+    GString *inner, *cols, *sql;
+    gchar *extra = NULL;
+    guint i, n_keys = 0;
+
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), NULL);
+    g_return_val_if_fail(aggregates != NULL || n_aggregates == 0, NULL);
+    priv = RTCOM_EL_QUERY_GET_PRIV(query);
+
+    if(!priv->sql)
+        return NULL;
+
+    /* The inner query picks the columns, the outer one aggregates them */
+    inner = g_string_sized_new(256);
+    cols = g_string_sized_new(128);
+
+    for(i = 0; keys != NULL && keys[i] != NULL; i++, n_keys++)
+    {
+        const gchar *column = g_hash_table_lookup(priv->mapping, keys[i]);
+
+        if(column == NULL)
+        {
+            g_warning("%s: unknown field %s", G_STRFUNC, keys[i]);
+            goto fail;
+        }
+
+        g_string_append_printf(inner, "%s%s AS k%u", i ? ", " : "",
+                column, i);
+        g_string_append_printf(cols, "%sk%u", i ? ", " : "", i);
+    }
+
+    for(i = 0; i < n_aggregates; i++)
+    {
+        const gchar *column = NULL;
+
+        if((guint) aggregates[i].func >= G_N_ELEMENTS(funcs))
+        {
+            g_warning("%s: unknown aggregate %d", G_STRFUNC,
+                    aggregates[i].func);
+            goto fail;
+        }
+
+        if(aggregates[i].field == NULL)
+        {
+            if(aggregates[i].func != RTCOM_EL_AGGREGATE_COUNT)
+            {
+                g_warning("%s: %s needs a field", G_STRFUNC,
+                        funcs[aggregates[i].func]);
+                goto fail;
+            }
+
+            g_string_append_printf(cols, "%sCOUNT(*)", cols->len ? ", " : "");
+            continue;
+        }
+
+        column = _aggregate_column(priv, aggregates[i].field);
+        if(column == NULL)
+        {
+            g_warning("%s: can't aggregate field %s", G_STRFUNC,
+                    aggregates[i].field);
+            goto fail;
+        }
+
+        g_string_append_printf(inner, "%s%s AS v%u", inner->len ? ", " : "",
+                column, i);
+        /* SUM() of no rows is NULL */
+        g_string_append_printf(cols, "%sCOALESCE(%s(v%u), 0)",
+                cols->len ? ", " : "", funcs[aggregates[i].func], i);
+    }
+
+    if(inner->len == 0)
+        g_string_append(inner, "1");
+
+    /* Grouping by contact needs the unique_remote column */
+    if(priv->group_by == RTCOM_EL_QUERY_GROUP_BY_CONTACT)
+    {
+        const gchar *none[] = { NULL };
+        extra = rtcom_el_db_schema_get_selection(none, TRUE);
+        g_string_append_printf(inner, ", %s", extra);
+        g_free(extra);
+    }
+
+    if(cols->len == 0)
+        g_string_append(cols, "COUNT(*)");
+
+    sql = g_string_sized_new(1024);
+    g_string_append_printf(sql, "SELECT %s FROM (", cols->str);
+    _build_select(priv, sql, inner->str,
+            _where_needs(priv, "Remotes.") ||
+                strstr(inner->str, "Remotes.") != NULL,
+            _where_needs(priv, "Headers.") ||
+                strstr(inner->str, "Headers.") != NULL,
+            NULL);
+    g_string_append(sql, " LIMIT ? OFFSET ?)");
+
+    if(n_keys > 0)
+    {
+        /* The keys come first in cols */
+        g_string_truncate(cols, 0);
+        for(i = 0; i < n_keys; i++)
+            g_string_append_printf(cols, "%sk%u", i ? ", " : "", i);
+        g_string_append_printf(sql, " GROUP BY %s ORDER BY %s",
+                cols->str, cols->str);
+    }
+    g_string_append(sql, ";");
+
+    g_string_free(inner, TRUE);
+    g_string_free(cols, TRUE);
+    return g_string_free(sql, FALSE);
+
+fail:
+    g_string_free(inner, TRUE);
+    g_string_free(cols, TRUE);
+    return NULL;
+}
+
+gboolean rtcom_el_query_bind(
+        RTComElQuery * query,
+        gpointer stmt)
+{
+    RTComElQueryPrivate * priv = NULL;
+    guint i;
+
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), FALSE);
+    g_return_val_if_fail(stmt, FALSE);
+    priv = RTCOM_EL_QUERY_GET_PRIV(query);
+    g_return_val_if_fail(priv->values, FALSE);
+
+    for(i = 0; i < priv->values->len; i++)
+    {
+        GValue *val = &g_array_index(priv->values, GValue, i);
+        gint ret;
+
+        if(G_VALUE_HOLDS_INT(val))
+            ret = sqlite3_bind_int(stmt, i + 1, g_value_get_int(val));
+        else
+            ret = sqlite3_bind_text(stmt, i + 1, g_value_get_string(val),
+                    -1, SQLITE_TRANSIENT);
+
+        if(ret != SQLITE_OK)
+        {
+            g_warning("%s: could not bind value %u: %s", G_STRFUNC, i + 1,
+                    sqlite3_errmsg(sqlite3_db_handle(stmt)));
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
 const gchar * rtcom_el_query_get_where_clause(
         RTComElQuery * query)
 {
@@ -421,18 +1094,421 @@ const gchar * rtcom_el_query_get_where_clause(
     g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), NULL);
     priv = RTCOM_EL_QUERY_GET_PRIV(query);
 
+    if(!priv->where_clause && priv->where_template)
+        priv->where_clause = _render_sql(priv->where_template,
+                priv->where_values);
+
     return priv->where_clause;
 }
 
 /* Some private functions */
 
+/* Replaces the WHERE clause, taking over where_buf and where_values */
+static void
+_set_where(
+        RTComElQuery * query,
+        GString * where_buf,
+        GArray * where_values)
+{
+    RTComElQueryPrivate * priv = RTCOM_EL_QUERY_GET_PRIV(query);
+
+    g_free (priv->where_template);
+    priv->where_template = NULL;
+    g_free (priv->where_clause);
+    priv->where_clause = NULL;
+    if (priv->where_values)
+        g_array_free (priv->where_values, TRUE);
+    priv->where_values = where_values;
+
+    if (where_buf)
+        priv->where_template = g_string_free (where_buf, FALSE);
+}
+
+static gboolean
+_build_expr(
+        RTComElQuery * query,
+        const RTComElQueryExpr * expr,
+        GString * ret,
+        GArray * values)
+{
+    RTComElQueryPrivate * priv = RTCOM_EL_QUERY_GET_PRIV(query);
+    GType expect = G_TYPE_INVALID;
+    guint i;
+
+    if(expr->key != NULL)
+    {
+        expect = GPOINTER_TO_UINT(g_hash_table_lookup(priv->typing,
+                    expr->key));
+        if(expect == G_TYPE_BOOLEAN)
+            expect = G_TYPE_INT;
+
+        if(expect == G_TYPE_INVALID)
+        {
+            g_warning("%s: unknown key %s", G_STRFUNC, expr->key);
+            return FALSE;
+        }
+    }
+
+    switch(expr->type)
+    {
+        case EXPR_AND:
+        case EXPR_OR:
+            if(expr->children->len == 0)
+            {
+                /* Empty AND is true, empty OR is false */
+                g_string_append(ret, expr->type == EXPR_AND ? "1" : "0");
+                return TRUE;
+            }
+
+            g_string_append_c(ret, '(');
+            for(i = 0; i < expr->children->len; i++)
+            {
+                if(i > 0)
+                    g_string_append(ret,
+                            expr->type == EXPR_AND ? " AND " : " OR ");
+                if(!_build_expr(query, g_ptr_array_index(expr->children, i),
+                            ret, values))
+                    return FALSE;
+            }
+            g_string_append_c(ret, ')');
+            return TRUE;
+
+        case EXPR_NOT:
+            g_string_append(ret, "NOT (");
+            if(!_build_expr(query, g_ptr_array_index(expr->children, 0),
+                        ret, values))
+                return FALSE;
+            g_string_append_c(ret, ')');
+            return TRUE;
+
+        case EXPR_INT:
+            if(expect != G_TYPE_INT && expr->op != RTCOM_EL_OP_IS_NULL &&
+               expr->op != RTCOM_EL_OP_IS_NOT_NULL)
+                break;
+            return _build_where_clause(query, expr->key,
+                    GINT_TO_POINTER(expr->int_val), expr->op, ret, values);
+
+        case EXPR_STRING:
+        case EXPR_STRV:
+            if(expect != G_TYPE_STRING)
+                break;
+            return _build_where_clause(query, expr->key,
+                    expr->type == EXPR_STRV ?
+                        (gpointer) expr->strv_val : (gpointer) expr->str_val,
+                    expr->op, ret, values);
+
+        case EXPR_INTV:
+            if(expect != G_TYPE_INT)
+                break;
+
+            g_string_append_printf(ret, "%s IN (",
+                    (gchar *) g_hash_table_lookup(priv->mapping, expr->key));
+            for(i = 0; i < expr->intv_val->len; i++)
+            {
+                g_string_append(ret, i > 0 ? ",?" : "?");
+                _values_add_int(values,
+                        g_array_index(expr->intv_val, gint, i));
+            }
+            g_string_append_c(ret, ')');
+            return TRUE;
+    }
+
+    g_warning("%s: wrong type of value for %s", G_STRFUNC, expr->key);
+    return FALSE;
+}
+
+/* Appends the before-id/after-id bounds on id_column, the first one
+ * preceded by sep, and their values if values isn't NULL */
+static void
+_append_cursor(
+        RTComElQueryPrivate * priv,
+        GString * sql,
+        const gchar * sep,
+        const gchar * id_column,
+        GArray * values)
+{
+    if(priv->before_id > 0)
+    {
+        g_string_append_printf(sql, "%s%s < ?", sep, id_column);
+        if(values)
+            _values_add_int(values, priv->before_id);
+        sep = " AND ";
+    }
+
+    if(priv->after_id > 0)
+    {
+        g_string_append_printf(sql, "%s%s > ?", sep, id_column);
+        if(values)
+            _values_add_int(values, priv->after_id);
+    }
+}
+
+/* Whether the WHERE clause or grouping refers to table. The WHERE
+ * template has no literal values in it to confuse this. */
+static gboolean
+_where_needs(
+        RTComElQueryPrivate * priv,
+        const gchar * table)
+{
+    if(g_str_equal(table, "Remotes.") &&
+       (priv->group_by == RTCOM_EL_QUERY_GROUP_BY_CONTACT ||
+        priv->group_by == RTCOM_EL_QUERY_GROUP_BY_UIDS))
+        return TRUE;
+
+    return priv->where_template != NULL &&
+        strstr(priv->where_template, table) != NULL;
+}
+
+/* Whether grouping by contact or uids can pick the latest event of each
+ * group from ContactCache. It only knows about whole groups, so there
+ * can't be any other filter. */
+static gboolean
+_uses_contact_cache(
+        RTComElQueryPrivate * priv)
+{
+    return (priv->group_by == RTCOM_EL_QUERY_GROUP_BY_CONTACT ||
+            priv->group_by == RTCOM_EL_QUERY_GROUP_BY_UIDS) &&
+        priv->where_template == NULL;
+}
+
+/* Builds the query up to, not including, ORDER BY and LIMIT; the cursor
+ * values are added to values if it isn't NULL */
+static void
+_build_select(
+        RTComElQueryPrivate * priv,
+        GString * sql,
+        const gchar * selection,
+        gboolean need_remotes,
+        gboolean need_headers,
+        GArray * values)
+{
+    const gchar *sep = " WHERE ";
+
+    /* Use the caching data if available. */
+    if (priv->group_by == RTCOM_EL_QUERY_GROUP_BY_GROUP)
+    {
+        g_string_append_printf (sql, "SELECT %s FROM GroupCache "
+            "JOIN Events ON GroupCache.event_id = Events.id "
+            "JOIN Services ON GroupCache.service_id = Services.id "
+            "JOIN EventTypes ON Events.event_type_id = EventTypes.id",
+            selection);
+        _append_joins(sql, need_remotes, need_headers);
+
+        if(priv->where_template)
+        {
+            g_string_append_printf(sql, " WHERE %s", priv->where_template);
+            sep = " AND ";
+        }
+
+        _append_cursor(priv, sql, sep, "GroupCache.event_id", values);
+    } else if (_uses_contact_cache(priv)) {
+        g_string_append_printf (sql, "SELECT %s FROM Events "
+            "JOIN Services ON Events.service_id = Services.id "
+            "JOIN EventTypes ON Events.event_type_id = EventTypes.id",
+            selection);
+        _append_joins(sql, need_remotes, need_headers);
+
+        /* Same grouping as below, over the uid pairs instead of every
+         * event */
+        g_string_append(sql, " WHERE Events.id IN ("
+            "SELECT MAX(ContactCache.event_id) FROM ContactCache "
+            "LEFT JOIN Remotes ON ContactCache.remote_uid = Remotes.remote_uid "
+                "AND ContactCache.local_uid = Remotes.local_uid");
+        if(priv->group_by == RTCOM_EL_QUERY_GROUP_BY_CONTACT)
+            g_string_append(sql, " GROUP BY CASE Remotes.abook_uid IS NOT NULL "
+                "WHEN 1 THEN ('ab:' || Remotes.abook_uid) "
+                "ELSE ('lr:' || ContactCache.local_uid || ';' || "
+                    "ContactCache.remote_uid) END)");
+        else
+            g_string_append(sql,
+                " GROUP BY Remotes.local_uid, Remotes.remote_uid)");
+
+        _append_cursor(priv, sql, " AND ", "Events.id", values);
+    } else {
+        g_string_append_printf (sql, "SELECT %s FROM Events "
+            "JOIN Services ON Events.service_id = Services.id "
+            "JOIN EventTypes ON Events.event_type_id = EventTypes.id",
+            selection);
+        _append_joins(sql, need_remotes, need_headers);
+
+        if(priv->where_template)
+        {
+            g_string_append_printf(sql, " WHERE %s", priv->where_template);
+            sep = " AND ";
+        }
+
+        /* The cursor applies to the latest event of each group, so it
+         * can't go into the WHERE clause */
+        if(priv->group_by == RTCOM_EL_QUERY_GROUP_BY_CONTACT)
+        {
+            g_string_append(sql, " GROUP BY unique_remote");
+            _append_cursor(priv, sql, " HAVING ", "MAX(Events.id)", values);
+        }
+        else if(priv->group_by == RTCOM_EL_QUERY_GROUP_BY_UIDS)
+        {
+            g_string_append(sql, " GROUP BY Remotes.local_uid, Remotes.remote_uid");
+            _append_cursor(priv, sql, " HAVING ", "MAX(Events.id)", values);
+        }
+        else
+            _append_cursor(priv, sql, sep, "Events.id", values);
+    }
+}
+
+/* Builds the COUNT(*) or EXISTS form of the query. It takes the same
+ * values, so LIMIT and OFFSET are kept; they don't need ORDER BY to
+ * give the right number of rows. */
+static gchar *
+_build_aggregate(
+        RTComElQueryPrivate * priv,
+        gboolean exists)
+{
+    GString *sql;
+    gchar *selection = NULL;
+
+    if(!exists && priv->where_template == NULL &&
+       priv->before_id <= 0 && priv->after_id <= 0 &&
+       priv->group_by == RTCOM_EL_QUERY_GROUP_BY_NONE &&
+       priv->limit < 0 && priv->offset == 0)
+    {
+        /* Everything: use the maintained counters. LIMIT -1 OFFSET 0
+         * leaves the single row alone. */
+        return g_strdup("SELECT COALESCE(SUM(total), 0) FROM EventCounts "
+                "LIMIT ? OFFSET ?;");
+    }
+
+    sql = g_string_sized_new(512);
+    g_string_append(sql, exists ? "SELECT EXISTS (" : "SELECT COUNT(*) FROM (");
+
+    /* Grouping by contact needs the unique_remote column */
+    if(priv->group_by == RTCOM_EL_QUERY_GROUP_BY_CONTACT)
+    {
+        const gchar *none[] = { NULL };
+        selection = rtcom_el_db_schema_get_selection(none, TRUE);
+    }
+
+    _build_select(priv, sql, selection ? selection : "1",
+            _where_needs(priv, "Remotes."), _where_needs(priv, "Headers."),
+            NULL);
+    g_string_append(sql, " LIMIT ? OFFSET ?);");
+
+    g_free(selection);
+    return g_string_free(sql, FALSE);
+}
+
+static void
+_append_joins(
+        GString * sql,
+        gboolean remotes,
+        gboolean headers)
+{
+    if(remotes)
+        g_string_append(sql,
+            " LEFT JOIN Remotes ON Events.remote_uid = Remotes.remote_uid "
+                "AND Events.local_uid = Remotes.local_uid");
+
+    if(headers)
+        g_string_append(sql,
+            " LEFT JOIN Headers ON Headers.event_id = Events.id "
+                "AND Headers.name = 'message-token'");
+}
+
+static GArray *
+_values_new(void)
+{
+    GArray *values = g_array_new(FALSE, FALSE, sizeof(GValue));
+
+    g_array_set_clear_func(values, (GDestroyNotify) g_value_unset);
+    return values;
+}
+
+static GArray *
+_values_copy(
+        GArray * values)
+{
+    GArray *copy = _values_new();
+    guint i;
+
+    for(i = 0; i < values->len; i++)
+    {
+        GValue val = G_VALUE_INIT;
+        GValue *src = &g_array_index(values, GValue, i);
+
+        g_value_init(&val, G_VALUE_TYPE(src));
+        g_value_copy(src, &val);
+        g_array_append_val(copy, val);
+    }
+
+    return copy;
+}
+
+static void
+_values_add_int(
+        GArray * values,
+        gint val)
+{
+    GValue v = G_VALUE_INIT;
+
+    g_value_init(&v, G_TYPE_INT);
+    g_value_set_int(&v, val);
+    g_array_append_val(values, v);
+}
+
+static void
+_values_add_string(
+        GArray * values,
+        const gchar * val)
+{
+    GValue v = G_VALUE_INIT;
+
+    g_value_init(&v, G_TYPE_STRING);
+    g_value_set_string(&v, val);
+    g_array_append_val(values, v);
+}
+
+/* Puts the values in place of the placeholders, quoting strings */
+static gchar *
+_render_sql(
+        const gchar * sql,
+        GArray * values)
+{
+    GString *ret = g_string_sized_new(strlen(sql) + 64);
+    gboolean quoted = FALSE;
+    guint n = 0;
+    const gchar *p;
+
+    for(p = sql; *p; p++)
+    {
+        if(*p == '\'')
+            quoted = !quoted;
+
+        if(*p == '?' && !quoted && values && n < values->len)
+        {
+            GValue *val = &g_array_index(values, GValue, n++);
+
+            if(G_VALUE_HOLDS_INT(val))
+                g_string_append_printf(ret, "%d", g_value_get_int(val));
+            else
+            {
+                char *tmp = sqlite3_mprintf("%Q", g_value_get_string(val));
+                g_string_append(ret, tmp);
+                sqlite3_free(tmp);
+            }
+        }
+        else
+            g_string_append_c(ret, *p);
+    }
+
+    return g_string_free(ret, FALSE);
+}
+
 static gboolean
 _build_where_clause(
         RTComElQuery * query,
         const gchar * key,
         gpointer val,
         RTComElOp op,
-        GString *ret)
+        GString *ret,
+        GArray *values)
 {
     RTComElQueryPrivate * priv = NULL;
     GType expect;
@@ -450,20 +1526,51 @@ _build_where_clause(
 
     expect = GPOINTER_TO_UINT (g_hash_table_lookup (priv->typing, key));
 
+    if (expect != G_TYPE_INVALID &&
+        (op == RTCOM_EL_OP_IS_NULL || op == RTCOM_EL_OP_IS_NOT_NULL))
+    {
+        g_string_append_printf(
+                ret, "%s %s",
+                (gchar *) g_hash_table_lookup(priv->mapping, key),
+                op == RTCOM_EL_OP_IS_NULL ? "IS NULL" : "IS NOT NULL");
+        return TRUE;
+    }
+
     switch (expect)
     {
         case G_TYPE_INT:
         case G_TYPE_BOOLEAN:
             {
                 guint int_val = GPOINTER_TO_UINT(val);
-                const gchar *op_string = _build_operator(op);
+                const gchar *op_string;
+
+                if(op == RTCOM_EL_OP_HAS_ANY_FLAG)
+                {
+                    g_string_append_printf(
+                            ret, "(%s & ?) <> 0",
+                            (gchar *) g_hash_table_lookup(priv->mapping, key));
+                    _values_add_int(values, int_val);
+                    return TRUE;
+                }
+                else if(op == RTCOM_EL_OP_HAS_ALL_FLAGS)
+                {
+                    g_string_append_printf(
+                            ret, "(%s & ?) = ?",
+                            (gchar *) g_hash_table_lookup(priv->mapping, key));
+                    _values_add_int(values, int_val);
+                    _values_add_int(values, int_val);
+                    return TRUE;
+                }
+
+                op_string = _build_operator(op);
                 if(!op_string)
                     return FALSE;
 
                 g_string_append_printf(
-                        ret, "%s %s %d",
+                        ret, "%s %s ?",
                         (gchar *) g_hash_table_lookup( priv->mapping, key),
-                        op_string, int_val);
+                        op_string);
+                _values_add_int(values, int_val);
                 return TRUE;
             }
 
@@ -471,14 +1578,12 @@ _build_where_clause(
             {
             if(op == RTCOM_EL_OP_STR_LIKE)
             {
-              gchar *string_val = (gchar *) val;
-              char *tmp = sqlite3_mprintf("%s LIKE '%%%q%%'",
-                                          (gchar *) g_hash_table_lookup(priv->mapping, key),
-                                          string_val);
-              g_string_append(ret, tmp);
-              g_print("wat: %s", ret);
-
-              sqlite3_free(tmp);
+                gchar *pattern = g_strconcat("%", (gchar *) val, "%", NULL);
+                g_string_append_printf(
+                        ret, "%s LIKE ?",
+                        (gchar *) g_hash_table_lookup(priv->mapping, key));
+                _values_add_string(values, pattern);
+                g_free(pattern);
             }
             else if(op == RTCOM_EL_OP_IN_STRV)
             {
@@ -488,34 +1593,32 @@ _build_where_clause(
                         (gchar *) g_hash_table_lookup(priv->mapping, key));
                 for(; *strv_val; strv_val++)
                 {
-                    char *tmp = sqlite3_mprintf("%Q%c", *strv_val, *(strv_val + 1) ? ',': ' ');
-                    g_string_append(ret, tmp);
-                    sqlite3_free(tmp);
+                    g_string_append(ret, *(strv_val + 1) ? "?," : "?");
+                    _values_add_string(values, *strv_val);
                 }
                 ret = g_string_append(ret, ")");
             }
             else if(op == RTCOM_EL_OP_STR_ENDS_WITH)
             {
-                gchar *string_val = (gchar *) val;
-                char *tmp = sqlite3_mprintf("%s LIKE '%%%q'",
-                        (gchar *) g_hash_table_lookup(priv->mapping, key),
-                        string_val);
-                g_string_append(ret, tmp);
-                sqlite3_free(tmp);
+                gchar *pattern = g_strconcat("%", (gchar *) val, NULL);
+                g_string_append_printf(
+                        ret, "%s LIKE ?",
+                        (gchar *) g_hash_table_lookup(priv->mapping, key));
+                _values_add_string(values, pattern);
+                g_free(pattern);
             }
             else
             {
                 gchar *string_val = (gchar *) val;
                 const gchar *op_string = _build_operator(op);
-                char *tmp;
                 if(!op_string)
                     return FALSE;
 
-                tmp = sqlite3_mprintf("%s %s %Q",
+                g_string_append_printf(
+                        ret, "%s %s ?",
                         (gchar *) g_hash_table_lookup(priv->mapping, key),
-                        op_string, string_val);
-                g_string_append (ret, tmp);
-                sqlite3_free (tmp);
+                        op_string);
+                _values_add_string(values, string_val);
             }
             return TRUE;
             }
@@ -539,6 +1642,10 @@ _build_operator (RTComElOp op)
         case RTCOM_EL_OP_IN_STRV: g_return_val_if_reached(NULL);
         case RTCOM_EL_OP_STR_ENDS_WITH: g_return_val_if_reached(NULL);
         case RTCOM_EL_OP_STR_LIKE: g_return_val_if_reached(NULL);
+        case RTCOM_EL_OP_HAS_ANY_FLAG: g_return_val_if_reached(NULL);
+        case RTCOM_EL_OP_HAS_ALL_FLAGS: g_return_val_if_reached(NULL);
+        case RTCOM_EL_OP_IS_NULL: g_return_val_if_reached(NULL);
+        case RTCOM_EL_OP_IS_NOT_NULL: g_return_val_if_reached(NULL);
         default: g_return_val_if_reached(NULL);
     }
 }
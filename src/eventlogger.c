@@ -17,15 +17,22 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include "config.h"
+
 #include <sqlite3.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <sched.h>
 #include <unistd.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 
 #include <gmodule.h>
 #include <dbus/dbus.h>
@@ -37,7 +44,6 @@
 #include "rtcom-eventlogger/eventlogger-attach-iter.h"
 #include "rtcom-eventlogger/db.h"
 #include "eventlogger-marshalers.h"
-#include "config.h"
 
 /* Configuration directory where EventLogger database and config is stored */
 #define CONFIG_DIR      ".rtcom-eventlogger"
@@ -45,6 +51,21 @@
 #define SQLITE_DATABASE        "el-v1.db"
 #define OLD_SQLITE_DATABASE    "el.db"
 #define ATTACH_DIR             "attachments"
+/* Connections kept open for queries run in worker threads */
+#define MAX_POOLED_CONNECTIONS 4
+
+/* Buffer size for reading attachments while hashing and copying them */
+#define ATTACH_COPY_BUFFER_SIZE (64 * 1024)
+/* Directory entries looked at per idle callback while sweeping the
+ * attachment store for orphaned files */
+#define ATTACH_GC_ENTRIES_PER_TICK 32
+/* Legacy attachment files moved into the store per idle callback */
+#define ATTACH_MIGRATE_FILES_PER_TICK 8
+/* Seconds a file in the store is left alone after it was last linked or
+ * renamed, so that the sweep doesn't take one whose writer hasn't
+ * inserted the attachment yet. Can be overridden with
+ * $RTCOM_EL_ATTACH_GC_AGE. */
+#define ATTACH_GC_MIN_AGE      (60 * 60)
 
 #define DBUS_PATH              "/rtcomeventlogger/signal"
 #define DBUS_INTERFACE         "rtcomeventlogger.signal"
@@ -56,6 +77,21 @@
  * "somewhere between 1 and 3". */
 #define MAX_SQLITE_BUSY_LOOP_TIME 2
 
+/* Number of ids put in a single "WHERE id IN (...)" list when updating
+ * events in bulk, keeps the statement size bounded. */
+#define SET_READ_BATCH_SIZE 500
+
+/* Joins the where clause of an RTComElQuery may refer to; used when
+ * running set-based operations on the events matching a query. */
+#define EVENTS_JOIN_SQL \
+    "Events " \
+    "JOIN Services ON Events.service_id = Services.id " \
+    "JOIN EventTypes ON Events.event_type_id = EventTypes.id " \
+    "LEFT JOIN Remotes ON Events.remote_uid = Remotes.remote_uid " \
+        "AND Events.local_uid = Remotes.local_uid " \
+    "LEFT JOIN Headers ON Headers.event_id = Events.id AND " \
+        "Headers.name = 'message-token'"
+
 #define RTCOM_EL_GET_PRIV(el) ((RTComElPrivate *) \
   rtcom_el_get_instance_private(RTCOM_EL(el)))
 
@@ -72,60 +108,121 @@ enum
     EVENT_DELETED,
     ALL_DELETED,
     REFRESH_HINT,
+    ATTACHMENTS_COLLECTED,
     LAST_SIGNAL
 };
 
 static guint signals[LAST_SIGNAL] = {0};
 
 typedef struct _RTComElPrivate RTComElPrivate;
+typedef struct _AttachGc AttachGc;
+
+/* Name to id maps of the lookup tables. Services, event types and flags
+ * only come from the plugins, which are loaded when the database is
+ * opened, so the maps are filled in then and never changed afterwards;
+ * they can be read without locking. */
+typedef struct {
+    GHashTable * services;
+    GHashTable * event_types;
+    GHashTable * flags;
+} ElLookup;
+
+/* What each thread other than the one that opened the database has of
+ * its own, for each RTComEl it uses */
+typedef struct {
+    /* NULL once the RTComEl is gone */
+    RTComElPrivate * priv;
+    sqlite3 * db;
+    gchar * last_group_uid;
+} ElThreadState;
+
 struct _RTComElPrivate {
+    /* Connection of the thread that opened the database */
     sqlite3 * db;
+    GThread * owner;
+
+    /* Set once the database is open and the plugins are loaded */
+    gint ready;
+    GMutex open_lock;
+
+    /* ElThreadState of the other threads, under thread_states_lock */
+    GSList * thread_states;
 
     /* GHashTable of (guint, RTComElPlugin*) */
     GHashTable * plugins;
 
-    GHashTable * services;
-    GHashTable * event_types;
-    GHashTable * flags;
+    /* Set once the plugins are loaded, see ElLookup */
+    ElLookup * lookup;
 
     DBusConnection   * dbus;
 
     gchar * last_group_uid;
+
+    /* Attachment store sweep in progress, if any */
+    AttachGc * attach_gc;
+    guint attach_gc_source;
+
+    /* Migration of attachments from the old layout, if running */
+    guint attach_migrate_source;
+
+    /* Idle connections for queries run in worker threads, sqlite3 * */
+    GMutex read_pool_lock;
+    GQueue read_pool;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(RTComEl, rtcom_el, G_TYPE_OBJECT);
 
+static void _thread_states_free(
+        GSList * states);
+
+/* Guards the ElThreadState lists of the RTComEls, and clearing the priv
+ * fields */
+static GMutex thread_states_lock;
+/* GSList of the calling thread's ElThreadState */
+static GPrivate thread_states =
+    G_PRIVATE_INIT((GDestroyNotify) _thread_states_free);
+
+#define EL_DB(priv) _el_db(priv)
+
 /**************************************/
 /* Private functions prototypes begin */
 /**************************************/
 
 static const gchar *el_get_home_dir (void);
 
-static void _build_db_representation(
-        sqlite3 ** db,
-        GHashTable ** services,
-        GHashTable ** event_types,
-        GHashTable ** flags);
+static ElLookup * _lookup_new(
+        sqlite3 * db);
 
-static void _free_db_representation(
-        GHashTable ** services,
-        GHashTable ** event_types,
-        GHashTable ** flags);
+static void _lookup_free(
+        ElLookup * lookup);
 
-static void _load_plugins(
+static sqlite3 * _el_db(
+        RTComElPrivate * priv);
+
+static ElThreadState * _el_thread_state(
+        RTComElPrivate * priv);
+
+static gchar ** _el_last_group_uid(
         RTComElPrivate * priv);
 
+static void _load_plugins(
+        RTComElPrivate * priv,
+        ElLookup * lookup);
+
 static gboolean _scan_plugins_dir(
         const gchar * dir,
-        RTComElPrivate * priv);
+        RTComElPrivate * priv,
+        ElLookup * lookup);
 
 static gboolean _load_plugin(
         const gchar * filename,
-        RTComElPrivate * priv);
+        RTComElPrivate * priv,
+        ElLookup * lookup);
 
 static gint _init_plugin(
         RTComElPlugin * plugin,
-        RTComElPrivate * priv);
+        RTComElPrivate * priv,
+        ElLookup * lookup);
 
 static void _unload_plugins(
         GHashTable ** plugins);
@@ -135,8 +232,34 @@ static void _unload_plugin(
         gpointer value,
         gpointer user_data);
 
-static gchar * _build_unique_dirname(
-        const gchar * parent);
+static gchar * _store_attachment_file(
+        const gchar * path,
+        RTComElAttachFlags flags,
+        GError ** error);
+
+static void _remove_attachment_dirs(
+        const gchar * dir);
+
+static void _remove_attachment_file(
+        const gchar * dest_path);
+
+static void _release_attachment_file(
+        RTComEl * el,
+        const gchar * dest_path);
+
+static void _purge_attachment_files(
+        RTComEl * el);
+
+static gboolean _attachment_files_exist(
+        gchar ** paths,
+        guint n_paths,
+        GError ** error);
+
+static gboolean _migrate_attachments_idle(
+        gpointer data);
+
+static void _attach_gc_free(
+        AttachGc * gc);
 
 static void _emit_dbus(
         RTComEl * el,
@@ -183,29 +306,21 @@ static void rtcom_el_get_property(
     switch(prop_id)
     {
         case RTCOM_EL_PROP_DB:
-            g_value_set_pointer(value, priv->db);
+            g_value_set_pointer(value, EL_DB(priv));
             break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(obj, prop_id, pspec);
     }
 }
 
-/* Take care of initialising the database, potentially trying it
- * later (when needed) if it couldn't be done while creating
- * the eventlogger. This is to try and recover from the disk
- * full conditions.
- */
-static gboolean _ensure_db(RTComEl *el, gboolean reopen)
+/* Opens the database and loads the plugins, with open_lock held */
+static gboolean _open_db(RTComEl *el, gboolean reopen)
 {
     gchar *fn, *old_fn;
+    ElLookup *lookup;
 
     RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
 
-    g_assert (priv != NULL);
-
-    if (priv->db != NULL)
-        return TRUE;
-
     g_debug ("%s: called", G_STRFUNC);
 
     fn = g_build_filename (el_get_home_dir (), CONFIG_DIR, NULL);
@@ -247,13 +362,20 @@ static gboolean _ensure_db(RTComEl *el, gboolean reopen)
     if (priv->db == NULL)
         return FALSE;
 
-    _build_db_representation(
-            &(priv->db),
-            &(priv->services),
-            &(priv->event_types),
-            &(priv->flags));
+    priv->owner = g_thread_self ();
+
+    lookup = _lookup_new (priv->db);
+
+    /* Legacy attachments are moved into the store a few at a time,
+     * rather than stalling the opening on them */
+    if (priv->attach_migrate_source == 0)
+        priv->attach_migrate_source = g_idle_add_full(G_PRIORITY_LOW,
+                _migrate_attachments_idle, el, NULL);
+
+    _load_plugins(priv, lookup);
 
-    _load_plugins(priv);
+    /* Complete before anyone can see it */
+    g_atomic_pointer_set (&priv->lookup, lookup);
 
     if (reopen)
     {
@@ -263,6 +385,138 @@ static gboolean _ensure_db(RTComEl *el, gboolean reopen)
     return TRUE;
 }
 
+/* Take care of initialising the database, potentially trying it
+ * later (when needed) if it couldn't be done while creating
+ * the eventlogger. This is to try and recover from the disk
+ * full conditions. Also makes sure the calling thread has its
+ * connection.
+ */
+static gboolean _ensure_db(RTComEl *el, gboolean reopen)
+{
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+
+    g_assert (priv != NULL);
+
+    if (!g_atomic_int_get (&priv->ready))
+    {
+        gboolean opened;
+
+        g_mutex_lock (&priv->open_lock);
+        opened = priv->ready || _open_db (el, reopen);
+        if (opened)
+            g_atomic_int_set (&priv->ready, TRUE);
+        g_mutex_unlock (&priv->open_lock);
+
+        if (!opened)
+            return FALSE;
+    }
+
+    return _el_db (priv) != NULL;
+}
+
+/* Connection the calling thread should use */
+static sqlite3 *
+_el_db (RTComElPrivate * priv)
+{
+    ElThreadState * ts;
+
+    if (priv->owner == g_thread_self ())
+        return priv->db;
+
+    ts = _el_thread_state (priv);
+    return ts != NULL ? ts->db : NULL;
+}
+
+/* State of the calling thread for priv, opening a connection for it
+ * the first time around */
+static ElThreadState *
+_el_thread_state (RTComElPrivate * priv)
+{
+    GSList * states, * l;
+    ElThreadState * ts = NULL;
+    gchar * fn;
+    sqlite3 * db;
+
+    states = g_private_get (&thread_states);
+
+    /* No lock needed to look: only this thread changes its list, and a
+     * state's priv is only cleared while its RTComEl is being finalized,
+     * when nobody may be using it anymore. */
+    for (l = states; l != NULL; l = l->next)
+    {
+        if (g_atomic_pointer_get (&((ElThreadState *) l->data)->priv) ==
+            priv)
+        {
+            ts = l->data;
+            break;
+        }
+    }
+
+    if (ts != NULL)
+        return ts;
+
+    /* The schema is in place by now, this is quick */
+    fn = g_build_filename (el_get_home_dir (), CONFIG_DIR, SQLITE_DATABASE,
+        NULL);
+    db = rtcom_el_db_open (fn);
+    g_free (fn);
+
+    if (db == NULL)
+        return NULL;
+
+    ts = g_slice_new0 (ElThreadState);
+    ts->priv = priv;
+    ts->db = db;
+
+    g_mutex_lock (&thread_states_lock);
+    priv->thread_states = g_slist_prepend (priv->thread_states, ts);
+    g_mutex_unlock (&thread_states_lock);
+
+    g_private_set (&thread_states, g_slist_prepend (states, ts));
+
+    return ts;
+}
+
+/* Called when a thread exits */
+static void
+_thread_states_free (GSList * states)
+{
+    GSList * l;
+
+    g_mutex_lock (&thread_states_lock);
+    for (l = states; l != NULL; l = l->next)
+    {
+        ElThreadState * ts = l->data;
+
+        if (ts->priv != NULL)
+        {
+            ts->priv->thread_states = g_slist_remove (
+                    ts->priv->thread_states, ts);
+            rtcom_el_db_close (ts->db);
+        }
+
+        g_free (ts->last_group_uid);
+        g_slice_free (ElThreadState, ts);
+    }
+    g_mutex_unlock (&thread_states_lock);
+
+    g_slist_free (states);
+}
+
+/* Group UID of the last event added by the calling thread, or NULL if
+ * the thread has no connection */
+static gchar **
+_el_last_group_uid (RTComElPrivate * priv)
+{
+    ElThreadState * ts;
+
+    if (priv->owner == g_thread_self ())
+        return &priv->last_group_uid;
+
+    ts = _el_thread_state (priv);
+    return ts != NULL ? &ts->last_group_uid : NULL;
+}
+
 static void rtcom_el_init(
         RTComEl * el)
 {
@@ -273,13 +527,22 @@ static void rtcom_el_init(
     g_debug("%s: called", G_STRFUNC);
 
     priv = RTCOM_EL_GET_PRIV(el);
-    priv->services = NULL;
-    priv->event_types = NULL;
-    priv->flags = NULL;
+    priv->lookup = NULL;
     priv->db = NULL;
+    priv->owner = NULL;
+    priv->ready = FALSE;
+    priv->thread_states = NULL;
+    g_mutex_init(&priv->open_lock);
 
     priv->last_group_uid = NULL;
 
+    priv->attach_gc = NULL;
+    priv->attach_gc_source = 0;
+    priv->attach_migrate_source = 0;
+
+    g_mutex_init(&priv->read_pool_lock);
+    g_queue_init(&priv->read_pool);
+
     priv->plugins = g_hash_table_new(NULL, NULL);
 
     dbus_error_init(&err);
@@ -316,6 +579,24 @@ rtcom_el_dispose (GObject *object)
 
     g_debug ("%s: called", G_STRFUNC);
 
+    if (priv->attach_gc_source != 0)
+    {
+        g_source_remove(priv->attach_gc_source);
+        priv->attach_gc_source = 0;
+    }
+
+    if (priv->attach_gc != NULL)
+    {
+        _attach_gc_free(priv->attach_gc);
+        priv->attach_gc = NULL;
+    }
+
+    if (priv->attach_migrate_source != 0)
+    {
+        g_source_remove(priv->attach_migrate_source);
+        priv->attach_migrate_source = 0;
+    }
+
     if (priv->dbus != NULL)
     {
         dbus_bus_remove_match(priv->dbus, DBUS_MATCH, NULL);
@@ -343,13 +624,32 @@ static void rtcom_el_finalize(
 
     _unload_plugins(&(priv->plugins));
 
-    _free_db_representation(
-            &(priv->services),
-            &(priv->event_types),
-            &(priv->flags));
+    if (priv->lookup != NULL)
+        _lookup_free(priv->lookup);
+
+    /* Other threads' states go with the threads, only the connections
+     * are closed here. */
+    g_mutex_lock(&thread_states_lock);
+    while (priv->thread_states != NULL)
+    {
+        ElThreadState * ts = priv->thread_states->data;
+
+        rtcom_el_db_close (ts->db);
+        ts->db = NULL;
+        g_atomic_pointer_set (&ts->priv, NULL);
+        priv->thread_states = g_slist_delete_link(priv->thread_states,
+                priv->thread_states);
+    }
+    g_mutex_unlock(&thread_states_lock);
 
-    rtcom_el_db_close (priv->db);
+    if (priv->db != NULL)
+        rtcom_el_db_close (priv->db);
     priv->db = NULL;
+    g_mutex_clear(&priv->open_lock);
+
+    while (!g_queue_is_empty(&priv->read_pool))
+        rtcom_el_db_close (g_queue_pop_head(&priv->read_pool));
+    g_mutex_clear(&priv->read_pool_lock);
 
     G_OBJECT_CLASS(rtcom_el_parent_class)->finalize(object);
 }
@@ -359,6 +659,9 @@ static void rtcom_el_class_init(
 {
     GObjectClass* object_class = G_OBJECT_CLASS (klass);
 
+    /* The D-Bus connection is shared by all threads using RTComEl */
+    dbus_threads_init_default();
+
     object_class->finalize = rtcom_el_finalize;
     object_class->dispose = rtcom_el_dispose;
     object_class->get_property = rtcom_el_get_property;
@@ -445,6 +748,18 @@ static void rtcom_el_class_init(
             g_cclosure_marshal_VOID__VOID,
             G_TYPE_NONE,
             0);
+
+    signals[ATTACHMENTS_COLLECTED] = g_signal_new(
+            "attachments-collected",
+            G_TYPE_FROM_CLASS(object_class),
+            G_SIGNAL_RUN_FIRST,
+            0,
+            NULL,
+            NULL,
+            g_cclosure_marshal_generic,
+            G_TYPE_NONE,
+            1,
+            G_TYPE_UINT64);
 }
 
 /******************************************/
@@ -457,17 +772,20 @@ RTComEl * rtcom_el_new()
 
 RTComEl * rtcom_el_get_shared ()
 {
-    static gpointer el = NULL;
-
+    static GMutex lock;
+    static GWeakRef shared;
+    RTComEl * el;
+
+    /* The weak reference is cleared atomically with the last unref, so
+     * either we get a reference or a new instance is needed. */
+    g_mutex_lock (&lock);
+    el = g_weak_ref_get (&shared);
     if (G_UNLIKELY (NULL == el))
     {
         el = rtcom_el_new ();
-        g_object_add_weak_pointer (G_OBJECT (el), &el);
-    }
-    else
-    {
-        g_object_ref (G_OBJECT (el));
+        g_weak_ref_set (&shared, el);
     }
+    g_mutex_unlock (&lock);
 
     return el;
 }
@@ -502,31 +820,33 @@ rtcom_el_update_remote_contacts(RTComEl *el, GList *contacts, GError **error)
         return FALSE;
     }
 
-    if (!rtcom_el_db_transaction (priv->db, FALSE, error))
+    if (!rtcom_el_db_transaction (EL_DB(priv), FALSE, error))
     {
         return FALSE;
     }
 
+    /* ContactCache is keyed by the uids, so grouping by contact picks
+     * the new abook_uid up without it being touched */
     while (contacts != NULL)
     {
         RTComElRemote *c = contacts->data;
 
-        if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, error,
+        if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, error,
             "UPDATE Remotes SET abook_uid = %Q, remote_name = %Q "
               "WHERE remote_uid = %Q AND local_uid = %Q;",
             c->abook_uid, c->remote_name,
             c->remote_uid, c->local_uid))
         {
-            rtcom_el_db_rollback (priv->db, NULL);
+            rtcom_el_db_rollback (EL_DB(priv), NULL);
             return FALSE;
         }
 
         contacts = contacts->next;
     }
 
-    if (!rtcom_el_db_commit (priv->db, error))
+    if (!rtcom_el_db_commit (EL_DB(priv), error))
     {
-        rtcom_el_db_rollback (priv->db, NULL);
+        rtcom_el_db_rollback (EL_DB(priv), NULL);
         return FALSE;
     }
 
@@ -574,7 +894,7 @@ rtcom_el_remove_abook_uids (RTComEl *el, GList *abook_uids, GError **error)
         return FALSE;
     }
 
-    if (!rtcom_el_db_transaction (priv->db, FALSE, error))
+    if (!rtcom_el_db_transaction (EL_DB(priv), FALSE, error))
     {
         return FALSE;
     }
@@ -583,20 +903,20 @@ rtcom_el_remove_abook_uids (RTComEl *el, GList *abook_uids, GError **error)
     {
         const gchar *uid = abook_uids->data;
 
-        if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, error,
+        if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, error,
             "UPDATE Remotes SET abook_uid = NULL WHERE abook_uid = %Q;",
             uid))
         {
-            rtcom_el_db_rollback (priv->db, NULL);
+            rtcom_el_db_rollback (EL_DB(priv), NULL);
             return FALSE;
         }
 
         abook_uids = abook_uids->next;
     }
 
-    if (!rtcom_el_db_commit (priv->db, error))
+    if (!rtcom_el_db_commit (EL_DB(priv), error))
     {
-        rtcom_el_db_rollback (priv->db, NULL);
+        rtcom_el_db_rollback (EL_DB(priv), NULL);
         return FALSE;
     }
 
@@ -761,7 +1081,7 @@ _add_event_precheck(
         return FALSE;
     }
 
-    if(G_UNLIKELY(!priv->db))
+    if(G_UNLIKELY(!EL_DB(priv)))
     {
         g_warning("Database not initialized.");
         g_set_error(
@@ -784,17 +1104,29 @@ _add_event_core(
         GError ** error)
 {
     RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+    gchar ** last_group_uid = _el_last_group_uid(priv);
     gint event_id = -1;
     gint remote_uid_exists = 0;
     gchar *existing_abook_uid = NULL;
     gchar *existing_remote_name = NULL;
 
+    if (G_UNLIKELY (last_group_uid == NULL))
+    {
+        g_warning("Database not initialized.");
+        g_set_error(
+                error,
+                RTCOM_EL_ERROR,
+                RTCOM_EL_INTERNAL_ERROR,
+                "Database not initialized.");
+        return -1;
+    }
+
     /* Note: if group_uid field is not set, it's copied
-     * from the previous event. */
+     * from the previous event added by this thread. */
     if(RTCOM_EL_EVENT_IS_SET(ev, group_uid))
     {
-        g_free(priv->last_group_uid);
-        priv->last_group_uid = g_strdup(
+        g_free(*last_group_uid);
+        *last_group_uid = g_strdup(
                 RTCOM_EL_EVENT_GET_FIELD(ev, group_uid));
     }
 
@@ -802,7 +1134,7 @@ _add_event_core(
       {
         struct remotes_ctx ctx = { FALSE, NULL, NULL };
 
-        if (!rtcom_el_db_exec_printf (priv->db, _fetch_remote_data, &ctx,
+        if (!rtcom_el_db_exec_printf (EL_DB(priv), _fetch_remote_data, &ctx,
               NULL, "SELECT abook_uid, remote_name FROM Remotes WHERE "
               "remote_uid = %Q AND local_uid = %Q;",
             RTCOM_EL_EVENT_GET_FIELD(ev, remote_uid),
@@ -817,7 +1149,7 @@ _add_event_core(
         }
       }
 
-    if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, NULL,
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, NULL,
         "INSERT INTO Events ("
         "service_id, event_type_id, "
         "storage_time, start_time, end_time, is_read, outgoing, "
@@ -841,19 +1173,19 @@ _add_event_core(
         RTCOM_EL_EVENT_IS_SET(ev, remote_uid) ? RTCOM_EL_EVENT_GET_FIELD(ev, remote_uid) : NULL,
         RTCOM_EL_EVENT_IS_SET(ev, channel) ? RTCOM_EL_EVENT_GET_FIELD(ev, channel) : NULL,
         RTCOM_EL_EVENT_IS_SET(ev, free_text) ? RTCOM_EL_EVENT_GET_FIELD(ev, free_text) : NULL,
-        RTCOM_EL_EVENT_IS_SET(ev, group_uid) ? RTCOM_EL_EVENT_GET_FIELD(ev, group_uid) : priv->last_group_uid))
+        RTCOM_EL_EVENT_IS_SET(ev, group_uid) ? RTCOM_EL_EVENT_GET_FIELD(ev, group_uid) : *last_group_uid))
     {
         goto db_error;
     }
 
-    event_id = sqlite3_last_insert_rowid(priv->db);
+    event_id = sqlite3_last_insert_rowid(EL_DB(priv));
 
     if (RTCOM_EL_EVENT_IS_SET(ev, remote_uid))
       {
         /* If there's no entry for this remote_uid yet, create it. */
         if (!remote_uid_exists)
           {
-            if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, NULL,
+            if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, NULL,
                 "INSERT INTO Remotes (local_uid, remote_uid, remote_name, abook_uid) "
                 "VALUES (%Q, %Q, %Q, %Q);",
                 RTCOM_EL_EVENT_GET_FIELD(ev, local_uid),
@@ -879,7 +1211,7 @@ _add_event_core(
                     RTCOM_EL_EVENT_GET_FIELD(ev, remote_name) : NULL;
 
             if (g_strcmp0(new_abook_uid, existing_abook_uid))
-                if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, NULL,
+                if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, NULL,
                     "UPDATE Remotes SET abook_uid = %Q WHERE "
                         "remote_uid = %Q AND local_uid = %Q;",
                     new_abook_uid, RTCOM_EL_EVENT_GET_FIELD(ev,
@@ -887,7 +1219,7 @@ _add_event_core(
                           goto db_error;
 
             if (g_strcmp0(new_remote_name, existing_remote_name))
-                if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, NULL,
+                if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, NULL,
                     "UPDATE Remotes SET remote_name = %Q WHERE "
                         "remote_uid = %Q AND local_uid = %Q;",
                     new_remote_name, RTCOM_EL_EVENT_GET_FIELD(ev,
@@ -901,11 +1233,11 @@ _add_event_core(
     return event_id;
 
 db_error:
-    if ((sqlite3_errcode (priv->db) == SQLITE_FULL) ||
-      (sqlite3_errcode (priv->db) == SQLITE_IOERR))
+    if ((sqlite3_errcode (EL_DB(priv)) == SQLITE_FULL) ||
+      (sqlite3_errcode (EL_DB(priv)) == SQLITE_IOERR))
         g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_DATABASE_FULL,
             "Can't insert event, database is full.");
-    else if (sqlite3_errcode (priv->db) == SQLITE_BUSY)
+    else if (sqlite3_errcode (EL_DB(priv)) == SQLITE_BUSY)
         g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_TEMPORARY_ERROR,
             "Can't insert event, database is locked.");
     else
@@ -929,7 +1261,7 @@ gint rtcom_el_add_event(
     if (!_add_event_precheck (el, ev, error, &service_id, &eventtype_id))
         return -1;
 
-    if (!rtcom_el_db_transaction (priv->db, TRUE, error))
+    if (!rtcom_el_db_transaction (EL_DB(priv), TRUE, error))
     {
         return -1;
     }
@@ -937,13 +1269,13 @@ gint rtcom_el_add_event(
     event_id = _add_event_core (el, ev, service_id, eventtype_id, error);
     if (event_id == -1)
     {
-        rtcom_el_db_rollback (priv->db, NULL);
+        rtcom_el_db_rollback (EL_DB(priv), NULL);
         return -1;
     }
 
-    if (!rtcom_el_db_commit (priv->db, error))
+    if (!rtcom_el_db_commit (EL_DB(priv), error))
     {
-        rtcom_el_db_rollback (priv->db, NULL);
+        rtcom_el_db_rollback (EL_DB(priv), NULL);
         return -1;
     }
 
@@ -954,66 +1286,248 @@ gint rtcom_el_add_event(
     return event_id;
 }
 
+/* Prepares sql, reporting errors the same way rtcom_el_db_exec does */
+static sqlite3_stmt *
+_prepare_stmt (
+        sqlite3 * db,
+        const gchar * sql,
+        GError ** error)
+{
+    sqlite3_stmt * stmt = NULL;
+
+    if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        g_warning ("%s: can't compile SQL statement \"%s\": %s", G_STRFUNC,
+            sql, sqlite3_errmsg (db));
+        g_set_error (error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+            "Can't compile SQL statement: %s", sqlite3_errmsg (db));
+        return NULL;
+    }
+
+    return stmt;
+}
+
+/* Inserts all the headers with a single prepared statement */
+static gboolean
+_add_headers_batch (
+        sqlite3 * db,
+        gint event_id,
+        GHashTable * headers,
+        GError ** error)
+{
+    GHashTableIter iter;
+    sqlite3_stmt * stmt;
+    gpointer hk, hv;
+    gboolean ret = TRUE;
+
+    if (headers == NULL || g_hash_table_size (headers) == 0)
+        return TRUE;
+
+    stmt = _prepare_stmt (db,
+        "INSERT INTO Headers (event_id, name, value) VALUES (?, ?, ?);",
+        error);
+    if (!stmt)
+        return FALSE;
+
+    g_hash_table_iter_init (&iter, headers);
+    while (ret && g_hash_table_iter_next (&iter, &hk, &hv))
+    {
+        sqlite3_bind_int (stmt, 1, event_id);
+        sqlite3_bind_text (stmt, 2, hk, -1, SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 3, hv, -1, SQLITE_STATIC);
+
+        if (rtcom_el_db_iterate (db, stmt, error) != SQLITE_DONE)
+            ret = FALSE;
+
+        sqlite3_reset (stmt);
+    }
+
+    sqlite3_finalize (stmt);
+    return ret;
+}
+
+/* Inserts rows for the already stored attachment files, paths being
+ * in the same order as the attachments list. */
+static gboolean
+_add_attachments_batch (
+        sqlite3 * db,
+        gint event_id,
+        GList * attachments,
+        GPtrArray * paths,
+        GError ** error)
+{
+    GList *li;
+    sqlite3_stmt * stmt;
+    guint i = 0;
+    gboolean ret = TRUE;
+
+    if (attachments == NULL)
+        return TRUE;
+
+    stmt = _prepare_stmt (db,
+        "INSERT INTO Attachments (event_id, path, desc) VALUES (?, ?, ?);",
+        error);
+    if (!stmt)
+        return FALSE;
+
+    for (li = attachments; ret && li != NULL; li = g_list_next (li), i++)
+    {
+        RTComElAttachment *att = li->data;
+
+        sqlite3_bind_int (stmt, 1, event_id);
+        sqlite3_bind_text (stmt, 2, g_ptr_array_index (paths, i), -1,
+            SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 3, att->desc, -1, SQLITE_STATIC);
+
+        if (rtcom_el_db_iterate (db, stmt, error) != SQLITE_DONE)
+            ret = FALSE;
+
+        sqlite3_reset (stmt);
+    }
+
+    sqlite3_finalize (stmt);
+    return ret;
+}
+
 gint rtcom_el_add_event_full(
         RTComEl * el,
         RTComElEvent * ev,
         GHashTable *headers,
         GList *attachments,
         GError ** error)
+{
+    return rtcom_el_add_event_full_with_flags(el, ev, headers, attachments,
+            RTCOM_EL_ADD_DEFAULT, error);
+}
+
+gint rtcom_el_add_event_full_with_flags(
+        RTComEl * el,
+        RTComElEvent * ev,
+        GHashTable *headers,
+        GList *attachments,
+        RTComElAddFlags flags,
+        GError ** error)
 {
     GList *li;
     GHashTableIter iter;
     RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+    GPtrArray * paths = NULL;
     gint event_id, service_id, eventtype_id;
+    const gchar *token = NULL;
     gpointer hk, hv;
+    guint i;
 
     if (!_add_event_precheck (el, ev, error, &service_id, &eventtype_id))
         return -1;
 
-    if (!rtcom_el_db_transaction (priv->db, TRUE, error))
-    {
-        return -1;
-    }
-
-    event_id = _add_event_core (el, ev, service_id, eventtype_id, error);
-    if (event_id == -1)
+    if (headers != NULL)
     {
-        rtcom_el_db_rollback (priv->db, NULL);
-        return -1;
+        g_hash_table_iter_init (&iter, headers);
+        while (g_hash_table_iter_next (&iter, &hk, &hv))
+        {
+            if (hk == NULL || hv == NULL)
+            {
+                g_set_error(
+                        error,
+                        RTCOM_EL_ERROR,
+                        RTCOM_EL_INVALID_ARGUMENT_ERROR,
+                        "Invalid header.");
+                return -1;
+            }
+        }
     }
 
+    /* Store the attachment files before locking the database, so that the
+     * exclusive lock isn't held while we're doing file I/O. */
+    paths = g_ptr_array_sized_new (g_list_length (attachments));
     for (li = attachments; li != NULL; li = g_list_next (li))
     {
         RTComElAttachment *att = li->data;
-        if (-1 == rtcom_el_add_attachment (el, event_id, att->path,
-            att->desc, error))
+        gchar *dest_path;
+
+        if (att->path == NULL)
         {
-            rtcom_el_db_rollback (priv->db, NULL);
-            return -1;
+            g_set_error(
+                    error,
+                    RTCOM_EL_ERROR,
+                    RTCOM_EL_INVALID_ARGUMENT_ERROR,
+                    "Invalid path.");
+            goto add_event_full_error;
         }
+
+        dest_path = _store_attachment_file (att->path, 0, error);
+        if (dest_path == NULL)
+            goto add_event_full_error;
+
+        g_ptr_array_add (paths, dest_path);
     }
 
-    g_hash_table_iter_init (&iter, headers);
-    while (g_hash_table_iter_next (&iter, &hk, &hv))
+    if (!rtcom_el_db_transaction (EL_DB(priv), TRUE, error))
+        goto add_event_full_error;
+
+    if (flags & RTCOM_EL_ADD_UNIQUE_TOKEN && headers != NULL)
+        token = g_hash_table_lookup (headers, "message-token");
+
+    if (token != NULL)
     {
-        if (-1 == rtcom_el_add_header (el, event_id, hk, hv, error))
+        event_id = 0;
+        if (!rtcom_el_db_exec_printf (EL_DB(priv), rtcom_el_db_single_int,
+                &event_id, error, "SELECT event_id FROM MessageTokens "
+                "WHERE service_id = %d AND token = %Q;", service_id, token))
+            goto add_event_full_rollback;
+
+        /* A redelivery: drop it, along with the files stored for it */
+        if (event_id > 0)
         {
-            rtcom_el_db_rollback (priv->db, NULL);
-            return -1;
+            rtcom_el_db_rollback (EL_DB(priv), NULL);
+            for (i = 0; i < paths->len; i++)
+            {
+                _release_attachment_file (el, g_ptr_array_index (paths, i));
+                g_free (g_ptr_array_index (paths, i));
+            }
+            g_ptr_array_free (paths, TRUE);
+            return event_id;
         }
     }
 
-    if (!rtcom_el_db_commit (priv->db, error))
-    {
-        rtcom_el_db_rollback (priv->db, NULL);
-        return -1;
-    }
+    event_id = _add_event_core (el, ev, service_id, eventtype_id, error);
+    if (event_id == -1)
+        goto add_event_full_rollback;
+
+    if (!_add_attachments_batch (EL_DB(priv), event_id, attachments, paths,
+            error))
+        goto add_event_full_rollback;
+
+    if (!_attachment_files_exist ((gchar **) paths->pdata, paths->len,
+            error))
+        goto add_event_full_rollback;
+
+    if (!_add_headers_batch (EL_DB(priv), event_id, headers, error))
+        goto add_event_full_rollback;
+
+    if (!rtcom_el_db_commit (EL_DB(priv), error))
+        goto add_event_full_rollback;
+
+    for (i = 0; i < paths->len; i++)
+        g_free (g_ptr_array_index (paths, i));
+    g_ptr_array_free (paths, TRUE);
 
     /* Emit dbus signal */
     if(event_id > 0)
         _emit_dbus(el, "NewEvent", event_id, RTCOM_EL_EVENT_GET_FIELD(ev, service));
 
     return event_id;
+
+add_event_full_rollback:
+    rtcom_el_db_rollback (EL_DB(priv), NULL);
+add_event_full_error:
+    for (i = 0; i < paths->len; i++)
+    {
+        _release_attachment_file (el, g_ptr_array_index (paths, i));
+        g_free (g_ptr_array_index (paths, i));
+    }
+    g_ptr_array_free (paths, TRUE);
+    return -1;
 }
 
 
@@ -1026,7 +1540,10 @@ const gchar * rtcom_el_get_last_group_uid(
 
     priv = RTCOM_EL_GET_PRIV(el);
 
-    return priv->last_group_uid;
+    if (!_ensure_db (el, TRUE))
+        return NULL;
+
+    return *_el_last_group_uid(priv);
 }
 
 gint rtcom_el_add_header(
@@ -1089,196 +1606,1107 @@ gint rtcom_el_add_header(
         return -1;
     }
 
-    if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, error,
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, error,
         "INSERT INTO Headers (event_id, name, value) VALUES (%d, %Q, %Q);",
         event_id, header, value))
     {
         return -1;
     }
 
-    header_id = sqlite3_last_insert_rowid(priv->db);
+    header_id = sqlite3_last_insert_rowid(EL_DB(priv));
 
     return header_id;
 }
 
-gint rtcom_el_add_attachment(
-        RTComEl * el,
-        gint event_id,
-        const gchar * path,
-        const gchar * desc,
-        GError ** error)
+/* Computes the hex SHA-256 digest of the file contents, reading it in
+ * chunks. Leaves the file offset at the end of the file. */
+static gchar *
+_hash_file (gint fd)
 {
-    gint attachment_id = -1;
-    RTComElPrivate * priv = NULL;
-    gchar * dir = NULL;
-    gchar * unique_dir = NULL;
-    FILE * src = NULL;
-    FILE * dest = NULL;
-    gchar * dest_filename = NULL;
-    gchar * dest_path = NULL;
-    gchar copy_buffer[1024] = {0};
-    gint nread = 0, nwritten = 0;
+    GChecksum * checksum;
+    guchar * buffer;
+    gssize n;
+    gchar * hash = NULL;
 
-    g_return_val_if_fail(RTCOM_IS_EL(el), -1);
-    priv = RTCOM_EL_GET_PRIV(el);
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    buffer = g_malloc(ATTACH_COPY_BUFFER_SIZE);
 
-    if (!_ensure_db (el, TRUE))
+    while ((n = read(fd, buffer, ATTACH_COPY_BUFFER_SIZE)) != 0)
     {
-        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
-            "Database isn't opened.");
-        return -1;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            goto hash_done;
+        }
+        g_checksum_update(checksum, buffer, n);
     }
 
-    if(event_id < 0)
+    hash = g_strdup(g_checksum_get_string(checksum));
+
+hash_done:
+    g_free(buffer);
+    g_checksum_free(checksum);
+    return hash;
+}
+
+/* Copies src_fd to dest_fd, hashing the contents on the way, and returns
+ * the hex SHA-256 digest of them. A reflink shares the data blocks
+ * (copy-on-write), so that only the hashing has to read them; otherwise
+ * the contents are read once, for both. */
+static gchar *
+_copy_and_hash_file (
+        gint src_fd,
+        gint dest_fd)
+{
+    GChecksum * checksum;
+    guchar * buffer;
+    gssize n;
+    gchar * hash = NULL;
+
+#ifdef FICLONE
+    if (ioctl(dest_fd, FICLONE, src_fd) == 0)
+        return _hash_file(src_fd);
+#endif
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    buffer = g_malloc(ATTACH_COPY_BUFFER_SIZE);
+
+    while ((n = read(src_fd, buffer, ATTACH_COPY_BUFFER_SIZE)) != 0)
+    {
+        guchar * p = buffer;
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            goto copy_done;
+        }
+
+        g_checksum_update(checksum, buffer, n);
+
+        while (n > 0)
+        {
+            gssize written = write(dest_fd, p, n);
+
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                goto copy_done;
+            }
+            p += written;
+            n -= written;
+        }
+    }
+
+    hash = g_strdup(g_checksum_get_string(checksum));
+
+copy_done:
+    g_free(buffer);
+    g_checksum_free(checksum);
+    return hash;
+}
+
+/* Hard links another name of the same content, if the store has one, to
+ * dest_path. */
+static gboolean
+_link_same_content (
+        const gchar * dir,
+        const gchar * dest_path)
+{
+    GDir * d;
+    const gchar * name;
+    gboolean ret = FALSE;
+
+    d = g_dir_open(dir, 0, NULL);
+    if (d == NULL)
+        return FALSE;
+
+    while (!ret && (name = g_dir_read_name(d)) != NULL)
+    {
+        gchar * existing;
+
+        /* Skip files still being written */
+        if (name[0] == '.')
+            continue;
+
+        existing = g_build_filename(dir, name, NULL);
+        ret = (link(existing, dest_path) == 0);
+        g_free(existing);
+    }
+
+    g_dir_close(d);
+    return ret;
+}
+
+/* Syncs dir, so that names just added to it are durable. If it was
+ * just created, its parents up to the attachments dir are synced too, so
+ * that dir itself is. */
+static gboolean
+_sync_attachment_dirs (
+        const gchar * dir,
+        gboolean created)
+{
+    gchar * root;
+    gchar * d;
+    gboolean ret = TRUE;
+    gint saved_errno = 0;
+
+    root = g_build_filename(el_get_home_dir(), CONFIG_DIR, ATTACH_DIR,
+            NULL);
+    d = g_strdup(dir);
+
+    while (ret)
     {
+        gint fd = open(d, O_RDONLY | O_DIRECTORY);
+        gchar * parent;
+
+        if (fd < 0 || fsync(fd) != 0)
+        {
+            saved_errno = errno;
+            ret = FALSE;
+        }
+        if (fd >= 0)
+            close(fd);
+
+        if (!created || !g_str_has_prefix(d, root) || strcmp(d, root) == 0)
+            break;
+
+        parent = g_path_get_dirname(d);
+        g_free(d);
+        d = parent;
+    }
+
+    g_free(d);
+    g_free(root);
+
+    errno = saved_errno;
+    return ret;
+}
+
+/* Creates the store directory for contents with the given hash,
+ * ATTACH_DIR/ab/cd/<sha256>. created tells whether it didn't exist. */
+static gchar *
+_make_attachment_dir (
+        const gchar * hash,
+        gboolean * created,
+        GError ** error)
+{
+    gchar shard1[3] = {0}, shard2[3] = {0};
+    gchar * dir;
+
+    memcpy(shard1, hash, 2);
+    memcpy(shard2, hash + 2, 2);
+    dir = g_build_filename(
+            el_get_home_dir(),
+            CONFIG_DIR,
+            ATTACH_DIR,
+            shard1,
+            shard2,
+            hash,
+            NULL);
+
+    *created = !g_file_test(dir, G_FILE_TEST_IS_DIR);
+    if (g_mkdir_with_parents(dir, S_IRWXU) != 0)
+    {
+        g_warning("Creating directory '%s' failed: %s", dir,
+                g_strerror(errno));
         g_set_error(
                 error,
                 RTCOM_EL_ERROR,
-                RTCOM_EL_INVALID_ARGUMENT_ERROR,
-                "Invalid event_id.");
-        return -1;
+                RTCOM_EL_INTERNAL_ERROR,
+                "Couldn't create attachment dir.");
+        g_free(dir);
+        return NULL;
     }
-    if(!path)
+
+    return dir;
+}
+
+/* Stores the file at path in the content-addressed attachment store:
+ * ATTACH_DIR/ab/cd/<sha256>/<basename>. If the same content is already
+ * there, it isn't stored again. Doesn't touch the database, so it can
+ * (and should) be done outside of transactions. Returns the path of the
+ * stored file, which may be shared with other attachments. path itself
+ * is left alone even with RTCOM_EL_ATTACH_MOVE: the caller removes it
+ * once the attachment is committed. */
+static gchar *
+_store_attachment_file (
+        const gchar * path,
+        RTComElAttachFlags flags,
+        GError ** error)
+{
+    gchar * root = NULL;
+    gchar * dir = NULL;
+    gchar * hash = NULL;
+    gchar * dest_filename = NULL;
+    gchar * dest_path = NULL;
+    gchar * tmp_path = NULL;
+    gchar * tmp_name;
+    gint src_fd = -1, dest_fd = -1;
+    gboolean created = FALSE;
+
+    src_fd = open(path, O_RDONLY);
+    if (src_fd < 0)
     {
+        g_warning("Couldn't open %s for reading.", path);
         g_set_error(
                 error,
                 RTCOM_EL_ERROR,
-                RTCOM_EL_INVALID_ARGUMENT_ERROR,
-                "Invalid path.");
-        return -1;
+                RTCOM_EL_INTERNAL_ERROR,
+                "Couldn't open %s", path);
+        goto store_error;
     }
 
-    /* Check if EventLogger attachments dir exists. If not, create it */
-    dir = g_build_filename(
-            el_get_home_dir(),
-            CONFIG_DIR,
-            ATTACH_DIR,
-            NULL);
-    if(g_file_test(dir, G_FILE_TEST_EXISTS) == FALSE)
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    dest_filename = g_path_get_basename(path);
+
+    /* If the file is ours now and on the same filesystem, no data needs
+     * to be copied at all, only hashed to know where it goes. */
+    if (flags & RTCOM_EL_ATTACH_MOVE)
     {
-        if(g_mkdir(dir, S_IRWXU) != 0)
+        hash = _hash_file(src_fd);
+        if (hash == NULL)
         {
-            g_warning("Creating directory '%s' failed: %s", dir,
-                    g_strerror(errno));
+            g_warning("Couldn't read %s.", path);
+            g_set_error(
+                    error,
+                    RTCOM_EL_ERROR,
+                    RTCOM_EL_INTERNAL_ERROR,
+                    "Couldn't read %s", path);
+            goto store_error;
+        }
+
+        dir = _make_attachment_dir(hash, &created, error);
+        if (dir == NULL)
+            goto store_error;
+        dest_path = g_build_filename(dir, dest_filename, NULL);
+
+        if (g_file_test(dest_path, G_FILE_TEST_EXISTS) ||
+            _link_same_content(dir, dest_path))
+        {
+            g_debug("%s already stored as %s", path, dest_path);
+            goto store_done;
+        }
+
+        /* Only another name for now: the caller's is removed once the
+         * attachment is committed, so a failed insert loses nothing. */
+        if (link(path, dest_path) == 0)
+        {
+            g_debug("Linked %s to %s", path, dest_path);
+            if ((flags & RTCOM_EL_ATTACH_SYNC) &&
+                (fsync(src_fd) != 0 || !_sync_attachment_dirs(dir, created)))
+            {
+                g_warning("Error syncing %s: %s", dest_path,
+                        g_strerror(errno));
+                g_set_error(
+                        error,
+                        RTCOM_EL_ERROR,
+                        RTCOM_EL_INTERNAL_ERROR,
+                        "Couldn't sync %s: %s", dest_path, g_strerror(errno));
+                g_unlink(dest_path);
+                goto store_error;
+            }
+            close(src_fd);
+            g_free(dest_filename);
+            g_free(hash);
             g_free(dir);
+            return dest_path;
+        }
+
+        /* On another filesystem, so it has to be copied after all */
+        if (lseek(src_fd, 0, SEEK_SET) != 0)
+        {
+            g_warning("Couldn't read %s.", path);
             g_set_error(
                     error,
                     RTCOM_EL_ERROR,
                     RTCOM_EL_INTERNAL_ERROR,
-                    "Couldn't create attachments dir.");
-            return -1;
+                    "Couldn't read %s", path);
+            goto store_error;
         }
+
+        g_free(dest_path);
+        dest_path = NULL;
+        g_free(hash);
+        hash = NULL;
+        g_free(dir);
+        dir = NULL;
     }
 
-    unique_dir = _build_unique_dirname(dir);
-    g_free(dir);
+    /* Copy under a temporary name, hashing on the way, so that nobody
+     * sees a partial file and the contents are read only once. Being in
+     * the store, it can then be renamed to wherever its hash says. */
+    root = g_build_filename(el_get_home_dir(), CONFIG_DIR, ATTACH_DIR,
+            NULL);
+    g_mkdir_with_parents(root, S_IRWXU);
+    tmp_name = g_strdup_printf(".tmp-%d-%08x", (gint) getpid(),
+            g_random_int());
+    tmp_path = g_build_filename(root, tmp_name, NULL);
+    g_free(tmp_name);
 
-    if(g_mkdir(unique_dir, S_IRWXU) != 0)
+    dest_fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (dest_fd < 0)
     {
-        g_warning("Creating directory '%s' failed: %s", unique_dir,
-                g_strerror(errno));
-        g_free(unique_dir);
+        g_warning("Couldn't open %s for writing.", tmp_path);
         g_set_error(
                 error,
                 RTCOM_EL_ERROR,
                 RTCOM_EL_INTERNAL_ERROR,
-                "Couldn't create attachment dir.");
-        return -1;
+                "Couldn't open %s", tmp_path);
+        goto store_error;
     }
 
-    dest_filename = g_path_get_basename(path);
-    dest_path = g_build_filename(
-            unique_dir,
-            dest_filename,
-            NULL);
+    g_debug("Copying %s to %s", path, tmp_path);
 
-    g_free(dest_filename);
-    g_free(unique_dir);
+    hash = _copy_and_hash_file(src_fd, dest_fd);
+    if (hash == NULL)
+    {
+        g_warning("Error copying!");
+        g_set_error(
+                error,
+                RTCOM_EL_ERROR,
+                RTCOM_EL_INTERNAL_ERROR,
+                "Error copying.");
+        goto store_error;
+    }
 
-    g_debug("Copying %s to %s", path, dest_path);
+    if ((flags & RTCOM_EL_ATTACH_SYNC) && fsync(dest_fd) != 0)
+    {
+        g_warning("Error syncing %s: %s", tmp_path, g_strerror(errno));
+        g_set_error(
+                error,
+                RTCOM_EL_ERROR,
+                RTCOM_EL_INTERNAL_ERROR,
+                "Couldn't sync %s: %s", tmp_path, g_strerror(errno));
+        goto store_error;
+    }
 
-    src = fopen(path, "rb");
-    if(!src)
+    if (close(dest_fd) != 0)
     {
-        g_warning("Couldn't open %s for reading.", path);
+        dest_fd = -1;
+        g_warning("Error closing dest!");
         g_set_error(
                 error,
                 RTCOM_EL_ERROR,
                 RTCOM_EL_INTERNAL_ERROR,
-                "Couldn't open %s", path);
-        g_free(dest_path);
-        return -1;
+                "Error closing destination file.");
+        goto store_error;
+    }
+    dest_fd = -1;
+
+    dir = _make_attachment_dir(hash, &created, error);
+    if (dir == NULL)
+        goto store_error;
+    dest_path = g_build_filename(dir, dest_filename, NULL);
+
+    if (g_file_test(dest_path, G_FILE_TEST_EXISTS) ||
+        _link_same_content(dir, dest_path))
+    {
+        g_debug("%s already stored as %s", path, dest_path);
+        g_unlink(tmp_path);
+    }
+    else if (g_rename(tmp_path, dest_path) != 0)
+    {
+        g_warning("Couldn't rename %s to %s: %s", tmp_path, dest_path,
+                g_strerror(errno));
+        g_set_error(
+                error,
+                RTCOM_EL_ERROR,
+                RTCOM_EL_INTERNAL_ERROR,
+                "Couldn't store %s", path);
+        goto store_error;
     }
-    dest = fopen(dest_path, "wb");
-    if(!dest)
+
+    g_free(tmp_path);
+    tmp_path = NULL;
+
+store_done:
+    /* The name may be a new link as well as a new file */
+    if ((flags & RTCOM_EL_ATTACH_SYNC) &&
+        !_sync_attachment_dirs(dir, created))
     {
-        g_warning("Couldn't open %s for writing.", dest_path);
+        g_warning("Error syncing %s: %s", dir, g_strerror(errno));
         g_set_error(
                 error,
                 RTCOM_EL_ERROR,
                 RTCOM_EL_INTERNAL_ERROR,
-                "Couldn't open %s", dest_path);
-        g_free(dest_path);
-        fclose(src);
-        return -1;
+                "Couldn't sync %s: %s", dir, g_strerror(errno));
+        goto store_error;
+    }
+
+#ifdef HAVE_POSIX_FADVISE
+    /* We won't read the source again, don't let it push other data out
+     * of the page cache. */
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(src_fd);
+
+    g_free(dest_filename);
+    g_free(hash);
+    g_free(dir);
+    g_free(root);
+    return dest_path;
+
+store_error:
+    if (src_fd >= 0)
+        close(src_fd);
+    if (dest_fd >= 0)
+        close(dest_fd);
+    if (tmp_path != NULL)
+        g_unlink(tmp_path);
+    if (dir != NULL)
+        _remove_attachment_dirs(dir);
+    g_free(tmp_path);
+    g_free(dest_path);
+    g_free(dest_filename);
+    g_free(hash);
+    g_free(dir);
+    g_free(root);
+    return NULL;
+}
+
+/* Removes dir and its parents, as long as they're empty and inside
+ * the attachments dir. */
+static void
+_remove_attachment_dirs (const gchar * dir)
+{
+    gchar * root;
+    gchar * d;
+
+    root = g_build_filename(el_get_home_dir(), CONFIG_DIR, ATTACH_DIR,
+            NULL);
+    d = g_strdup(dir);
+
+    while (g_str_has_prefix(d, root) && strcmp(d, root) != 0 &&
+        g_rmdir(d) == 0)
+    {
+        gchar * parent = g_path_get_dirname(d);
+
+        g_free(d);
+        d = parent;
+    }
+
+    g_free(d);
+    g_free(root);
+}
+
+/* Removes a stored attachment file, and the directories it leaves empty */
+static void
+_remove_attachment_file (const gchar * dest_path)
+{
+    gchar * dir;
+
+    g_unlink(dest_path);
+
+    dir = g_path_get_dirname(dest_path);
+    _remove_attachment_dirs(dir);
+    g_free(dir);
+}
+
+/* Removes a stored file unless some attachment refers to it. Used to
+ * undo _store_attachment_file when the attachment couldn't be added. */
+static void
+_release_attachment_file (
+        RTComEl * el,
+        const gchar * dest_path)
+{
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+    gint refs = 0;
+
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), rtcom_el_db_single_int, &refs,
+        NULL, "SELECT COUNT(*) FROM AttachmentFiles WHERE path = %Q "
+        "AND refcount > 0;", dest_path))
+      return;
+
+    if (refs == 0)
+        _remove_attachment_file(dest_path);
+}
+
+static void
+get_string_slave (sqlite3_stmt *stmt, GSList **li)
+{
+  *li = g_slist_prepend (*li,
+      g_strdup((gchar *) sqlite3_column_text (stmt, 0)));
+}
+
+/* Removes the files no attachment refers to anymore. Done with the
+ * database locked, so that the files can't be picked up again by
+ * attachments being added meanwhile. */
+static void
+_purge_attachment_files (RTComEl * el)
+{
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+    GSList * li = NULL, * l;
+
+    if (!rtcom_el_db_transaction (EL_DB(priv), TRUE, NULL))
+        return;
+
+    if (!rtcom_el_db_exec (EL_DB(priv), (GFunc) get_string_slave, &li,
+        "SELECT path FROM AttachmentFiles WHERE refcount <= 0;", NULL))
+      {
+        rtcom_el_db_rollback (EL_DB(priv), NULL);
+        return;
+      }
+
+    if (li == NULL)
+      {
+        rtcom_el_db_rollback (EL_DB(priv), NULL);
+        return;
+      }
+
+    for (l = li; l != NULL; l = l->next)
+    {
+        g_debug("Removing unreferenced attachment %s", (gchar *) l->data);
+        _remove_attachment_file(l->data);
+        g_free(l->data);
     }
+    g_slist_free(li);
 
-    while((nread = fread(copy_buffer, 1, sizeof(copy_buffer), src) ) > 0)
+    if (!rtcom_el_db_exec (EL_DB(priv), NULL, NULL,
+        "DELETE FROM AttachmentFiles WHERE refcount <= 0;", NULL) ||
+        !rtcom_el_db_commit (EL_DB(priv), NULL))
+      rtcom_el_db_rollback (EL_DB(priv), NULL);
+}
+
+/* A file we've just stored might have been removed as unreferenced
+ * before our row for it was added. Checked with the row in place and the
+ * transaction open, so it can't happen anymore from there on. */
+static gboolean
+_attachment_files_exist (
+        gchar ** paths,
+        guint n_paths,
+        GError ** error)
+{
+    guint i;
+
+    for (i = 0; i < n_paths; i++)
     {
-        nwritten = fwrite(copy_buffer, 1, nread, dest);
-        if(nwritten != nread)
+        if (!g_file_test(paths[i], G_FILE_TEST_EXISTS))
         {
-            g_warning("Error copying!");
             g_set_error(
                     error,
                     RTCOM_EL_ERROR,
-                    RTCOM_EL_INTERNAL_ERROR,
-                    "Error copying.");
-            g_free(dest_path);
-            fclose(src);
-            fclose(dest);
-            return -1;
+                    RTCOM_EL_TEMPORARY_ERROR,
+                    "Attachment was removed while being added.");
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Records that a legacy attachment file couldn't be migrated, so that
+ * it isn't tried, and warned about, again. It stays usable where it is. */
+static void
+_migrate_attachment_failed (
+        RTComEl * el,
+        const gchar * old_path,
+        const gchar * reason)
+{
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+
+    g_warning("Couldn't migrate attachment %s: %s", old_path, reason);
+
+    rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, NULL,
+        "INSERT OR IGNORE INTO AttachmentMigrationFailures (path) "
+        "VALUES (%Q);", old_path);
+}
+
+/* Moves a file stored in the old one-directory-per-attachment layout into
+ * the attachment store, repointing the attachments using it. The file is
+ * linked rather than copied, so no data is written; the old name is only
+ * removed once the database refers to the new one. */
+static void
+_migrate_attachment_file (
+        RTComEl * el,
+        const gchar * old_path)
+{
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+    gchar * hash = NULL;
+    gchar * dir = NULL;
+    gchar * name;
+    gchar * new_path = NULL;
+    gboolean created;
+    gint fd;
+
+    fd = open(old_path, O_RDONLY);
+    if (fd < 0)
+    {
+        _migrate_attachment_failed(el, old_path, g_strerror(errno));
+        return;
+    }
+
+    hash = _hash_file(fd);
+    close(fd);
+    if (hash == NULL)
+    {
+        _migrate_attachment_failed(el, old_path, "couldn't read it");
+        return;
+    }
+
+    dir = _make_attachment_dir(hash, &created, NULL);
+    g_free(hash);
+    if (dir == NULL)
+    {
+        _migrate_attachment_failed(el, old_path,
+                "couldn't create attachment dir");
+        return;
+    }
+
+    name = g_path_get_basename(old_path);
+    new_path = g_build_filename(dir, name, NULL);
+    g_free(name);
+
+    if (!g_file_test(new_path, G_FILE_TEST_EXISTS) &&
+        !_link_same_content(dir, new_path) &&
+        link(old_path, new_path) != 0)
+    {
+        _migrate_attachment_failed(el, old_path, g_strerror(errno));
+        _remove_attachment_dirs(dir);
+        g_free(new_path);
+        g_free(dir);
+        return;
+    }
+    g_free(dir);
+
+    if (!rtcom_el_db_transaction (EL_DB(priv), FALSE, NULL))
+        goto migrate_error;
+
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, NULL,
+        "UPDATE Attachments SET path = %Q WHERE path = %Q;",
+        new_path, old_path))
+        goto migrate_rollback;
+
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, NULL,
+        "DELETE FROM AttachmentFiles WHERE path = %Q AND refcount <= 0;",
+        old_path))
+        goto migrate_rollback;
+
+    if (!_attachment_files_exist (&new_path, 1, NULL))
+        goto migrate_rollback;
+
+    if (!rtcom_el_db_commit (EL_DB(priv), NULL))
+        goto migrate_rollback;
+
+    g_debug("Migrated attachment %s to %s", old_path, new_path);
+    _remove_attachment_file(old_path);
+    g_free(new_path);
+    return;
+
+migrate_rollback:
+    rtcom_el_db_rollback (EL_DB(priv), NULL);
+migrate_error:
+    /* Most likely the database being busy; tried again next time */
+    _release_attachment_file(el, new_path);
+    g_free(new_path);
+}
+
+/* Attachments used to be stored in directories named after the minute
+ * they were added in, right under ATTACH_DIR. The store only has two
+ * hex digit shard directories there, so files referred to from anywhere
+ * else are left over from the old layout. Migrates up to max_files of
+ * them, returning FALSE once there are none left. Unreferenced files are
+ * left in place, for the attachment sweep. */
+static gboolean
+_migrate_legacy_attachments (
+        RTComEl * el,
+        guint max_files)
+{
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+    gchar * dir;
+    gchar * root;
+    GSList * li = NULL, * l;
+    guint n = 0;
+
+    dir = g_build_filename(el_get_home_dir(), CONFIG_DIR, ATTACH_DIR,
+            NULL);
+    root = g_strconcat(dir, G_DIR_SEPARATOR_S, NULL);
+    g_free(dir);
+
+    /* length() and substr() both count characters, so they agree with
+     * each other whatever the encoding of the home dir */
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), (GFunc) get_string_slave,
+        &li, NULL, "SELECT path FROM AttachmentFiles "
+        "WHERE refcount > 0 AND instr(path, %Q) = 1 "
+        "AND substr(path, length(%Q) + 1, 3) "
+        "NOT GLOB '[0-9a-fA-F][0-9a-fA-F]/' "
+        "AND path NOT IN (SELECT path FROM AttachmentMigrationFailures) "
+        "LIMIT %u;", root, root, max_files))
+    {
+        g_free(root);
+        return FALSE;
+    }
+
+    for (l = li; l != NULL; l = l->next)
+    {
+        _migrate_attachment_file(el, l->data);
+        n++;
+    }
+
+    g_slist_free_full(li, g_free);
+    g_free(root);
+
+    return n == max_files;
+}
+
+static gboolean
+_migrate_attachments_idle (gpointer data)
+{
+    RTComEl * el = RTCOM_EL(data);
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+
+    if (_ensure_db (el, TRUE) &&
+        _migrate_legacy_attachments(el, ATTACH_MIGRATE_FILES_PER_TICK))
+      return TRUE;
+
+    priv->attach_migrate_source = 0;
+    return FALSE;
+}
+
+/* State of a sweep over the attachment store, kept between idle ticks */
+struct _AttachGc {
+    /* Directories still to be scanned, gchar * */
+    GQueue dirs;
+    GDir * dir;
+    gchar * dir_path;
+    guint64 reclaimed;
+    gint64 min_age;
+};
+
+static AttachGc *
+_attach_gc_new (void)
+{
+    AttachGc * gc = g_slice_new0(AttachGc);
+    const gchar * age = g_getenv("RTCOM_EL_ATTACH_GC_AGE");
+
+    gc->min_age = age ? g_ascii_strtoll(age, NULL, 10) : ATTACH_GC_MIN_AGE;
+    g_queue_init(&gc->dirs);
+    g_queue_push_tail(&gc->dirs, g_build_filename(el_get_home_dir(),
+                CONFIG_DIR, ATTACH_DIR, NULL));
+    return gc;
+}
+
+static void
+_attach_gc_free (AttachGc * gc)
+{
+    gchar * d;
+
+    if (gc->dir != NULL)
+        g_dir_close(gc->dir);
+    g_free(gc->dir_path);
+    while ((d = g_queue_pop_head(&gc->dirs)) != NULL)
+        g_free(d);
+    g_slice_free(AttachGc, gc);
+}
+
+/* Removes path if no attachment refers to it, returning the number of
+ * bytes this freed. */
+static guint64
+_attach_gc_file (
+        RTComEl * el,
+        AttachGc * gc,
+        const gchar * path,
+        struct stat * st)
+{
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+    const gchar * name;
+    gint refs = 0;
+    guint64 freed = 0;
+
+    name = strrchr(path, G_DIR_SEPARATOR);
+    name = name ? name + 1 : path;
+
+    /* Just stored, and maybe about to be referred to; leave it alone
+     * unless whoever was storing it is long gone. */
+    if (time(NULL) - st->st_ctime < gc->min_age)
+        return 0;
+
+    /* Temporary files of _store_attachment_file */
+    if (name[0] == '.')
+    {
+        if (g_unlink(path) != 0)
+            return 0;
+        return st->st_nlink == 1 ? st->st_size : 0;
+    }
+
+    /* Unlocked check first, as most files will be in use */
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), rtcom_el_db_single_int, &refs,
+        NULL, "SELECT COUNT(*) FROM AttachmentFiles WHERE path = %Q "
+        "AND refcount > 0;", path) || refs > 0)
+      return 0;
+
+    /* Check again with the database locked, so the file can't be picked
+     * up by an attachment being added meanwhile. */
+    if (!rtcom_el_db_transaction (EL_DB(priv), TRUE, NULL))
+        return 0;
+
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), rtcom_el_db_single_int, &refs,
+        NULL, "SELECT COUNT(*) FROM AttachmentFiles WHERE path = %Q "
+        "AND refcount > 0;", path) || refs > 0)
+      {
+        rtcom_el_db_rollback (EL_DB(priv), NULL);
+        return 0;
+      }
+
+    if (g_unlink(path) == 0)
+    {
+        g_debug("Removed orphaned attachment %s", path);
+
+        /* Other names of the same content keep the data around */
+        if (st->st_nlink == 1)
+            freed = st->st_size;
+    }
+
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, NULL,
+        "DELETE FROM AttachmentFiles WHERE path = %Q;", path) ||
+        !rtcom_el_db_commit (EL_DB(priv), NULL))
+      rtcom_el_db_rollback (EL_DB(priv), NULL);
+
+    return freed;
+}
+
+/* Looks at up to max_entries directory entries. Returns FALSE once the
+ * whole store has been swept. */
+static gboolean
+_attach_gc_step (
+        RTComEl * el,
+        AttachGc * gc,
+        guint max_entries)
+{
+    guint n = 0;
+
+    while (n < max_entries)
+    {
+        const gchar * name;
+        gchar * path;
+        struct stat st;
+
+        if (gc->dir == NULL)
+        {
+            if (gc->dir_path != NULL)
+            {
+                /* Done with it; remove it if nothing's left inside */
+                _remove_attachment_dirs(gc->dir_path);
+                g_free(gc->dir_path);
+            }
+
+            gc->dir_path = g_queue_pop_head(&gc->dirs);
+            if (gc->dir_path == NULL)
+                return FALSE;
+
+            gc->dir = g_dir_open(gc->dir_path, 0, NULL);
+            continue;
+        }
+
+        name = g_dir_read_name(gc->dir);
+        if (name == NULL)
+        {
+            g_dir_close(gc->dir);
+            gc->dir = NULL;
+            continue;
         }
+
+        n++;
+        path = g_build_filename(gc->dir_path, name, NULL);
+
+        if (g_lstat(path, &st) != 0)
+        {
+            g_free(path);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            g_queue_push_tail(&gc->dirs, path);
+            continue;
+        }
+
+        gc->reclaimed += _attach_gc_file(el, gc, path, &st);
+        g_free(path);
+    }
+
+    return TRUE;
+}
+
+static gboolean
+_attach_gc_idle (gpointer data)
+{
+    RTComEl * el = RTCOM_EL(data);
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+    guint64 reclaimed;
+
+    if (_ensure_db (el, TRUE) &&
+        _attach_gc_step(el, priv->attach_gc, ATTACH_GC_ENTRIES_PER_TICK))
+      return TRUE;
+
+    reclaimed = priv->attach_gc->reclaimed;
+    _attach_gc_free(priv->attach_gc);
+    priv->attach_gc = NULL;
+    priv->attach_gc_source = 0;
+
+    g_debug("Attachment sweep done, %" G_GUINT64_FORMAT " bytes reclaimed",
+            reclaimed);
+    g_signal_emit(el, signals[ATTACHMENTS_COLLECTED], 0, reclaimed);
+
+    return FALSE;
+}
+
+void
+rtcom_el_collect_attachments_idle (RTComEl * el)
+{
+    RTComElPrivate * priv;
+
+    g_return_if_fail(RTCOM_IS_EL(el));
+    priv = RTCOM_EL_GET_PRIV(el);
+
+    /* Already sweeping, it'll carry on where it is */
+    if (priv->attach_gc_source != 0)
+        return;
+
+    if (priv->attach_gc == NULL)
+        priv->attach_gc = _attach_gc_new();
+
+    priv->attach_gc_source = g_idle_add_full(G_PRIORITY_LOW,
+            _attach_gc_idle, el, NULL);
+}
+
+void
+rtcom_el_stop_collecting_attachments (RTComEl * el)
+{
+    RTComElPrivate * priv;
+
+    g_return_if_fail(RTCOM_IS_EL(el));
+    priv = RTCOM_EL_GET_PRIV(el);
+
+    /* The sweep state is kept, so it can be resumed later */
+    if (priv->attach_gc_source != 0)
+    {
+        g_source_remove(priv->attach_gc_source);
+        priv->attach_gc_source = 0;
+    }
+}
+
+gboolean
+rtcom_el_collect_attachments (
+        RTComEl * el,
+        guint64 * reclaimed,
+        GError ** error)
+{
+    AttachGc * gc;
+
+    g_return_val_if_fail(RTCOM_IS_EL(el), FALSE);
+
+    if (!_ensure_db (el, TRUE))
+    {
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+            "Database isn't opened.");
+        return FALSE;
     }
 
-    if(fclose(src) == EOF)
+    gc = _attach_gc_new();
+    while (_attach_gc_step(el, gc, G_MAXUINT))
+        ;
+
+    if (reclaimed != NULL)
+        *reclaimed = gc->reclaimed;
+
+    _attach_gc_free(gc);
+    return TRUE;
+}
+
+gint rtcom_el_add_attachment(
+        RTComEl * el,
+        gint event_id,
+        const gchar * path,
+        const gchar * desc,
+        GError ** error)
+{
+    return rtcom_el_add_attachment_with_flags(el, event_id, path, desc,
+            RTCOM_EL_ATTACH_COPY, error);
+}
+
+gint rtcom_el_add_attachment_with_flags(
+        RTComEl * el,
+        gint event_id,
+        const gchar * path,
+        const gchar * desc,
+        RTComElAttachFlags flags,
+        GError ** error)
+{
+    gint attachment_id = -1;
+    RTComElPrivate * priv = NULL;
+    gchar * dest_path = NULL;
+
+    g_return_val_if_fail(RTCOM_IS_EL(el), -1);
+    priv = RTCOM_EL_GET_PRIV(el);
+
+    if (!_ensure_db (el, TRUE))
+    {
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+            "Database isn't opened.");
+        return -1;
+    }
+
+    if(event_id < 0)
     {
-        g_warning("Error closing src!");
         g_set_error(
                 error,
                 RTCOM_EL_ERROR,
-                RTCOM_EL_INTERNAL_ERROR,
-                "Error closing source file.");
-        g_free(dest_path);
-        fclose(dest);
+                RTCOM_EL_INVALID_ARGUMENT_ERROR,
+                "Invalid event_id.");
         return -1;
     }
-
-    if(fclose(dest) == EOF)
+    if(!path)
     {
-        g_warning("Error closing dest!");
         g_set_error(
                 error,
                 RTCOM_EL_ERROR,
-                RTCOM_EL_INTERNAL_ERROR,
-                "Error closing destination file.");
-        g_free(dest_path);
+                RTCOM_EL_INVALID_ARGUMENT_ERROR,
+                "Invalid path.");
         return -1;
     }
 
+    dest_path = _store_attachment_file (path, flags, error);
+    if (!dest_path)
+        return -1;
+
     /* We got the file, let's save the path in the db. */
 
-    if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, error,
+    if (!rtcom_el_db_transaction (EL_DB(priv), FALSE, error))
+        goto add_attachment_error;
+
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, error,
         "INSERT INTO Attachments (event_id, path, desc) VALUES (%d, %Q, %Q);",
         event_id, dest_path, desc))
-      {
-        return -1;
-      }
+        goto add_attachment_rollback;
+
+    attachment_id = sqlite3_last_insert_rowid(EL_DB(priv));
+
+    if (!_attachment_files_exist (&dest_path, 1, error))
+        goto add_attachment_rollback;
+
+    if (!rtcom_el_db_commit (EL_DB(priv), error))
+        goto add_attachment_rollback;
+
+    /* Stored for good, so the caller's copy can go */
+    if (flags & RTCOM_EL_ATTACH_MOVE)
+        g_unlink(path);
 
-    attachment_id = sqlite3_last_insert_rowid(priv->db);
     g_free(dest_path);
 
     return attachment_id;
+
+add_attachment_rollback:
+    rtcom_el_db_rollback (EL_DB(priv), NULL);
+add_attachment_error:
+    _release_attachment_file (el, dest_path);
+    g_free(dest_path);
+    return -1;
 }
 
 gint rtcom_el_fire_event_updated(
@@ -1335,7 +2763,7 @@ gint rtcom_el_set_read_event(
     priv = RTCOM_EL_GET_PRIV(el);
     g_assert(priv);
 
-    if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, error,
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, error,
         "UPDATE Events SET is_read = %d WHERE id = %d;",
         read == TRUE, event_id))
       {
@@ -1353,10 +2781,18 @@ gint rtcom_el_set_read_events(
         GError ** error)
 {
     RTComElPrivate * priv = NULL;
-    guint i = 0, ret = -1;
+    GString * ids = NULL;
+    gint i = 0, changed = 0;
 
-    priv = RTCOM_EL_GET_PRIV(el);
-    g_assert(priv);
+    if(!RTCOM_IS_EL(el))
+    {
+        g_set_error(
+                error,
+                RTCOM_EL_ERROR,
+                RTCOM_EL_INVALID_ARGUMENT_ERROR,
+                "Invalid RTComEl.");
+        return -1;
+    }
 
     if(!event_ids)
     {
@@ -1378,23 +2814,71 @@ gint rtcom_el_set_read_events(
         return -1;
     }
 
-    while(event_ids[i])
+    if (!_ensure_db (el, TRUE))
+    {
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+            "Database isn't opened.");
+        return -1;
+    }
+
+    priv = RTCOM_EL_GET_PRIV(el);
+    g_assert(priv);
+
+    if (!rtcom_el_db_transaction (EL_DB(priv), FALSE, error))
+        return -1;
+
+    ids = g_string_sized_new (SET_READ_BATCH_SIZE * 8);
+
+    while (event_ids[i])
     {
-        ret = rtcom_el_set_read_event(
-                el,
-                event_ids[i],
-                read,
-                error);
-        if(ret == -1)
+        if (event_ids[i] < 1)
         {
-            /* Make sure that the error was set. */
-            g_assert(error == NULL || *error != NULL);
-            break;
+            g_set_error(
+                    error,
+                    RTCOM_EL_ERROR,
+                    RTCOM_EL_INVALID_ARGUMENT_ERROR,
+                    "Invalid event_id.");
+            goto set_read_events_error;
         }
+
+        if (ids->len > 0)
+            g_string_append_c (ids, ',');
+        g_string_append_printf (ids, "%d", event_ids[i]);
         i++;
+
+        /* Rows already in the requested state are skipped, so that the
+         * GroupCache trigger only fires for events that really change. */
+        if ((i % SET_READ_BATCH_SIZE) == 0 || !event_ids[i])
+        {
+            if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, error,
+                "UPDATE Events SET is_read = %d "
+                "WHERE id IN (%s) AND is_read <> %d;",
+                read == TRUE, ids->str, read == TRUE))
+              goto set_read_events_error;
+
+            changed += sqlite3_changes (EL_DB(priv));
+            g_string_truncate (ids, 0);
+        }
     }
 
-    return ret;
+    if (!rtcom_el_db_commit (EL_DB(priv), error))
+        goto set_read_events_error;
+
+    g_string_free (ids, TRUE);
+
+    /* One notification for the whole batch; for more than one event we
+     * don't enumerate them, listeners should just refresh their model. */
+    if (changed == 1 && !event_ids[1])
+        _emit_dbus(el, "EventUpdated", event_ids[0], NULL);
+    else if (changed > 0)
+        _emit_dbus(el, "RefreshHint", -1, NULL);
+
+    return 0;
+
+set_read_events_error:
+    rtcom_el_db_rollback (EL_DB(priv), NULL);
+    g_string_free (ids, TRUE);
+    return -1;
 }
 
 gint rtcom_el_set_event_flag(
@@ -1447,7 +2931,7 @@ gint rtcom_el_set_event_flag(
         return -1;
     }
 
-    if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, error,
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, error,
         "UPDATE Events SET flags = flags | %d WHERE id = %d;",
         flag_value, event_id))
       {
@@ -1510,7 +2994,7 @@ gint rtcom_el_unset_event_flag(
         return -1;
     }
 
-    if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, error,
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, error,
         "UPDATE Events SET flags = flags & ~%d WHERE id = %d;",
         flag_value, event_id))
       {
@@ -1563,7 +3047,7 @@ gboolean rtcom_el_set_end_time(
         /* nothing to do :) */
         return TRUE;
 
-    if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, error,
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, error,
         "UPDATE Events SET end_time=%d WHERE id=%d",
         end_time, event_id))
       {
@@ -1596,24 +3080,27 @@ RTComElIter * _get_events_core(
     priv = RTCOM_EL_GET_PRIV(el);
     g_assert(priv);
 
-    sql = rtcom_el_query_get_sql(query);
+    sql = rtcom_el_query_get_sql_template(query);
+    g_return_val_if_fail(sql != NULL, NULL);
 
-    if(sqlite3_prepare(priv->db, sql, -1, &stmt, NULL) != SQLITE_OK)
-    {
-        g_warning("%s: could not compile: '%s': %s.", G_STRFUNC,
-            sql, sqlite3_errmsg(priv->db));
+    /* Queries of the same shape only differ in their bound values, so
+     * the compiled statement is reused */
+    stmt = rtcom_el_db_stmt_acquire(EL_DB(priv), sql, NULL);
+    if(stmt == NULL)
+        return NULL;
 
-        if(stmt)
-            sqlite3_finalize(stmt);
+    if(!rtcom_el_query_bind(query, stmt))
+    {
+        rtcom_el_db_stmt_release(stmt);
         return NULL;
     }
 
     if (atomic)
       {
-        if (!rtcom_el_db_transaction (priv->db, FALSE, NULL))
+        if (!rtcom_el_db_transaction (EL_DB(priv), FALSE, NULL))
         {
             g_warning("%s: could not begin transaction", G_STRFUNC);
-            sqlite3_finalize(stmt);
+            rtcom_el_db_stmt_release(stmt);
             return NULL;
         }
       }
@@ -1621,20 +3108,20 @@ RTComElIter * _get_events_core(
     status = sqlite3_step(stmt);
     if(status == SQLITE_DONE)
     {
-        sqlite3_finalize(stmt);
+        rtcom_el_db_stmt_release(stmt);
         stmt = NULL;
         if (atomic)
-            rtcom_el_db_rollback (priv->db, NULL);
+            rtcom_el_db_rollback (EL_DB(priv), NULL);
         return NULL;
     }
 
     if(status != SQLITE_ROW)
     {
         g_warning("%s: could not step statement: %s", G_STRFUNC,
-                sqlite3_errmsg (priv->db));
-        sqlite3_finalize(stmt);
+                sqlite3_errmsg (EL_DB(priv)));
+        rtcom_el_db_stmt_release(stmt);
         if (atomic)
-            rtcom_el_db_rollback (priv->db, NULL);
+            rtcom_el_db_rollback (EL_DB(priv), NULL);
         stmt = NULL;
         return NULL;
     }
@@ -1643,30 +3130,443 @@ RTComElIter * _get_events_core(
             RTCOM_TYPE_EL_ITER,
             "el", el,
             "query", query,
-            "sqlite3-database", priv->db,
+            "sqlite3-database", EL_DB(priv),
+            "sqlite3-statement", stmt,
+            "plugins-table", priv->plugins,
+            "atomic", atomic,
+            NULL);
+
+    if(!RTCOM_IS_EL_ITER(it))
+        g_warning("Could not create the iterator.");
+
+    return it;
+}
+
+RTComElIter * rtcom_el_get_events(
+        RTComEl * el,
+        RTComElQuery * query)
+{
+    return _get_events_core (el, query, FALSE);
+}
+
+/* Runs one of the single-value forms of the query */
+static gint
+_query_single_int(
+        RTComEl * el,
+        RTComElQuery * query,
+        const gchar * sql,
+        GError ** error)
+{
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+    sqlite3_stmt * stmt;
+    gint status, n = -1;
+
+    if (!_ensure_db (el, TRUE))
+    {
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+            "Can't run query, database isn't opened.");
+        return -1;
+    }
+
+    if (sql == NULL)
+    {
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INVALID_ARGUMENT_ERROR,
+            "Query hasn't been prepared.");
+        return -1;
+    }
+
+    stmt = rtcom_el_db_stmt_acquire(EL_DB(priv), sql, error);
+    if(stmt == NULL)
+        return -1;
+
+    if(!rtcom_el_query_bind(query, stmt))
+    {
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+            "Can't bind query values.");
+        rtcom_el_db_stmt_release(stmt);
+        return -1;
+    }
+
+    status = sqlite3_step(stmt);
+    if(status == SQLITE_ROW)
+        n = sqlite3_column_int(stmt, 0);
+    else if(status == SQLITE_BUSY)
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_TEMPORARY_ERROR,
+            "Database is busy.");
+    else
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+            "Can't step statement: %s", sqlite3_errmsg(EL_DB(priv)));
+
+    rtcom_el_db_stmt_release(stmt);
+    return n;
+}
+
+gint rtcom_el_query_count(
+        RTComEl * el,
+        RTComElQuery * query,
+        GError ** error)
+{
+    g_return_val_if_fail(RTCOM_IS_EL(el), -1);
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), -1);
+
+    return _query_single_int(el, query,
+            rtcom_el_query_get_count_sql_template(query), error);
+}
+
+gboolean rtcom_el_query_exists(
+        RTComEl * el,
+        RTComElQuery * query,
+        GError ** error)
+{
+    g_return_val_if_fail(RTCOM_IS_EL(el), FALSE);
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), FALSE);
+
+    return _query_single_int(el, query,
+            rtcom_el_query_get_exists_sql_template(query), error) > 0;
+}
+
+RTComElAggregateResult * rtcom_el_query_aggregate(
+        RTComEl * el,
+        RTComElQuery * query,
+        const gchar * const * keys,
+        const RTComElAggregate * aggregates,
+        guint n_aggregates,
+        GError ** error)
+{
+    RTComElPrivate * priv;
+    RTComElAggregateResult * result = NULL;
+    GPtrArray * row_keys = NULL;
+    GArray * row_values = NULL;
+    sqlite3_stmt * stmt = NULL;
+    gchar * sql = NULL;
+    gint status;
+    guint i;
+
+    g_return_val_if_fail(RTCOM_IS_EL(el), NULL);
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), NULL);
+
+    priv = RTCOM_EL_GET_PRIV(el);
+
+    if (!_ensure_db (el, TRUE))
+    {
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+            "Can't run query, database isn't opened.");
+        return NULL;
+    }
+
+    sql = rtcom_el_query_get_aggregate_sql_template(query, keys, aggregates,
+            n_aggregates);
+    if (sql == NULL)
+    {
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INVALID_ARGUMENT_ERROR,
+            "Query hasn't been prepared, or can't aggregate these fields.");
+        return NULL;
+    }
+
+    stmt = rtcom_el_db_stmt_acquire(EL_DB(priv), sql, error);
+    g_free(sql);
+    if(stmt == NULL)
+        return NULL;
+
+    if(!rtcom_el_query_bind(query, stmt))
+    {
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+            "Can't bind query values.");
+        rtcom_el_db_stmt_release(stmt);
+        return NULL;
+    }
+
+    result = g_slice_new0(RTComElAggregateResult);
+    while(keys != NULL && keys[result->n_keys] != NULL)
+        result->n_keys++;
+    result->n_values = sqlite3_column_count(stmt) - result->n_keys;
+    result->chunk = g_string_chunk_new(256);
+    row_keys = g_ptr_array_new();
+    row_values = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+    while((status = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        for(i = 0; i < result->n_keys; i++)
+        {
+            const gchar *key = (const gchar *) sqlite3_column_text(stmt, i);
+
+            g_ptr_array_add(row_keys, key == NULL ? NULL :
+                    g_string_chunk_insert_const(result->chunk, key));
+        }
+
+        for(i = 0; i < result->n_values; i++)
+        {
+            gint64 value = sqlite3_column_int64(stmt, result->n_keys + i);
+            g_array_append_val(row_values, value);
+        }
+
+        result->n_rows++;
+    }
+
+    if(status != SQLITE_DONE)
+    {
+        g_set_error(error, RTCOM_EL_ERROR,
+            status == SQLITE_BUSY ? RTCOM_EL_TEMPORARY_ERROR :
+                RTCOM_EL_INTERNAL_ERROR,
+            "Can't step statement: %s", sqlite3_errmsg(EL_DB(priv)));
+        rtcom_el_db_stmt_release(stmt);
+        g_ptr_array_free(row_keys, TRUE);
+        g_array_free(row_values, TRUE);
+        g_string_chunk_free(result->chunk);
+        g_slice_free(RTComElAggregateResult, result);
+        return NULL;
+    }
+
+    rtcom_el_db_stmt_release(stmt);
+
+    result->keys = (const gchar **) g_ptr_array_free(row_keys, FALSE);
+    result->values = (gint64 *) g_array_free(row_values, FALSE);
+
+    return result;
+}
+
+void rtcom_el_aggregate_result_free(
+        RTComElAggregateResult * result)
+{
+    if(result == NULL)
+        return;
+
+    g_free(result->keys);
+    g_free(result->values);
+    g_string_chunk_free(result->chunk);
+    g_slice_free(RTComElAggregateResult, result);
+}
+
+RTComElIter * rtcom_el_get_events_atomic(
+        RTComEl * el,
+        RTComElQuery * query)
+{
+    return _get_events_core (el, query, TRUE);
+}
+
+/* A connection from the read pool, handed back when the iterator using
+ * it goes away. */
+typedef struct {
+    RTComEl * el;
+    sqlite3 * db;
+} PooledDb;
+
+static sqlite3 *
+_acquire_read_db (RTComEl * el)
+{
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+    sqlite3 * db;
+    gchar * fn;
+
+    g_mutex_lock(&priv->read_pool_lock);
+    db = g_queue_pop_head(&priv->read_pool);
+    g_mutex_unlock(&priv->read_pool_lock);
+
+    if (db != NULL)
+        return db;
+
+    fn = g_build_filename (el_get_home_dir (), CONFIG_DIR, SQLITE_DATABASE,
+        NULL);
+    db = rtcom_el_db_open (fn);
+    g_free (fn);
+
+    return db;
+}
+
+static void
+_release_read_db (
+        RTComEl * el,
+        sqlite3 * db)
+{
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+
+    g_mutex_lock(&priv->read_pool_lock);
+    if (g_queue_get_length(&priv->read_pool) < MAX_POOLED_CONNECTIONS)
+    {
+        g_queue_push_head(&priv->read_pool, db);
+        db = NULL;
+    }
+    g_mutex_unlock(&priv->read_pool_lock);
+
+    if (db != NULL)
+        rtcom_el_db_close (db);
+}
+
+static void
+_pooled_db_free (PooledDb * pdb)
+{
+    _release_read_db(pdb->el, pdb->db);
+    g_object_unref(pdb->el);
+    g_slice_free(PooledDb, pdb);
+}
+
+static void
+_interrupt_db (
+        GCancellable * cancellable,
+        sqlite3 * db)
+{
+    sqlite3_interrupt(db);
+}
+
+typedef struct {
+    RTComElQuery * query;
+    gchar * sql;
+} GetEventsData;
+
+static void
+_get_events_data_free (GetEventsData * data)
+{
+    g_object_unref(data->query);
+    g_free(data->sql);
+    g_slice_free(GetEventsData, data);
+}
+
+static void
+_get_events_thread (
+        GTask * task,
+        gpointer source_object,
+        gpointer task_data,
+        GCancellable * cancellable)
+{
+    RTComEl * el = RTCOM_EL(source_object);
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+    GetEventsData * data = task_data;
+    RTComElIter * it;
+    PooledDb * pdb;
+    sqlite3 * db;
+    sqlite3_stmt * stmt = NULL;
+    GError * error = NULL;
+    gulong handler = 0;
+    gint status;
+
+    if (g_task_return_error_if_cancelled(task))
+        return;
+
+    db = _acquire_read_db(el);
+    if (db == NULL)
+    {
+        g_task_return_new_error(task, RTCOM_EL_ERROR,
+                RTCOM_EL_INTERNAL_ERROR, "Couldn't open database.");
+        return;
+    }
+
+    stmt = rtcom_el_db_stmt_acquire(db, data->sql, &error);
+    if (stmt == NULL)
+    {
+        g_task_return_error(task, error);
+        goto get_events_error;
+    }
+
+    /* The query is only read from here on */
+    if (!rtcom_el_query_bind(data->query, stmt))
+    {
+        g_task_return_new_error(task, RTCOM_EL_ERROR,
+                RTCOM_EL_INTERNAL_ERROR, "SQL error: %s",
+                sqlite3_errmsg(db));
+        goto get_events_error;
+    }
+
+    if (cancellable != NULL)
+        handler = g_cancellable_connect(cancellable,
+                G_CALLBACK(_interrupt_db), db, NULL);
+
+    status = rtcom_el_db_iterate(db, stmt, &error);
+
+    /* Waits for _interrupt_db to finish if it's running */
+    if (handler != 0)
+        g_cancellable_disconnect(cancellable, handler);
+
+    if (g_cancellable_is_cancelled(cancellable))
+    {
+        g_clear_error(&error);
+        g_task_return_error_if_cancelled(task);
+        goto get_events_error;
+    }
+
+    if (status == SQLITE_DONE)
+    {
+        rtcom_el_db_stmt_release(stmt);
+        _release_read_db(el, db);
+        g_task_return_pointer(task, NULL, NULL);
+        return;
+    }
+
+    if (status != SQLITE_ROW)
+    {
+        g_warning("%s: could not step statement: %s", G_STRFUNC,
+                sqlite3_errmsg(db));
+        g_task_return_error(task, error);
+        goto get_events_error;
+    }
+
+    it = g_object_new(
+            RTCOM_TYPE_EL_ITER,
+            "el", el,
+            "query", data->query,
+            "sqlite3-database", db,
             "sqlite3-statement", stmt,
             "plugins-table", priv->plugins,
-            "atomic", atomic,
+            "atomic", FALSE,
             NULL);
 
-    if(!RTCOM_IS_EL_ITER(it))
-        g_warning("Could not create the iterator.");
+    /* Object data is released after the iterator has finalized its
+     * statement, so the connection is idle by then. */
+    pdb = g_slice_new(PooledDb);
+    pdb->el = g_object_ref(el);
+    pdb->db = db;
+    g_object_set_data_full(G_OBJECT(it), "rtcom-el-pooled-db", pdb,
+            (GDestroyNotify) _pooled_db_free);
 
-    return it;
+    g_task_return_pointer(task, it, g_object_unref);
+    return;
+
+get_events_error:
+    rtcom_el_db_stmt_release(stmt);
+    _release_read_db(el, db);
 }
 
-RTComElIter * rtcom_el_get_events(
+void rtcom_el_get_events_async(
         RTComEl * el,
-        RTComElQuery * query)
+        RTComElQuery * query,
+        GCancellable * cancellable,
+        GAsyncReadyCallback callback,
+        gpointer user_data)
 {
-    return _get_events_core (el, query, FALSE);
+    GTask * task;
+    GetEventsData * data;
+
+    g_return_if_fail(RTCOM_IS_EL(el));
+    g_return_if_fail(RTCOM_IS_EL_QUERY(query));
+
+    task = g_task_new(el, cancellable, callback, user_data);
+    g_task_set_source_tag(task, rtcom_el_get_events_async);
+
+    /* Plugins and the schema are set up here, the worker only reads */
+    if (!_ensure_db (el, TRUE))
+    {
+        g_task_return_new_error(task, RTCOM_EL_ERROR,
+                RTCOM_EL_INTERNAL_ERROR, "Database isn't opened.");
+        g_object_unref(task);
+        return;
+    }
+
+    data = g_slice_new(GetEventsData);
+    data->query = g_object_ref(query);
+    data->sql = g_strdup(rtcom_el_query_get_sql_template(query));
+    g_task_set_task_data(task, data, (GDestroyNotify) _get_events_data_free);
+
+    g_task_run_in_thread(task, _get_events_thread);
+    g_object_unref(task);
 }
 
-RTComElIter * rtcom_el_get_events_atomic(
+RTComElIter * rtcom_el_get_events_finish(
         RTComEl * el,
-        RTComElQuery * query)
+        GAsyncResult * result,
+        GError ** error)
 {
-    return _get_events_core (el, query, TRUE);
+    g_return_val_if_fail(g_task_is_valid(result, el), NULL);
+
+    return g_task_propagate_pointer(G_TASK(result), error);
 }
 
 static void
@@ -1695,7 +3595,7 @@ GHashTable * rtcom_el_fetch_event_headers(
 
     ret = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 
-    if (!rtcom_el_db_exec_printf (priv->db, (GFunc) _fetch_event_headers_slave,
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), (GFunc) _fetch_event_headers_slave,
         ret, NULL, "SELECT name, value FROM Headers WHERE event_id = %d;", event_id))
       {
         g_hash_table_destroy (ret);
@@ -1705,6 +3605,206 @@ GHashTable * rtcom_el_fetch_event_headers(
     return ret;
 }
 
+/* The number of ids bound to each statement; the last chunk is padded
+ * with its last id, so every chunk uses the same cached statement */
+#define HEADERS_CHUNK 128
+
+static gint
+_compare_ids (gconstpointer a, gconstpointer b)
+{
+    gint x = *(const gint *) a;
+    gint y = *(const gint *) b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+RTComElHeadersResult * rtcom_el_fetch_headers_for_events(
+        RTComEl * el,
+        const gint * event_ids,
+        guint n_events,
+        const gchar * const * names,
+        GError ** error)
+{
+    RTComElPrivate * priv;
+    RTComElHeadersResult * result = NULL;
+    GArray * ids = NULL;
+    GArray * offsets = NULL;
+    GPtrArray * header_names = NULL;
+    GPtrArray * header_values = NULL;
+    sqlite3_stmt * stmt = NULL;
+    GString * sql = NULL;
+    guint n_names = 0, i, chunk, e = 0, offset = 0;
+    gboolean failed = FALSE;
+    gint status;
+
+    g_return_val_if_fail(RTCOM_IS_EL(el), NULL);
+    g_return_val_if_fail(event_ids != NULL || n_events == 0, NULL);
+
+    priv = RTCOM_EL_GET_PRIV(el);
+
+    if (!_ensure_db (el, TRUE))
+    {
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+            "Can't fetch headers, database isn't opened.");
+        return NULL;
+    }
+
+    /* Sorted and without duplicates, so that the headers come out grouped
+     * in the same order */
+    ids = g_array_sized_new(FALSE, FALSE, sizeof(gint), n_events);
+    g_array_append_vals(ids, event_ids, n_events);
+    g_array_sort(ids, _compare_ids);
+    for(i = 1; i < ids->len; i++)
+        if(g_array_index(ids, gint, i) == g_array_index(ids, gint, i - 1))
+            g_array_remove_index(ids, i--);
+
+    while(names != NULL && names[n_names] != NULL)
+        n_names++;
+
+    sql = g_string_new("SELECT event_id, name, value FROM Headers "
+            "WHERE event_id IN (?");
+    for(i = 1; i < HEADERS_CHUNK; i++)
+        g_string_append(sql, ", ?");
+    g_string_append(sql, ")");
+    if(n_names > 0)
+    {
+        g_string_append(sql, " AND name IN (?");
+        for(i = 1; i < n_names; i++)
+            g_string_append(sql, ", ?");
+        g_string_append(sql, ")");
+    }
+    g_string_append(sql, " ORDER BY event_id, id;");
+
+    result = g_slice_new0(RTComElHeadersResult);
+    result->chunk = g_string_chunk_new(1024);
+    offsets = g_array_sized_new(FALSE, FALSE, sizeof(guint), ids->len + 1);
+    g_array_append_val(offsets, offset);
+    header_names = g_ptr_array_new();
+    header_values = g_ptr_array_new();
+
+    for(chunk = 0; chunk < ids->len && !failed; chunk += HEADERS_CHUNK)
+    {
+        stmt = rtcom_el_db_stmt_acquire(EL_DB(priv), sql->str, error);
+        if(stmt == NULL)
+        {
+            failed = TRUE;
+            break;
+        }
+
+        for(i = 0; i < HEADERS_CHUNK; i++)
+            sqlite3_bind_int(stmt, i + 1, g_array_index(ids, gint,
+                        MIN(chunk + i, ids->len - 1)));
+        for(i = 0; i < n_names; i++)
+            sqlite3_bind_text(stmt, HEADERS_CHUNK + i + 1, names[i], -1,
+                    SQLITE_STATIC);
+
+        while((status = rtcom_el_db_iterate(EL_DB(priv), stmt, NULL))
+                == SQLITE_ROW)
+        {
+            gint event_id = sqlite3_column_int(stmt, 0);
+            const gchar * value = (const gchar *) sqlite3_column_text(stmt, 2);
+
+            /* Close the events before this one */
+            while(g_array_index(ids, gint, e) < event_id)
+            {
+                e++;
+                g_array_append_val(offsets, header_names->len);
+            }
+
+            g_ptr_array_add(header_names, g_string_chunk_insert_const(
+                        result->chunk,
+                        (const gchar *) sqlite3_column_text(stmt, 1)));
+            g_ptr_array_add(header_values, value == NULL ? NULL :
+                    g_string_chunk_insert(result->chunk, value));
+        }
+
+        if(status != SQLITE_DONE)
+        {
+            failed = TRUE;
+            g_set_error(error, RTCOM_EL_ERROR,
+                status == SQLITE_BUSY ? RTCOM_EL_TEMPORARY_ERROR :
+                    RTCOM_EL_INTERNAL_ERROR,
+                "Can't step statement: %s", sqlite3_errmsg(EL_DB(priv)));
+        }
+
+        rtcom_el_db_stmt_release(stmt);
+    }
+
+    g_string_free(sql, TRUE);
+
+    if(failed)
+    {
+        g_array_free(ids, TRUE);
+        g_array_free(offsets, TRUE);
+        g_ptr_array_free(header_names, TRUE);
+        g_ptr_array_free(header_values, TRUE);
+        g_string_chunk_free(result->chunk);
+        g_slice_free(RTComElHeadersResult, result);
+        return NULL;
+    }
+
+    /* Close the remaining events, including those without headers */
+    while(e < ids->len)
+    {
+        e++;
+        g_array_append_val(offsets, header_names->len);
+    }
+
+    result->n_events = ids->len;
+    result->event_ids = (const gint *) g_array_free(ids, FALSE);
+    result->offsets = (const guint *) g_array_free(offsets, FALSE);
+    result->n_headers = header_names->len;
+    result->names = (const gchar **) g_ptr_array_free(header_names, FALSE);
+    result->values = (const gchar **) g_ptr_array_free(header_values, FALSE);
+
+    return result;
+}
+
+const gchar * rtcom_el_headers_result_lookup(
+        const RTComElHeadersResult * result,
+        gint event_id,
+        const gchar * name)
+{
+    guint low = 0, high, i;
+
+    g_return_val_if_fail(result != NULL, NULL);
+    g_return_val_if_fail(name != NULL, NULL);
+
+    high = result->n_events;
+    while(low < high)
+    {
+        guint mid = (low + high) / 2;
+
+        if(result->event_ids[mid] < event_id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if(low == result->n_events || result->event_ids[low] != event_id)
+        return NULL;
+
+    for(i = result->offsets[low]; i < result->offsets[low + 1]; i++)
+        if(strcmp(result->names[i], name) == 0)
+            return result->values[i];
+
+    return NULL;
+}
+
+void rtcom_el_headers_result_free(
+        RTComElHeadersResult * result)
+{
+    if(result == NULL)
+        return;
+
+    g_free((gint *) result->event_ids);
+    g_free((guint *) result->offsets);
+    g_free(result->names);
+    g_free(result->values);
+    g_string_chunk_free(result->chunk);
+    g_slice_free(RTComElHeadersResult, result);
+}
+
 static void
 _events_by_header_slave (sqlite3_stmt *stmt, GArray *arr)
 {
@@ -1734,7 +3834,7 @@ gint * rtcom_el_get_events_by_header(
 
     a = g_array_new(FALSE, FALSE, sizeof(gint));
 
-    if (!rtcom_el_db_exec_printf (priv->db, (GFunc) _events_by_header_slave,
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), (GFunc) _events_by_header_slave,
         a, NULL, "SELECT event_id FROM Headers WHERE name=%Q AND value=%Q;",
         key, val))
       {
@@ -1761,7 +3861,7 @@ static GList *unique_remote_col (RTComEl *el, const gchar *col)
   RTComElPrivate *priv = RTCOM_EL_GET_PRIV(el);
   GList *ret = NULL;
 
-  if (!rtcom_el_db_exec_printf(priv->db, (GFunc) _unique_remote_col_slave,
+  if (!rtcom_el_db_exec_printf(EL_DB(priv), (GFunc) _unique_remote_col_slave,
       &ret, NULL, "SELECT DISTINCT %s FROM Remotes WHERE %s IS NOT NULL", col, col))
     return NULL;
 
@@ -1816,7 +3916,7 @@ gboolean rtcom_el_get_group_info(
         return FALSE;
     }
 
-    if (!rtcom_el_db_exec_printf(priv->db, (GFunc) _get_group_info_slave,
+    if (!rtcom_el_db_exec_printf(EL_DB(priv), (GFunc) _get_group_info_slave,
         vars, NULL, "SELECT total_events, read_events, flags FROM GroupCache WHERE "
         "group_uid = %Q", group_uid))
       return FALSE;
@@ -1850,7 +3950,7 @@ gint rtcom_el_get_group_most_recent_event_id(
         return FALSE;
     }
 
-    if (!rtcom_el_db_exec_printf(priv->db, rtcom_el_db_single_int, &max_id, NULL,
+    if (!rtcom_el_db_exec_printf(EL_DB(priv), rtcom_el_db_single_int, &max_id, NULL,
         "SELECT MAX(id) FROM Events WHERE group_uid=%Q;", group_uid))
       return -1;
 
@@ -1872,7 +3972,7 @@ gint rtcom_el_get_flag_value(
         return -1;
     }
 
-    db = RTCOM_EL_GET_PRIV(el)->db;
+    db = EL_DB(RTCOM_EL_GET_PRIV(el));
 
     if (!rtcom_el_db_exec_printf (db, rtcom_el_db_single_int, &ret, NULL,
         "SELECT value FROM Flags WHERE name=%Q", flag))
@@ -1896,7 +3996,7 @@ gint rtcom_el_get_contacts_events_n(
         return -1;
     }
 
-    db = RTCOM_EL_GET_PRIV(el)->db;
+    db = EL_DB(RTCOM_EL_GET_PRIV(el));
 
     if (!rtcom_el_db_exec_printf(db, rtcom_el_db_single_int, &n, NULL,
         "SELECT COUNT(*) FROM Events WHERE remote_ebook_uid=%;", 
@@ -1923,7 +4023,7 @@ gint rtcom_el_get_local_remote_uid_events_n(
         return -1;
     }
 
-    db = RTCOM_EL_GET_PRIV(el)->db;
+    db = EL_DB(RTCOM_EL_GET_PRIV(el));
 
     if (!rtcom_el_db_exec_printf(db, rtcom_el_db_single_int, &n, NULL,
         "SELECT COUNT(*) FROM Events WHERE local_uid=%Q AND remote_uid=%Q;",
@@ -1935,13 +4035,6 @@ gint rtcom_el_get_local_remote_uid_events_n(
     return n;
 }
 
-static void
-get_group_uid_slave (sqlite3_stmt *stmt, GSList **li)
-{
-  *li = g_slist_prepend (*li,
-      g_strdup((gchar *) sqlite3_column_text (stmt, 0)));
-}
-
 static GSList *
 get_event_group_uids (RTComEl *el, gint event_id, const gchar *where)
 {
@@ -1950,20 +4043,15 @@ get_event_group_uids (RTComEl *el, gint event_id, const gchar *where)
 
     if (event_id > 0)
     {
-        if (!rtcom_el_db_exec_printf (priv->db, (GFunc) get_group_uid_slave,
+        if (!rtcom_el_db_exec_printf (EL_DB(priv), (GFunc) get_string_slave,
             &li, NULL, "SELECT DISTINCT(group_uid) FROM Events WHERE id=%d;", event_id))
           return NULL;
     }
     else if (where != NULL)
     {
-        if (!rtcom_el_db_exec_printf (priv->db, (GFunc) get_group_uid_slave, &li, NULL,
-            "SELECT DISTINCT(Events.group_uid) FROM Events "
-                "JOIN Services ON Events.service_id = Services.id "
-                "JOIN EventTypes ON Events.event_type_id = EventTypes.id "
-                "LEFT JOIN Remotes ON Events.remote_uid = Remotes.remote_uid "
-                    "AND Events.local_uid = Remotes.local_uid "
-                "LEFT JOIN Headers ON Headers.event_id = Events.id AND "
-                    "Headers.name = 'message-token' WHERE %s;", where))
+        if (!rtcom_el_db_exec_printf (EL_DB(priv), (GFunc) get_string_slave, &li, NULL,
+            "SELECT DISTINCT(Events.group_uid) FROM " EVENTS_JOIN_SQL
+            " WHERE %s;", where))
           return NULL;
     }
 
@@ -2005,7 +4093,7 @@ update_group_cache (RTComEl *el, GSList *li)
 
     g_string_append (tmp, ") GROUP BY group_uid;");
 
-    if (!rtcom_el_db_exec (priv->db, NULL, NULL, tmp->str, NULL))
+    if (!rtcom_el_db_exec (EL_DB(priv), NULL, NULL, tmp->str, NULL))
     {
         g_string_free (tmp, TRUE);
         return FALSE;
@@ -2015,7 +4103,7 @@ update_group_cache (RTComEl *el, GSList *li)
 
     /* If there are no events in the group left, the groupcache won't
      * be updated. Clear those. */
-    rtcom_el_db_exec (priv->db, NULL, NULL, "DELETE FROM GroupCache "
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "DELETE FROM GroupCache "
         "WHERE NOT EXISTS (SELECT id FROM Events WHERE "
             "events.group_uid = groupcache.group_uid LIMIT 1)", NULL);
 
@@ -2048,33 +4136,34 @@ gint rtcom_el_delete_event (
 
     /* if disk is full we might not be in position to create journal, so
      * we turn it off temporarily. */
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = OFF;", NULL);
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = OFF;", NULL);
 
-    if (!rtcom_el_db_transaction (priv->db, FALSE, NULL))
+    if (!rtcom_el_db_transaction (EL_DB(priv), FALSE, NULL))
       goto sql_error;
 
     li = get_event_group_uids (el, event_id, NULL);
 
-    if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, NULL,
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, NULL,
         "DELETE FROM Events WHERE id=%d;", event_id))
       goto sql_error;
 
     if (!update_group_cache (el, li))
       goto sql_error;
 
-    if (!rtcom_el_db_commit (priv->db, NULL))
+    if (!rtcom_el_db_commit (EL_DB(priv), NULL))
       goto sql_error;
 
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
         NULL);
+    _purge_attachment_files (el);
     _emit_dbus(el, "EventDeleted", event_id, NULL);
     return 0;
 
 sql_error:
-    rtcom_el_db_rollback (priv->db, NULL);
+    rtcom_el_db_rollback (EL_DB(priv), NULL);
     g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
         "Error executing sql.");
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
         NULL);
     return -1;
 }
@@ -2107,31 +4196,27 @@ gboolean rtcom_el_delete_events(
 
     /* if disk is full we might not be in position to create journal, so
      * we turn it off temporarily. */
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = OFF;", NULL);
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = OFF;", NULL);
 
-    if (!rtcom_el_db_transaction (priv->db, FALSE, NULL))
+    if (!rtcom_el_db_transaction (EL_DB(priv), FALSE, NULL))
         goto rtcom_el_delete_events_error;
 
     li = get_event_group_uids (el, -1, where);
 
-    if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, NULL,
-        "DELETE FROM Events WHERE id IN (SELECT Events.id FROM Events "
-        "JOIN Services ON Events.service_id = Services.id "
-        "JOIN EventTypes ON Events.event_type_id = EventTypes.id "
-        "LEFT JOIN Remotes ON Events.remote_uid = Remotes.remote_uid "
-            "AND Events.local_uid = Remotes.local_uid "
-        "LEFT JOIN Headers ON Headers.event_id = Events.id AND "
-            "Headers.name = 'message-token' WHERE %s);", where))
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, NULL,
+        "DELETE FROM Events WHERE id IN (SELECT Events.id FROM "
+        EVENTS_JOIN_SQL " WHERE %s);", where))
         goto rtcom_el_delete_events_error;
 
     if (!update_group_cache (el, li))
         goto rtcom_el_delete_events_error;
 
-    if (!rtcom_el_db_commit (priv->db, NULL))
+    if (!rtcom_el_db_commit (EL_DB(priv), NULL))
         goto rtcom_el_delete_events_error;
 
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
         NULL);
+    _purge_attachment_files (el);
 
     /* What was really deleted depends on the passed query, so we just
      * notify everyone that they should refresh their model, instead of
@@ -2141,15 +4226,161 @@ gboolean rtcom_el_delete_events(
     return TRUE;
 
 rtcom_el_delete_events_error:
-    rtcom_el_db_rollback (priv->db, NULL);
+    rtcom_el_db_rollback (EL_DB(priv), NULL);
 
     g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
         "Error executing sql.");
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
         NULL);
     return FALSE;
 }
 
+/* Applies "SET set_expr" to all events matching the query that also
+ * satisfy changed_expr. Filtering out the rows that wouldn't change
+ * keeps the GroupCache trigger from firing for them. */
+static gboolean
+_update_events_by_query (
+        RTComEl * el,
+        RTComElQuery * query,
+        const gchar * set_expr,
+        const gchar * changed_expr,
+        GError ** error)
+{
+    RTComElPrivate * priv = RTCOM_EL_GET_PRIV(el);
+    const gchar * where;
+    gint changed;
+
+    where = rtcom_el_query_get_where_clause(query);
+    if (where == NULL)
+        where = "1";
+
+    if (!rtcom_el_db_transaction (EL_DB(priv), FALSE, error))
+        return FALSE;
+
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, error,
+        "UPDATE Events SET %s WHERE %s AND id IN (SELECT Events.id FROM "
+        EVENTS_JOIN_SQL " WHERE %s);", set_expr, changed_expr, where))
+      {
+        rtcom_el_db_rollback (EL_DB(priv), NULL);
+        return FALSE;
+      }
+
+    changed = sqlite3_changes (EL_DB(priv));
+
+    if (!rtcom_el_db_commit (EL_DB(priv), error))
+      {
+        rtcom_el_db_rollback (EL_DB(priv), NULL);
+        return FALSE;
+      }
+
+    /* As with rtcom_el_delete_events, what was really changed depends on
+     * the query, so ask everyone to refresh. */
+    if (changed > 0)
+        _emit_dbus(el, "RefreshHint", -1, NULL);
+
+    return TRUE;
+}
+
+gboolean rtcom_el_set_read_by_query(
+        RTComEl * el,
+        RTComElQuery * query,
+        gboolean read,
+        GError ** error)
+{
+    gboolean ret;
+    gchar * set_expr;
+    gchar * changed_expr;
+
+    g_return_val_if_fail(RTCOM_IS_EL(el), FALSE);
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), FALSE);
+
+    if (!_ensure_db (el, TRUE))
+    {
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+            "Database isn't opened.");
+        return FALSE;
+    }
+
+    set_expr = g_strdup_printf ("is_read = %d", read == TRUE);
+    changed_expr = g_strdup_printf ("is_read <> %d", read == TRUE);
+
+    ret = _update_events_by_query (el, query, set_expr, changed_expr, error);
+
+    g_free (set_expr);
+    g_free (changed_expr);
+    return ret;
+}
+
+static gboolean
+_set_flag_by_query (
+        RTComEl * el,
+        RTComElQuery * query,
+        const gchar * flag,
+        gboolean set,
+        GError ** error)
+{
+    gboolean ret;
+    gint flag_value;
+    gchar * set_expr;
+    gchar * changed_expr;
+
+    g_return_val_if_fail(RTCOM_IS_EL(el), FALSE);
+    g_return_val_if_fail(RTCOM_IS_EL_QUERY(query), FALSE);
+
+    if (!_ensure_db (el, TRUE))
+    {
+        g_set_error(error, RTCOM_EL_ERROR, RTCOM_EL_INTERNAL_ERROR,
+            "Database isn't opened.");
+        return FALSE;
+    }
+
+    flag_value = rtcom_el_get_flag_value(el, flag);
+    if(flag_value == -1)
+    {
+        g_set_error(
+                error,
+                RTCOM_EL_ERROR,
+                RTCOM_EL_INVALID_ARGUMENT_ERROR,
+                "Flag name not in database.");
+        return FALSE;
+    }
+
+    if (set)
+    {
+        set_expr = g_strdup_printf ("flags = flags | %d", flag_value);
+        changed_expr = g_strdup_printf ("(flags & %d) = 0", flag_value);
+    }
+    else
+    {
+        set_expr = g_strdup_printf ("flags = flags & ~%d", flag_value);
+        changed_expr = g_strdup_printf ("(flags & %d) <> 0", flag_value);
+    }
+
+    ret = _update_events_by_query (el, query, set_expr, changed_expr, error);
+
+    g_free (set_expr);
+    g_free (changed_expr);
+    return ret;
+}
+
+gboolean rtcom_el_set_flag_by_query(
+        RTComEl * el,
+        RTComElQuery * query,
+        const gchar * flag,
+        GError ** error)
+{
+    return _set_flag_by_query (el, query, flag, TRUE, error);
+}
+
+gboolean rtcom_el_unset_flag_by_query(
+        RTComEl * el,
+        RTComElQuery * query,
+        const gchar * flag,
+        GError ** error)
+{
+    return _set_flag_by_query (el, query, flag, FALSE, error);
+}
+
 gboolean rtcom_el_delete_by_service(
         RTComEl * el,
         const gchar * service)
@@ -2175,31 +4406,32 @@ gboolean rtcom_el_delete_by_service(
 
     /* if disk is full we might not be in position to create journal, so
      * we turn it off temporarily. */
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = OFF;", NULL);
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = OFF;", NULL);
 
-    if (!rtcom_el_db_transaction (priv->db, FALSE, NULL))
+    if (!rtcom_el_db_transaction (EL_DB(priv), FALSE, NULL))
       goto error;
 
-    if (!rtcom_el_db_exec_printf(priv->db, NULL, NULL, NULL,
+    if (!rtcom_el_db_exec_printf(EL_DB(priv), NULL, NULL, NULL,
         "DELETE FROM Events WHERE service_id=%d;", service_id))
       goto error;
 
-    if (!rtcom_el_db_exec_printf (priv->db, NULL, NULL, NULL,
+    if (!rtcom_el_db_exec_printf (EL_DB(priv), NULL, NULL, NULL,
         "DELETE FROM GroupCache WHERE service_id=%d;", service_id))
       goto error;
 
-    if (!rtcom_el_db_commit (priv->db, NULL))
+    if (!rtcom_el_db_commit (EL_DB(priv), NULL))
       goto error;
 
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
         NULL);
+    _purge_attachment_files (el);
 
     _emit_dbus(el, "AllDeleted", -1, service);
     return TRUE;
 
 error:
-    rtcom_el_db_rollback (priv->db, NULL);
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
+    rtcom_el_db_rollback (EL_DB(priv), NULL);
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
         NULL);
     return FALSE;
 }
@@ -2223,33 +4455,34 @@ gboolean rtcom_el_delete_by_group_uids(
 
     /* if disk is full we might not be in position to create journal, so
      * we turn it off temporarily. */
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = OFF;", NULL);
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = OFF;", NULL);
 
-    if (!rtcom_el_db_transaction (priv->db, FALSE, NULL))
+    if (!rtcom_el_db_transaction (EL_DB(priv), FALSE, NULL))
       goto error;
 
     for (i = 0; group_uids[i] != NULL; i++)
     {
-        if (!rtcom_el_db_exec_printf(priv->db, NULL, NULL, NULL,
+        if (!rtcom_el_db_exec_printf(EL_DB(priv), NULL, NULL, NULL,
             "DELETE FROM Events WHERE group_uid=%Q;", group_uids[i]))
           goto error;
-        if (!rtcom_el_db_exec_printf(priv->db, NULL, NULL, NULL,
+        if (!rtcom_el_db_exec_printf(EL_DB(priv), NULL, NULL, NULL,
             "DELETE FROM GroupCache WHERE group_uid=%Q;", group_uids[i]))
           goto error;
     }
 
-    if (!rtcom_el_db_commit (priv->db, NULL))
+    if (!rtcom_el_db_commit (EL_DB(priv), NULL))
       goto error;
 
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
         NULL);
+    _purge_attachment_files (el);
 
     _emit_dbus(el, "RefreshHint", -1, NULL);
     return TRUE;
 
 error:
-    rtcom_el_db_rollback (priv->db, NULL);
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
+    rtcom_el_db_rollback (EL_DB(priv), NULL);
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
         NULL);
     return FALSE;
 }
@@ -2270,27 +4503,28 @@ gboolean rtcom_el_delete_all(
 
     /* if disk is full we might not be in position to create journal, so
      * we turn it off temporarily. */
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = OFF;", NULL);
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = OFF;", NULL);
 
-    if (!rtcom_el_db_transaction (priv->db, FALSE, NULL))
+    if (!rtcom_el_db_transaction (EL_DB(priv), FALSE, NULL))
       goto delete_all_err;
 
-    if (!rtcom_el_db_exec (priv->db, NULL, NULL, "DELETE FROM Events;", NULL))
+    if (!rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "DELETE FROM Events;", NULL))
       goto delete_all_err;
 
-    if (!rtcom_el_db_commit (priv->db, NULL))
+    if (!rtcom_el_db_commit (EL_DB(priv), NULL))
       goto delete_all_err;
 
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
         NULL);
+    _purge_attachment_files (el);
 
     g_debug("All events, headers and attachments deleted.");
     _emit_dbus(el, "AllDeleted", -1, NULL);
     return TRUE;
 
 delete_all_err:
-    rtcom_el_db_rollback (priv->db, NULL);
-    rtcom_el_db_exec (priv->db, NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
+    rtcom_el_db_rollback (EL_DB(priv), NULL);
+    rtcom_el_db_exec (EL_DB(priv), NULL, NULL, "PRAGMA journal_mode = TRUNCATE;",
         NULL);
     return FALSE;
 }
@@ -2300,7 +4534,7 @@ gint rtcom_el_count_by_service(
         const gchar * service)
 {
     RTComElPrivate * priv;
-    gint service_id = -1, n;
+    gint service_id = -1, n = 0;
 
     g_return_val_if_fail(RTCOM_IS_EL(el), -1);
 
@@ -2313,6 +4547,7 @@ gint rtcom_el_count_by_service(
 
     g_debug("%s: getting number of events for service %s.", G_STRLOC, service);
 
+    /* The counters are kept up to date by triggers on Events */
     if(service != NULL)
     {
         service_id = rtcom_el_get_service_id(el, service);
@@ -2322,14 +4557,14 @@ gint rtcom_el_count_by_service(
             return 0;
         }
 
-        if (!rtcom_el_db_exec_printf(priv->db, rtcom_el_db_single_int, &n, NULL,
-            "SELECT COUNT(*) FROM Events WHERE service_id=%d;", service_id))
+        if (!rtcom_el_db_exec_printf(EL_DB(priv), rtcom_el_db_single_int, &n, NULL,
+            "SELECT total FROM EventCounts WHERE service_id=%d;", service_id))
           return -1;
     }
     else
     {
-        if (!rtcom_el_db_exec_printf(priv->db, rtcom_el_db_single_int, &n, NULL,
-            "SELECT COUNT(*) FROM Events WHERE service_id=%d;", service_id))
+        if (!rtcom_el_db_exec(EL_DB(priv), rtcom_el_db_single_int, &n,
+            "SELECT COALESCE(SUM(total), 0) FROM EventCounts;", NULL))
           return -1;
     }
 
@@ -2341,12 +4576,17 @@ gint rtcom_el_get_service_id(
         const gchar * service)
 {
     RTComElPrivate * priv;
+    ElLookup * lookup;
     gpointer p;
 
     g_return_val_if_fail(RTCOM_IS_EL(el), -1);
 
     priv = RTCOM_EL_GET_PRIV(el);
-    p = g_hash_table_lookup(priv->services, service);
+    lookup = g_atomic_pointer_get(&priv->lookup);
+    if(!lookup)
+        return -1;
+
+    p = g_hash_table_lookup(lookup->services, service);
     if(!p)
         return -1;
 
@@ -2358,12 +4598,17 @@ gint rtcom_el_get_eventtype_id(
         const gchar * eventtype)
 {
     RTComElPrivate * priv;
+    ElLookup * lookup;
     gpointer p;
 
     g_return_val_if_fail(RTCOM_IS_EL(el), -1);
 
     priv = RTCOM_EL_GET_PRIV(el);
-    p = g_hash_table_lookup(priv->event_types, eventtype);
+    lookup = g_atomic_pointer_get(&priv->lookup);
+    if(!lookup)
+        return -1;
+
+    p = g_hash_table_lookup(lookup->event_types, eventtype);
     if(!p)
         return -1;
 
@@ -2375,12 +4620,17 @@ gint rtcom_el_get_flag_id(
         const gchar * flag)
 {
     RTComElPrivate * priv;
+    ElLookup * lookup;
     gpointer p;
 
     g_return_val_if_fail(RTCOM_IS_EL(el), -1);
 
     priv = RTCOM_EL_GET_PRIV(el);
-    p = g_hash_table_lookup(priv->flags, flag);
+    lookup = g_atomic_pointer_get(&priv->lookup);
+    if(!lookup)
+        return -1;
+
+    p = g_hash_table_lookup(lookup->flags, flag);
     if(!p)
         return -1;
 
@@ -2397,66 +4647,57 @@ gint rtcom_el_get_flag_id(
 static const gchar *
 el_get_home_dir (void)
 {
-    static const gchar *home = NULL;
+    static gsize home = 0;
 
-    if (home == NULL)
+    if (g_once_init_enter (&home))
     {
-        home = g_getenv ("RTCOM_EL_HOME");
+        const gchar *dir = g_getenv ("RTCOM_EL_HOME");
 
-        if (home == NULL)
+        if (dir == NULL)
         {
-            home = g_get_home_dir ();
+            dir = g_get_home_dir ();
         }
+
+        g_once_init_leave (&home, (gsize) dir);
     }
 
-    return home;
+    return (const gchar *) home;
 }
 
-static void
-_build_db_representation (
-        sqlite3 ** db,
-        GHashTable ** services,
-        GHashTable ** event_types,
-        GHashTable ** flags)
+static ElLookup *
+_lookup_new (sqlite3 * db)
 {
+    ElLookup * lookup;
+
     g_assert(db);
-    g_assert(*db);
-    g_assert(services);
-    g_assert(event_types);
-    g_assert(flags);
 
-    *services = rtcom_el_db_cache_lookup_table (*db, "Services");
-    *event_types = rtcom_el_db_cache_lookup_table (*db, "EventTypes");
-    *flags = rtcom_el_db_cache_lookup_table (*db, "Flags");
+    lookup = g_slice_new(ElLookup);
+    lookup->services = rtcom_el_db_cache_lookup_table (db, "Services");
+    lookup->event_types = rtcom_el_db_cache_lookup_table (db, "EventTypes");
+    lookup->flags = rtcom_el_db_cache_lookup_table (db, "Flags");
+
+    return lookup;
 }
 
 static void
-_free_db_representation (
-        GHashTable ** services,
-        GHashTable ** event_types,
-        GHashTable ** flags)
+_lookup_free (ElLookup * lookup)
 {
-    if(services && *services)
-    {
-        g_hash_table_destroy(*services);
-        *services = NULL;
-    }
+    if(lookup->services)
+        g_hash_table_destroy(lookup->services);
 
-    if(event_types && *event_types)
-    {
-        g_hash_table_destroy(*event_types);
-        *event_types = NULL;
-    }
+    if(lookup->event_types)
+        g_hash_table_destroy(lookup->event_types);
 
-    if(flags && *flags)
-    {
-        g_hash_table_destroy(*flags);
-        *flags = NULL;
-    }
+    if(lookup->flags)
+        g_hash_table_destroy(lookup->flags);
+
+    g_slice_free(ElLookup, lookup);
 }
 
 static void
-_load_plugins (RTComElPrivate * priv)
+_load_plugins (
+        RTComElPrivate * priv,
+        ElLookup * lookup)
 {
     const gchar * system_dir = PACKAGE_PLUGINS_DIR;
     gchar * user_dir = NULL;
@@ -2482,7 +4723,7 @@ _load_plugins (RTComElPrivate * priv)
 
     if(only_env)
     {
-        if(!_scan_plugins_dir(env_path, priv))
+        if(!_scan_plugins_dir(env_path, priv, lookup))
             g_warning("Some env plugins could not be loaded.");
     }
     else
@@ -2533,10 +4774,10 @@ _load_plugins (RTComElPrivate * priv)
             }
         }
 
-        if(!_scan_plugins_dir(system_dir, priv))
+        if(!_scan_plugins_dir(system_dir, priv, lookup))
             g_warning("Some system plugins could not be loaded.");
 
-        if(!_scan_plugins_dir(user_dir, priv))
+        if(!_scan_plugins_dir(user_dir, priv, lookup))
             g_warning("Some user plugins could not be loaded.");
 
         g_free(user_dir);
@@ -2546,7 +4787,8 @@ _load_plugins (RTComElPrivate * priv)
 static gboolean
 _scan_plugins_dir (
         const gchar * dir,
-        RTComElPrivate * priv)
+        RTComElPrivate * priv,
+        ElLookup * lookup)
 {
     GDir * d = NULL;
     const gchar * filename = NULL;
@@ -2570,7 +4812,7 @@ _scan_plugins_dir (
                 && (extension = strrchr(filename, '.'))
                 && (strcmp(++extension, G_MODULE_SUFFIX) == 0))
         {
-            ret &= _load_plugin(pathname, priv);
+            ret &= _load_plugin(pathname, priv, lookup);
         }
         g_free(pathname);
     }
@@ -2582,7 +4824,8 @@ _scan_plugins_dir (
 static gboolean
 _load_plugin (
         const gchar * filename,
-        RTComElPrivate * priv)
+        RTComElPrivate * priv,
+        ElLookup * lookup)
 {
     RTComElPlugin * plugin = g_new0(RTComElPlugin, 1);
     GHashTable * plugins = NULL;
@@ -2674,7 +4917,34 @@ _load_plugin (
         g_debug("Couldn't find 'rtcom_el_plugin_get_value' in %s", filename);
     }
 
-    if((service_id = _init_plugin(plugin, priv)) == -1)
+    if(!g_module_symbol(
+                plugin->module,
+                "rtcom_el_plugin_get_value_by_id",
+                (gpointer)(&(plugin->get_value_by_id))))
+    {
+        g_debug("Couldn't find 'rtcom_el_plugin_get_value_by_id' in %s",
+                filename);
+    }
+
+    if(!g_module_symbol(
+                plugin->module,
+                "rtcom_el_plugin_get_values",
+                (gpointer)(&(plugin->get_values))))
+    {
+        g_debug("Couldn't find 'rtcom_el_plugin_get_values' in %s",
+                filename);
+    }
+
+    if(!g_module_symbol(
+                plugin->module,
+                "rtcom_el_plugin_get_values_fields",
+                (gpointer)(&(plugin->get_values_fields))))
+    {
+        g_debug("Couldn't find 'rtcom_el_plugin_get_values_fields' in %s",
+                filename);
+    }
+
+    if((service_id = _init_plugin(plugin, priv, lookup)) == -1)
     {
         g_warning("There was an error initializing the plugin.");
         return FALSE;
@@ -2692,7 +4962,8 @@ _load_plugin (
 static gint
 _init_plugin (
         RTComElPlugin * plugin,
-        RTComElPrivate * priv)
+        RTComElPrivate * priv,
+        ElLookup * lookup)
 {
     const gchar * name = NULL;
     const gchar * desc = NULL;
@@ -2709,7 +4980,7 @@ _init_plugin (
     g_assert(plugin);
     g_assert(priv);
 
-    db = priv->db;
+    db = EL_DB(priv);
 
     /* Some plugins have init routine, others don't.
      * It's not an error, don't warn on it. */
@@ -2772,7 +5043,7 @@ _init_plugin (
      * This can happen only because the plugin is not using a really
      * unique service name (FIXME: in that case service selection above
      * will be horribly wrong) */
-    p = g_hash_table_lookup(priv->services, service->name);
+    p = g_hash_table_lookup(lookup->services, service->name);
     if(p)
     {
         g_warning(
@@ -2792,7 +5063,7 @@ _init_plugin (
       goto db_error;
 
     service->id = sqlite3_last_insert_rowid(db);
-    g_hash_table_insert(priv->services, g_strdup(service->name), GINT_TO_POINTER(service->id));
+    g_hash_table_insert(lookup->services, g_strdup(service->name), GINT_TO_POINTER(service->id));
     service_id = service->id;
     g_debug("Service '%s' inserted with id %d.", service->name, service->id);
 
@@ -2806,7 +5077,7 @@ _init_plugin (
         for (li = event_types; li; li = li->next)
         {
             event_type = (RTComElEventType *) li->data;
-            p = g_hash_table_lookup(priv->event_types, event_type->name);
+            p = g_hash_table_lookup(lookup->event_types, event_type->name);
             if(p)
             {
                 g_warning(
@@ -2832,7 +5103,7 @@ _init_plugin (
             }
 
             event_type->id = sqlite3_last_insert_rowid(db);
-            g_hash_table_insert(priv->event_types, g_strdup(event_type->name), GINT_TO_POINTER(event_type->id));
+            g_hash_table_insert(lookup->event_types, g_strdup(event_type->name), GINT_TO_POINTER(event_type->id));
             g_debug("EventType %s inserted.", event_type->name);
         }
 
@@ -2851,7 +5122,7 @@ _init_plugin (
         {
 
             flag = (RTComElFlag *) li->data;
-            p = g_hash_table_lookup(priv->flags, flag->name);
+            p = g_hash_table_lookup(lookup->flags, flag->name);
             if(p)
             {
                 g_warning(
@@ -2877,7 +5148,7 @@ _init_plugin (
                 goto db_error;
             }
             flag->id = sqlite3_last_insert_rowid(db);
-            g_hash_table_insert(priv->flags, g_strdup(flag->name), GINT_TO_POINTER(flag->id));
+            g_hash_table_insert(lookup->flags, g_strdup(flag->name), GINT_TO_POINTER(flag->id));
             g_debug("Flag %s inserted.", flag->name);
         }
 
@@ -2920,44 +5191,6 @@ _unload_plugin (
     g_free(plugin);
 }
 
-static gchar *
-_build_unique_dirname (const gchar * parent)
-{
-    gchar * tmp = NULL;
-    GString * dir = NULL;
-    guint i = 0;
-    time_t t = 0;
-    struct tm * stm = NULL;
-    gchar time_buf[12+1] = {0};
-
-    g_return_val_if_fail(parent, NULL);
-
-    /* XXX: racy if you don't create the directory in the act */
-
-    dir = g_string_new(NULL);
-    do
-    {
-        t = time(0);
-        stm = gmtime(&t);
-        memset(time_buf, 0, 12+1);
-        strftime(time_buf, 12+1, "%Y%m%d%H%M", stm);
-        tmp = g_build_filename(
-                parent,
-                time_buf,
-                NULL);
-
-        g_string_erase(dir, 0, -1);
-        g_string_append(dir, tmp);
-        if(i != 0)
-            g_string_append_printf(dir, "-%d", i);
-        g_free(tmp);
-
-        i++;
-    } while(g_file_test(dir->str, G_FILE_TEST_EXISTS));
-
-    return g_string_free(dir, FALSE);
-}
-
 /* FIXME: Use dbus-glib signal bindings on GObjects for the win */
 static void
 _emit_dbus (
@@ -3144,7 +5377,7 @@ _dbus_filter_callback (
                 /* If needed, reopen the DB and send the refresh-hint
                  * signal. Take care not to emit DbReopen D-Bus signal
                  * again. */
-                if (priv->db == NULL)
+                if (!g_atomic_int_get(&priv->ready))
                 {
                     if (_ensure_db(el, FALSE))
                     {
@@ -3182,11 +5415,11 @@ static void _get_events_dbus_data(
           "Events LEFT JOIN Remotes ON Events.remote_uid = Remotes.remote_uid AND "
           "Events.local_uid = Remotes.local_uid WHERE id=?;";
 
-    ret = sqlite3_prepare(priv->db, sql, -1, &stmt, NULL);
+    ret = sqlite3_prepare(EL_DB(priv), sql, -1, &stmt, NULL);
     if(ret != SQLITE_OK)
     {
         g_warning("Could not prepare statement for sql \"%s\": %s", sql,
-            sqlite3_errmsg(priv->db));
+            sqlite3_errmsg(EL_DB(priv)));
         return;
     }
 
@@ -0,0 +1,182 @@
+/**
+ * Copyright (C) 2026 The rtcom-eventlogger contributors.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Measures attachment ingest throughput. Run with "make bench" so that
+ * the test plugin and a scratch RTCOM_EL_HOME are used. */
+
+#include "rtcom-eventlogger/eventlogger.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SERVICE "RTCOM_EL_SERVICE_TEST"
+#define EVENT_TYPE "RTCOM_EL_EVENTTYPE_TEST_ET1"
+#define LOCAL_UID "bench@example.com"
+
+static gint size_mb = 8;
+static gint iterations = 10;
+static gboolean sync_files = FALSE;
+
+static GOptionEntry entries[] = {
+    { "size", 's', 0, G_OPTION_ARG_INT, &size_mb,
+        "Attachment size in MiB (default: 8)", "MB" },
+    { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+        "Number of attachments per mode (default: 10)", "N" },
+    { "sync", 0, 0, G_OPTION_ARG_NONE, &sync_files,
+        "fsync every stored attachment", NULL },
+    { NULL }
+};
+
+static gchar *
+make_file (gsize size)
+{
+    gchar *path = NULL;
+    gchar *data;
+    gint fd;
+    gsize i;
+
+    /* Create the source next to the database, so that moving it into
+     * the attachment store doesn't cross filesystems. */
+    path = g_build_filename (g_getenv ("RTCOM_EL_HOME") ?
+        g_getenv ("RTCOM_EL_HOME") : g_get_home_dir (),
+        "bench-attach.XXXXXX", NULL);
+    fd = g_mkstemp (path);
+    if (fd < 0)
+    {
+        g_free (path);
+        return NULL;
+    }
+    close (fd);
+
+    /* Random, so that no two sources share content and the store
+     * never gets to skip one as already stored */
+    data = g_malloc (size);
+    for (i = 0; i < size; i += sizeof (guint32))
+    {
+        guint32 r = g_random_int ();
+
+        memcpy (data + i, &r, MIN (sizeof (r), size - i));
+    }
+
+    if (!g_file_set_contents (path, data, size, NULL))
+    {
+        g_unlink (path);
+        g_free (path);
+        path = NULL;
+    }
+
+    g_free (data);
+    return path;
+}
+
+static void
+run (RTComEl *el, gint event_id, RTComElAttachFlags flags,
+        const gchar *name)
+{
+    gsize size = (gsize) size_mb * 1024 * 1024;
+    gdouble elapsed = 0;
+    GTimer *timer;
+    gint i;
+
+    timer = g_timer_new ();
+
+    for (i = 0; i < iterations; i++)
+    {
+        GError *error = NULL;
+        gchar *path = make_file (size);
+
+        if (path == NULL)
+        {
+            g_printerr ("can't create source file\n");
+            exit (EXIT_FAILURE);
+        }
+
+        g_timer_start (timer);
+        if (rtcom_el_add_attachment_with_flags (el, event_id, path, NULL,
+                flags, &error) < 0)
+        {
+            g_printerr ("%s: %s\n", name, error->message);
+            exit (EXIT_FAILURE);
+        }
+        g_timer_stop (timer);
+        elapsed += g_timer_elapsed (timer, NULL);
+
+        g_unlink (path);
+        g_free (path);
+    }
+
+    g_timer_destroy (timer);
+
+    g_print ("%-6s %3d x %4d MiB: %8.3f s, %8.1f MiB/s\n", name, iterations,
+        size_mb, elapsed, (iterations * size_mb) / elapsed);
+}
+
+int
+main (int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    RTComElEvent *ev;
+    RTComEl *el;
+    gint event_id;
+    RTComElAttachFlags extra;
+
+#if !GLIB_CHECK_VERSION(2,35,0)
+    g_type_init ();
+#endif
+
+    context = g_option_context_new ("- attachment ingest benchmark");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free (context);
+
+    el = rtcom_el_new ();
+
+    ev = rtcom_el_event_new ();
+    RTCOM_EL_EVENT_SET_FIELD (ev, service, g_strdup (SERVICE));
+    RTCOM_EL_EVENT_SET_FIELD (ev, event_type, g_strdup (EVENT_TYPE));
+    RTCOM_EL_EVENT_SET_FIELD (ev, local_uid, g_strdup (LOCAL_UID));
+    event_id = rtcom_el_add_event (el, ev, &error);
+    rtcom_el_event_free_contents (ev);
+    rtcom_el_event_free (ev);
+
+    if (event_id < 0)
+    {
+        g_printerr ("can't add event: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+
+    extra = sync_files ? RTCOM_EL_ATTACH_SYNC : 0;
+    run (el, event_id, RTCOM_EL_ATTACH_COPY | extra, "copy");
+    run (el, event_id, RTCOM_EL_ATTACH_MOVE | extra, "move");
+
+    rtcom_el_delete_event (el, event_id, NULL);
+    g_object_unref (el);
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ai et tw=75 ts=4 sw=4: */
@@ -23,6 +23,8 @@
  */
 
 #include "rtcom-eventlogger/eventlogger.h"
+#include "rtcom-eventlogger/eventlogger-live-query.h"
+#include "rtcom-eventlogger/db.h"
 
 #include <glib.h>
 #include <glib/gstdio.h>
@@ -455,6 +457,22 @@ START_TEST(test_add_full)
 
     g_object_unref (att_it);
 
+    /* A missing attachment file fails the whole insertion */
+    attachments = g_list_prepend (NULL,
+            rtcom_el_attachment_new (path1, NULL));
+    fail_unless (rtcom_el_add_event_full (el, ev, NULL, attachments,
+                NULL) == -1);
+    g_list_foreach (attachments, (GFunc) rtcom_el_free_attachment, NULL);
+    g_list_free (attachments);
+
+    query = rtcom_el_query_new(el);
+    fail_unless (rtcom_el_query_prepare (query,
+                "id", event_id, RTCOM_EL_OP_GREATER,
+                NULL));
+    it = rtcom_el_get_events(el, query);
+    g_object_unref(query);
+    fail_unless (it == NULL, "No event should have been added");
+
     g_free (path1);
     g_free (path2);
 
@@ -656,6 +674,417 @@ START_TEST(test_attach)
 }
 END_TEST
 
+START_TEST(test_attach_move)
+{
+    RTComElEvent * ev = NULL;
+    gint event_id = -1;
+    gint attachment_id = -1;
+    RTComElAttachIter * att_it = NULL;
+    RTComElAttachment *att = NULL;
+    RTComElQuery * query = NULL;
+    RTComElIter * it = NULL;
+    gchar *contents;
+    gsize length;
+    gchar *attach_path;
+    gint fd;
+
+    ev = event_new_lite ();
+    fail_if (ev == NULL, "Failed to create event");
+
+    event_id = rtcom_el_add_event(el, ev, NULL);
+    fail_if (event_id < 0, "Failed to add event");
+
+    fd = g_file_open_tmp ("attachment.XXXXXX", &attach_path, NULL);
+    fail_unless (fd >= 0);
+    close (fd);
+    fail_unless (g_file_set_contents (attach_path, "lalala", 6, NULL));
+
+    attachment_id = rtcom_el_add_attachment_with_flags(
+            el, event_id,
+            attach_path, ATTACH_DESC,
+            RTCOM_EL_ATTACH_MOVE | RTCOM_EL_ATTACH_SYNC,
+            NULL);
+    fail_if (attachment_id < 0, "Failed to add attachment");
+
+    /* The file was handed over, so it's gone from its old location */
+    fail_if (g_file_test (attach_path, G_FILE_TEST_EXISTS));
+
+    query = rtcom_el_query_new(el);
+    fail_unless (rtcom_el_query_prepare(
+                query,
+                "id", event_id, RTCOM_EL_OP_EQUAL,
+                NULL));
+    it = rtcom_el_get_events(el, query);
+    g_object_unref(query);
+
+    fail_unless (it != NULL, "Failed to get iterator");
+    fail_unless (rtcom_el_iter_first(it), "Failed to start iterator");
+    att_it = rtcom_el_iter_get_attachments(it);
+    fail_unless (att_it != NULL, "Failed to get attachment iterator");
+    g_object_unref(it);
+
+    fail_unless (rtcom_el_attach_iter_first(att_it));
+    att = rtcom_el_attach_iter_get(att_it);
+    fail_if (att == NULL, "failed to get attachment data");
+    fail_unless (g_file_get_contents (att->path, &contents, &length, NULL));
+    rtcom_fail_unless_uintcmp (length, ==, 6);
+    rtcom_fail_unless_strcmp (contents, ==, "lalala");
+    g_free (contents);
+
+    g_free (attach_path);
+    rtcom_el_free_attachment (att);
+    g_object_unref(att_it);
+    rtcom_el_event_free_contents (ev);
+    rtcom_el_event_free (ev);
+}
+END_TEST
+
+START_TEST(test_attach_move_failed)
+{
+    RTComElEvent * ev = NULL;
+    gint event_id = -1;
+    gint attachment_id = -1;
+    GError * error = NULL;
+    sqlite3 * db = NULL;
+    gchar *contents;
+    gsize length;
+    gchar *attach_path;
+    gint fd;
+
+    ev = event_new_lite ();
+    fail_if (ev == NULL, "Failed to create event");
+
+    event_id = rtcom_el_add_event(el, ev, NULL);
+    fail_if (event_id < 0, "Failed to add event");
+
+    fd = g_file_open_tmp ("attachment.XXXXXX", &attach_path, NULL);
+    fail_unless (fd >= 0);
+    close (fd);
+    fail_unless (g_file_set_contents (attach_path, "lalala", 6, NULL));
+
+    /* Make the insert itself fail, after the file is stored */
+    g_object_get (el, "db", &db, NULL);
+    fail_unless (sqlite3_exec (db,
+                "CREATE TEMP TRIGGER fail_attachments "
+                "BEFORE INSERT ON Attachments "
+                "BEGIN SELECT RAISE(ABORT, 'refused'); END;",
+                NULL, NULL, NULL) == SQLITE_OK);
+
+    attachment_id = rtcom_el_add_attachment_with_flags(
+            el, event_id,
+            attach_path, ATTACH_DESC,
+            RTCOM_EL_ATTACH_MOVE | RTCOM_EL_ATTACH_SYNC,
+            &error);
+
+    fail_unless (sqlite3_exec (db, "DROP TRIGGER fail_attachments;",
+                NULL, NULL, NULL) == SQLITE_OK);
+
+    rtcom_fail_unless_intcmp (attachment_id, ==, -1);
+    fail_unless (error != NULL);
+    g_clear_error (&error);
+
+    /* Nothing was handed over, so the caller still has the file */
+    fail_unless (g_file_get_contents (attach_path, &contents, &length,
+                NULL));
+    rtcom_fail_unless_uintcmp (length, ==, 6);
+    rtcom_fail_unless_strcmp (contents, ==, "lalala");
+    g_free (contents);
+
+    g_unlink (attach_path);
+    g_free (attach_path);
+    rtcom_el_event_free_contents (ev);
+    rtcom_el_event_free (ev);
+}
+END_TEST
+
+static gchar *
+first_attachment_path (gint event_id)
+{
+    RTComElQuery * query = NULL;
+    RTComElIter * it = NULL;
+    RTComElAttachIter * att_it = NULL;
+    RTComElAttachment * att = NULL;
+    gchar * path;
+
+    query = rtcom_el_query_new(el);
+    fail_unless (rtcom_el_query_prepare(
+                query,
+                "id", event_id, RTCOM_EL_OP_EQUAL,
+                NULL));
+    it = rtcom_el_get_events(el, query);
+    g_object_unref(query);
+
+    fail_unless (it != NULL, "Failed to get iterator");
+    fail_unless (rtcom_el_iter_first(it), "Failed to start iterator");
+    att_it = rtcom_el_iter_get_attachments(it);
+    fail_unless (att_it != NULL, "Failed to get attachment iterator");
+    g_object_unref(it);
+
+    fail_unless (rtcom_el_attach_iter_first(att_it));
+    att = rtcom_el_attach_iter_get(att_it);
+    fail_if (att == NULL, "failed to get attachment data");
+    path = g_strdup (att->path);
+
+    rtcom_el_free_attachment (att);
+    g_object_unref(att_it);
+    return path;
+}
+
+START_TEST(test_add_unique_token)
+{
+    RTComElEvent * ev = NULL;
+    GHashTable * headers;
+    gint event_id1, event_id2, event_id3;
+
+    headers = g_hash_table_new (g_str_hash, g_str_equal);
+    g_hash_table_insert (headers, "message-token", "unique-token-1");
+
+    ev = event_new_full (time (NULL));
+    fail_unless (ev != NULL, "Failed to create event.");
+
+    event_id1 = rtcom_el_add_event_full_with_flags (el, ev, headers, NULL,
+            RTCOM_EL_ADD_UNIQUE_TOKEN, NULL);
+    fail_if (event_id1 < 0, "Failed to add event");
+
+    /* A redelivery gives back the stored event */
+    event_id2 = rtcom_el_add_event_full_with_flags (el, ev, headers, NULL,
+            RTCOM_EL_ADD_UNIQUE_TOKEN, NULL);
+    rtcom_fail_unless_intcmp (event_id2, ==, event_id1);
+
+    /* Without the flag, duplicates are stored as before */
+    event_id3 = rtcom_el_add_event_full (el, ev, headers, NULL, NULL);
+    fail_if (event_id3 < 0, "Failed to add event");
+    fail_if (event_id3 == event_id1);
+
+    /* Once the event is gone, the token can be used again */
+    fail_unless (rtcom_el_delete_event (el, event_id1, NULL) == 0);
+    event_id2 = rtcom_el_add_event_full_with_flags (el, ev, headers, NULL,
+            RTCOM_EL_ADD_UNIQUE_TOKEN, NULL);
+    fail_if (event_id2 < 0, "Failed to add event");
+    fail_if (event_id2 == event_id1);
+
+    g_hash_table_destroy (headers);
+    rtcom_el_event_free_contents (ev);
+    rtcom_el_event_free (ev);
+}
+END_TEST
+
+START_TEST(test_attach_dedup)
+{
+    RTComElEvent * ev = NULL;
+    gint event_id1 = -1, event_id2 = -1;
+    gchar *attach_path;
+    gchar *path1, *path2;
+
+    ev = event_new_lite ();
+    fail_if (ev == NULL, "Failed to create event");
+
+    event_id1 = rtcom_el_add_event(el, ev, NULL);
+    fail_if (event_id1 < 0, "Failed to add event");
+    event_id2 = rtcom_el_add_event(el, ev, NULL);
+    fail_if (event_id2 < 0, "Failed to add event");
+
+    attach_path = g_build_filename (g_get_tmp_dir (), "dedup.txt", NULL);
+    fail_unless (g_file_set_contents (attach_path, "lalala", 6, NULL));
+
+    fail_if (rtcom_el_add_attachment (el, event_id1, attach_path,
+                ATTACH_DESC, NULL) < 0, "Failed to add attachment");
+    fail_if (rtcom_el_add_attachment (el, event_id2, attach_path,
+                ATTACH_DESC, NULL) < 0, "Failed to add attachment");
+    g_unlink (attach_path);
+
+    /* Same contents, so both events share the stored file */
+    path1 = first_attachment_path (event_id1);
+    path2 = first_attachment_path (event_id2);
+    rtcom_fail_unless_strcmp (path1, ==, path2);
+    fail_unless (g_str_has_suffix (path1, "dedup.txt"));
+
+    /* The file goes away only with the last attachment using it */
+    fail_unless (rtcom_el_delete_event (el, event_id1, NULL) == 0);
+    fail_unless (g_file_test (path1, G_FILE_TEST_EXISTS));
+    fail_unless (rtcom_el_delete_event (el, event_id2, NULL) == 0);
+    fail_if (g_file_test (path1, G_FILE_TEST_EXISTS));
+
+    g_free (path1);
+    g_free (path2);
+    g_free (attach_path);
+    rtcom_el_event_free_contents (ev);
+    rtcom_el_event_free (ev);
+}
+END_TEST
+
+static int
+count_cb (void *data, int n_columns, char **values, char **names)
+{
+    *(gint *) data = (gint) g_ascii_strtoll (values[0], NULL, 10);
+    return 0;
+}
+
+START_TEST(test_attach_migrate)
+{
+    RTComElEvent * ev = NULL;
+    RTComEl * el2 = NULL;
+    gint event_id = -1;
+    const gchar *home;
+    gchar *legacy_dir, *legacy_path, *attach_path, *path;
+    gchar *missing_path;
+    gchar *sql, *contents;
+    gsize length;
+    gint failures = 0;
+    gpointer db;
+
+    ev = event_new_lite ();
+    fail_if (ev == NULL, "Failed to create event");
+
+    event_id = rtcom_el_add_event(el, ev, NULL);
+    fail_if (event_id < 0, "Failed to add event");
+
+    attach_path = g_build_filename (g_get_tmp_dir (), "legacy.txt", NULL);
+    fail_unless (g_file_set_contents (attach_path, "legacy", 6, NULL));
+    fail_if (rtcom_el_add_attachment (el, event_id, attach_path,
+                ATTACH_DESC, NULL) < 0, "Failed to add attachment");
+
+    /* Pretend it was stored in the old minute-named directory layout */
+    home = g_getenv ("RTCOM_EL_HOME");
+    if (!home)
+        home = g_get_home_dir();
+
+    legacy_dir = g_build_filename (home, ".rtcom-eventlogger", "attachments",
+            "200901011200-1", NULL);
+    legacy_path = g_build_filename (legacy_dir, "legacy.txt", NULL);
+    fail_unless (g_mkdir_with_parents (legacy_dir, S_IRWXU) == 0);
+    fail_unless (g_rename (attach_path, legacy_path) == 0);
+
+    g_object_get (el, "db", &db, NULL);
+    sql = sqlite3_mprintf ("UPDATE Attachments SET path = %Q "
+            "WHERE event_id = %d;", legacy_path, event_id);
+    fail_unless (sqlite3_exec (db, sql, NULL, NULL, NULL) == SQLITE_OK);
+    sqlite3_free (sql);
+
+    /* One whose file is gone can't be migrated */
+    missing_path = g_build_filename (home, ".rtcom-eventlogger",
+            "attachments", "200901011201-1", "missing.txt", NULL);
+    sql = sqlite3_mprintf ("INSERT INTO Attachments (event_id, path) "
+            "VALUES (%d, %Q);", event_id, missing_path);
+    fail_unless (sqlite3_exec (db, sql, NULL, NULL, NULL) == SQLITE_OK);
+    sqlite3_free (sql);
+
+    /* Opening the database moves it into the attachment store, from the
+     * main loop */
+    el2 = rtcom_el_new ();
+    fail_unless (el2 != NULL);
+    while (g_main_context_pending (NULL))
+        g_main_context_iteration (NULL, FALSE);
+    g_object_unref (el2);
+
+    /* Recorded, so that it isn't tried again */
+    sql = sqlite3_mprintf ("SELECT COUNT(*) FROM AttachmentMigrationFailures "
+            "WHERE path = %Q;", missing_path);
+    fail_unless (sqlite3_exec (db, sql, count_cb, &failures, NULL) ==
+            SQLITE_OK);
+    sqlite3_free (sql);
+    rtcom_fail_unless_intcmp (failures, ==, 1);
+
+    path = first_attachment_path (event_id);
+    rtcom_fail_unless_strcmp (path, !=, legacy_path);
+    fail_unless (g_str_has_suffix (path, "legacy.txt"));
+    fail_unless (g_file_get_contents (path, &contents, &length, NULL));
+    rtcom_fail_unless_uintcmp (length, ==, 6);
+    rtcom_fail_unless_strcmp (contents, ==, "legacy");
+    g_free (contents);
+
+    fail_if (g_file_test (legacy_dir, G_FILE_TEST_EXISTS));
+
+    g_free (path);
+    g_free (missing_path);
+    g_free (legacy_path);
+    g_free (legacy_dir);
+    g_free (attach_path);
+    rtcom_el_event_free_contents (ev);
+    rtcom_el_event_free (ev);
+}
+END_TEST
+
+static void
+attachments_collected_cb (RTComEl *el, guint64 reclaimed, gpointer data)
+{
+    *(gint64 *) data = reclaimed;
+}
+
+START_TEST(test_attach_gc)
+{
+    RTComElEvent * ev = NULL;
+    gint event_id = -1;
+    const gchar *home;
+    gchar *orphan_dir, *orphan_path, *attach_path, *path;
+    guint64 reclaimed = 0;
+    gint64 idle_reclaimed = -1;
+
+    ev = event_new_lite ();
+    fail_if (ev == NULL, "Failed to create event");
+
+    event_id = rtcom_el_add_event(el, ev, NULL);
+    fail_if (event_id < 0, "Failed to add event");
+
+    attach_path = g_build_filename (g_get_tmp_dir (), "kept.txt", NULL);
+    fail_unless (g_file_set_contents (attach_path, "kept", 4, NULL));
+    fail_if (rtcom_el_add_attachment (el, event_id, attach_path,
+                ATTACH_DESC, NULL) < 0, "Failed to add attachment");
+    g_unlink (attach_path);
+    path = first_attachment_path (event_id);
+
+    /* Clear whatever the earlier tests left behind */
+    g_setenv ("RTCOM_EL_ATTACH_GC_AGE", "0", TRUE);
+    fail_unless (rtcom_el_collect_attachments (el, NULL, NULL));
+    fail_unless (g_file_test (path, G_FILE_TEST_EXISTS));
+
+    home = g_getenv ("RTCOM_EL_HOME");
+    if (!home)
+        home = g_get_home_dir();
+
+    orphan_dir = g_build_filename (home, ".rtcom-eventlogger", "attachments",
+            "ff", "ff", "ffff", NULL);
+    orphan_path = g_build_filename (orphan_dir, "orphan.txt", NULL);
+    fail_unless (g_mkdir_with_parents (orphan_dir, S_IRWXU) == 0);
+    fail_unless (g_file_set_contents (orphan_path, "orphan", 6, NULL));
+
+    /* Too fresh to tell from one an attachment is about to refer to */
+    g_unsetenv ("RTCOM_EL_ATTACH_GC_AGE");
+    fail_unless (rtcom_el_collect_attachments (el, &reclaimed, NULL));
+    fail_unless (reclaimed == 0);
+    fail_unless (g_file_test (orphan_path, G_FILE_TEST_EXISTS));
+
+    g_setenv ("RTCOM_EL_ATTACH_GC_AGE", "0", TRUE);
+    fail_unless (rtcom_el_collect_attachments (el, &reclaimed, NULL));
+    fail_unless (reclaimed == 6);
+    fail_if (g_file_test (orphan_path, G_FILE_TEST_EXISTS));
+    fail_if (g_file_test (orphan_dir, G_FILE_TEST_EXISTS));
+    fail_unless (g_file_test (path, G_FILE_TEST_EXISTS));
+
+    /* Same again, from the main loop */
+    fail_unless (g_mkdir_with_parents (orphan_dir, S_IRWXU) == 0);
+    fail_unless (g_file_set_contents (orphan_path, "orphan", 6, NULL));
+
+    g_signal_connect (el, "attachments-collected",
+            G_CALLBACK (attachments_collected_cb), &idle_reclaimed);
+    rtcom_el_collect_attachments_idle (el);
+    while (idle_reclaimed < 0)
+        g_main_context_iteration (NULL, TRUE);
+
+    fail_unless (idle_reclaimed == 6);
+    fail_if (g_file_test (orphan_path, G_FILE_TEST_EXISTS));
+    fail_unless (g_file_test (path, G_FILE_TEST_EXISTS));
+    g_unsetenv ("RTCOM_EL_ATTACH_GC_AGE");
+
+    g_free (path);
+    g_free (orphan_path);
+    g_free (orphan_dir);
+    g_free (attach_path);
+    rtcom_el_event_free_contents (ev);
+    rtcom_el_event_free (ev);
+}
+END_TEST
+
 START_TEST(test_read)
 {
     RTComElQuery * query = NULL;
@@ -759,6 +1188,19 @@ START_TEST(test_read)
     g_object_unref (query);
     fail_unless (it == NULL, "all read flags should have been unset");
 
+    /* An invalid id anywhere in the array leaves every event untouched */
+    ids[1] = -1;
+    rtcom_fail_unless_intcmp (rtcom_el_set_read_events (el, ids, TRUE, NULL),
+            ==, -1);
+
+    query = rtcom_el_query_new (el);
+    fail_unless (rtcom_el_query_prepare(query,
+                "is-read", TRUE, RTCOM_EL_OP_EQUAL,
+                NULL));
+    it = rtcom_el_get_events(el, query);
+    g_object_unref (query);
+    fail_unless (it == NULL, "failed batch should have been rolled back");
+
     rtcom_el_event_free_contents (ev);
     rtcom_el_event_free (ev);
 }
@@ -813,27 +1255,93 @@ START_TEST(test_flags)
 END_TEST
 
 
-START_TEST(test_get)
+START_TEST(test_update_by_query)
 {
     RTComElQuery * query = NULL;
-    RTComElEvent * ev = NULL;
-    RTComElEvent *result = NULL;
-    gint event_id = -1;
     RTComElIter * it = NULL;
+    gint test_flag1;
+    gint flags;
+    gint count;
 
-    ev = event_new_full (time (NULL));
-    if(!ev)
-    {
-        fail("Failed to create event.");
-    }
+    query = rtcom_el_query_new (el);
+    fail_unless (rtcom_el_query_prepare (query,
+                "group-uid", "group(chris+frank)", RTCOM_EL_OP_EQUAL,
+                NULL));
 
-    event_id = rtcom_el_add_event(el, ev, NULL);
-    fail_if (event_id < 0, "Fail to add event");
+    fail_unless (rtcom_el_set_read_by_query (el, query, TRUE, NULL));
+    fail_unless (rtcom_el_set_flag_by_query (el, query,
+                "RTCOM_EL_FLAG_TEST_FLAG1", NULL));
+    fail_if (rtcom_el_set_flag_by_query (el, query, "no-such-flag", NULL));
+    g_object_unref (query);
 
-    query = rtcom_el_query_new(el);
-    if(!rtcom_el_query_prepare(
-                query,
-                "id", event_id, RTCOM_EL_OP_EQUAL,
+    query = rtcom_el_query_new (el);
+    fail_unless (rtcom_el_query_prepare (query,
+                "is-read", TRUE, RTCOM_EL_OP_EQUAL,
+                NULL));
+    it = rtcom_el_get_events (el, query);
+    g_object_unref (query);
+
+    fail_unless (it != NULL, "Failed to get iterator");
+    count = iter_count_results (it);
+    rtcom_fail_unless_intcmp (count, ==, 3);
+
+    test_flag1 = rtcom_el_get_flag_value (el, "RTCOM_EL_FLAG_TEST_FLAG1");
+    fail_unless (rtcom_el_iter_first (it));
+    do
+    {
+        fail_unless (rtcom_el_iter_get_values (it, "flags", &flags, NULL));
+        fail_if ((flags & test_flag1) == 0, "flags don't match");
+    }
+    while (rtcom_el_iter_next (it));
+    g_object_unref (it);
+
+    /* An unconditional query affects every event */
+    query = rtcom_el_query_new (el);
+    fail_unless (rtcom_el_query_prepare (query, NULL));
+    fail_unless (rtcom_el_set_read_by_query (el, query, FALSE, NULL));
+    fail_unless (rtcom_el_unset_flag_by_query (el, query,
+                "RTCOM_EL_FLAG_TEST_FLAG1", NULL));
+    g_object_unref (query);
+
+    query = rtcom_el_query_new (el);
+    fail_unless (rtcom_el_query_prepare (query,
+                "is-read", TRUE, RTCOM_EL_OP_EQUAL,
+                NULL));
+    it = rtcom_el_get_events (el, query);
+    g_object_unref (query);
+    fail_unless (it == NULL, "all read flags should have been unset");
+
+    query = rtcom_el_query_new (el);
+    fail_unless (rtcom_el_query_prepare (query,
+                "flags", test_flag1, RTCOM_EL_OP_EQUAL,
+                NULL));
+    it = rtcom_el_get_events (el, query);
+    g_object_unref (query);
+    fail_unless (it == NULL, "test flag should have been unset");
+}
+END_TEST
+
+START_TEST(test_get)
+{
+    RTComElQuery * query = NULL;
+    RTComElEvent * ev = NULL;
+    RTComElEvent *result = NULL;
+    gint event_id = -1;
+    RTComElIter * it = NULL;
+
+    ev = event_new_full (time (NULL));
+    if(!ev)
+    {
+        fail("Failed to create event.");
+    }
+
+    event_id = rtcom_el_add_event(el, ev, NULL);
+    fail_if (event_id < 0, "Fail to add event");
+
+    query = rtcom_el_query_new(el);
+    if(!rtcom_el_query_prepare(
+                query,
+                "id", event_id, RTCOM_EL_OP_EQUAL,
                 NULL))
     {
         fail("Failed to prepare the query.");
@@ -862,6 +1370,186 @@ START_TEST(test_get)
 }
 END_TEST
 
+static void
+get_events_async_cb (GObject *source, GAsyncResult *res, gpointer data)
+{
+    GAsyncResult **result = data;
+
+    *result = g_object_ref (res);
+}
+
+static RTComElIter *
+get_events_async (RTComElQuery *query, GCancellable *cancellable,
+    GError **error)
+{
+    GAsyncResult *res = NULL;
+    RTComElIter *it;
+
+    rtcom_el_get_events_async (el, query, cancellable, get_events_async_cb,
+            &res);
+    while (res == NULL)
+        g_main_context_iteration (NULL, TRUE);
+
+    it = rtcom_el_get_events_finish (el, res, error);
+    g_object_unref (res);
+    return it;
+}
+
+START_TEST(test_get_async)
+{
+    RTComElQuery * query = NULL;
+    RTComElEvent * ev = NULL;
+    RTComElEvent *result = NULL;
+    gint event_id = -1;
+    RTComElIter * it = NULL;
+    GCancellable * cancellable;
+    GError * error = NULL;
+
+    ev = event_new_full (time (NULL));
+    fail_if (ev == NULL, "Failed to create event.");
+
+    event_id = rtcom_el_add_event(el, ev, NULL);
+    fail_if (event_id < 0, "Fail to add event");
+
+    query = rtcom_el_query_new(el);
+    fail_unless (rtcom_el_query_prepare(
+                query,
+                "id", event_id, RTCOM_EL_OP_EQUAL,
+                NULL));
+
+    it = get_events_async (query, NULL, &error);
+    fail_unless (error == NULL);
+    fail_unless (it != NULL, "Failed to get iterator");
+
+    result = rtcom_el_event_new ();
+    fail_unless (rtcom_el_iter_get_full (it, result),
+                 "Failed to get event from iterator");
+    fail_unless (rtcom_el_event_equals (ev, result),
+                 "Retrieved event doesn't match created one");
+    fail_if (rtcom_el_iter_next (it));
+    g_object_unref (it);
+
+    /* Connections are reused, and see the events added meanwhile */
+    rtcom_el_event_free_contents (result);
+    fail_unless (rtcom_el_delete_event (el, event_id, NULL) == 0);
+    it = get_events_async (query, NULL, &error);
+    fail_unless (error == NULL);
+    fail_unless (it == NULL);
+
+    /* A query cancelled before it started never runs */
+    cancellable = g_cancellable_new ();
+    g_cancellable_cancel (cancellable);
+    it = get_events_async (query, cancellable, &error);
+    fail_unless (it == NULL);
+    fail_unless (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED));
+    g_clear_error (&error);
+    g_object_unref (cancellable);
+
+    g_object_unref (query);
+    rtcom_el_event_free (result);
+    rtcom_el_event_free_contents (ev);
+    rtcom_el_event_free (ev);
+}
+END_TEST
+
+#define STRESS_THREADS 4
+#define STRESS_EVENTS 25
+
+/* Adds and reads back events, returning the number of failures */
+static gpointer
+stress_thread (gpointer data)
+{
+    RTComEl *shared;
+    gint i, failures = 0;
+    gchar *group_uid;
+
+    shared = rtcom_el_get_shared ();
+    group_uid = g_strdup_printf ("stress-%p", (void *) g_thread_self ());
+
+    for (i = 0; i < STRESS_EVENTS; i++)
+    {
+        RTComElEvent *ev;
+        RTComElQuery *query;
+        RTComElIter *it;
+        GError *error = NULL;
+        gint event_id, tries = 0;
+
+        ev = event_new_lite ();
+        if (i == 0)
+            RTCOM_EL_EVENT_SET_FIELD (ev, group_uid, g_strdup (group_uid));
+
+        /* Writers on other connections can hold the lock for a while */
+        do
+        {
+            g_clear_error (&error);
+            event_id = rtcom_el_add_event (el, ev, &error);
+        } while (event_id < 0 && ++tries < 10 &&
+            g_error_matches (error, RTCOM_EL_ERROR,
+                RTCOM_EL_TEMPORARY_ERROR));
+
+        g_clear_error (&error);
+        rtcom_el_event_free_contents (ev);
+        rtcom_el_event_free (ev);
+
+        if (event_id < 0)
+        {
+            failures++;
+            continue;
+        }
+
+        /* Each thread gets its own last group uid */
+        if (g_strcmp0 (rtcom_el_get_last_group_uid (el), group_uid) != 0)
+            failures++;
+
+        if (rtcom_el_get_service_id (shared, SERVICE) < 0)
+            failures++;
+
+        query = rtcom_el_query_new (el);
+        rtcom_el_query_prepare (query,
+                "id", event_id, RTCOM_EL_OP_EQUAL,
+                "group-uid", group_uid, RTCOM_EL_OP_EQUAL,
+                NULL);
+        it = rtcom_el_get_events (el, query);
+        if (iter_count_results (it) != 1)
+            failures++;
+        if (it != NULL)
+            g_object_unref (it);
+        g_object_unref (query);
+    }
+
+    g_free (group_uid);
+    g_object_unref (shared);
+
+    return GINT_TO_POINTER (failures);
+}
+
+START_TEST(test_threads)
+{
+    GThread *threads[STRESS_THREADS];
+    RTComEl *shared;
+    gint i, before, after;
+
+    shared = rtcom_el_get_shared ();
+    before = rtcom_el_count_by_service (el, SERVICE);
+
+    for (i = 0; i < STRESS_THREADS; i++)
+        threads[i] = g_thread_new ("stress", stress_thread, NULL);
+
+    for (i = 0; i < STRESS_THREADS; i++)
+        rtcom_fail_unless_intcmp (
+                GPOINTER_TO_INT (g_thread_join (threads[i])), ==, 0);
+
+    after = rtcom_el_count_by_service (el, SERVICE);
+    rtcom_fail_unless_intcmp (after - before, ==,
+            STRESS_THREADS * STRESS_EVENTS);
+
+    /* Everybody got the same shared instance */
+    fail_unless (rtcom_el_get_shared () == shared);
+    g_object_unref (shared);
+    g_object_unref (shared);
+}
+END_TEST
+
 START_TEST(test_unique_remotes)
 {
     RTComElEvent * ev = NULL;
@@ -917,210 +1605,1297 @@ START_TEST(test_unique_remotes)
     remote_ebook_uids = rtcom_el_get_unique_remote_ebook_uids(el);
     fail_if (remote_ebook_uids == NULL, "Fail to get unique remote_ebook_uids");
 
-    fail_if (g_list_length(remote_ebook_uids) < 2,
-             "remote_ebook_uids's length doesn't match");
+    fail_if (g_list_length(remote_ebook_uids) < 2,
+             "remote_ebook_uids's length doesn't match");
+
+    for (iter = remote_ebook_uids; iter != NULL; iter = iter->next)
+        g_debug("Unique remote_ebook_uid: %s", (const guchar *) iter->data);
+
+    remote_uids =  rtcom_el_get_unique_remote_uids(el);
+    fail_if (remote_uids == NULL, "Fail to get unique remote_uids");
+
+    fail_if (g_list_length(remote_uids) < 2, "remote_uids's length doesn't match");
+
+    for (iter = remote_uids; iter != NULL; iter = iter->next)
+        g_debug("Unique remote_uid: %s", (const guchar *) iter->data);
+
+    remote_names = rtcom_el_get_unique_remote_names(el);
+    fail_if (remote_names == NULL, "Fail to get unique remote_names");
+
+    fail_if (g_list_length(remote_names) < 2,
+             "remote_names's length doesn't match");
+
+    for (iter = remote_names; iter != NULL; iter = iter->next)
+        g_debug("Unique remote_name: %s", (const guchar *) iter->data);
+
+    rtcom_el_event_free_contents (ev);
+    rtcom_el_event_free (ev);
+    g_list_foreach(remote_ebook_uids, (GFunc) g_free, NULL);
+    g_list_free(remote_ebook_uids);
+    g_list_foreach(remote_uids, (GFunc) g_free, NULL);
+    g_list_free(remote_uids);
+    g_list_foreach(remote_names, (GFunc) g_free, NULL);
+    g_list_free(remote_names);
+}
+END_TEST
+
+START_TEST(test_get_string)
+{
+    RTComElQuery * query = NULL;
+    RTComElEvent * ev = NULL;
+    gint event_id = -1;
+    RTComElIter * it = NULL;
+    gint header_id;
+    gchar *bar;
+
+    ev = event_new_full (time (NULL));
+    if(!ev)
+    {
+        fail("Failed to create event.");
+    }
+
+    event_id = rtcom_el_add_event(el, ev, NULL);
+    fail_if (event_id < 0, "Fail to add event");
+
+    header_id = rtcom_el_add_header(
+            el, event_id,
+            HEADER_KEY,
+            HEADER_VAL,
+            NULL);
+    fail_if (header_id < 0, "Failed to add header");
+
+    query = rtcom_el_query_new(el);
+    if(!rtcom_el_query_prepare(
+                query,
+                "id", event_id, RTCOM_EL_OP_EQUAL,
+                NULL))
+    {
+        fail("Failed to prepare the query.");
+    }
+
+    it = rtcom_el_get_events(el, query);
+    g_object_unref(query);
+
+    fail_unless(it != NULL, "Failed to get iterator");
+    fail_unless(rtcom_el_iter_first(it), "Failed to start iterator");
+
+    bar = GUINT_TO_POINTER (0xDEADBEEF);
+    fail_if(rtcom_el_iter_get_values(it, "there is no such key", &bar, NULL),
+            "Shouldn't be able to get a missing value as a string");
+    fail_unless(bar == GUINT_TO_POINTER (0xDEADBEEF),
+            "bar should be left untouched in this case");
+
+    fail_unless(rtcom_el_iter_get_values(it, HEADER_KEY,  &bar, NULL));
+    fail_if(bar == NULL);
+    fail_if(bar == GUINT_TO_POINTER (0xDEADBEEF));
+    rtcom_fail_unless_strcmp(bar, ==, HEADER_VAL);
+
+    g_free(bar);
+    g_object_unref(it);
+    rtcom_el_event_free_contents (ev);
+    rtcom_el_event_free (ev);
+}
+END_TEST
+
+START_TEST(test_get_int)
+{
+    RTComElQuery * query = NULL;
+    RTComElEvent * ev = NULL;
+    gint event_id = -1;
+    RTComElIter * it = NULL;
+    gint retrieved;
+
+    ev = event_new_full (time (NULL));
+    if(!ev)
+    {
+        fail("Failed to create event.");
+    }
+
+    event_id = rtcom_el_add_event(el, ev, NULL);
+    fail_if (event_id < 0, "Fail to add event");
+
+    query = rtcom_el_query_new(el);
+    if(!rtcom_el_query_prepare(
+                query,
+                "id", event_id, RTCOM_EL_OP_EQUAL,
+                NULL))
+    {
+        fail("Failed to prepare the query.");
+    }
+
+    it = rtcom_el_get_events(el, query);
+    g_object_unref(query);
+
+    fail_unless(it != NULL, "Failed to get iterator");
+    fail_unless(rtcom_el_iter_first(it), "Failed to start iterator");
+
+    fail_unless(rtcom_el_iter_get_values(it, "bytes-sent", &retrieved, NULL),
+            "Failed to get bytes-sent");
+    rtcom_fail_unless_intcmp(retrieved, ==, BYTES_SENT);
+
+    g_object_unref(it);
+    rtcom_el_event_free_contents (ev);
+    rtcom_el_event_free (ev);
+}
+END_TEST
+
+START_TEST(test_ends_with)
+{
+    RTComElQuery * query = NULL;
+    RTComElIter * it = NULL;
+    gchar *contents;
+
+    query = rtcom_el_query_new(el);
+    if(!rtcom_el_query_prepare(
+                query,
+                "remote-name", "ve", RTCOM_EL_OP_STR_ENDS_WITH,
+                NULL))
+    {
+        fail("Failed to prepare the query.");
+    }
+
+    it = rtcom_el_get_events(el, query);
+    g_object_unref(query);
+
+    fail_unless(it != NULL, "Failed to get iterator");
+    fail_unless(rtcom_el_iter_first(it), "Failed to start iterator");
+
+    fail_unless(rtcom_el_iter_get_values(it, "free-text", &contents, NULL));
+
+    /* It is an API guarantee that we're sorting by event ID, which ascends
+     * as time goes on, so Eve's recent message comes before Dave's older
+     * message */
+    rtcom_fail_unless_strcmp("I am online", ==, contents);
+    g_free(contents);
+
+    fail_unless (rtcom_el_iter_next (it));
+
+    fail_unless(rtcom_el_iter_get_values(it, "free-text", &contents, NULL));
+
+    rtcom_fail_unless_strcmp("Hello from Dave", ==, contents);
+
+    g_free(contents);
+
+    fail_if (rtcom_el_iter_next (it));
+
+    g_object_unref(it);
+}
+END_TEST
+
+START_TEST(test_like)
+{
+    RTComElQuery * query = NULL;
+    RTComElIter * it = NULL;
+    gchar *contents;
+
+    query = rtcom_el_query_new(el);
+    if(!rtcom_el_query_prepare(
+        query,
+        "free-text", "AM oNLi", RTCOM_EL_OP_STR_LIKE,
+        NULL))
+    {
+        fail("Failed to prepare the query.");
+    }
+
+    it = rtcom_el_get_events(el, query);
+    g_object_unref(query);
+
+    fail_unless(it != NULL, "Failed to get iterator");
+    fail_unless(rtcom_el_iter_first(it), "Failed to start iterator");
+
+    fail_unless(rtcom_el_iter_get_values(it, "free-text", &contents, NULL));
+
+    rtcom_fail_unless_strcmp("I am online", ==, contents);
+    g_free(contents);
+
+    g_object_unref(it);
+}
+END_TEST
+
+START_TEST(test_query_template)
+{
+    RTComElQuery * query1 = NULL;
+    RTComElQuery * query2 = NULL;
+    RTComElIter * it = NULL;
+    gchar *contents;
+
+    query1 = rtcom_el_query_new(el);
+    fail_unless(rtcom_el_query_prepare(query1,
+                "remote-uid", "bob@example.com", RTCOM_EL_OP_EQUAL,
+                NULL));
+    query2 = rtcom_el_query_new(el);
+    fail_unless(rtcom_el_query_prepare(query2,
+                "remote-uid", "it's frank", RTCOM_EL_OP_EQUAL,
+                NULL));
+
+    /* Same shape, so the same statement can serve both */
+    rtcom_fail_unless_strcmp(rtcom_el_query_get_sql_template(query1), ==,
+            rtcom_el_query_get_sql_template(query2));
+    fail_if(strstr(rtcom_el_query_get_sql_template(query2), "frank")
+            != NULL);
+
+    /* The rendered SQL and WHERE clause still have the values in */
+    fail_unless(strstr(rtcom_el_query_get_sql(query2), "'it''s frank'")
+            != NULL);
+    rtcom_fail_unless_strcmp(rtcom_el_query_get_where_clause(query2), ==,
+            "Remotes.remote_uid = 'it''s frank'");
+
+    /* Running the same shape twice gives the right rows each time */
+    it = rtcom_el_get_events(el, query1);
+    fail_unless(it != NULL, "Failed to get iterator");
+    fail_unless(rtcom_el_iter_first(it), "Failed to start iterator");
+    fail_unless(rtcom_el_iter_get_values(it, "remote-uid", &contents, NULL));
+    rtcom_fail_unless_strcmp("bob@example.com", ==, contents);
+    g_free(contents);
+    g_object_unref(it);
+
+    fail_unless(rtcom_el_query_prepare(query1,
+                "remote-uid", "frank@msn.invalid", RTCOM_EL_OP_EQUAL,
+                NULL));
+    it = rtcom_el_get_events(el, query1);
+    fail_unless(it != NULL, "Failed to get iterator");
+    fail_unless(rtcom_el_iter_first(it), "Failed to start iterator");
+    fail_unless(rtcom_el_iter_get_values(it, "remote-uid", &contents, NULL));
+    rtcom_fail_unless_strcmp("frank@msn.invalid", ==, contents);
+    g_free(contents);
+    g_object_unref(it);
+
+    it = rtcom_el_get_events(el, query2);
+    fail_unless(it == NULL, "Nothing should match");
+
+    g_object_unref(query1);
+    g_object_unref(query2);
+}
+END_TEST
+
+static gint
+count_expr (RTComElQueryExpr *expr)
+{
+    RTComElQuery * query = NULL;
+    RTComElIter * it = NULL;
+    gint count;
+
+    query = rtcom_el_query_new(el);
+    fail_unless(rtcom_el_query_prepare_expr(query, expr));
+    rtcom_el_query_expr_free(expr);
+
+    it = rtcom_el_get_events(el, query);
+    g_object_unref(query);
+
+    count = iter_count_results(it);
+    if (it != NULL)
+        g_object_unref(it);
+
+    return count;
+}
+
+START_TEST(test_query_expr)
+{
+    RTComElQuery * query = NULL;
+    RTComElQueryExpr * expr;
+    gint bob, frank, all, either, ids[2];
+
+    bob = count_expr(rtcom_el_query_expr_string("remote-uid",
+                RTCOM_EL_OP_EQUAL, "bob@example.com"));
+    frank = count_expr(rtcom_el_query_expr_string("remote-uid",
+                RTCOM_EL_OP_EQUAL, "frank@msn.invalid"));
+    all = count_expr(NULL);
+    fail_unless(bob > 0);
+    fail_unless(frank > 0);
+
+    either = count_expr(rtcom_el_query_expr_or(
+                rtcom_el_query_expr_string("remote-uid",
+                    RTCOM_EL_OP_EQUAL, "bob@example.com"),
+                rtcom_el_query_expr_string("remote-uid",
+                    RTCOM_EL_OP_EQUAL, "frank@msn.invalid"),
+                NULL));
+    rtcom_fail_unless_intcmp(either, ==, bob + frank);
+
+    rtcom_fail_unless_intcmp(count_expr(rtcom_el_query_expr_not(
+                rtcom_el_query_expr_or(
+                    rtcom_el_query_expr_string("remote-uid",
+                        RTCOM_EL_OP_EQUAL, "bob@example.com"),
+                    rtcom_el_query_expr_string("remote-uid",
+                        RTCOM_EL_OP_EQUAL, "frank@msn.invalid"),
+                    NULL))), <=, all - either);
+
+    /* Flag bits, int lists and NULL tests */
+    rtcom_fail_unless_intcmp(count_expr(rtcom_el_query_expr_and(
+                rtcom_el_query_expr_string("remote-uid",
+                    RTCOM_EL_OP_EQUAL, "bob@example.com"),
+                rtcom_el_query_expr_int("flags",
+                    RTCOM_EL_OP_HAS_ALL_FLAGS, 0),
+                NULL)), ==, bob);
+
+    ids[0] = 1;
+    ids[1] = 2;
+    rtcom_fail_unless_intcmp(count_expr(rtcom_el_query_expr_in_ints("id",
+                ids, 2)), ==, 2);
+
+    rtcom_fail_unless_intcmp(
+            count_expr(rtcom_el_query_expr_is_null("group-uid")) +
+            count_expr(rtcom_el_query_expr_not(
+                    rtcom_el_query_expr_is_null("group-uid"))),
+            ==, all);
+
+    /* A string value for an integer field is refused */
+    query = rtcom_el_query_new(el);
+    expr = rtcom_el_query_expr_string("id", RTCOM_EL_OP_EQUAL, "1");
+    fail_if(rtcom_el_query_prepare_expr(query, expr));
+    rtcom_el_query_expr_free(expr);
+    g_object_unref(query);
+}
+END_TEST
+
+START_TEST(test_query_fields)
+{
+    const gchar *fields[] = { "start-time", "free-text", NULL };
+    RTComElQuery * query = NULL;
+    RTComElIter * it = NULL;
+    gint id, start_time;
+    gchar *remote_uid, *free_text;
+
+    query = rtcom_el_query_new(el);
+    rtcom_el_query_set_fields(query, fields);
+    fail_unless(rtcom_el_query_prepare(query,
+                "local-uid", "butterfly/msn/alice", RTCOM_EL_OP_EQUAL,
+                NULL));
+
+    /* Nothing needs the contact or message-token */
+    fail_if(strstr(rtcom_el_query_get_sql(query), "Remotes") != NULL);
+    fail_if(strstr(rtcom_el_query_get_sql(query), "Headers") != NULL);
+
+    it = rtcom_el_get_events(el, query);
+    fail_unless(it != NULL, "Failed to get iterator");
+    fail_unless(rtcom_el_iter_first(it), "Failed to start iterator");
+
+    fail_unless(rtcom_el_iter_get_values(it, "id", &id, "start-time",
+                &start_time, "free-text", &free_text, "remote-uid",
+                &remote_uid, NULL));
+    fail_unless(id > 0);
+    fail_unless(start_time > 0);
+    fail_unless(free_text != NULL);
+    /* Not fetched */
+    fail_unless(remote_uid == NULL);
+    g_free(free_text);
+    g_object_unref(it);
+
+    /* Filtering on a contact brings the join back */
+    fail_unless(rtcom_el_query_prepare(query,
+                "remote-uid", "bob@example.com", RTCOM_EL_OP_EQUAL,
+                NULL));
+    fail_unless(strstr(rtcom_el_query_get_sql(query), "Remotes") != NULL);
+
+    it = rtcom_el_get_events(el, query);
+    rtcom_fail_unless_intcmp(iter_count_results(it), >, 0);
+    g_object_unref(it);
+
+    g_object_unref(query);
+}
+END_TEST
+
+START_TEST(test_query_count)
+{
+    RTComElQuery * query = NULL;
+    RTComElIter * it = NULL;
+    GError * error = NULL;
+    gint count;
+
+    /* Everything comes from the counters */
+    query = rtcom_el_query_new(el);
+    fail_unless(rtcom_el_query_prepare(query, NULL));
+    fail_unless(strstr(rtcom_el_query_get_count_sql_template(query),
+                "EventCounts") != NULL);
+
+    count = rtcom_el_query_count(el, query, &error);
+    fail_unless(error == NULL);
+    it = rtcom_el_get_events(el, query);
+    rtcom_fail_unless_intcmp(count, ==, iter_count_results(it));
+    g_object_unref(it);
+    rtcom_fail_unless_intcmp(count, ==, rtcom_el_count_by_service(el, NULL));
+
+    /* Filtered, without joining the contacts for nothing */
+    fail_unless(rtcom_el_query_prepare(query,
+                "local-uid", "butterfly/msn/alice", RTCOM_EL_OP_EQUAL,
+                NULL));
+    fail_if(strstr(rtcom_el_query_get_count_sql_template(query),
+                "Remotes") != NULL);
+
+    count = rtcom_el_query_count(el, query, NULL);
+    it = rtcom_el_get_events(el, query);
+    rtcom_fail_unless_intcmp(count, >, 0);
+    rtcom_fail_unless_intcmp(count, ==, iter_count_results(it));
+    g_object_unref(it);
+    fail_unless(rtcom_el_query_exists(el, query, NULL));
+
+    /* Grouped, and limited */
+    rtcom_el_query_set_group_by(query, RTCOM_EL_QUERY_GROUP_BY_CONTACT);
+    fail_unless(rtcom_el_query_prepare(query, NULL));
+    count = rtcom_el_query_count(el, query, NULL);
+    it = rtcom_el_get_events(el, query);
+    rtcom_fail_unless_intcmp(count, ==, iter_count_results(it));
+    g_object_unref(it);
+
+    rtcom_el_query_set_limit(query, 1);
+    fail_unless(rtcom_el_query_prepare(query, NULL));
+    rtcom_fail_unless_intcmp(rtcom_el_query_count(el, query, NULL), ==, 1);
+
+    g_object_unref(query);
+
+    query = rtcom_el_query_new(el);
+    fail_unless(rtcom_el_query_prepare(query,
+                "remote-uid", "nobody@example.invalid", RTCOM_EL_OP_EQUAL,
+                NULL));
+    rtcom_fail_unless_intcmp(rtcom_el_query_count(el, query, NULL), ==, 0);
+    fail_if(rtcom_el_query_exists(el, query, NULL));
+    g_object_unref(query);
+}
+END_TEST
+
+START_TEST(test_query_aggregate)
+{
+    const gchar *keys[] = { "service", NULL };
+    const RTComElAggregate aggregates[] = {
+        { RTCOM_EL_AGGREGATE_COUNT, NULL },
+        { RTCOM_EL_AGGREGATE_MAX, "duration" },
+        { RTCOM_EL_AGGREGATE_SUM, "bytes-sent" },
+    };
+    const RTComElAggregate bad[] = {
+        { RTCOM_EL_AGGREGATE_SUM, "free-text" },
+    };
+    RTComElQuery * query = NULL;
+    RTComElAggregateResult * result = NULL;
+    GError * error = NULL;
+    gint64 total = 0;
+    guint i;
+
+    query = rtcom_el_query_new(el);
+    fail_unless(rtcom_el_query_prepare(query, NULL));
+
+    result = rtcom_el_query_aggregate(el, query, keys, aggregates,
+            G_N_ELEMENTS(aggregates), &error);
+    fail_unless(result != NULL);
+    fail_unless(error == NULL);
+    rtcom_fail_unless_uintcmp(result->n_keys, ==, 1);
+    rtcom_fail_unless_uintcmp(result->n_values, ==, 3);
+    rtcom_fail_unless_uintcmp(result->n_rows, >, 0);
+
+    for(i = 0; i < result->n_rows; i++)
+    {
+        fail_unless(result->keys[i] != NULL);
+        /* Ordered by key */
+        if(i > 0)
+            rtcom_fail_unless_strcmp(result->keys[i - 1], <, result->keys[i]);
+        total += result->values[i * result->n_values];
+    }
+
+    rtcom_fail_unless_intcmp((gint) total, ==, rtcom_el_query_count(el, query, NULL));
+    rtcom_el_aggregate_result_free(result);
+
+    /* Without keys there's a single row */
+    result = rtcom_el_query_aggregate(el, query, NULL, aggregates, 1, NULL);
+    fail_unless(result != NULL);
+    rtcom_fail_unless_uintcmp(result->n_rows, ==, 1);
+    rtcom_fail_unless_intcmp((gint) result->values[0], ==, (gint) total);
+    rtcom_el_aggregate_result_free(result);
+
+    result = rtcom_el_query_aggregate(el, query, NULL, bad, 1, &error);
+    fail_unless(result == NULL);
+    fail_unless(error != NULL);
+    g_clear_error(&error);
+
+    g_object_unref(query);
+}
+END_TEST
+
+/* Collects the event ids of every group, optionally through a filter
+ * that matches everything */
+static GArray *
+grouped_ids (RTComElQueryGroupBy group_by,
+             gboolean filtered)
+{
+    RTComElQuery * query = NULL;
+    RTComElIter * it = NULL;
+    GArray *ids = g_array_new (FALSE, FALSE, sizeof (gint));
+    gint id;
+
+    query = rtcom_el_query_new(el);
+    rtcom_el_query_set_group_by (query, group_by);
+    if (filtered)
+        fail_unless(rtcom_el_query_prepare(query,
+                    "id", 0, RTCOM_EL_OP_GREATER,
+                    NULL));
+    else
+        fail_unless(rtcom_el_query_prepare(query, NULL));
+
+    fail_unless((strstr(rtcom_el_query_get_sql(query), "ContactCache")
+                == NULL) == filtered);
+
+    it = rtcom_el_get_events(el, query);
+    g_object_unref(query);
+
+    if (it != NULL && rtcom_el_iter_first(it))
+    {
+        do
+        {
+            fail_unless (rtcom_el_iter_get_values (it, "id", &id, NULL));
+            g_array_append_val (ids, id);
+        }
+        while (rtcom_el_iter_next (it));
+    }
+
+    if (it != NULL)
+        g_object_unref(it);
+
+    return ids;
+}
+
+static void
+assert_contact_cache (void)
+{
+    RTComElQueryGroupBy group_by[] = { RTCOM_EL_QUERY_GROUP_BY_CONTACT,
+        RTCOM_EL_QUERY_GROUP_BY_UIDS };
+    guint i, j;
+
+    for (i = 0; i < G_N_ELEMENTS (group_by); i++)
+    {
+        GArray *cached = grouped_ids (group_by[i], FALSE);
+        GArray *scanned = grouped_ids (group_by[i], TRUE);
+
+        rtcom_fail_unless_uintcmp (cached->len, >, 0);
+        rtcom_fail_unless_uintcmp (cached->len, ==, scanned->len);
+        for (j = 0; j < cached->len; j++)
+            rtcom_fail_unless_intcmp (g_array_index (cached, gint, j), ==,
+                    g_array_index (scanned, gint, j));
+
+        g_array_free (cached, TRUE);
+        g_array_free (scanned, TRUE);
+    }
+}
+
+START_TEST(test_contact_cache)
+{
+    GArray *ids;
+
+    assert_contact_cache ();
+
+    /* Removing the latest event of a contact falls back to the one
+     * before it */
+    ids = grouped_ids (RTCOM_EL_QUERY_GROUP_BY_CONTACT, FALSE);
+    rtcom_fail_unless_intcmp (rtcom_el_delete_event (el,
+                g_array_index (ids, gint, 0), NULL), ==, 0);
+    g_array_free (ids, TRUE);
+    assert_contact_cache ();
+
+    /* Address book changes regroup without touching the cache */
+    fail_unless (rtcom_el_update_remote_contact (el,
+                "butterfly/msn/alice", "frank@msn.invalid", "abook-bob",
+                NULL, NULL));
+    fail_unless (rtcom_el_update_remote_contact (el,
+                "gabble/jabber/alice", "bob@example.com", "abook-bob",
+                NULL, NULL));
+    assert_contact_cache ();
+}
+END_TEST
+
+typedef struct {
+    gint inserted;
+    guint inserted_at;
+    gint removed;
+    guint removed_at;
+    gint changed;
+} LiveDeltas;
+
+static void
+live_inserted_cb (RTComElLiveQuery *live, gint event_id, guint position,
+                  gpointer user_data)
+{
+    LiveDeltas *d = user_data;
+
+    d->inserted = event_id;
+    d->inserted_at = position;
+}
+
+static void
+live_removed_cb (RTComElLiveQuery *live, gint event_id, guint position,
+                 gpointer user_data)
+{
+    LiveDeltas *d = user_data;
+
+    d->removed = event_id;
+    d->removed_at = position;
+}
+
+static void
+live_changed_cb (RTComElLiveQuery *live, gint event_id, guint position,
+                 gpointer user_data)
+{
+    LiveDeltas *d = user_data;
+
+    d->changed = event_id;
+}
+
+static void
+emit_el_signal (const gchar *name, gint event_id)
+{
+    g_signal_emit_by_name (el, name, event_id, NULL, NULL, NULL, NULL,
+            NULL);
+}
+
+START_TEST(test_live_query)
+{
+    RTComElQuery * query = NULL;
+    RTComElLiveQuery * live = NULL;
+    RTComElEvent * ev = NULL;
+    LiveDeltas d = { 0, 0, 0, 0, 0 };
+    const gint * ids;
+    gint first[3];
+    gint event_id, i;
+    guint n;
+
+    for (i = 0; i < 4; i++)
+    {
+        ev = event_new_lite ();
+        fail_unless (rtcom_el_add_event (el, ev, NULL) > 0);
+        rtcom_el_event_free (ev);
+    }
+
+    query = rtcom_el_query_new (el);
+    rtcom_el_query_set_limit (query, 3);
+    fail_unless (rtcom_el_query_prepare (query,
+                "local-uid", LOCAL_UID, RTCOM_EL_OP_EQUAL,
+                NULL));
+
+    live = rtcom_el_live_query_new (el, query);
+    g_signal_connect (live, "inserted", G_CALLBACK (live_inserted_cb), &d);
+    g_signal_connect (live, "removed", G_CALLBACK (live_removed_cb), &d);
+    g_signal_connect (live, "changed", G_CALLBACK (live_changed_cb), &d);
 
-    for (iter = remote_ebook_uids; iter != NULL; iter = iter->next)
-        g_debug("Unique remote_ebook_uid: %s", (const guchar *) iter->data);
+    ids = rtcom_el_live_query_get_ids (live, &n);
+    rtcom_fail_unless_uintcmp (n, ==, 3);
+    memcpy (first, ids, sizeof (first));
 
-    remote_uids =  rtcom_el_get_unique_remote_uids(el);
-    fail_if (remote_uids == NULL, "Fail to get unique remote_uids");
+    /* A matching event goes on top, pushing the oldest one out */
+    ev = event_new_lite ();
+    event_id = rtcom_el_add_event (el, ev, NULL);
+    rtcom_el_event_free (ev);
+    emit_el_signal ("new-event", event_id);
 
-    fail_if (g_list_length(remote_uids) < 2, "remote_uids's length doesn't match");
+    rtcom_fail_unless_intcmp (d.inserted, ==, event_id);
+    rtcom_fail_unless_uintcmp (d.inserted_at, ==, 0);
+    rtcom_fail_unless_intcmp (d.removed, ==, first[2]);
+    rtcom_fail_unless_uintcmp (d.removed_at, ==, 2);
 
-    for (iter = remote_uids; iter != NULL; iter = iter->next)
-        g_debug("Unique remote_uid: %s", (const guchar *) iter->data);
+    emit_el_signal ("event-updated", event_id);
+    rtcom_fail_unless_intcmp (d.changed, ==, event_id);
 
-    remote_names = rtcom_el_get_unique_remote_names(el);
-    fail_if (remote_names == NULL, "Fail to get unique remote_names");
+    /* Removing it brings the oldest one back */
+    rtcom_fail_unless_intcmp (rtcom_el_delete_event (el, event_id, NULL),
+            ==, 0);
+    emit_el_signal ("event-deleted", event_id);
 
-    fail_if (g_list_length(remote_names) < 2,
-             "remote_names's length doesn't match");
+    rtcom_fail_unless_intcmp (d.removed, ==, event_id);
+    rtcom_fail_unless_uintcmp (d.removed_at, ==, 0);
+    rtcom_fail_unless_intcmp (d.inserted, ==, first[2]);
+    rtcom_fail_unless_uintcmp (d.inserted_at, ==, 2);
 
-    for (iter = remote_names; iter != NULL; iter = iter->next)
-        g_debug("Unique remote_name: %s", (const guchar *) iter->data);
+    ids = rtcom_el_live_query_get_ids (live, &n);
+    rtcom_fail_unless_uintcmp (n, ==, 3);
+    fail_unless (memcmp (first, ids, sizeof (first)) == 0);
 
-    rtcom_el_event_free_contents (ev);
+    /* Events the query doesn't return are left alone */
+    memset (&d, 0, sizeof (d));
+    ev = event_new_lite ();
+    g_free (RTCOM_EL_EVENT_GET_FIELD (ev, local_uid));
+    RTCOM_EL_EVENT_SET_FIELD (ev, local_uid, g_strdup ("someone/else"));
+    event_id = rtcom_el_add_event (el, ev, NULL);
     rtcom_el_event_free (ev);
-    g_list_foreach(remote_ebook_uids, (GFunc) g_free, NULL);
-    g_list_free(remote_ebook_uids);
-    g_list_foreach(remote_uids, (GFunc) g_free, NULL);
-    g_list_free(remote_uids);
-    g_list_foreach(remote_names, (GFunc) g_free, NULL);
-    g_list_free(remote_names);
+    emit_el_signal ("new-event", event_id);
+    rtcom_fail_unless_intcmp (d.inserted, ==, 0);
+    rtcom_fail_unless_intcmp (d.removed, ==, 0);
+
+    g_object_unref (live);
+    g_object_unref (query);
 }
 END_TEST
 
-START_TEST(test_get_string)
+START_TEST(test_iter_fetch_batch)
 {
+    const gchar * fields[] = { "id", "local-uid", "is-read", "free-text",
+        NULL };
     RTComElQuery * query = NULL;
-    RTComElEvent * ev = NULL;
-    gint event_id = -1;
     RTComElIter * it = NULL;
-    gint header_id;
-    gchar *bar;
+    RTComElIter * check = NULL;
+    RTComElIterBatch * batch = NULL;
+    const gint * ids;
+    const gint * is_read;
+    guint n, total = 0, row;
 
-    ev = event_new_full (time (NULL));
-    if(!ev)
-    {
-        fail("Failed to create event.");
-    }
+    query = rtcom_el_query_new(el);
+    fail_unless(rtcom_el_query_prepare(query, NULL));
 
-    event_id = rtcom_el_add_event(el, ev, NULL);
-    fail_if (event_id < 0, "Fail to add event");
+    it = rtcom_el_get_events(el, query);
+    check = rtcom_el_get_events(el, query);
+    fail_unless(it != NULL);
+    fail_unless(check != NULL);
 
-    header_id = rtcom_el_add_header(
-            el, event_id,
-            HEADER_KEY,
-            HEADER_VAL,
-            NULL);
-    fail_if (header_id < 0, "Failed to add header");
+    batch = rtcom_el_iter_batch_new(fields);
+    fail_unless(rtcom_el_iter_batch_get_ints(batch, 1) == NULL);
 
-    query = rtcom_el_query_new(el);
-    if(!rtcom_el_query_prepare(
-                query,
-                "id", event_id, RTCOM_EL_OP_EQUAL,
-                NULL))
+    /* The same batch is reused for every fetch */
+    while((n = rtcom_el_iter_fetch_batch(it, 3, batch)) > 0)
     {
-        fail("Failed to prepare the query.");
+        rtcom_fail_unless_uintcmp(n, <=, 3);
+        rtcom_fail_unless_uintcmp(n, ==, rtcom_el_iter_batch_get_n_rows(batch));
+
+        ids = rtcom_el_iter_batch_get_ints(batch, 0);
+        is_read = rtcom_el_iter_batch_get_ints(batch, 2);
+        fail_unless(ids != NULL);
+        fail_unless(is_read != NULL);
+
+        for(row = 0; row < n; row++)
+        {
+            gint id = -1;
+            gboolean read = FALSE;
+            gchar * local_uid = NULL;
+            gchar * free_text = NULL;
+
+            fail_unless(rtcom_el_iter_get_values(check, "id", &id,
+                        "local-uid", &local_uid, "is-read", &read,
+                        "free-text", &free_text, NULL));
+
+            rtcom_fail_unless_intcmp(ids[row], ==, id);
+            rtcom_fail_unless_intcmp(is_read[row], ==, read);
+            rtcom_fail_unless_strcmp(local_uid, ==,
+                    rtcom_el_iter_batch_get_string(batch, 1, row));
+            if(free_text == NULL)
+                fail_unless(rtcom_el_iter_batch_get_string(batch, 3, row)
+                        == NULL);
+            else
+                rtcom_fail_unless_strcmp(free_text, ==,
+                        rtcom_el_iter_batch_get_string(batch, 3, row));
+
+            g_free(local_uid);
+            g_free(free_text);
+
+            rtcom_el_iter_next(check);
+        }
+
+        total += n;
     }
 
-    it = rtcom_el_get_events(el, query);
+    fail_unless(total > 3);
+    rtcom_fail_unless_uintcmp(rtcom_el_iter_batch_get_n_rows(batch), ==, 0);
+
+    rtcom_el_iter_batch_free(batch);
+    g_object_unref(check);
+    g_object_unref(it);
     g_object_unref(query);
+}
+END_TEST
 
-    fail_unless(it != NULL, "Failed to get iterator");
-    fail_unless(rtcom_el_iter_first(it), "Failed to start iterator");
+START_TEST(test_iter_peek)
+{
+    RTComElQuery * query = NULL;
+    RTComElIter * it = NULL;
+    RTComElEvent * owned = NULL;
+    RTComElEvent * borrowed = NULL;
+    const gchar * foo;
+    gchar * contents = NULL;
+    gchar * local_uid = NULL;
+    gint rows = 0;
 
-    bar = GUINT_TO_POINTER (0xDEADBEEF);
-    fail_if(rtcom_el_iter_get_values(it, "there is no such key", &bar, NULL),
-            "Shouldn't be able to get a missing value as a string");
-    fail_unless(bar == GUINT_TO_POINTER (0xDEADBEEF),
-            "bar should be left untouched in this case");
+    query = rtcom_el_query_new(el);
+    fail_unless(rtcom_el_query_prepare(query,
+                "service", SERVICE, RTCOM_EL_OP_EQUAL,
+                NULL));
+    it = rtcom_el_get_events(el, query);
+    g_object_unref(query);
+    fail_unless(it != NULL);
+    fail_unless(rtcom_el_iter_first(it));
 
-    fail_unless(rtcom_el_iter_get_values(it, HEADER_KEY,  &bar, NULL));
-    fail_if(bar == NULL);
-    fail_if(bar == GUINT_TO_POINTER (0xDEADBEEF));
-    rtcom_fail_unless_strcmp(bar, ==, HEADER_VAL);
+    owned = rtcom_el_event_new();
+    borrowed = rtcom_el_event_new();
 
-    g_free(bar);
+    do
+    {
+        /* Plugin values are kept for the row */
+        foo = rtcom_el_iter_peek_string(it, HEADER_KEY);
+        fail_unless(foo == rtcom_el_iter_peek_string(it, HEADER_KEY));
+        fail_unless(rtcom_el_iter_get_values(it, HEADER_KEY, &contents,
+                    "local-uid", &local_uid, NULL));
+        fail_unless(g_strcmp0(foo, contents) == 0);
+        rtcom_fail_unless_strcmp(local_uid, ==,
+                rtcom_el_iter_peek_string(it, "local-uid"));
+        g_free(contents);
+        g_free(local_uid);
+
+        fail_unless(rtcom_el_iter_get_full(it, owned));
+        fail_unless(rtcom_el_iter_peek_full(it, borrowed));
+        fail_unless(rtcom_el_event_equals(owned, borrowed));
+        rtcom_fail_unless_strcmp(RTCOM_EL_EVENT_GET_FIELD(owned, service),
+                ==, RTCOM_EL_EVENT_GET_FIELD(borrowed, service));
+        fail_unless(g_strcmp0(
+                    RTCOM_EL_EVENT_GET_FIELD(owned, additional_text),
+                    RTCOM_EL_EVENT_GET_FIELD(borrowed, additional_text)) == 0);
+        fail_unless(g_strcmp0(
+                    RTCOM_EL_EVENT_GET_FIELD(owned, icon_name),
+                    RTCOM_EL_EVENT_GET_FIELD(borrowed, icon_name)) == 0);
+        fail_unless(g_strcmp0(
+                    RTCOM_EL_EVENT_GET_FIELD(owned, pango_markup),
+                    RTCOM_EL_EVENT_GET_FIELD(borrowed, pango_markup)) == 0);
+
+        /* The borrowed strings belong to the iterator */
+        rtcom_el_event_free_contents(owned);
+        memset(borrowed, 0, sizeof(RTComElEvent));
+
+        rows++;
+    } while(rtcom_el_iter_next(it));
+
+    rtcom_fail_unless_intcmp(rows, >, 0);
+
+    rtcom_el_event_free(owned);
+    rtcom_el_event_free(borrowed);
     g_object_unref(it);
-    rtcom_el_event_free_contents (ev);
-    rtcom_el_event_free (ev);
 }
 END_TEST
 
-START_TEST(test_get_int)
+START_TEST(test_field_ids)
 {
+    const gchar * fields[] = { "local-uid", NULL };
     RTComElQuery * query = NULL;
-    RTComElEvent * ev = NULL;
-    gint event_id = -1;
     RTComElIter * it = NULL;
-    gint retrieved;
-
-    ev = event_new_full (time (NULL));
-    if(!ev)
+    GValue value = G_VALUE_INIT;
+    gchar * local_uid = NULL;
+    gchar * text = NULL;
+    gint id = -1;
+    gint i, pass;
+
+    for(i = 0; i < RTCOM_EL_N_FIELDS; i++)
+        rtcom_fail_unless_intcmp(i, ==,
+                rtcom_el_field_from_name(rtcom_el_field_get_name(i)));
+    rtcom_fail_unless_intcmp(rtcom_el_field_from_name("local-uid"), ==,
+            RTCOM_EL_FIELD_LOCAL_UID);
+    rtcom_fail_unless_intcmp(rtcom_el_field_from_name("no-such-field"), ==,
+            -1);
+
+    /* Once with every column, once with the ones asked for */
+    for(pass = 0; pass < 2; pass++)
     {
-        fail("Failed to create event.");
+        query = rtcom_el_query_new(el);
+        if(pass == 1)
+            rtcom_el_query_set_fields(query, fields);
+        fail_unless(rtcom_el_query_prepare(query,
+                    "service", SERVICE, RTCOM_EL_OP_EQUAL,
+                    NULL));
+        it = rtcom_el_get_events(el, query);
+        g_object_unref(query);
+        fail_unless(it != NULL);
+        fail_unless(rtcom_el_iter_first(it));
+
+        do
+        {
+            fail_unless(rtcom_el_iter_get_values(it, "id", &id,
+                        "local-uid", &local_uid,
+                        "additional-text", &text, NULL));
+
+            fail_unless(rtcom_el_iter_get_by_id(it, RTCOM_EL_FIELD_ID,
+                        &value));
+            rtcom_fail_unless_intcmp(g_value_get_int(&value), ==, id);
+            g_value_unset(&value);
+
+            fail_unless(rtcom_el_iter_get_by_id(it,
+                        RTCOM_EL_FIELD_LOCAL_UID, &value));
+            rtcom_fail_unless_strcmp(g_value_get_string(&value), ==,
+                    local_uid);
+            g_value_unset(&value);
+
+            /* Provided by the test plugin */
+            fail_unless(rtcom_el_iter_get_by_id(it,
+                        RTCOM_EL_FIELD_ADDITIONAL_TEXT, &value));
+            rtcom_fail_unless_strcmp(g_value_get_string(&value), ==, text);
+            fail_unless(g_str_has_suffix(text,
+                        ": Hello from the Test plugin!"));
+            g_value_unset(&value);
+
+            fail_if(rtcom_el_iter_get_raw_by_id(it,
+                        RTCOM_EL_FIELD_ADDITIONAL_TEXT, &value));
+
+            g_free(local_uid);
+            g_free(text);
+        } while(rtcom_el_iter_next(it));
+
+        g_object_unref(it);
     }
+}
+END_TEST
 
-    event_id = rtcom_el_add_event(el, ev, NULL);
-    fail_if (event_id < 0, "Fail to add event");
+START_TEST(test_header_prefetch)
+{
+    const gchar * names[] = { HEADER_KEY, "Missing", NULL };
+    RTComElEvent * ev = NULL;
+    RTComElQuery * query = NULL;
+    RTComElIter * it = NULL;
+    gint ids[5];
+    gint i, event_id, rows = 0;
 
-    query = rtcom_el_query_new(el);
-    if(!rtcom_el_query_prepare(
-                query,
-                "id", event_id, RTCOM_EL_OP_EQUAL,
-                NULL))
+    ev = event_new_lite();
+    for(i = 0; i < 5; i++)
     {
-        fail("Failed to prepare the query.");
+        ids[i] = rtcom_el_add_event(el, ev, NULL);
+        fail_if(ids[i] < 0, "Failed to add event");
+
+        /* Every other event has the header */
+        if(i % 2 == 0)
+        {
+            gchar * value = g_strdup_printf("prefetch-%d", i);
+
+            fail_if(rtcom_el_add_header(el, ids[i], HEADER_KEY, value,
+                        NULL) < 0);
+            g_free(value);
+        }
     }
+    rtcom_el_event_free_contents(ev);
+    rtcom_el_event_free(ev);
 
+    query = rtcom_el_query_new(el);
+    fail_unless(rtcom_el_query_prepare(query,
+                "id", ids[0], RTCOM_EL_OP_GREATER_EQUAL,
+                NULL));
     it = rtcom_el_get_events(el, query);
     g_object_unref(query);
+    fail_unless(it != NULL);
+    fail_unless(rtcom_el_iter_first(it));
 
-    fail_unless(it != NULL, "Failed to get iterator");
-    fail_unless(rtcom_el_iter_first(it), "Failed to start iterator");
+    /* Two rows at a time, so the window is fetched more than once */
+    rtcom_el_iter_set_header_prefetch(it, names, 2);
 
-    fail_unless(rtcom_el_iter_get_values(it, "bytes-sent", &retrieved, NULL),
-            "Failed to get bytes-sent");
-    rtcom_fail_unless_intcmp(retrieved, ==, BYTES_SENT);
+    do
+    {
+        gchar * contents = NULL;
+
+        fail_unless(rtcom_el_iter_get_values(it, "id", &event_id, NULL));
+        for(i = 0; i < 5 && ids[i] != event_id; i++);
+        fail_unless(i < 5);
+
+        contents = rtcom_el_iter_get_header_raw(it, HEADER_KEY);
+        if(i % 2 == 0)
+        {
+            gchar * expected = g_strdup_printf("prefetch-%d", i);
+
+            rtcom_fail_unless_strcmp(expected, ==, contents);
+            g_free(expected);
+        }
+        else
+        {
+            fail_unless(contents == NULL);
+        }
+        g_free(contents);
+
+        /* Through the plugin */
+        fail_unless(rtcom_el_iter_get_values(it, HEADER_KEY, &contents,
+                    NULL));
+        fail_unless((i % 2 == 0) == (contents != NULL));
+        g_free(contents);
+
+        fail_unless(rtcom_el_iter_get_header_raw(it, "Missing") == NULL);
+
+        rows++;
+    } while(rtcom_el_iter_next(it));
+
+    rtcom_fail_unless_intcmp(rows, ==, 5);
 
     g_object_unref(it);
-    rtcom_el_event_free_contents (ev);
-    rtcom_el_event_free (ev);
 }
 END_TEST
 
-START_TEST(test_ends_with)
+START_TEST(test_attachment_prefetch)
 {
+    RTComElEvent * ev = NULL;
     RTComElQuery * query = NULL;
     RTComElIter * it = NULL;
-    gchar *contents;
+    gchar * attach_path = NULL;
+    gint ids[4];
+    gint i, k, event_id, count, rows = 0;
 
-    query = rtcom_el_query_new(el);
-    if(!rtcom_el_query_prepare(
-                query,
-                "remote-name", "ve", RTCOM_EL_OP_STR_ENDS_WITH,
-                NULL))
+    attach_path = g_build_filename(g_get_tmp_dir(), "prefetch.txt", NULL);
+
+    ev = event_new_lite();
+    for(i = 0; i < 4; i++)
     {
-        fail("Failed to prepare the query.");
+        ids[i] = rtcom_el_add_event(el, ev, NULL);
+        fail_if(ids[i] < 0, "Failed to add event");
+
+        /* 0, 1, 2 and 0 attachments */
+        for(k = 0; k < i % 3; k++)
+        {
+            gchar * contents = g_strdup_printf("prefetch %d %d", i, k);
+
+            fail_unless(g_file_set_contents(attach_path, contents, -1,
+                        NULL));
+            fail_if(rtcom_el_add_attachment(el, ids[i], attach_path,
+                        ATTACH_DESC, NULL) < 0, "Failed to add attachment");
+            g_free(contents);
+        }
     }
+    g_unlink(attach_path);
+    g_free(attach_path);
+    rtcom_el_event_free_contents(ev);
+    rtcom_el_event_free(ev);
 
+    query = rtcom_el_query_new(el);
+    fail_unless(rtcom_el_query_prepare(query,
+                "id", ids[0], RTCOM_EL_OP_GREATER_EQUAL,
+                NULL));
     it = rtcom_el_get_events(el, query);
     g_object_unref(query);
+    fail_unless(it != NULL);
+    fail_unless(rtcom_el_iter_first(it));
 
-    fail_unless(it != NULL, "Failed to get iterator");
-    fail_unless(rtcom_el_iter_first(it), "Failed to start iterator");
+    rtcom_el_iter_set_attachment_prefetch(it, 3);
 
-    fail_unless(rtcom_el_iter_get_values(it, "free-text", &contents, NULL));
+    do
+    {
+        RTComElAttachIter * att_it = NULL;
+        const RTComElAttachment * atts;
+        guint n;
+
+        fail_unless(rtcom_el_iter_get_values(it, "id", &event_id,
+                    "attachment-count", &count, NULL));
+        for(i = 0; i < 4 && ids[i] != event_id; i++);
+        fail_unless(i < 4);
+        rtcom_fail_unless_intcmp(count, ==, i % 3);
+
+        atts = rtcom_el_iter_peek_attachments(it, &n);
+        rtcom_fail_unless_uintcmp(n, ==, i % 3);
+        fail_unless((n == 0) == (atts == NULL));
+
+        /* The same as through an attachment iterator */
+        att_it = rtcom_el_iter_get_attachments(it);
+        fail_unless((n == 0) == (att_it == NULL));
+        for(k = 0; att_it != NULL && k < (gint) n; k++)
+        {
+            RTComElAttachment * att = NULL;
 
-    /* It is an API guarantee that we're sorting by event ID, which ascends
-     * as time goes on, so Eve's recent message comes before Dave's older
-     * message */
-    rtcom_fail_unless_strcmp("I am online", ==, contents);
-    g_free(contents);
+            if(k > 0)
+                fail_unless(rtcom_el_attach_iter_next(att_it));
 
-    fail_unless (rtcom_el_iter_next (it));
+            att = rtcom_el_attach_iter_get(att_it);
+            rtcom_fail_unless_uintcmp(att->id, ==, atts[k].id);
+            rtcom_fail_unless_uintcmp(atts[k].event_id, ==, event_id);
+            rtcom_fail_unless_strcmp(att->path, ==, atts[k].path);
+            rtcom_fail_unless_strcmp(ATTACH_DESC, ==, atts[k].desc);
+            rtcom_el_free_attachment(att);
+        }
+        if(att_it != NULL)
+        {
+            fail_if(rtcom_el_attach_iter_next(att_it));
+            g_object_unref(att_it);
+        }
 
-    fail_unless(rtcom_el_iter_get_values(it, "free-text", &contents, NULL));
+        rows++;
+    } while(rtcom_el_iter_next(it));
 
-    rtcom_fail_unless_strcmp("Hello from Dave", ==, contents);
+    rtcom_fail_unless_intcmp(rows, ==, 4);
 
-    g_free(contents);
+    /* Events can be picked by it */
+    query = rtcom_el_query_new(el);
+    fail_unless(rtcom_el_query_prepare(query,
+                "id", ids[0], RTCOM_EL_OP_GREATER_EQUAL,
+                "attachment-count", 0, RTCOM_EL_OP_GREATER,
+                NULL));
+    g_object_unref(it);
+    it = rtcom_el_get_events(el, query);
+    g_object_unref(query);
+    rtcom_fail_unless_intcmp(iter_count_results(it), ==, 2);
+    g_object_unref(it);
+}
+END_TEST
 
-    fail_if (rtcom_el_iter_next (it));
+START_TEST(test_fetch_headers_for_events)
+{
+    const gchar * only_foo[] = { HEADER_KEY, NULL };
+    RTComElEvent * ev = NULL;
+    RTComElHeadersResult * result = NULL;
+    GError * error = NULL;
+    gint ids[3];
+    gint many[300];
+    gint i;
 
-    g_object_unref(it);
+    ev = event_new_lite();
+    for(i = 0; i < 3; i++)
+    {
+        ids[i] = rtcom_el_add_event(el, ev, NULL);
+        fail_if(ids[i] < 0, "Failed to add event");
+    }
+    rtcom_el_event_free_contents(ev);
+    rtcom_el_event_free(ev);
+
+    /* The one in the middle has none */
+    fail_if(rtcom_el_add_header(el, ids[0], HEADER_KEY, "first", NULL) < 0);
+    fail_if(rtcom_el_add_header(el, ids[0], "Baz", "other", NULL) < 0);
+    fail_if(rtcom_el_add_header(el, ids[2], HEADER_KEY, "last", NULL) < 0);
+
+    /* Out of order, with a duplicate */
+    many[0] = ids[2];
+    many[1] = ids[0];
+    many[2] = ids[1];
+    many[3] = ids[0];
+
+    result = rtcom_el_fetch_headers_for_events(el, many, 4, NULL, &error);
+    fail_unless(result != NULL);
+    fail_unless(error == NULL);
+    rtcom_fail_unless_uintcmp(result->n_events, ==, 3);
+    rtcom_fail_unless_uintcmp(result->n_headers, ==, 3);
+    for(i = 0; i < 3; i++)
+        rtcom_fail_unless_intcmp(result->event_ids[i], ==, ids[i]);
+    rtcom_fail_unless_uintcmp(result->offsets[1] - result->offsets[0], ==, 2);
+    rtcom_fail_unless_uintcmp(result->offsets[2] - result->offsets[1], ==, 0);
+    rtcom_fail_unless_uintcmp(result->offsets[3] - result->offsets[2], ==, 1);
+    rtcom_fail_unless_strcmp("first", ==,
+            rtcom_el_headers_result_lookup(result, ids[0], HEADER_KEY));
+    rtcom_fail_unless_strcmp("other", ==,
+            rtcom_el_headers_result_lookup(result, ids[0], "Baz"));
+    rtcom_fail_unless_strcmp("last", ==,
+            rtcom_el_headers_result_lookup(result, ids[2], HEADER_KEY));
+    fail_unless(rtcom_el_headers_result_lookup(result, ids[1],
+                HEADER_KEY) == NULL);
+    fail_unless(rtcom_el_headers_result_lookup(result, ids[2] + 1,
+                HEADER_KEY) == NULL);
+    rtcom_el_headers_result_free(result);
+
+    /* More ids than fit in a statement, and only some names */
+    for(i = 3; i < 300; i++)
+        many[i] = ids[2] + i;
+
+    result = rtcom_el_fetch_headers_for_events(el, many, 300, only_foo,
+            NULL);
+    fail_unless(result != NULL);
+    rtcom_fail_unless_uintcmp(result->n_events, ==, 300);
+    rtcom_fail_unless_uintcmp(result->n_headers, ==, 2);
+    rtcom_fail_unless_uintcmp(result->offsets[result->n_events], ==, 2);
+    rtcom_fail_unless_strcmp("first", ==,
+            rtcom_el_headers_result_lookup(result, ids[0], HEADER_KEY));
+    rtcom_fail_unless_strcmp("last", ==,
+            rtcom_el_headers_result_lookup(result, ids[2], HEADER_KEY));
+    fail_unless(rtcom_el_headers_result_lookup(result, ids[0],
+                "Baz") == NULL);
+    rtcom_el_headers_result_free(result);
+
+    /* Nothing asked for */
+    result = rtcom_el_fetch_headers_for_events(el, NULL, 0, NULL, NULL);
+    fail_unless(result != NULL);
+    rtcom_fail_unless_uintcmp(result->n_events, ==, 0);
+    rtcom_fail_unless_uintcmp(result->offsets[0], ==, 0);
+    rtcom_el_headers_result_free(result);
 }
 END_TEST
 
-START_TEST(test_like)
+START_TEST(test_plugin_window)
 {
+    RTComElEvent * ev = NULL;
     RTComElQuery * query = NULL;
     RTComElIter * it = NULL;
-    gchar *contents;
+    gint ids[5];
+    gint i, event_id, batch_rows, rows = 0;
 
-    query = rtcom_el_query_new(el);
-    if(!rtcom_el_query_prepare(
-        query,
-        "free-text", "AM oNLi", RTCOM_EL_OP_STR_LIKE,
-        NULL))
+    ev = event_new_lite();
+    for(i = 0; i < 5; i++)
     {
-        fail("Failed to prepare the query.");
+        ids[i] = rtcom_el_add_event(el, ev, NULL);
+        fail_if(ids[i] < 0, "Failed to add event");
     }
+    rtcom_el_event_free_contents(ev);
+    rtcom_el_event_free(ev);
 
+    query = rtcom_el_query_new(el);
+    fail_unless(rtcom_el_query_prepare(query,
+                "id", ids[0], RTCOM_EL_OP_GREATER_EQUAL,
+                NULL));
     it = rtcom_el_get_events(el, query);
     g_object_unref(query);
+    fail_unless(it != NULL);
+    fail_unless(rtcom_el_iter_first(it));
 
-    fail_unless(it != NULL, "Failed to get iterator");
-    fail_unless(rtcom_el_iter_first(it), "Failed to start iterator");
+    /* Three rows at a time: the second window only has two left */
+    rtcom_el_iter_set_plugin_window(it, 3);
 
-    fail_unless(rtcom_el_iter_get_values(it, "free-text", &contents, NULL));
+    do
+    {
+        gchar * text = NULL;
+        gchar * markup = NULL;
+        gchar * expected = NULL;
+
+        fail_unless(rtcom_el_iter_get_values(it, "id", &event_id,
+                    "additional-text", &text,
+                    "pango-markup", &markup,
+                    "batch-rows", &batch_rows,
+                    NULL));
+        rtcom_fail_unless_intcmp(event_id, ==, ids[4 - rows]);
+        rtcom_fail_unless_intcmp(batch_rows, ==, rows < 3 ? 3 : 2);
+
+        /* The same as computed one row at a time */
+        expected = g_strdup_printf("%d: Hello from the Test plugin!",
+                event_id);
+        rtcom_fail_unless_strcmp(expected, ==, text);
+        g_free(expected);
+        g_free(text);
+
+        /* The fields the plugin reads are fetched for it */
+        fail_unless(strstr(markup, LOCAL_UID) != NULL);
+        g_free(markup);
+
+        rows++;
+    } while(rtcom_el_iter_next(it));
+
+    rtcom_fail_unless_intcmp(rows, ==, 5);
+    g_object_unref(it);
+}
+END_TEST
 
-    rtcom_fail_unless_strcmp("I am online", ==, contents);
-    g_free(contents);
+START_TEST(test_stmt_cache)
+{
+    sqlite3_stmt * stmts[40];
+    sqlite3_stmt * stmt = NULL;
+    gchar * sql;
+    gpointer db;
+    gint i, cached = 0;
 
-    g_object_unref(it);
+    g_object_get (el, "db", &db, NULL);
+
+    for (i = 0; i < 40; i++)
+    {
+        sql = g_strdup_printf ("SELECT 'stmt-cache', %d;", i);
+        stmts[i] = rtcom_el_db_stmt_acquire (db, sql, NULL);
+        fail_unless (stmts[i] != NULL);
+        g_free (sql);
+    }
+
+    for (i = 0; i < 40; i++)
+        rtcom_el_db_stmt_release (stmts[i]);
+
+    /* Only the ones released last are kept */
+    while ((stmt = sqlite3_next_stmt (db, stmt)) != NULL)
+        if (strstr (sqlite3_sql (stmt), "'stmt-cache'") != NULL)
+            cached++;
+    rtcom_fail_unless_intcmp (cached, <, 40);
+
+    stmt = rtcom_el_db_stmt_acquire (db, "SELECT 'stmt-cache', 39;", NULL);
+    fail_unless (stmt == stmts[39]);
+    rtcom_el_db_stmt_release (stmt);
+
+    /* And whatever is used again stays */
+    for (i = 0; i < 40; i++)
+    {
+        stmt = rtcom_el_db_stmt_acquire (db, "SELECT 'stmt-cache', 39;",
+                NULL);
+        fail_unless (stmt == stmts[39]);
+        rtcom_el_db_stmt_release (stmt);
+
+        sql = g_strdup_printf ("SELECT 'stmt-cache', %d;", 100 + i);
+        rtcom_el_db_stmt_release (rtcom_el_db_stmt_acquire (db, sql, NULL));
+        g_free (sql);
+    }
 }
 END_TEST
 
@@ -1595,6 +3370,88 @@ START_TEST(test_group_by_group)
 }
 END_TEST
 
+/* Collects the event ids returned by a query, newest first */
+static GArray *
+query_ids (RTComElQueryGroupBy group_by,
+           gint limit,
+           gint before_id)
+{
+    RTComElQuery * query = NULL;
+    RTComElIter * it = NULL;
+    GArray *ids = g_array_new (FALSE, FALSE, sizeof (gint));
+    gint id;
+
+    query = rtcom_el_query_new(el);
+    rtcom_el_query_set_group_by (query, group_by);
+    rtcom_el_query_set_limit (query, limit);
+    rtcom_el_query_set_before_id (query, before_id);
+    fail_unless(rtcom_el_query_prepare(query,
+                "remote-uid", "b", RTCOM_EL_OP_GREATER_EQUAL,
+                "remote-uid", "g", RTCOM_EL_OP_LESS,
+                NULL));
+
+    it = rtcom_el_get_events(el, query);
+    g_object_unref(query);
+
+    if (it != NULL && rtcom_el_iter_first(it))
+    {
+        do
+        {
+            fail_unless (rtcom_el_iter_get_values (it, "id", &id, NULL));
+            g_array_append_val (ids, id);
+        }
+        while (rtcom_el_iter_next (it));
+    }
+
+    if (it != NULL)
+        g_object_unref(it);
+
+    return ids;
+}
+
+START_TEST(test_keyset_paging)
+{
+    RTComElQueryGroupBy group_bys[] = { RTCOM_EL_QUERY_GROUP_BY_NONE,
+        RTCOM_EL_QUERY_GROUP_BY_CONTACT, RTCOM_EL_QUERY_GROUP_BY_GROUP };
+    guint g, i;
+
+    for (g = 0; g < G_N_ELEMENTS (group_bys); g++)
+    {
+        GArray *all = query_ids (group_bys[g], -1, 0);
+        GArray *paged = g_array_new (FALSE, FALSE, sizeof (gint));
+        gint before_id = 0;
+
+        fail_unless (all->len > 1);
+
+        /* Walk the list two at a time, each page starting after the last
+         * event of the previous one */
+        while (TRUE)
+        {
+            GArray *page = query_ids (group_bys[g], 2, before_id);
+
+            fail_if (page->len > 2);
+            if (page->len == 0)
+            {
+                g_array_free (page, TRUE);
+                break;
+            }
+
+            g_array_append_vals (paged, page->data, page->len);
+            before_id = g_array_index (page, gint, page->len - 1);
+            g_array_free (page, TRUE);
+        }
+
+        rtcom_fail_unless_uintcmp (paged->len, ==, all->len);
+        for (i = 0; i < all->len; i++)
+            rtcom_fail_unless_intcmp (g_array_index (paged, gint, i), ==,
+                    g_array_index (all, gint, i));
+
+        g_array_free (paged, TRUE);
+        g_array_free (all, TRUE);
+    }
+}
+END_TEST
+
 START_TEST(test_update_remote_contact)
 {
     RTComElQuery *query_by_abook;
@@ -1683,14 +3540,38 @@ el_suite(void)
     tcase_add_test(tc_core, test_add_full);
     tcase_add_test(tc_core, test_header);
     tcase_add_test(tc_core, test_attach);
+    tcase_add_test(tc_core, test_attach_move);
+    tcase_add_test(tc_core, test_attach_move_failed);
+    tcase_add_test(tc_core, test_add_unique_token);
+    tcase_add_test(tc_core, test_attach_dedup);
+    tcase_add_test(tc_core, test_attach_migrate);
+    tcase_add_test(tc_core, test_attach_gc);
     tcase_add_test(tc_core, test_read);
     tcase_add_test(tc_core, test_flags);
+    tcase_add_test(tc_core, test_update_by_query);
     tcase_add_test(tc_core, test_get);
+    tcase_add_test(tc_core, test_get_async);
+    tcase_add_test(tc_core, test_threads);
     tcase_add_test(tc_core, test_unique_remotes);
     tcase_add_test(tc_core, test_get_int);
     tcase_add_test(tc_core, test_get_string);
     tcase_add_test(tc_core, test_ends_with);
     tcase_add_test(tc_core, test_like);
+    tcase_add_test(tc_core, test_query_template);
+    tcase_add_test(tc_core, test_query_expr);
+    tcase_add_test(tc_core, test_query_fields);
+    tcase_add_test(tc_core, test_query_count);
+    tcase_add_test(tc_core, test_query_aggregate);
+    tcase_add_test(tc_core, test_contact_cache);
+    tcase_add_test(tc_core, test_live_query);
+    tcase_add_test(tc_core, test_iter_fetch_batch);
+    tcase_add_test(tc_core, test_iter_peek);
+    tcase_add_test(tc_core, test_field_ids);
+    tcase_add_test(tc_core, test_header_prefetch);
+    tcase_add_test(tc_core, test_attachment_prefetch);
+    tcase_add_test(tc_core, test_fetch_headers_for_events);
+    tcase_add_test(tc_core, test_plugin_window);
+    tcase_add_test(tc_core, test_stmt_cache);
     tcase_add_test(tc_core, test_delete_events);
     tcase_add_test(tc_core, test_delete_event);
     tcase_add_test(tc_core, test_in_strv);
@@ -1699,6 +3580,7 @@ el_suite(void)
     tcase_add_test(tc_core, test_group_by_uids);
     tcase_add_test(tc_core, test_group_by_metacontacts);
     tcase_add_test(tc_core, test_group_by_group);
+    tcase_add_test(tc_core, test_keyset_paging);
     tcase_add_test(tc_core, test_update_remote_contact);
 
     suite_add_tcase(s, tc_core);
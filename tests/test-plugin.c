@@ -117,13 +117,6 @@ gboolean rtcom_el_plugin_get_value(
     g_return_val_if_fail(item, FALSE);
     g_return_val_if_fail(value, FALSE);
 
-    GString * add = NULL;
-
-    GString * markup = NULL;
-    GValue id = {0};
-    GValue local_name = {0};
-    GValue local_uid = {0};
-
     if(!strcmp(item, "Foo"))
     {
         header_value = rtcom_el_iter_get_header_raw(
@@ -145,46 +138,133 @@ gboolean rtcom_el_plugin_get_value(
             return TRUE;
         }
     }
-    else if(!strcmp(item, "additional-text"))
+    else if(!strcmp(item, "icon-path"))
     {
-        add = g_string_new("");
-        rtcom_el_iter_get_raw(it, "id", &id);
-        g_string_append_printf(add, "%d", g_value_get_int(&id));
-        g_value_unset(&id);
-        g_string_append(add, ": Hello from the Test plugin!");
-
         g_value_init(value, G_TYPE_STRING);
-        g_value_set_string(value, add->str);
-
-        g_string_free(add, TRUE);
+        g_value_set_string(value, "");
         return TRUE;
     }
-    else if(!strcmp(item, "pango-markup"))
+
+    return FALSE;
+}
+
+gboolean rtcom_el_plugin_get_value_by_id(
+        RTComElIter * it,
+        RTComElField field,
+        GValue * value)
+{
+    GString * add = NULL;
+
+    GString * markup = NULL;
+    GValue id = {0};
+    GValue local_name = {0};
+    GValue local_uid = {0};
+
+    g_return_val_if_fail(it, FALSE);
+    g_return_val_if_fail(value, FALSE);
+
+    switch(field)
     {
-        markup = g_string_new("");
-        rtcom_el_iter_get_raw(it, "id", &id);
-        rtcom_el_iter_get_raw(it, "local-name", &local_name);
-        rtcom_el_iter_get_raw(it, "local-uid", &local_uid);
-        g_string_append_printf(
-                markup,
-                "%d: <b>%s</b>\n<small>Hello from the Test plugin! UID: %s</small>",
-                g_value_get_int(&id),
-                g_value_get_string(&local_name),
-                g_value_get_string(&local_uid));
-
-        g_value_unset(&local_name);
-        g_value_unset(&local_uid);
+        case RTCOM_EL_FIELD_ADDITIONAL_TEXT:
+            add = g_string_new("");
+            rtcom_el_iter_get_raw_by_id(it, RTCOM_EL_FIELD_ID, &id);
+            g_string_append_printf(add, "%d", g_value_get_int(&id));
+            g_value_unset(&id);
+            g_string_append(add, ": Hello from the Test plugin!");
 
-        g_value_init(value, G_TYPE_STRING);
-        g_value_set_string(value, markup->str);
+            g_value_init(value, G_TYPE_STRING);
+            g_value_set_string(value, add->str);
+
+            g_string_free(add, TRUE);
+            return TRUE;
 
-        g_string_free(markup, TRUE);
+        case RTCOM_EL_FIELD_PANGO_MARKUP:
+            markup = g_string_new("");
+            rtcom_el_iter_get_raw_by_id(it, RTCOM_EL_FIELD_ID, &id);
+            rtcom_el_iter_get_raw_by_id(it, RTCOM_EL_FIELD_LOCAL_NAME,
+                    &local_name);
+            rtcom_el_iter_get_raw_by_id(it, RTCOM_EL_FIELD_LOCAL_UID,
+                    &local_uid);
+            g_string_append_printf(
+                    markup,
+                    "%d: <b>%s</b>\n<small>Hello from the Test plugin! UID: %s</small>",
+                    g_value_get_int(&id),
+                    g_value_get_string(&local_name),
+                    g_value_get_string(&local_uid));
+
+            g_value_unset(&id);
+            g_value_unset(&local_name);
+            g_value_unset(&local_uid);
+
+            g_value_init(value, G_TYPE_STRING);
+            g_value_set_string(value, markup->str);
+
+            g_string_free(markup, TRUE);
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+const gchar * const * rtcom_el_plugin_get_values_fields(void)
+{
+    static const gchar * fields[] = { "local-uid", "local-name", NULL };
+
+    return fields;
+}
+
+gboolean rtcom_el_plugin_get_values(
+        RTComElIter * it,
+        const RTComElIterBatch * batch,
+        const gchar * key,
+        GValue * values)
+{
+    const gint * ids = NULL;
+    guint n, i;
+
+    g_return_val_if_fail(it, FALSE);
+    g_return_val_if_fail(batch, FALSE);
+    g_return_val_if_fail(key, FALSE);
+    g_return_val_if_fail(values, FALSE);
+
+    n = rtcom_el_iter_batch_get_n_rows(batch);
+    ids = rtcom_el_iter_batch_get_ints(batch, RTCOM_EL_FIELD_ID);
+
+    if(!strcmp(key, "additional-text"))
+    {
+        for(i = 0; i < n; i++)
+        {
+            g_value_init(&values[i], G_TYPE_STRING);
+            g_value_take_string(&values[i], g_strdup_printf(
+                        "%d: Hello from the Test plugin!", ids[i]));
+        }
         return TRUE;
     }
-    else if(!strcmp(item, "icon-path"))
+    else if(!strcmp(key, "pango-markup"))
     {
-        g_value_init(value, G_TYPE_STRING);
-        g_value_set_string(value, "");
+        for(i = 0; i < n; i++)
+        {
+            g_value_init(&values[i], G_TYPE_STRING);
+            g_value_take_string(&values[i], g_strdup_printf(
+                        "%d: <b>%s</b>\n<small>Hello from the Test plugin! UID: %s</small>",
+                        ids[i],
+                        rtcom_el_iter_batch_get_string(batch,
+                            RTCOM_EL_FIELD_LOCAL_NAME, i),
+                        rtcom_el_iter_batch_get_string(batch,
+                            RTCOM_EL_FIELD_LOCAL_UID, i)));
+        }
+        return TRUE;
+    }
+    else if(!strcmp(key, "batch-rows"))
+    {
+        /* Only computed by the batch, to tell which window a row was
+         * computed in */
+        for(i = 0; i < n; i++)
+        {
+            g_value_init(&values[i], G_TYPE_INT);
+            g_value_set_int(&values[i], n);
+        }
         return TRUE;
     }
 